@@ -21,36 +21,26 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-bool receive_dlm_client_request(int socket, struct dlm_client_request *request)
-{
+/* Requests other than DLM_RESUME_LEASE only carry the opcode, so that they
+ * stay compatible with lease managers that don't support resume tokens. */
+#define DLM_BASIC_REQUEST_LEN (sizeof(enum dlm_opcode))
 
-	ssize_t len;
-	struct iovec iov = {
-	    .iov_base = request,
-	    .iov_len = sizeof(*request),
-	};
-	struct msghdr msg = {
-	    .msg_iov = &iov,
-	    .msg_iovlen = 1,
-	};
-
-	while ((len = recvmsg(socket, &msg, 0)) < 0) {
-		if (errno != EINTR)
-			return false;
-	}
-
-	if (len != sizeof(*request)) {
-		errno = EPROTO;
-		return false;
+bool dlm_resume_token_is_valid(const struct dlm_resume_token *token)
+{
+	for (int i = 0; i < DLM_RESUME_TOKEN_LEN; i++) {
+		if (token->data[i])
+			return true;
 	}
-	return true;
+	return false;
 }
 
 bool send_dlm_client_request(int socket, struct dlm_client_request *request)
 {
 	struct iovec iov = {
 	    .iov_base = request,
-	    .iov_len = sizeof(*request),
+	    .iov_len = request->opcode == DLM_RESUME_LEASE
+			   ? sizeof(*request)
+			   : DLM_BASIC_REQUEST_LEN,
 	};
 
 	struct msghdr msg = {
@@ -65,12 +55,14 @@ bool send_dlm_client_request(int socket, struct dlm_client_request *request)
 	return true;
 }
 
-int receive_lease_fd(int socket)
+int receive_lease_fd(int socket, struct dlm_resume_token *token)
 {
 	int lease_fd = -1;
 	char ctrl_buf[CMSG_SPACE(sizeof(lease_fd))];
 
-	char data;
+	/* The lease fd is sent with either a resume token, or a single
+	 * dummy byte (from lease managers without resume token support) */
+	struct dlm_resume_token data = {0};
 	struct iovec iov = {.iov_base = &data, .iov_len = sizeof(data)};
 	struct msghdr msg = {
 	    .msg_iov = &iov,
@@ -115,11 +107,17 @@ int receive_lease_fd(int socket)
 		goto err;
 	}
 
+	if (token) {
+		if (len != sizeof(data))
+			memset(&data, 0, sizeof(data));
+		*token = data;
+	}
+
 err:
 	return lease_fd;
 }
 
-bool send_lease_fd(int socket, int lease)
+bool send_lease_fd(int socket, int lease, const struct dlm_resume_token *token)
 {
 	char data;
 	struct iovec iov = {
@@ -127,6 +125,11 @@ bool send_lease_fd(int socket, int lease)
 	    .iov_len = sizeof(data),
 	};
 
+	if (token) {
+		iov.iov_base = (void *)token;
+		iov.iov_len = sizeof(*token);
+	}
+
 	char ctrl_buf[CMSG_SPACE(sizeof(lease))] = {0};
 
 	struct msghdr msg = {
@@ -142,8 +145,252 @@ bool send_lease_fd(int socket, int lease)
 	cmsg->cmsg_len = CMSG_LEN(sizeof(lease));
 	*((int *)CMSG_DATA(cmsg)) = lease;
 
-	if (sendmsg(socket, &msg, 0) < 0)
+	if (sendmsg(socket, &msg, MSG_NOSIGNAL) < 0)
 		return false;
 
 	return true;
 }
+
+#define DLM_ATTR_ALIGN(len) (((len) + 3) & ~3u)
+
+void dlm_msg_init(struct dlm_msg *msg, enum dlm_msg_type type, uint32_t seq)
+{
+	msg->hdr = (struct dlm_msg_header){
+	    .magic = DLM_MSG_MAGIC,
+	    .version = DLM_PROTOCOL_VERSION,
+	    .type = type,
+	    .seq = seq,
+	    .length = 0,
+	};
+	msg->nfds = 0;
+	for (int i = 0; i < DLM_MSG_MAX_FDS; i++)
+		msg->fds[i] = -1;
+}
+
+bool dlm_msg_add_attr(struct dlm_msg *msg, enum dlm_attr_type type,
+		      const void *value, size_t length)
+{
+	struct dlm_attr_header attr = {
+	    .type = type,
+	    .length = length,
+	};
+	size_t attr_len = sizeof(attr) + DLM_ATTR_ALIGN(length);
+
+	if (length > UINT16_MAX ||
+	    msg->hdr.length + attr_len > DLM_MSG_MAX_PAYLOAD) {
+		errno = EMSGSIZE;
+		return false;
+	}
+
+	uint8_t *pos = msg->payload + msg->hdr.length;
+	memcpy(pos, &attr, sizeof(attr));
+	memcpy(pos + sizeof(attr), value, length);
+	memset(pos + sizeof(attr) + length, 0,
+	       DLM_ATTR_ALIGN(length) - length);
+
+	msg->hdr.length += attr_len;
+	return true;
+}
+
+bool dlm_msg_add_u32(struct dlm_msg *msg, enum dlm_attr_type type,
+		     uint32_t value)
+{
+	return dlm_msg_add_attr(msg, type, &value, sizeof(value));
+}
+
+bool dlm_msg_add_fd(struct dlm_msg *msg, int fd)
+{
+	if (msg->nfds == DLM_MSG_MAX_FDS) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	msg->fds[msg->nfds++] = fd;
+	return true;
+}
+
+const void *dlm_msg_get_attr(const struct dlm_msg *msg, enum dlm_attr_type type,
+			     size_t *length)
+{
+	size_t offset = 0;
+
+	while (offset + sizeof(struct dlm_attr_header) <= msg->hdr.length) {
+		struct dlm_attr_header attr;
+		memcpy(&attr, msg->payload + offset, sizeof(attr));
+
+		const uint8_t *value = msg->payload + offset + sizeof(attr);
+		offset += sizeof(attr) + DLM_ATTR_ALIGN(attr.length);
+		if (offset > msg->hdr.length)
+			break;
+
+		if (attr.type == type) {
+			if (length)
+				*length = attr.length;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+bool dlm_msg_get_u32(const struct dlm_msg *msg, enum dlm_attr_type type,
+		     uint32_t *value)
+{
+	size_t length;
+	const void *data = dlm_msg_get_attr(msg, type, &length);
+
+	if (!data || length != sizeof(*value))
+		return false;
+
+	memcpy(value, data, sizeof(*value));
+	return true;
+}
+
+void dlm_msg_close_fds(struct dlm_msg *msg)
+{
+	for (int i = 0; i < msg->nfds; i++)
+		close(msg->fds[i]);
+	msg->nfds = 0;
+}
+
+static bool parse_v1_request(struct dlm_msg *msg, const uint8_t *buf,
+			     size_t len)
+{
+	struct dlm_client_request request = {0};
+
+	if (len != DLM_BASIC_REQUEST_LEN && len != sizeof(request))
+		return false;
+
+	memcpy(&request, buf, len);
+
+	static const enum dlm_msg_type msg_types[] = {
+	    [DLM_GET_LEASE] = DLM_MSG_GET_LEASE,
+	    [DLM_RELEASE_LEASE] = DLM_MSG_RELEASE_LEASE,
+	    [DLM_RESUME_LEASE] = DLM_MSG_RESUME_LEASE,
+	};
+
+	size_t nmsg_types = sizeof(msg_types) / sizeof(msg_types[0]);
+	if ((unsigned)request.opcode >= nmsg_types)
+		return false;
+
+	dlm_msg_init(msg, msg_types[request.opcode], 0);
+	msg->hdr.version = 1;
+
+	if (request.opcode == DLM_RESUME_LEASE) {
+		return dlm_msg_add_attr(msg, DLM_ATTR_RESUME_TOKEN,
+					&request.token, sizeof(request.token));
+	}
+	return true;
+}
+
+bool dlm_receive_msg(int socket, struct dlm_msg *msg)
+{
+	uint8_t buf[sizeof(msg->hdr) + DLM_MSG_MAX_PAYLOAD];
+	char ctrl_buf[CMSG_SPACE(sizeof(int) * DLM_MSG_MAX_FDS)];
+
+	struct iovec iov = {
+	    .iov_base = buf,
+	    .iov_len = sizeof(buf),
+	};
+	struct msghdr hdr = {
+	    .msg_iov = &iov,
+	    .msg_iovlen = 1,
+	    .msg_control = ctrl_buf,
+	    .msg_controllen = sizeof(ctrl_buf),
+	};
+
+	ssize_t len;
+	while ((len = recvmsg(socket, &hdr, MSG_CMSG_CLOEXEC)) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+
+	if (len == 0) {
+		errno = ECONNRESET;
+		return false;
+	}
+
+	msg->nfds = 0;
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < nfds; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+			       sizeof(fd));
+			if (!dlm_msg_add_fd(msg, fd))
+				close(fd);
+		}
+	}
+
+	if (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		goto err;
+
+	struct dlm_msg_header msg_hdr;
+	if ((size_t)len < sizeof(msg_hdr)) {
+		if (!parse_v1_request(msg, buf, len))
+			goto err;
+		return true;
+	}
+
+	memcpy(&msg_hdr, buf, sizeof(msg_hdr));
+	if (msg_hdr.magic != DLM_MSG_MAGIC) {
+		if (!parse_v1_request(msg, buf, len))
+			goto err;
+		return true;
+	}
+
+	/* Version 1 requests are never framed */
+	if (msg_hdr.version < 2 || msg_hdr.length != len - sizeof(msg_hdr))
+		goto err;
+
+	msg->hdr = msg_hdr;
+	memcpy(msg->payload, buf + sizeof(msg_hdr), msg_hdr.length);
+	return true;
+
+err:
+	dlm_msg_close_fds(msg);
+	errno = EPROTO;
+	return false;
+}
+
+bool dlm_send_msg(int socket, const struct dlm_msg *msg)
+{
+	struct iovec iov[] = {
+	    {
+		.iov_base = (void *)&msg->hdr,
+		.iov_len = sizeof(msg->hdr),
+	    },
+	    {
+		.iov_base = (void *)msg->payload,
+		.iov_len = msg->hdr.length,
+	    },
+	};
+
+	char ctrl_buf[CMSG_SPACE(sizeof(int) * DLM_MSG_MAX_FDS)] = {0};
+
+	struct msghdr hdr = {
+	    .msg_iov = iov,
+	    .msg_iovlen = 2,
+	};
+
+	if (msg->nfds > 0) {
+		hdr.msg_control = ctrl_buf;
+		hdr.msg_controllen = CMSG_SPACE(sizeof(int) * msg->nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * msg->nfds);
+		memcpy(CMSG_DATA(cmsg), msg->fds, sizeof(int) * msg->nfds);
+	}
+
+	while (sendmsg(socket, &hdr, MSG_NOSIGNAL) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return true;
+}
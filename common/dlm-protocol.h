@@ -17,18 +17,227 @@
 #define DLM_PROTOCOL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#define DLM_RESUME_TOKEN_LEN 16
+
+/* Protocol version 1
+ * A request is a bare opcode (plus a resume token for DLM_RESUME_LEASE).
+ * The lease fd is sent back with a resume token (or a single dummy byte),
+ * and a rejected request is signalled by closing the connection. */
 enum dlm_opcode {
 	DLM_GET_LEASE,
 	DLM_RELEASE_LEASE,
+	DLM_RESUME_LEASE,
+};
+
+/* Opaque token sent to the client along with the lease fd.
+ * Presenting it in a DLM_RESUME_LEASE request allows a restarted client
+ * to get back the same lease.  An all-zero token is never valid. */
+struct dlm_resume_token {
+	uint8_t data[DLM_RESUME_TOKEN_LEN];
 };
 
 struct dlm_client_request {
 	enum dlm_opcode opcode;
+	/* Only sent with DLM_RESUME_LEASE requests */
+	struct dlm_resume_token token;
 };
 
-bool receive_dlm_client_request(int socket, struct dlm_client_request *request);
+bool dlm_resume_token_is_valid(const struct dlm_resume_token *token);
+
 bool send_dlm_client_request(int socket, struct dlm_client_request *request);
-int receive_lease_fd(int socket);
-bool send_lease_fd(int socket, int lease);
+int receive_lease_fd(int socket, struct dlm_resume_token *token);
+bool send_lease_fd(int socket, int lease, const struct dlm_resume_token *token);
+
+/* Protocol version 2
+ * Every message starts with a struct dlm_msg_header, followed by a list
+ * of type-length-value attributes, each padded to a multiple of 4 bytes.
+ * Clients start by sending a DLM_MSG_HELLO with their highest supported
+ * version and capabilities, and may send further requests on the same
+ * connection without waiting for the replies.  Each request, except
+ * DLM_MSG_RELEASE_LEASE, is answered with a DLM_MSG_REPLY that carries the
+ * sequence number of the request and a DLM_ATTR_STATUS. */
+#define DLM_PROTOCOL_VERSION 2
+#define DLM_MSG_MAGIC 0x324d4c44 /* "DLM2" */
+
+#define DLM_MSG_MAX_PAYLOAD 1024
+#define DLM_MSG_MAX_FDS 2
+
+enum dlm_msg_type {
+	DLM_MSG_HELLO = 1,
+	DLM_MSG_GET_LEASE,
+	DLM_MSG_RELEASE_LEASE,
+	DLM_MSG_RESUME_LEASE,
+	DLM_MSG_SELECT_LEASE,
+	DLM_MSG_REASSIGN_LEASES,
+	DLM_MSG_HANDOFF,
+
+	/* Notifications sent by the lease manager, with sequence number 0 */
+	DLM_MSG_LEASE_EVENT = 0x40,
+
+	/* Lease manager state, sent in reply to DLM_MSG_HANDOFF */
+	DLM_MSG_HANDOFF_DEVICE = 0x80,
+	DLM_MSG_HANDOFF_SERVER,
+	DLM_MSG_HANDOFF_LEASE,
+	DLM_MSG_HANDOFF_DONE,
+
+	DLM_MSG_REPLY = 0x100,
+};
+
+enum dlm_attr_type {
+	DLM_ATTR_STATUS = 1,   /* uint32_t, enum dlm_status */
+	DLM_ATTR_VERSION,      /* uint32_t */
+	DLM_ATTR_CAPS,	       /* uint32_t, DLM_CAP_* flags */
+	DLM_ATTR_RESUME_TOKEN, /* struct dlm_resume_token */
+	DLM_ATTR_TOPOLOGY_FD,  /* uint32_t, index of the topology memfd
+				* in the fds sent with the message */
+	DLM_ATTR_LEASE_NAME,   /* NUL terminated string */
+
+	/* Lease selection constraints, all optional */
+	DLM_ATTR_SELECT_FLAGS,	 /* uint32_t, DLM_SELECT_* flags */
+	DLM_ATTR_MIN_WIDTH,	 /* uint32_t */
+	DLM_ATTR_MIN_HEIGHT,	 /* uint32_t */
+	DLM_ATTR_MIN_REFRESH,	 /* uint32_t, in Hz */
+	DLM_ATTR_PLANE_TYPE,	 /* uint32_t, DRM_PLANE_TYPE_* */
+	DLM_ATTR_PLANE_FORMAT,	 /* uint32_t, DRM fourcc code */
+	DLM_ATTR_PLANE_MODIFIER, /* uint64_t, DRM format modifier */
+
+	/* Lease reassignment */
+	DLM_ATTR_LEASE_LIST,  /* NUL terminated strings, one per lease */
+	DLM_ATTR_SWITCH_TIME, /* uint32_t, in us */
+
+	/* Planes needed in the lease, all optional.  Sent with lease
+	 * requests and lease selection requests. */
+	DLM_ATTR_OVERLAY_PLANES, /* uint32_t */
+	DLM_ATTR_CURSOR_PLANES,	 /* uint32_t */
+	DLM_ATTR_SCALING_PLANES, /* uint32_t */
+
+	/* Lease manager handoff */
+	DLM_ATTR_LESSEE_ID,  /* uint32_t */
+	DLM_ATTR_CLIENT_PID, /* uint32_t */
+	DLM_ATTR_CLIENT_FD,  /* uint32_t, index of the client connection
+			      * in the fds sent with the message */
+
+	DLM_ATTR_LEASE_EVENT, /* uint32_t, enum dlm_lease_event_type */
+
+	/* Optional, sent with lease requests and lease selection requests
+	 * to trace them (see dlm-trace.h) */
+	DLM_ATTR_TRACE_ID, /* uint64_t, non-zero request ID */
+};
+
+enum dlm_status {
+	DLM_STATUS_OK,
+	DLM_STATUS_LEASE_BUSY,
+	DLM_STATUS_LEASE_FAILED,
+	DLM_STATUS_INVALID_REQUEST,
+	DLM_STATUS_UNSUPPORTED_VERSION,
+	DLM_STATUS_NO_MATCH, /* No free lease meets the constraints */
+};
+
+/* Capabilities, negotiated in the DLM_MSG_HELLO exchange */
+#define DLM_CAP_RESUME_TOKEN (1u << 0)
+#define DLM_CAP_TOPOLOGY (1u << 1) /* see dlm-topology.h */
+#define DLM_CAP_LEASE_EVENTS (1u << 2)
+#define DLM_CAP_SESSION (1u << 3)
+
+/* Lease events
+ * Lease holders that support DLM_CAP_LEASE_EVENTS are sent a
+ * DLM_MSG_LEASE_EVENT with a DLM_ATTR_LEASE_EVENT when their lease is about
+ * to be moved to another client, when the move is cancelled, and once the
+ * lease has been revoked.  The connection is closed after a revocation,
+ * so clients that don't support lease events only see the connection
+ * closing. */
+enum dlm_lease_event_type {
+	DLM_LEASE_EVENT_REVOKED = 1,
+	DLM_LEASE_EVENT_TRANSFER_PENDING,
+	DLM_LEASE_EVENT_TRANSFER_CANCELLED,
+};
+
+/* Sessions
+ * The lease manager keeps the connection of a client that supports
+ * DLM_CAP_SESSION open when it sends a DLM_MSG_RELEASE_LEASE, or when its
+ * lease request fails, so that it can request the lease again on the same
+ * connection.  The connection is still closed when the lease is revoked
+ * from the client.  Lease requests sent on a connection kept open this way
+ * are refused with DLM_STATUS_LEASE_BUSY while the lease already has both
+ * a holder and another client requesting it. */
+
+/* Lease selection
+ * Instead of connecting to the socket of a named lease, clients can send
+ * a DLM_MSG_SELECT_LEASE with a set of constraints to the lease selection
+ * socket.  The lease manager grants the best matching free lease, and
+ * replies as for DLM_MSG_GET_LEASE, with the name of the lease in a
+ * DLM_ATTR_LEASE_NAME.  The connection then belongs to that lease. */
+#define DLM_SELECT_SERVER_NAME "drm-lease-select"
+
+#define DLM_SELECT_CONNECTED (1u << 0) /* only select connected outputs */
+
+/* Lease reassignment
+ * An administrative client sends a DLM_MSG_REASSIGN_LEASES, with the
+ * leases to move in a DLM_ATTR_LEASE_LIST, to the admin socket.  Once the
+ * plan is accepted, the lease manager replies with DLM_STATUS_OK, and
+ * holds back the requests of new clients for the listed leases.  When
+ * every listed lease has a waiting client, all the leases are revoked from
+ * their current holders and granted to the waiting clients in one batch.
+ * A second reply is sent once the new clients have updated the displays,
+ * with the time taken since the leases were revoked in a
+ * DLM_ATTR_SWITCH_TIME.
+ * Closing the connection before that cancels the plan. */
+#define DLM_ADMIN_SERVER_NAME "drm-lease-admin"
+
+/* Lease manager handoff
+ * A new lease manager instance takes over from a running one by sending a
+ * DLM_MSG_HANDOFF to the handoff socket.  The running instance replies
+ * with its state, without revoking any lease:
+ *  - a DLM_MSG_HANDOFF_DEVICE, with the DRM master fd,
+ *  - a DLM_MSG_HANDOFF_SERVER per server socket, with its DLM_ATTR_LEASE_NAME
+ *    and the fds of the listening socket and of its lock file,
+ *  - a DLM_MSG_HANDOFF_LEASE per granted lease, with its
+ *    DLM_ATTR_LEASE_NAME, DLM_ATTR_LESSEE_ID and lease fd, and the resume
+ *    token and connection of its client, if any,
+ *  - and a DLM_MSG_HANDOFF_DONE.
+ * The new instance acknowledges the state with a DLM_MSG_REPLY, and the
+ * running instance exits, closing the handoff connection. */
+#define DLM_HANDOFF_SERVER_NAME "drm-lease-handoff"
+
+struct dlm_msg_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint32_t seq;
+	uint32_t length; /* length of the attributes following the header */
+};
+
+struct dlm_attr_header {
+	uint16_t type;
+	uint16_t length; /* length of the value, excluding padding */
+};
+
+struct dlm_msg {
+	struct dlm_msg_header hdr;
+	uint8_t payload[DLM_MSG_MAX_PAYLOAD];
+
+	int fds[DLM_MSG_MAX_FDS];
+	int nfds;
+};
+
+void dlm_msg_init(struct dlm_msg *msg, enum dlm_msg_type type, uint32_t seq);
+bool dlm_msg_add_attr(struct dlm_msg *msg, enum dlm_attr_type type,
+		      const void *value, size_t length);
+bool dlm_msg_add_u32(struct dlm_msg *msg, enum dlm_attr_type type,
+		     uint32_t value);
+bool dlm_msg_add_fd(struct dlm_msg *msg, int fd);
+const void *dlm_msg_get_attr(const struct dlm_msg *msg, enum dlm_attr_type type,
+			     size_t *length);
+bool dlm_msg_get_u32(const struct dlm_msg *msg, enum dlm_attr_type type,
+		     uint32_t *value);
+void dlm_msg_close_fds(struct dlm_msg *msg);
+
+/* dlm_receive_msg() also accepts version 1 requests, which are converted
+ * to the equivalent version 2 message, with hdr.version set to 1.  Framed
+ * messages with a header version below 2 are rejected with EPROTO. */
+bool dlm_receive_msg(int socket, struct dlm_msg *msg);
+bool dlm_send_msg(int socket, const struct dlm_msg *msg);
 #endif
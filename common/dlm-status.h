@@ -0,0 +1,82 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLM_STATUS_H
+#define DLM_STATUS_H
+
+#include <stdint.h>
+
+/* Lease status page
+ * The lease manager publishes the state of its leases in a file in the
+ * runtime directory, which monitoring tools map read-only.
+ *
+ * The page starts with a struct dlm_status_header, followed by nleases
+ * struct dlm_status_lease entries.  Updates are protected by a seqlock:
+ * seq is odd while the lease manager is writing, and readers must retry
+ * if it is odd or changed while they were copying the entries. */
+#define DLM_STATUS_FILE_NAME "drm-lease-status"
+#define DLM_STATUS_MAGIC 0x54534c44 /* "DLST" */
+#define DLM_STATUS_VERSION 3
+#define DLM_STATUS_NAME_LEN 64
+
+/* Header flags */
+#define DLM_STATUS_CLOSED (1u << 0) /* The lease manager has exited */
+
+/* Lease states */
+#define DLM_STATUS_LEASE_FREE 0
+#define DLM_STATUS_LEASE_GRANTED 1
+/* Granted, while the previous holder's framebuffer is still displayed */
+#define DLM_STATUS_LEASE_IN_TRANSITION 2
+
+struct dlm_status_lease {
+	char name[DLM_STATUS_NAME_LEN];
+	uint32_t state;
+	int32_t holder_pid; /* 0 if no client holds the lease */
+	uint64_t grant_time; /* CLOCK_REALTIME, in ns */
+
+	/* Event counters */
+	uint64_t grants;
+	uint64_t transfers;
+	uint64_t resumes;
+	uint64_t revokes;
+	uint64_t failures;
+
+	/* Frame timing of the lease holder, if frame sampling is enabled.
+	 * A frame is a change of the framebuffer scanned out by the CRTC. */
+	uint32_t frame_rate; /* Over the last second, in mHz */
+	uint32_t max_stall_ms;
+	uint64_t frames;
+	uint64_t missed_frames; /* vblanks known to have no new frame */
+	uint64_t stalls;	/* gaps of at least 100 ms between frames */
+	uint64_t stall_time_ms;
+
+	/* Admission control of the lease socket */
+	uint64_t connections;	   /* accepted */
+	uint64_t connections_shed; /* closed as soon as accepted */
+	uint64_t throttle_time_ms; /* new connections left in the backlog */
+};
+
+struct dlm_status_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t nleases;
+	uint32_t flags;
+	uint32_t pad;
+	uint64_t update_time; /* CLOCK_REALTIME, in ns */
+	struct dlm_status_lease leases[];
+};
+
+#endif
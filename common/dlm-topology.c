@@ -0,0 +1,77 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dlm-topology.h"
+
+static bool array_is_valid(const struct dlm_topology_array *array,
+			   size_t elem_size, size_t size)
+{
+	if (array->count == 0)
+		return true;
+
+	if (array->offset % DLM_TOPOLOGY_ALIGN)
+		return false;
+
+	if (array->offset > size)
+		return false;
+
+	return array->count <= (size - array->offset) / elem_size;
+}
+
+bool dlm_topology_validate(const void *data, size_t size)
+{
+	const struct dlm_topology_header *hdr = data;
+
+	if (size < sizeof(*hdr))
+		return false;
+
+	if (hdr->magic != DLM_TOPOLOGY_MAGIC ||
+	    hdr->version != DLM_TOPOLOGY_VERSION || hdr->size > size)
+		return false;
+
+	size = hdr->size;
+
+	if (!array_is_valid(&hdr->modes, sizeof(struct dlm_topology_mode),
+			    size) ||
+	    !array_is_valid(&hdr->planes, sizeof(struct dlm_topology_plane),
+			    size) ||
+	    !array_is_valid(&hdr->props, sizeof(struct dlm_topology_prop),
+			    size) ||
+	    !array_is_valid(&hdr->boot_mode, sizeof(struct dlm_topology_mode),
+			    size))
+		return false;
+
+	const struct dlm_topology_plane *planes =
+	    dlm_topology_array_data(data, &hdr->planes);
+
+	for (uint32_t i = 0; i < hdr->planes.count; i++) {
+		if (!array_is_valid(&planes[i].formats, sizeof(uint32_t),
+				    size) ||
+		    !array_is_valid(&planes[i].modifiers,
+				    sizeof(struct dlm_topology_modifier), size))
+			return false;
+	}
+
+	return true;
+}
+
+const void *dlm_topology_array_data(const void *data,
+				    const struct dlm_topology_array *array)
+{
+	if (array->count == 0)
+		return NULL;
+
+	return (const uint8_t *)data + array->offset;
+}
@@ -0,0 +1,98 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLM_TOPOLOGY_H
+#define DLM_TOPOLOGY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Lease topology
+ * A read-only description of the DRM objects in a lease, sent to clients
+ * in a sealed memfd along with the lease fd, so that they don't have to
+ * query the objects, modes and properties of the lease themselves.
+ *
+ * The blob starts with a struct dlm_topology_header.  Each array is
+ * located by its offset from the start of the blob, and is aligned to
+ * DLM_TOPOLOGY_ALIGN bytes. */
+#define DLM_TOPOLOGY_MAGIC 0x504f5444 /* "DTOP" */
+#define DLM_TOPOLOGY_VERSION 2
+#define DLM_TOPOLOGY_ALIGN 8
+#define DLM_TOPOLOGY_NAME_LEN 32
+
+struct dlm_topology_array {
+	uint32_t offset;
+	uint32_t count;
+};
+
+/* Same layout as struct drm_mode_modeinfo */
+struct dlm_topology_mode {
+	uint32_t clock;
+	uint16_t hdisplay, hsync_start, hsync_end, htotal, hskew;
+	uint16_t vdisplay, vsync_start, vsync_end, vtotal, vscan;
+	uint32_t vrefresh;
+	uint32_t flags;
+	uint32_t type;
+	char name[DLM_TOPOLOGY_NAME_LEN];
+};
+
+struct dlm_topology_modifier {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+};
+
+struct dlm_topology_plane {
+	uint32_t plane_id;
+	uint32_t type; /* DRM_PLANE_TYPE_*, from the "type" property */
+	struct dlm_topology_array formats;   /* uint32_t */
+	struct dlm_topology_array modifiers; /* struct dlm_topology_modifier */
+};
+
+struct dlm_topology_prop {
+	uint32_t object_id;
+	uint32_t prop_id;
+	char name[DLM_TOPOLOGY_NAME_LEN];
+};
+
+struct dlm_topology_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; /* size of the whole blob */
+
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	uint32_t connection; /* drmModeConnection */
+
+	struct dlm_topology_array modes;  /* struct dlm_topology_mode */
+	struct dlm_topology_array planes; /* struct dlm_topology_plane */
+	struct dlm_topology_array props;  /* struct dlm_topology_prop */
+
+	/* Framebuffer and mode left on the CRTC by the bootloader or a
+	 * splash screen.  Only sent to the first client of a lease.  The
+	 * framebuffer may have been removed by its owner since. */
+	uint32_t boot_fb_id;
+	uint32_t pad;
+	struct dlm_topology_array boot_mode; /* struct dlm_topology_mode */
+};
+
+/* Check that the header and all arrays of a blob lie within 'size' bytes */
+bool dlm_topology_validate(const void *data, size_t size);
+
+/* Get a pointer to the first element of an array in a validated blob */
+const void *dlm_topology_array_data(const void *data,
+				    const struct dlm_topology_array *array);
+#endif
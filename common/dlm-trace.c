@@ -0,0 +1,82 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dlm-trace.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const stage_names[] = {
+    [DLM_TRACE_CLIENT_START] = "client-start",
+    [DLM_TRACE_CLIENT_CONNECTED] = "client-connected",
+    [DLM_TRACE_CLIENT_SENT] = "client-sent",
+    [DLM_TRACE_SERVER_RECEIVED] = "server-received",
+    [DLM_TRACE_SERVER_GRANT] = "server-grant",
+    [DLM_TRACE_SERVER_CREATED] = "server-created",
+    [DLM_TRACE_SERVER_SENT] = "server-sent",
+    [DLM_TRACE_CLIENT_RECEIVED] = "client-received",
+};
+
+int dlm_trace_open(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0)
+		DEBUG_LOG("Cannot open trace file %s: %s\n", path,
+			  strerror(errno));
+	return fd;
+}
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t dlm_trace_new_id(void)
+{
+	uint64_t id = 0;
+
+	/* Don't block while the entropy pool is not initialized early in
+	 * boot; trace ids only need to be unique, not unpredictable. */
+	while (id == 0) {
+		if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id))
+			id = get_time_ns() ^ ((uint64_t)getpid() << 32);
+	}
+	return id;
+}
+
+void dlm_trace_record(int fd, uint64_t id, enum dlm_trace_stage stage)
+{
+	char record[64];
+
+	if (fd < 0 || id == 0)
+		return;
+
+	uint64_t time = get_time_ns();
+	int len = snprintf(record, sizeof(record),
+			   "%016" PRIx64 " %s %" PRIu64 "\n", id,
+			   stage_names[stage], time);
+	if (write(fd, record, len) != len)
+		DEBUG_LOG("Trace record write failed: %s\n", strerror(errno));
+}
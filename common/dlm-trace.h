@@ -0,0 +1,52 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLM_TRACE_H
+#define DLM_TRACE_H
+
+#include <stdint.h>
+
+/* Request tracing
+ * Lease requests can carry a random request ID in a DLM_ATTR_TRACE_ID.
+ * The client library and the lease manager then each append a record to
+ * their trace file at every stage of the request:
+ *
+ *   <request ID, in hex> <stage name> <CLOCK_MONOTONIC time, in ns>
+ *
+ * Both sides use the same clock, so dlm-trace can merge the trace files
+ * into a latency breakdown of each request. */
+
+enum dlm_trace_stage {
+	DLM_TRACE_CLIENT_START,	    /* Before connecting to the lease manager */
+	DLM_TRACE_CLIENT_CONNECTED, /* Connected */
+	DLM_TRACE_CLIENT_SENT,	    /* Request sent */
+	DLM_TRACE_SERVER_RECEIVED,  /* Request read by the lease manager */
+	DLM_TRACE_SERVER_GRANT,	    /* Lease creation started */
+	DLM_TRACE_SERVER_CREATED,   /* Lease created */
+	DLM_TRACE_SERVER_SENT,	    /* Lease fd sent */
+	DLM_TRACE_CLIENT_RECEIVED,  /* Lease fd received by the client */
+};
+
+/* Open a trace file for appending.  Returns -1 on error. */
+int dlm_trace_open(const char *path);
+
+/* Get a new, non-zero, request ID */
+uint64_t dlm_trace_new_id(void);
+
+/* Append a record of the current time, if fd is valid and id is non-zero.
+ * Records are written with a single write, so that processes can share a
+ * trace file. */
+void dlm_trace_record(int fd, uint64_t id, enum dlm_trace_stage stage);
+#endif
@@ -27,11 +27,16 @@
 bool sockaddr_set_lease_server_path(struct sockaddr_un *sa,
 				    const char *lease_name)
 {
-	int maxlen = sizeof(sa->sun_path);
+	return get_runtime_file_path(sa->sun_path, sizeof(sa->sun_path),
+				     lease_name);
+}
+
+bool get_runtime_file_path(char *dest, size_t size, const char *name)
+{
+	int maxlen = size;
 	char *socket_dir = getenv("DLM_RUNTIME_PATH") ?: RUNTIME_PATH;
 
-	int len =
-	    snprintf(sa->sun_path, maxlen, "%s/%s", socket_dir, lease_name);
+	int len = snprintf(dest, maxlen, "%s/%s", socket_dir, name);
 
 	if (len < 0) {
 		DEBUG_LOG("Socket path creation failed: %s\n", strerror(errno));
@@ -23,4 +23,7 @@
 bool sockaddr_set_lease_server_path(struct sockaddr_un *dest,
 				    const char *lease_name);
 
+/* Get the path of a file in the lease manager runtime directory */
+bool get_runtime_file_path(char *dest, size_t size, const char *name);
+
 #endif
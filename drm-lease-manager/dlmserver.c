@@ -0,0 +1,1437 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "dlmserver.h"
+#include "dlm-trace.h"
+#include "drm-calls.h"
+#include "handoff.h"
+#include "lease-manager.h"
+#include "lease-server.h"
+#include "log.h"
+#include "startup-profile.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+_Static_assert((int)DLM_SERVER_CURSOR_DEDICATED == (int)LM_CURSOR_DEDICATED &&
+		   (int)DLM_SERVER_CURSOR_ALWAYS == (int)LM_CURSOR_ALWAYS &&
+		   (int)DLM_SERVER_CURSOR_NONE == (int)LM_CURSOR_NONE,
+	       "dlm_server_cursor_planes and lm_cursor_policy values differ");
+_Static_assert((int)DLM_SERVER_WRITEBACK_NONE == (int)LM_WRITEBACK_NONE &&
+		   (int)DLM_SERVER_WRITEBACK_SEPARATE ==
+		       (int)LM_WRITEBACK_SEPARATE &&
+		   (int)DLM_SERVER_WRITEBACK_ATTACHED ==
+		       (int)LM_WRITEBACK_ATTACHED,
+	       "dlm_server_writeback and lm_writeback_mode values differ");
+
+/* Leases held by the embedding process have no client.  Their user_data
+ * is set to LOCAL_HOLDER instead. */
+static char local_holder;
+#define LOCAL_HOLDER ((void *)&local_holder)
+
+static void notify_holder(struct ls *ls, struct lease_handle *lease_handle,
+			  enum ls_lease_event event)
+{
+	if (lease_handle->user_data && lease_handle->user_data != LOCAL_HOLDER)
+		ls_send_lease_event(ls, lease_handle->user_data, event);
+}
+
+/* Let the client holding a revoked lease know before disconnecting it,
+ * so that it can stop rendering right away */
+static void disconnect_holder(struct ls *ls, struct lease_handle *lease_handle)
+{
+	struct ls_client *holder = lease_handle->user_data;
+	if (!holder || holder == LOCAL_HOLDER)
+		return;
+
+	ls_send_lease_event(ls, holder, LS_EVENT_REVOKED);
+	ls_disconnect_client(ls, holder);
+}
+
+/* Session clients stay connected once they are done with a lease, so that
+ * they can request it again without reconnecting.  Unless they still hold
+ * the lease, they no longer count as active clients meanwhile. */
+static void end_client_request(struct ls *ls,
+			       struct lease_handle *lease_handle,
+			       struct ls_client *client)
+{
+	if (!ls_client_has_session(client))
+		ls_disconnect_client(ls, client);
+	else if (lease_handle->user_data != client)
+		ls_idle_client(ls, client);
+}
+
+/* Turn a lease selection request into a request for the selected lease.
+ * Returns false if no lease could be selected. */
+static bool select_lease(struct lm *lm, struct ls *ls, struct ls_req *req)
+{
+	struct ls_client *client = NULL;
+	struct lease_handle *lease_handle =
+	    lm_select_lease(lm, &req->constraints);
+
+	if (lease_handle)
+		client = ls_assign_client(ls, req->client, lease_handle);
+
+	if (!client) {
+		INFO_LOG("No lease available for lease selection request\n");
+		ls_send_error(ls, req->client,
+			      lease_handle ? LS_ERR_LEASE_BUSY
+					   : LS_ERR_NO_MATCH);
+		ls_disconnect_client(ls, req->client);
+		return false;
+	}
+
+	req->lease_handle = lease_handle;
+	req->client = client;
+	req->type = LS_REQ_GET_LEASE;
+	return true;
+}
+
+/* Send a granted lease to its client, revoking it if that fails */
+static void send_lease(struct lm *lm, struct ls *ls,
+		       struct lease_handle *lease_handle,
+		       struct ls_client *client, int fd)
+{
+	int topology_fd = lm_lease_topology_fd(lm, lease_handle);
+
+	if (!ls_send_lease(ls, client, fd, topology_fd)) {
+		ERROR_LOG("Client communication error: lease=%s\n",
+			  lease_handle->name);
+		ls_disconnect_client(ls, client);
+		lm_lease_revoke(lm, lease_handle);
+	} else {
+		lm_lease_set_holder(lm, lease_handle, ls_client_pid(client));
+	}
+
+	if (topology_fd >= 0)
+		close(topology_fd);
+}
+
+/* Pending lease reassignment
+ * Requests from the clients taking over the leases of the plan are held
+ * back until every lease has one, then all leases are moved at once.  The
+ * admin client is told once the new clients have updated the displays. */
+struct reassign_plan {
+	struct ls_client *admin;
+	struct lease_handle **leases;
+	struct ls_client **clients;
+	int nleases;
+	int nclients;
+
+	/* Lease whose next vblank the plan waits for, once every lease has
+	 * a client, to move the leases between two frames */
+	struct lease_handle *vblank_lease;
+
+	/* Set once the leases have been moved, until the displays have
+	 * switched */
+	bool switching;
+};
+
+/* The plan lists each lease at most once, so its arrays are allocated
+ * for all leases when the lease manager is created. */
+static bool plan_init(struct reassign_plan *plan, int count)
+{
+	plan->leases = calloc(count, sizeof(struct lease_handle *));
+	plan->clients = calloc(count, sizeof(struct ls_client *));
+	if (!plan->leases || !plan->clients) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void plan_fini(struct reassign_plan *plan)
+{
+	free(plan->leases);
+	free(plan->clients);
+}
+
+static void plan_clear(struct reassign_plan *plan)
+{
+	if (plan->clients)
+		memset(plan->clients, 0,
+		       plan->nleases * sizeof(plan->clients[0]));
+	plan->admin = NULL;
+	plan->nleases = 0;
+	plan->nclients = 0;
+	plan->vblank_lease = NULL;
+	plan->switching = false;
+}
+
+static void plan_cancel(struct ls *ls, struct reassign_plan *plan)
+{
+	INFO_LOG("Lease reassignment cancelled\n");
+	for (int i = 0; i < plan->nleases; i++) {
+		notify_holder(ls, plan->leases[i], LS_EVENT_TRANSFER_CANCELLED);
+		if (!plan->clients[i])
+			continue;
+		ls_send_error(ls, plan->clients[i], LS_ERR_LEASE_BUSY);
+		ls_disconnect_client(ls, plan->clients[i]);
+	}
+	plan_clear(plan);
+}
+
+static void plan_start(struct ls *ls, struct reassign_plan *plan,
+		       struct ls_req *req)
+{
+	if (plan->admin || plan->switching) {
+		INFO_LOG("Lease reassignment already in progress\n");
+		ls_send_error(ls, req->client, LS_ERR_LEASE_BUSY);
+		return;
+	}
+
+	int n = req->nlease_handles;
+	memcpy(plan->leases, req->lease_handles, n * sizeof(plan->leases[0]));
+	plan->nleases = n;
+	plan->admin = req->client;
+
+	INFO_LOG("Lease reassignment of %d leases started\n", n);
+	if (!ls_send_reassign_accepted(ls, req->client)) {
+		plan_cancel(ls, plan);
+		return;
+	}
+
+	/* The current holders can stop rendering until the switch */
+	for (int i = 0; i < n; i++)
+		notify_holder(ls, plan->leases[i], LS_EVENT_TRANSFER_PENDING);
+}
+
+static void plan_apply(struct lm *lm, struct ls *ls,
+		       struct reassign_plan *plan)
+{
+	int fds[plan->nleases];
+
+	for (int i = 0; i < plan->nleases; i++)
+		ls_trace_request(ls, plan->clients[i], DLM_TRACE_SERVER_GRANT);
+
+	bool ok = lm_lease_reassign(lm, plan->leases, plan->nleases, fds);
+
+	for (int i = 0; i < plan->nleases; i++) {
+		struct lease_handle *lease_handle = plan->leases[i];
+		struct ls_client *client = plan->clients[i];
+		if (fds[i] < 0) {
+			ls_send_error(ls, client, LS_ERR_LEASE_FAILED);
+			ls_disconnect_client(ls, client);
+			continue;
+		}
+
+		ls_trace_request(ls, client, DLM_TRACE_SERVER_CREATED);
+
+		disconnect_holder(ls, lease_handle);
+		lease_handle->user_data = client;
+		send_lease(lm, ls, lease_handle, client, fds[i]);
+	}
+
+	struct ls_client *admin = plan->admin;
+	plan_clear(plan);
+
+	if (!ok) {
+		ls_send_error(ls, admin, LS_ERR_LEASE_FAILED);
+		return;
+	}
+
+	/* The admin client is answered on LM_EVENT_REASSIGN_DONE */
+	plan->admin = admin;
+	plan->switching = true;
+}
+
+/* Move the leases once every lease has a client, at the next vblank of
+ * the first granted lease if vblank transfers are enabled */
+static void plan_ready(struct lm *lm, struct ls *ls,
+		       struct reassign_plan *plan)
+{
+	for (int i = 0; i < plan->nleases; i++) {
+		if (lm_lease_wait_vblank(lm, plan->leases[i])) {
+			plan->vblank_lease = plan->leases[i];
+			return;
+		}
+	}
+	plan_apply(lm, ls, plan);
+}
+
+static void plan_vblank(struct lm *lm, struct ls *ls,
+			struct reassign_plan *plan,
+			struct lease_handle *lease_handle)
+{
+	if (plan->vblank_lease != lease_handle)
+		return;
+
+	/* Clients may have left while waiting */
+	plan->vblank_lease = NULL;
+	if (plan->nleases > 0 && plan->nclients == plan->nleases)
+		plan_apply(lm, ls, plan);
+}
+
+static void plan_done(struct ls *ls, struct reassign_plan *plan,
+		      const struct lm_event *event)
+{
+	if (!plan->switching)
+		return;
+
+	if (event->switched) {
+		INFO_LOG("Reassigned leases switched in %u us\n",
+			 event->switch_time_us);
+		ls_send_reassign_done(ls, plan->admin, event->switch_time_us);
+	} else {
+		INFO_LOG("Reassigned leases revoked before switching\n");
+		ls_send_error(ls, plan->admin, LS_ERR_LEASE_FAILED);
+	}
+	plan_clear(plan);
+}
+
+static bool plan_has_lease(struct reassign_plan *plan,
+			   struct lease_handle *lease_handle)
+{
+	for (int i = 0; i < plan->nleases; i++) {
+		if (plan->leases[i] == lease_handle)
+			return true;
+	}
+	return false;
+}
+
+/* Hold back requests for the leases of a pending reassignment.
+ * Returns true if the request was handled. */
+static bool plan_hold_request(struct lm *lm, struct ls *ls,
+			      struct reassign_plan *plan, struct ls_req *req)
+{
+	int i;
+	for (i = 0; i < plan->nleases; i++) {
+		if (plan->leases[i] == req->lease_handle)
+			break;
+	}
+	if (i == plan->nleases)
+		return false;
+
+	switch (req->type) {
+	case LS_REQ_GET_LEASE:
+	case LS_REQ_RESUME_LEASE:
+		if (plan->clients[i]) {
+			ls_send_error(ls, req->client, LS_ERR_LEASE_BUSY);
+			ls_disconnect_client(ls, req->client);
+			return true;
+		}
+		lm_lease_set_plane_demand(lm, req->lease_handle,
+					  &req->plane_demand);
+		plan->clients[i] = req->client;
+		if (++plan->nclients == plan->nleases)
+			plan_ready(lm, ls, plan);
+		return true;
+	case LS_REQ_RELEASE_LEASE:
+	case LS_REQ_CLIENT_DISCONNECT:
+		if (plan->clients[i] != req->client)
+			return false;
+		ls_disconnect_client(ls, req->client);
+		plan->clients[i] = NULL;
+		plan->nclients--;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Requests from clients of the admin server */
+static void handle_admin_request(struct ls *ls, struct reassign_plan *plan,
+				 struct ls_req *req)
+{
+	switch (req->type) {
+	case LS_REQ_REASSIGN_LEASES:
+		plan_start(ls, plan, req);
+		break;
+	case LS_REQ_CLIENT_DISCONNECT:
+		if (plan->admin == req->client)
+			plan_cancel(ls, plan);
+		ls_disconnect_client(ls, req->client);
+		break;
+	default:
+		ERROR_LOG("Internal error: Invalid admin request\n");
+		break;
+	}
+}
+
+struct dlm_server {
+	struct lm *lm;
+	struct ls *ls;
+	struct reassign_plan plan;
+
+	/* Polls both the lease sockets and the lease manager events */
+	int epoll_fd;
+
+	/* Clients whose lease request waits for the vblank of a transfer,
+	 * by lease index.  LOCAL_HOLDER if the embedding process waits. */
+	struct ls_client **vblank_clients;
+
+	/* Leases whose state in the supervisor needs an update */
+	struct lease_handle **changed_leases;
+	int nchanged;
+
+	bool can_transfer_leases;
+	bool keep_on_crash;
+	bool resume_leases;
+
+	/* Request trace file, -1 if requests are not traced */
+	int trace_fd;
+
+	/* Set once the leases have been handed over to a new instance.  The
+	 * handoff connection is closed last, to let the new instance know
+	 * that this one is gone. */
+	bool handed_off;
+	int handoff_fd;
+
+	/* Requests from clients and from the embedding process can come from
+	 * different threads */
+	pthread_mutex_t lock;
+};
+
+/* Connection to the supervisor started by dlm_server_supervise() */
+static int supervisor_fd = -1;
+
+static struct lease_handle *find_lease(struct dlm_server *server,
+				       const char *name)
+{
+	struct lease_handle **lease_handles;
+	int count = lm_get_lease_handles(server->lm, &lease_handles);
+
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(lease_handles[i]->name, name))
+			return lease_handles[i];
+	}
+	return NULL;
+}
+
+/* Seamless restarts
+ * The state of the lease manager is the DRM master fd, the server sockets,
+ * and the granted leases with the connections of their clients.  It is
+ * handed over to a new instance on request, and kept up to date in the
+ * supervisor, if there is one, so that a restarted instance can adopt the
+ * leases without revoking them. */
+static struct handoff *export_state(struct dlm_server *server)
+{
+	struct lm *lm = server->lm;
+	struct ls *ls = server->ls;
+
+	struct handoff *handoff = handoff_create();
+	if (!handoff)
+		return NULL;
+
+	if (!handoff_set_device(handoff, lm_get_drm_fd(lm)) ||
+	    !ls_export(ls, handoff))
+		goto err;
+
+	struct lease_handle **lease_handles;
+	int count = lm_get_lease_handles(lm, &lease_handles);
+	for (int i = 0; i < count; i++) {
+		struct lease_handle *lease_handle = lease_handles[i];
+		uint32_t lessee_id;
+
+		/* Leases of the embedding process end with it */
+		if (lease_handle->user_data == LOCAL_HOLDER)
+			continue;
+
+		int lease_fd = lm_lease_export(lm, lease_handle, &lessee_id);
+		if (lease_fd < 0)
+			continue;
+
+		struct handoff_lease *lease = handoff_add_lease(
+		    handoff, lease_handle->name, lessee_id, lease_fd);
+		if (!lease || !ls_export_lease(ls, lease_handle,
+					       lease_handle->user_data, lease))
+			goto err;
+	}
+	return handoff;
+err:
+	handoff_destroy(handoff);
+	return NULL;
+}
+
+/* The supervisor gets the whole state once, then the state of each lease
+ * that changes */
+static void init_supervisor(struct dlm_server *server)
+{
+	if (supervisor_fd < 0)
+		return;
+
+	struct handoff *handoff = export_state(server);
+	if (!handoff || !handoff_send(supervisor_fd, handoff))
+		WARN_LOG("Can't send lease manager state to supervisor\n");
+	handoff_destroy(handoff);
+}
+
+static void mark_changed(struct dlm_server *server,
+			 struct lease_handle *lease_handle)
+{
+	if (supervisor_fd < 0 || !lease_handle)
+		return;
+
+	for (int i = 0; i < server->nchanged; i++) {
+		if (server->changed_leases[i] == lease_handle)
+			return;
+	}
+	server->changed_leases[server->nchanged++] = lease_handle;
+}
+
+static bool update_lease(struct dlm_server *server,
+			 struct lease_handle *lease_handle)
+{
+	struct handoff_lease lease = {
+	    .name = lease_handle->name,
+	    .lease_fd = -1,
+	    .client_fd = -1,
+	};
+
+	/* Leases of the embedding process end with it */
+	if (lease_handle->user_data != LOCAL_HOLDER)
+		lease.lease_fd = lm_lease_export(server->lm, lease_handle,
+						 &lease.lessee_id);
+
+	bool ok = lease.lease_fd < 0 ||
+		  ls_export_lease(server->ls, lease_handle,
+				  lease_handle->user_data, &lease);
+	ok = ok && handoff_send_lease(supervisor_fd, &lease);
+
+	if (lease.client_fd >= 0)
+		close(lease.client_fd);
+	return ok;
+}
+
+static void mark_plan_changed(struct dlm_server *server)
+{
+	for (int i = 0; i < server->plan.nleases; i++)
+		mark_changed(server, server->plan.leases[i]);
+}
+
+static void update_supervisor(struct dlm_server *server)
+{
+	for (int i = 0; i < server->nchanged; i++) {
+		struct lease_handle *lease_handle = server->changed_leases[i];
+		if (!update_lease(server, lease_handle))
+			WARN_LOG("Can't update state of lease %s in "
+				 "supervisor\n",
+				 lease_handle->name);
+	}
+	server->nchanged = 0;
+}
+
+static void handle_handoff_request(struct dlm_server *server,
+				   struct ls_req *req)
+{
+	struct ls *ls = server->ls;
+
+	if (server->plan.admin) {
+		INFO_LOG("Lease reassignment in progress, handoff refused\n");
+		ls_send_error(ls, req->client, LS_ERR_LEASE_BUSY);
+		ls_disconnect_client(ls, req->client);
+		return;
+	}
+
+	struct handoff *handoff = export_state(server);
+	if (!handoff) {
+		ls_send_error(ls, req->client, LS_ERR_LEASE_FAILED);
+		ls_disconnect_client(ls, req->client);
+		return;
+	}
+
+	int socket = ls_take_client_socket(ls, req->client);
+	if (!handoff_send(socket, handoff) || !handoff_wait_ack(socket)) {
+		ERROR_LOG("Lease manager handoff failed\n");
+		handoff_destroy(handoff);
+		close(socket);
+		return;
+	}
+
+	/* The leases, and the server sockets, now belong to the new
+	 * instance */
+	for (int i = 0; i < handoff->nleases; i++) {
+		struct lease_handle *lease_handle =
+		    find_lease(server, handoff->leases[i].name);
+		lm_lease_disown(server->lm, lease_handle);
+		lease_handle->user_data = NULL;
+	}
+	ls_disown(ls);
+	handoff_destroy(handoff);
+
+	INFO_LOG("Lease manager handed off to the new instance\n");
+	server->handed_off = true;
+	server->handoff_fd = socket;
+}
+
+static void adopt_leases(struct dlm_server *server, struct handoff *handoff)
+{
+	struct lm *lm = server->lm;
+
+	for (int i = 0; i < handoff->nleases; i++) {
+		struct handoff_lease *lease = &handoff->leases[i];
+		struct lease_handle *lease_handle =
+		    find_lease(server, lease->name);
+
+		if (!lease_handle ||
+		    !lm_lease_adopt(lm, lease_handle, lease->lessee_id,
+				    lease->lease_fd)) {
+			WARN_LOG("Can't adopt lease %s\n", lease->name);
+			continue;
+		}
+		lease->lease_fd = -1;
+
+		struct ls_client *client =
+		    ls_adopt_lease(server->ls, lease_handle, lease);
+		if (!client && !server->resume_leases) {
+			lm_lease_revoke(lm, lease_handle);
+			lm_lease_close(lease_handle);
+			continue;
+		}
+
+		lease_handle->user_data = client;
+		lm_lease_set_holder(lm, lease_handle,
+				    client ? ls_client_pid(client) : 0);
+		INFO_LOG("Lease %s adopted\n", lease->name);
+	}
+}
+
+/* Get the state of the running instance, or of the crashed one from the
+ * supervisor */
+static struct handoff *get_handoff(bool takeover)
+{
+	if (!takeover && supervisor_fd < 0)
+		return NULL;
+
+	if (!takeover)
+		return handoff_receive(supervisor_fd);
+
+	int socket = handoff_connect();
+	if (socket < 0) {
+		INFO_LOG("No running lease manager to take over from\n");
+		return NULL;
+	}
+
+	struct handoff *handoff = handoff_receive(socket);
+	if (handoff && !handoff_send_ack(socket)) {
+		handoff_destroy(handoff);
+		handoff = NULL;
+	}
+
+	/* Wait for the running instance to let go of the DRM device */
+	if (handoff)
+		handoff_wait_close(socket);
+	close(socket);
+	return handoff;
+}
+
+static int lease_index(struct lm *lm, struct lease_handle *lease_handle)
+{
+	struct lease_handle **lease_handles;
+	int count = lm_get_lease_handles(lm, &lease_handles);
+
+	for (int i = 0; i < count; i++) {
+		if (lease_handles[i] == lease_handle)
+			return i;
+	}
+	return -1;
+}
+
+/* Hand a lease to the client that requested it, or tell the client why
+ * it can't have it */
+static void finish_lease_request(struct dlm_server *server,
+				 struct lease_handle *lease_handle,
+				 struct ls_client *client, int fd)
+{
+	struct ls *ls = server->ls;
+	struct ls_client *active_client = lease_handle->user_data;
+
+	if (fd < 0) {
+		ERROR_LOG("Can't fulfill lease request: lease=%s\n",
+			  lease_handle->name);
+
+		enum ls_error error = LS_ERR_LEASE_FAILED;
+		if (active_client && !server->can_transfer_leases)
+			error = LS_ERR_LEASE_BUSY;
+
+		ls_send_error(ls, client, error);
+		end_client_request(ls, lease_handle, client);
+		return;
+	}
+
+	ls_trace_request(ls, client, DLM_TRACE_SERVER_CREATED);
+	disconnect_holder(ls, lease_handle);
+	lease_handle->user_data = client;
+	send_lease(server->lm, ls, lease_handle, client, fd);
+}
+
+/* Vblank-aligned transfers
+ * A request that takes a lease from its holder waits for the next vblank
+ * of the lease CRTC, without holding up other requests, and is carried
+ * out on the LM_EVENT_VBLANK of the lease.
+ * Returns true if the request waits, or was refused because another
+ * request for the lease already does. */
+static bool queue_transfer(struct dlm_server *server,
+			   struct lease_handle *lease_handle,
+			   struct ls_client *client)
+{
+	int index = lease_index(server->lm, lease_handle);
+	if (server->vblank_clients[index]) {
+		INFO_LOG("Transfer of lease %s already pending\n",
+			 lease_handle->name);
+		ls_send_error(server->ls, client, LS_ERR_LEASE_BUSY);
+		end_client_request(server->ls, lease_handle, client);
+		return true;
+	}
+
+	if (!lm_lease_wait_vblank(server->lm, lease_handle))
+		return false;
+
+	server->vblank_clients[index] = client;
+	return true;
+}
+
+static void finish_transfer(struct dlm_server *server,
+			    struct lease_handle *lease_handle)
+{
+	struct lm *lm = server->lm;
+	int index = lease_index(lm, lease_handle);
+	struct ls_client *client = server->vblank_clients[index];
+
+	server->vblank_clients[index] = NULL;
+	if (!client || client == LOCAL_HOLDER)
+		return;
+
+	/* The holder may have released the lease meanwhile */
+	int fd = lm_lease_grant(lm, lease_handle);
+	if (fd < 0 && (server->can_transfer_leases || !lease_handle->user_data))
+		fd = lm_lease_transfer(lm, lease_handle);
+
+	finish_lease_request(server, lease_handle, client, fd);
+	mark_changed(server, lease_handle);
+}
+
+static void handle_lease_request(struct dlm_server *server,
+				 struct ls_req *req)
+{
+	struct lm *lm = server->lm;
+	struct ls *ls = server->ls;
+	int fd = -1;
+	struct ls_client *active_client = req->lease_handle->user_data;
+
+	ls_trace_request(ls, req->client, DLM_TRACE_SERVER_GRANT);
+
+	if (server->resume_leases && req->type == LS_REQ_RESUME_LEASE &&
+	    active_client != LOCAL_HOLDER)
+		fd = lm_lease_resume(lm, req->lease_handle);
+
+	lm_lease_set_plane_demand(lm, req->lease_handle, &req->plane_demand);
+
+	if (fd < 0)
+		fd = lm_lease_grant(lm, req->lease_handle);
+
+	/* A lease kept for resume, but not reclaimed by its owner, can
+	 * always be taken over by a new client */
+	if (fd < 0 && (server->can_transfer_leases || !active_client)) {
+		if (queue_transfer(server, req->lease_handle, req->client))
+			return;
+		fd = lm_lease_transfer(lm, req->lease_handle);
+	}
+
+	finish_lease_request(server, req->lease_handle, req->client, fd);
+}
+
+static void handle_release_request(struct dlm_server *server,
+				   struct ls_req *req)
+{
+	struct lm *lm = server->lm;
+
+	/* The client no longer waits for a transfer */
+	int index = lease_index(lm, req->lease_handle);
+	if (server->vblank_clients[index] == req->client)
+		server->vblank_clients[index] = NULL;
+
+	/* Only the holder can give up the lease.  Other clients may be
+	 * connected while waiting to request it. */
+	bool is_holder = req->lease_handle->user_data == req->client;
+	if (is_holder) {
+		req->lease_handle->user_data = NULL;
+		lm_lease_set_holder(lm, req->lease_handle, 0);
+	}
+
+	if (req->type == LS_REQ_RELEASE_LEASE)
+		end_client_request(server->ls, req->lease_handle, req->client);
+	else
+		ls_disconnect_client(server->ls, req->client);
+
+	if (!is_holder)
+		return;
+
+	/* A released lease can't be resumed */
+	if (req->type == LS_REQ_RELEASE_LEASE)
+		ls_clear_resume_token(server->ls, req->lease_handle);
+
+	if (server->resume_leases && req->type == LS_REQ_CLIENT_DISCONNECT) {
+		INFO_LOG("Lease %s kept for resume\n", req->lease_handle->name);
+		return;
+	}
+
+	lm_lease_revoke(lm, req->lease_handle);
+
+	if (!server->keep_on_crash || req->type == LS_REQ_RELEASE_LEASE)
+		lm_lease_close(req->lease_handle);
+}
+
+/* Handle a client request.  Returns false on internal errors. */
+static bool handle_request(struct dlm_server *server, struct ls_req *req)
+{
+	if (req->type == LS_REQ_SELECT_LEASE &&
+	    !select_lease(server->lm, server->ls, req))
+		return true;
+
+	if (req->type == LS_REQ_HANDOFF) {
+		handle_handoff_request(server, req);
+		return true;
+	}
+
+	if (!req->lease_handle) {
+		handle_admin_request(server->ls, &server->plan, req);
+		return true;
+	}
+
+	/* The request can complete a pending reassignment, which moves all
+	 * the leases of the plan */
+	if (plan_has_lease(&server->plan, req->lease_handle))
+		mark_plan_changed(server);
+
+	if (plan_hold_request(server->lm, server->ls, &server->plan, req))
+		return true;
+
+	switch (req->type) {
+	case LS_REQ_RESUME_LEASE:
+	case LS_REQ_GET_LEASE:
+		handle_lease_request(server, req);
+		return true;
+	case LS_REQ_RELEASE_LEASE:
+	case LS_REQ_CLIENT_DISCONNECT:
+		handle_release_request(server, req);
+		return true;
+	default:
+		ERROR_LOG("Internal error: Invalid lease request\n");
+		return false;
+	}
+}
+
+/* Scheduling state from before real-time mode, restored if the server
+ * can't be created */
+struct realtime_state {
+	bool active;
+	int policy;
+	struct sched_param param;
+	bool affinity_set;
+	cpu_set_t affinity;
+};
+
+static void restore_realtime(struct realtime_state *saved)
+{
+	if (saved->affinity_set &&
+	    sched_setaffinity(0, sizeof(saved->affinity), &saved->affinity))
+		WARN_LOG("Can't restore CPU affinity: %s\n", strerror(errno));
+	saved->affinity_set = false;
+
+	if (!saved->active)
+		return;
+
+	if (sched_setscheduler(0, saved->policy, &saved->param))
+		WARN_LOG("Can't restore scheduling policy: %s\n",
+			 strerror(errno));
+	munlockall();
+	saved->active = false;
+}
+
+/* Real-time mode
+ * Set up before the lease manager is created, so that its transition
+ * workers inherit the scheduling policy and CPU affinity.  The previous
+ * state is kept in saved. */
+static bool setup_realtime(const struct dlm_server_options *options,
+			   struct realtime_state *saved)
+{
+	*saved = (struct realtime_state){0};
+	if (!options->realtime_priority)
+		return true;
+
+	/* State updates to the supervisor allocate memory */
+	if (supervisor_fd >= 0) {
+		ERROR_LOG("Real-time mode can't be supervised\n");
+		return false;
+	}
+
+	if (options->cpu_affinity) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned i = 0; i < 8 * sizeof(unsigned long); i++) {
+			if (options->cpu_affinity & (1UL << i))
+				CPU_SET(i, &set);
+		}
+		if (sched_getaffinity(0, sizeof(saved->affinity),
+				      &saved->affinity) ||
+		    sched_setaffinity(0, sizeof(set), &set)) {
+			ERROR_LOG("Can't set CPU affinity: %s\n",
+				  strerror(errno));
+			return false;
+		}
+		saved->affinity_set = true;
+	}
+
+	saved->policy = sched_getscheduler(0);
+	struct sched_param param = {
+	    .sched_priority = options->realtime_priority,
+	};
+	if (saved->policy < 0 || sched_getparam(0, &saved->param) ||
+	    sched_setscheduler(0, SCHED_FIFO, &param)) {
+		ERROR_LOG("Can't set real-time priority %d: %s\n",
+			  options->realtime_priority, strerror(errno));
+		restore_realtime(saved);
+		return false;
+	}
+	saved->active = true;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		ERROR_LOG("Can't lock memory: %s\n", strerror(errno));
+		restore_realtime(saved);
+		return false;
+	}
+
+	INFO_LOG("Running with real-time priority %d\n",
+		 options->realtime_priority);
+	return true;
+}
+
+void dlm_server_enable_debug_log(bool enable)
+{
+	dlm_log_enable_debug(enable);
+}
+
+static struct lm_options
+get_lm_options(const struct dlm_server_options *options)
+{
+	return (struct lm_options){
+	    .fast_enumeration = options->fast_enumeration,
+	    .cursor_policy = (enum lm_cursor_policy)options->cursor_planes,
+	    .writeback = (enum lm_writeback_mode)options->writeback,
+	    .vblank_transfers = options->vblank_transfer,
+	    .realtime = options->realtime_priority > 0,
+	    .frame_stats = options->frame_stats,
+	    .profile_startup = options->profile_startup,
+	};
+}
+
+static bool create_epoll_fd(struct dlm_server *server)
+{
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epoll_fd < 0) {
+		DEBUG_LOG("epoll_create failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	int fds[] = {ls_get_fd(server->ls), lm_get_fd(server->lm)};
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		struct epoll_event ev = {.events = EPOLLIN};
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev)) {
+			DEBUG_LOG("epoll_ctl add failed: %s\n",
+				  strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+struct dlm_server *dlm_server_create(const char *device,
+				     const struct dlm_server_options *options)
+{
+	static const struct dlm_server_options default_options;
+
+	assert(device);
+	if (!options)
+		options = &default_options;
+
+	struct startup_profile total;
+	startup_profile_start(&total, options->profile_startup);
+
+	struct realtime_state saved_sched;
+	if (!setup_realtime(options, &saved_sched))
+		return NULL;
+
+	struct dlm_server *server = calloc(1, sizeof(struct dlm_server));
+	if (!server) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		restore_realtime(&saved_sched);
+		return NULL;
+	}
+
+	pthread_mutex_init(&server->lock, NULL);
+	server->handoff_fd = -1;
+	server->trace_fd = -1;
+	server->epoll_fd = -1;
+	server->can_transfer_leases = options->lease_transfer;
+	server->keep_on_crash = options->keep_on_crash;
+	server->resume_leases = options->resume_leases;
+
+	struct lm_options lm_options = get_lm_options(options);
+
+	struct handoff *handoff = get_handoff(options->takeover);
+	if (handoff && handoff->drm_fd >= 0) {
+		server->lm = lm_create_from_fd(handoff->drm_fd, &lm_options);
+		handoff->drm_fd = -1;
+	} else {
+		handoff_destroy(handoff);
+		handoff = NULL;
+		server->lm = lm_create(device, &lm_options);
+	}
+
+	if (!server->lm) {
+		ERROR_LOG("DRM Lease initialization failed\n");
+		goto err;
+	}
+
+	struct lease_handle **lease_handles = NULL;
+	int count_ids = lm_get_lease_handles(server->lm, &lease_handles);
+	assert(count_ids > 0);
+
+	if (!plan_init(&server->plan, count_ids))
+		goto err;
+
+	server->vblank_clients = calloc(count_ids, sizeof(struct ls_client *));
+	server->changed_leases =
+	    calloc(count_ids, sizeof(struct lease_handle *));
+	if (!server->vblank_clients || !server->changed_leases) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	struct startup_profile profile;
+	startup_profile_start(&profile, options->profile_startup);
+	server->ls = handoff ? ls_create_from_handoff(lease_handles, count_ids,
+						      handoff)
+			     : ls_create(lease_handles, count_ids);
+	if (!server->ls) {
+		ERROR_LOG("Client socket initialization failed\n");
+		goto err;
+	}
+	startup_profile_phase(&profile, "sockets", NULL);
+
+	if (handoff) {
+		adopt_leases(server, handoff);
+		handoff_destroy(handoff);
+		handoff = NULL;
+	}
+
+	if (options->trace_file) {
+		server->trace_fd = dlm_trace_open(options->trace_file);
+		if (server->trace_fd < 0) {
+			ERROR_LOG("Cannot open trace file %s\n",
+				  options->trace_file);
+			goto err;
+		}
+		ls_set_trace_fd(server->ls, server->trace_fd);
+	}
+
+	if (!create_epoll_fd(server))
+		goto err;
+
+	init_supervisor(server);
+	startup_profile_phase(&total, "total", NULL);
+	return server;
+err:
+	handoff_destroy(handoff);
+	dlm_server_destroy(server);
+	restore_realtime(&saved_sched);
+	return NULL;
+}
+
+bool dlm_server_dry_run(const char *device,
+			const struct dlm_server_options *options, FILE *out)
+{
+	static const struct dlm_server_options default_options;
+
+	assert(device);
+	assert(out);
+	if (!options)
+		options = &default_options;
+
+	struct lm_options lm_options = get_lm_options(options);
+	lm_options.realtime = false;
+	lm_options.dry_run = true;
+
+	struct lm *lm = lm_create(device, &lm_options);
+	if (!lm) {
+		ERROR_LOG("DRM Lease initialization failed\n");
+		return false;
+	}
+
+	lm_print_plan(lm, out);
+	lm_destroy(lm);
+	return true;
+}
+
+void dlm_server_destroy(struct dlm_server *server)
+{
+	assert(server);
+
+	plan_fini(&server->plan);
+	free(server->vblank_clients);
+	free(server->changed_leases);
+	if (server->ls)
+		ls_destroy(server->ls);
+	if (server->lm)
+		lm_destroy(server->lm);
+	if (server->handoff_fd >= 0)
+		close(server->handoff_fd);
+	if (server->trace_fd >= 0)
+		close(server->trace_fd);
+	if (server->epoll_fd >= 0)
+		close(server->epoll_fd);
+	pthread_mutex_destroy(&server->lock);
+	free(server);
+}
+
+int dlm_server_get_fd(struct dlm_server *server)
+{
+	assert(server);
+
+	return server->epoll_fd;
+}
+
+int dlm_server_get_timeout(struct dlm_server *server)
+{
+	assert(server);
+
+	pthread_mutex_lock(&server->lock);
+	int timeout = ls_get_timeout(server->ls);
+	int lm_timeout = lm_get_timeout(server->lm);
+	if (lm_timeout >= 0 && (timeout < 0 || lm_timeout < timeout))
+		timeout = lm_timeout;
+	pthread_mutex_unlock(&server->lock);
+	return timeout;
+}
+
+/* Publish the connections shed by the lease sockets in the status page */
+static void publish_admission_stats(struct dlm_server *server)
+{
+	struct lease_handle **lease_handles;
+	int count = lm_get_lease_handles(server->lm, &lease_handles);
+
+	for (int i = 0; i < count; i++) {
+		struct lease_admission_stats stats;
+		if (ls_get_admission_stats(server->ls, lease_handles[i],
+					   &stats))
+			lm_lease_set_admission_stats(server->lm,
+						     lease_handles[i], &stats);
+	}
+}
+
+static void handle_lm_event(const struct lm_event *event, void *data)
+{
+	struct dlm_server *server = data;
+
+	switch (event->type) {
+	case LM_EVENT_REASSIGN_DONE:
+		plan_done(server->ls, &server->plan, event);
+		break;
+	case LM_EVENT_VBLANK:
+		finish_transfer(server, event->lease_handle);
+		if (server->plan.vblank_lease == event->lease_handle)
+			mark_plan_changed(server);
+		plan_vblank(server->lm, server->ls, &server->plan,
+			    event->lease_handle);
+		break;
+	}
+}
+
+bool dlm_server_dispatch(struct dlm_server *server)
+{
+	assert(server);
+
+	struct ls_req req;
+	int ret = 0;
+
+	pthread_mutex_lock(&server->lock);
+	while (!server->handed_off &&
+	       (ret = ls_poll_request(server->ls, &req)) > 0) {
+		if (!handle_request(server, &req)) {
+			ret = -1;
+			break;
+		}
+		mark_changed(server, req.lease_handle);
+	}
+
+	if (ret == 0 && !server->handed_off)
+		lm_dispatch_events(server->lm, handle_lm_event, server);
+
+	if (server->handed_off)
+		ret = -1;
+	else
+		update_supervisor(server);
+
+	if (ret == 0)
+		publish_admission_stats(server);
+	pthread_mutex_unlock(&server->lock);
+	return ret == 0;
+}
+
+void dlm_server_log_drm_calls(struct dlm_server *server)
+{
+	assert(server);
+
+	drm_calls_log();
+}
+
+bool dlm_server_handed_off(struct dlm_server *server)
+{
+	assert(server);
+
+	pthread_mutex_lock(&server->lock);
+	bool handed_off = server->handed_off;
+	pthread_mutex_unlock(&server->lock);
+	return handed_off;
+}
+
+void dlm_server_run(struct dlm_server *server)
+{
+	assert(server);
+
+	struct pollfd server_poll = {
+	    .fd = dlm_server_get_fd(server),
+	    .events = POLLIN,
+	};
+
+	do {
+		int ret = poll(&server_poll, 1, dlm_server_get_timeout(server));
+		if (ret < 0 && errno != EINTR) {
+			DEBUG_LOG("poll failed: %s\n", strerror(errno));
+			return;
+		}
+	} while (dlm_server_dispatch(server));
+}
+
+int dlm_server_lease_count(struct dlm_server *server)
+{
+	assert(server);
+
+	struct lease_handle **lease_handles;
+
+	pthread_mutex_lock(&server->lock);
+	int count = lm_get_lease_handles(server->lm, &lease_handles);
+	pthread_mutex_unlock(&server->lock);
+	return count;
+}
+
+const char *dlm_server_lease_name(struct dlm_server *server, int index)
+{
+	assert(server);
+
+	struct lease_handle **lease_handles;
+	const char *name = NULL;
+
+	pthread_mutex_lock(&server->lock);
+	int count = lm_get_lease_handles(server->lm, &lease_handles);
+	if (index >= 0 && index < count)
+		name = lease_handles[index]->name;
+	pthread_mutex_unlock(&server->lock);
+	return name;
+}
+
+/* The embedding process waits for the vblank of its transfer, handling
+ * the events that arrive meanwhile.  Returns false if a client already
+ * waits to transfer the lease. */
+static bool wait_for_transfer_vblank(struct dlm_server *server,
+				     struct lease_handle *lease_handle)
+{
+	int index = lease_index(server->lm, lease_handle);
+	if (server->vblank_clients[index])
+		return false;
+
+	if (!lm_lease_wait_vblank(server->lm, lease_handle))
+		return true;
+
+	server->vblank_clients[index] = LOCAL_HOLDER;
+	struct pollfd lm_poll = {.fd = lm_get_fd(server->lm), .events = POLLIN};
+	while (server->vblank_clients[index] == LOCAL_HOLDER) {
+		if (poll(&lm_poll, 1, lm_get_timeout(server->lm)) < 0 &&
+		    errno != EINTR) {
+			DEBUG_LOG("poll failed: %s\n", strerror(errno));
+			server->vblank_clients[index] = NULL;
+			break;
+		}
+		lm_dispatch_events(server->lm, handle_lm_event, server);
+	}
+	return true;
+}
+
+int dlm_server_get_lease(struct dlm_server *server, const char *name)
+{
+	assert(server);
+	assert(name);
+
+	struct lm *lm = server->lm;
+	int fd = -1;
+
+	pthread_mutex_lock(&server->lock);
+
+	struct lease_handle *lease_handle = find_lease(server, name);
+	if (!lease_handle) {
+		errno = ENOENT;
+		goto done;
+	}
+
+	struct ls_client *active_client = lease_handle->user_data;
+	if (active_client == LOCAL_HOLDER ||
+	    plan_has_lease(&server->plan, lease_handle)) {
+		errno = EBUSY;
+		goto done;
+	}
+
+	struct lease_plane_demand no_demand = {0};
+	lm_lease_set_plane_demand(lm, lease_handle, &no_demand);
+
+	int lease_fd = lm_lease_grant(lm, lease_handle);
+	if (lease_fd < 0 && (server->can_transfer_leases || !active_client)) {
+		if (!wait_for_transfer_vblank(server, lease_handle)) {
+			errno = EBUSY;
+			goto done;
+		}
+		lease_fd = lm_lease_transfer(lm, lease_handle);
+	}
+
+	if (lease_fd < 0) {
+		ERROR_LOG("Can't fulfill local lease request: lease=%s\n",
+			  name);
+		if (active_client && !server->can_transfer_leases)
+			errno = EBUSY;
+		goto done;
+	}
+
+	disconnect_holder(server->ls, lease_handle);
+	lease_handle->user_data = LOCAL_HOLDER;
+	lm_lease_set_holder(lm, lease_handle, getpid());
+	mark_changed(server, lease_handle);
+	update_supervisor(server);
+
+	/* The lease manager keeps its own copy of the lease fd */
+	fd = fcntl(lease_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0) {
+		DEBUG_LOG("Can't duplicate lease fd: %s\n", strerror(errno));
+		lease_handle->user_data = NULL;
+		lm_lease_set_holder(lm, lease_handle, 0);
+		lm_lease_revoke(lm, lease_handle);
+		lm_lease_close(lease_handle);
+	}
+done:
+	pthread_mutex_unlock(&server->lock);
+	return fd;
+}
+
+void dlm_server_release_lease(struct dlm_server *server, const char *name)
+{
+	assert(server);
+	assert(name);
+
+	pthread_mutex_lock(&server->lock);
+
+	struct lease_handle *lease_handle = find_lease(server, name);
+	if (lease_handle && lease_handle->user_data == LOCAL_HOLDER) {
+		lease_handle->user_data = NULL;
+		lm_lease_set_holder(server->lm, lease_handle, 0);
+		lm_lease_revoke(server->lm, lease_handle);
+		lm_lease_close(lease_handle);
+	}
+
+	pthread_mutex_unlock(&server->lock);
+}
+
+/* Delay before restarting a crashed lease manager, so that a lease manager
+ * that crashes on startup does not keep the supervisor busy */
+#define SUPERVISOR_RESTART_DELAY_S 1
+
+bool dlm_server_supervise(void)
+{
+	struct handoff *state = handoff_create();
+	if (!state)
+		return false;
+
+	bool restarting = false;
+	for (;;) {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+			       sockets)) {
+			DEBUG_LOG("socketpair failed: %s\n", strerror(errno));
+			break;
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			DEBUG_LOG("fork failed: %s\n", strerror(errno));
+			close(sockets[0]);
+			close(sockets[1]);
+			break;
+		}
+
+		if (pid == 0) {
+			handoff_destroy(state);
+			close(sockets[0]);
+			supervisor_fd = sockets[1];
+			return true;
+		}
+
+		close(sockets[1]);
+
+		/* Hand the state of the crashed lease manager to the new one,
+		 * and keep its state up to date with the lease updates it
+		 * sends back */
+		struct handoff *update;
+		if (handoff_send(sockets[0], state) &&
+		    (update = handoff_receive(sockets[0]))) {
+			handoff_destroy(state);
+			state = update;
+			while (handoff_receive_update(sockets[0], state))
+				;
+		}
+		close(sockets[0]);
+
+		int status = 0;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+
+		if (!WIFSIGNALED(status)) {
+			handoff_destroy(state);
+			exit(WIFEXITED(status) ? WEXITSTATUS(status)
+					       : EXIT_FAILURE);
+		}
+
+		WARN_LOG("Lease manager killed by signal %d, restarting\n",
+			 WTERMSIG(status));
+		sleep(SUPERVISOR_RESTART_DELAY_S);
+		restarting = true;
+	}
+
+	handoff_destroy(state);
+	if (!restarting)
+		return false;
+
+	/* The leases of the crashed lease manager are lost */
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,257 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file dlmserver.h
+ */
+#ifndef DLM_SERVER_H
+#define DLM_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * @brief Cursor planes to include in leases
+ */
+enum dlm_server_cursor_planes {
+	/** Only cursor planes dedicated to the lease CRTC */
+	DLM_SERVER_CURSOR_DEDICATED,
+	/** Also add a shared cursor plane if the CRTC has none */
+	DLM_SERVER_CURSOR_ALWAYS,
+	/** Never lease cursor planes */
+	DLM_SERVER_CURSOR_NONE,
+};
+
+/**
+ * @brief How writeback connectors are leased
+ */
+enum dlm_server_writeback {
+	/** Writeback connectors are not used */
+	DLM_SERVER_WRITEBACK_NONE,
+	/** Each writeback connector has a lease of its own */
+	DLM_SERVER_WRITEBACK_SEPARATE,
+	/** Writeback connectors are added to display leases */
+	DLM_SERVER_WRITEBACK_ATTACHED,
+};
+
+/**
+ * @brief Lease manager options
+ *
+ * @details Each option matches a drm-lease-manager command line option.
+ */
+struct dlm_server_options {
+	bool lease_transfer;   /**< -t: Allow lease transfer to new clients */
+	bool keep_on_crash;    /**< -k: Don't close lease on client crash */
+	bool fast_enumeration; /**< -f: Don't wait for connector probing */
+	bool resume_leases;    /**< -r: Let restarted clients resume leases */
+	bool vblank_transfer;  /**< -b: Transfer leases at the next vblank */
+	bool takeover;	       /**< -u: Take over from a running instance */
+	bool frame_stats;      /**< -F: Publish frame timing of leases */
+	/** -c: Cursor planes to include in leases */
+	enum dlm_server_cursor_planes cursor_planes;
+	/** -w: How writeback connectors are leased */
+	enum dlm_server_writeback writeback;
+	/** -R: SCHED_FIFO priority, 0 to run without real-time scheduling */
+	int realtime_priority;
+	/** -a: Mask of the CPUs to run on in real-time mode, 0 for any CPU */
+	unsigned long cpu_affinity;
+	/** -T: File to append request traces to, NULL to not trace requests */
+	const char *trace_file;
+	/** -P: Log the time spent in each phase of startup */
+	bool profile_startup;
+};
+
+/**
+ * @brief Enable debug logging
+ *
+ * @param[in] enable enable/disable debug logging
+ */
+void dlm_server_enable_debug_log(bool enable);
+
+/**
+ * @brief lease manager handle
+ */
+struct dlm_server;
+
+/**
+ * @brief Restart the lease manager if it crashes, without revoking leases
+ *
+ * @details Forks a supervisor process, which keeps a copy of the DRM master
+ *          fd and of the lease manager state.  If the lease manager process
+ *          is killed by a signal, the supervisor forks it again, from the
+ *          return of this function, and the next dlm_server_create() call
+ *          adopts the leases of the crashed lease manager.
+ *
+ *          Must be called before dlm_server_create().  Only returns in the
+ *          lease manager process.  The supervisor exits with the exit
+ *          status of the lease manager.
+ *
+ * @return false if the supervisor could not be started
+ */
+bool dlm_server_supervise(void);
+
+/**
+ * @brief Create a lease manager
+ *
+ * @details Creates the leases of a DRM device, and the sockets that
+ *          clients request them on, exactly like drm-lease-manager does.
+ *          The calling process must be the DRM master of the device.
+ *
+ *          With the takeover option, the DRM master fd, sockets and granted
+ *          leases of the running lease manager are handed over instead,
+ *          and the running lease manager exits without revoking the leases.
+ *
+ *          All functions taking a lease manager handle can be called from
+ *          any thread.
+ *
+ *          With a real-time priority, the calling process is switched to
+ *          SCHED_FIFO and its memory is locked.  Everything the lease
+ *          manager needs is allocated here, so that handling requests
+ *          never allocates memory.  Real-time mode can't be combined with
+ *          dlm_server_supervise().
+ *
+ * @param[in] device path of the DRM device
+ * @param[in] options lease manager options, or NULL for the defaults
+ * @return A lease manager handle, or NULL on error
+ */
+struct dlm_server *dlm_server_create(const char *device,
+				     const struct dlm_server_options *options);
+
+/**
+ * @brief Print the leases a lease manager would create
+ *
+ * @details Plans the leases of a DRM device exactly like
+ *          dlm_server_create(), and prints the connector, CRTC and planes
+ *          of each, without creating any sockets or DRM leases.  The
+ *          calling process doesn't need to be the DRM master of the device.
+ *          The takeover and real-time options are ignored.
+ *
+ * @param[in] device path of the DRM device
+ * @param[in] options lease manager options, or NULL for the defaults
+ * @param[in] out stream to print the leases to
+ * @return false if the leases could not be planned
+ */
+bool dlm_server_dry_run(const char *device,
+			const struct dlm_server_options *options, FILE *out);
+
+/**
+ * @brief Destroy a lease manager
+ *
+ * @details Revokes all leases, and disconnects all clients.
+ */
+void dlm_server_destroy(struct dlm_server *server);
+
+/**
+ * @brief Get the lease manager fd to poll
+ *
+ * @details Call dlm_server_dispatch() when the fd becomes readable, so that
+ *          the lease manager can be run from an existing event loop.
+ */
+int dlm_server_get_fd(struct dlm_server *server);
+
+/**
+ * @brief Get the time until dlm_server_dispatch() must be called again
+ *
+ * @details Clients that stop reading replies are disconnected, and
+ *          transfers waiting for a vblank that doesn't come are carried
+ *          out, once a timeout expires, even if the fd is not readable.
+ * @return The timeout in ms, or -1 if there is none
+ */
+int dlm_server_get_timeout(struct dlm_server *server);
+
+/**
+ * @brief Handle all pending client requests, and the lease reassignments
+ *        that have completed, without blocking
+ *
+ * @return false if the lease manager failed, and can't handle any more
+ *         requests
+ */
+bool dlm_server_dispatch(struct dlm_server *server);
+
+/**
+ * @brief Handle client requests until the lease manager fails, or hands
+ *        its leases over to a new instance
+ */
+void dlm_server_run(struct dlm_server *server);
+
+/**
+ * @brief Log the libdrm calls made by the lease manager
+ *
+ * @details Logs the number of calls made at each libdrm call site of the
+ *          lease manager, and the time spent in them, since startup.
+ */
+void dlm_server_log_drm_calls(struct dlm_server *server);
+
+/**
+ * @brief Check if the leases have been handed over to a new instance
+ *
+ * @details Once handed over, dlm_server_dispatch() returns false, and the
+ *          lease manager should be destroyed.  The new instance takes over
+ *          when the lease manager is destroyed.
+ */
+bool dlm_server_handed_off(struct dlm_server *server);
+
+/**
+ * @brief Get the number of leases
+ */
+int dlm_server_lease_count(struct dlm_server *server);
+
+/**
+ * @brief Get the name of a lease
+ *
+ * @param[in] server lease manager handle
+ * @param[in] index lease index, from 0 to dlm_server_lease_count() - 1
+ * @return The lease name, or NULL if the index is out of range
+ */
+const char *dlm_server_lease_name(struct dlm_server *server, int index);
+
+/**
+ * @brief Get a lease for the calling process
+ *
+ * @details Grants a lease directly, without going through the lease
+ *          socket.  The lease is held by the calling process until it is
+ *          released with dlm_server_release_lease(), or transferred to a
+ *          client if lease transfer is enabled.
+ *
+ * @param[in] server lease manager handle
+ * @param[in] name lease name
+ * @return A DRM lease fd, owned by the caller, or -1 on error, with errno
+ *         set to:
+ *         - ENOENT: there is no lease with this name
+ *         - EBUSY: the lease is in use
+ *         - other: the lease could not be created
+ */
+int dlm_server_get_lease(struct dlm_server *server, const char *name);
+
+/**
+ * @brief Release a lease held by the calling process
+ *
+ * @details The lease is revoked, so the fd returned by
+ *          dlm_server_get_lease() can no longer be used to access the
+ *          lease objects.
+ *
+ * @param[in] server lease manager handle
+ * @param[in] name lease name
+ */
+void dlm_server_release_lease(struct dlm_server *server, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
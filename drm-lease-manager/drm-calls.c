@@ -0,0 +1,96 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "drm-calls.h"
+
+#include "log.h"
+
+#include <time.h>
+
+/* Registered call sites.  Sites are only ever added, at the head. */
+static struct drm_call_site *call_sites;
+
+uint64_t drm_call_start(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* libdrm is called from the transition workers and the frame sampler
+ * threads too, so sites are updated atomically */
+void drm_call_end(struct drm_call_site *site, uint64_t start)
+{
+	uint64_t time = drm_call_start() - start;
+
+	__atomic_add_fetch(&site->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->time_ns, time, __ATOMIC_RELAXED);
+
+	if (__atomic_exchange_n(&site->registered, true, __ATOMIC_ACQ_REL))
+		return;
+
+	site->next = __atomic_load_n(&call_sites, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&call_sites, &site->next, site,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE))
+		;
+}
+
+void drm_calls_get_total(struct drm_call_stats *stats)
+{
+	stats->calls = 0;
+	stats->time_ns = 0;
+
+	struct drm_call_site *site =
+	    __atomic_load_n(&call_sites, __ATOMIC_ACQUIRE);
+	for (; site; site = site->next) {
+		stats->calls += __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+		stats->time_ns +=
+		    __atomic_load_n(&site->time_ns, __ATOMIC_RELAXED);
+	}
+}
+
+void drm_calls_reset(void)
+{
+	struct drm_call_site *site =
+	    __atomic_load_n(&call_sites, __ATOMIC_ACQUIRE);
+	for (; site; site = site->next) {
+		__atomic_store_n(&site->calls, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->time_ns, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void drm_calls_log(void)
+{
+	struct drm_call_stats total;
+	drm_calls_get_total(&total);
+	INFO_LOG("libdrm calls: %llu, %llu us\n",
+		 (unsigned long long)total.calls,
+		 (unsigned long long)total.time_ns / 1000);
+
+	struct drm_call_site *site =
+	    __atomic_load_n(&call_sites, __ATOMIC_ACQUIRE);
+	for (; site; site = site->next) {
+		uint64_t calls =
+		    __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+		uint64_t time_ns =
+		    __atomic_load_n(&site->time_ns, __ATOMIC_RELAXED);
+		if (!calls)
+			continue;
+		INFO_LOG("  %s in %s:%d: %llu calls, %llu us\n", site->function,
+			 site->caller, site->line, (unsigned long long)calls,
+			 (unsigned long long)time_ns / 1000);
+	}
+}
@@ -0,0 +1,70 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DRM_CALLS_H
+#define DRM_CALLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* libdrm call accounting
+ * Calls to libdrm functions that go to the kernel are made through
+ * DRM_CALL(), which counts the calls made at each call site, and the time
+ * spent in them.  Call sites are registered the first time they are
+ * called, and never allocate memory.
+ *
+ *   drmModeConnectorPtr connector =
+ *       DRM_CALL(drmModeGetConnector, drm_fd, connector_id);
+ */
+struct drm_call_site {
+	const char *function;
+	const char *caller;
+	int line;
+
+	uint64_t calls;
+	uint64_t time_ns;
+
+	bool registered;
+	struct drm_call_site *next;
+};
+
+uint64_t drm_call_start(void);
+void drm_call_end(struct drm_call_site *site, uint64_t start);
+
+#define DRM_CALL(FN, ...)                                           \
+	({                                                          \
+		static struct drm_call_site site_ = {               \
+		    .function = #FN,                                \
+		    .caller = __func__,                             \
+		    .line = __LINE__,                               \
+		};                                                  \
+		uint64_t start_ = drm_call_start();                 \
+		__typeof__(FN(__VA_ARGS__)) ret_ = FN(__VA_ARGS__); \
+		drm_call_end(&site_, start_);                       \
+		ret_;                                               \
+	})
+
+struct drm_call_stats {
+	uint64_t calls;
+	uint64_t time_ns;
+};
+
+/* Totals over all call sites */
+void drm_calls_get_total(struct drm_call_stats *stats);
+void drm_calls_reset(void);
+
+/* Log the calls made at each call site */
+void drm_calls_log(void);
+#endif
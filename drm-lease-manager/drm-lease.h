@@ -16,8 +16,51 @@
 #ifndef DRM_LEASE_H
 #define DRM_LEASE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 struct lease_handle {
 	char *name;
 	void *user_data;
 };
+
+/* Number of planes of each kind a client needs in its lease.  Planes that
+ * can be used on more than one CRTC are only added to a lease on demand. */
+struct lease_plane_demand {
+	uint32_t overlay;
+	uint32_t cursor;
+	uint32_t scaling;
+};
+
+/* Requirements on a lease, for lease selection.
+ * Zero valued fields match any lease. */
+struct lease_constraints {
+	/* The connector must be connected, and have a mode of at least
+	 * this size and refresh rate */
+	bool connected;
+	uint32_t min_width;
+	uint32_t min_height;
+	uint32_t min_refresh;
+
+	/* One of the lease planes must be of this type, and support this
+	 * format / modifier */
+	bool has_plane_type;
+	uint32_t plane_type;
+	uint32_t plane_format;
+	bool has_plane_modifier;
+	uint64_t plane_modifier;
+
+	/* There must be enough free planes to meet this demand */
+	struct lease_plane_demand planes;
+};
+
+/* Admission control of the connections to a lease socket */
+struct lease_admission_stats {
+	/* Connections accepted */
+	uint64_t connections;
+	/* Connections closed as soon as they were accepted */
+	uint64_t shed;
+	/* Time new connections were left in the listen backlog */
+	uint64_t throttle_time_ms;
+};
 #endif
@@ -0,0 +1,362 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "frame-sampler.h"
+
+#include "drm-calls.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xf86drm.h>
+
+/* A longer gap between two frames is a stall, rather than missed frames */
+#define STALL_THRESHOLD_NS 100000000ull
+/* The frame rate is measured over this period */
+#define FRAME_RATE_PERIOD_NS 1000000000ull
+#define DEFAULT_REFRESH_HZ 60
+
+/* A CRTC is sampled at least twice per refresh period, so that every
+ * framebuffer it scans out is seen.  Page flips take effect at vblank,
+ * so there is at most one new frame per vblank. */
+struct sampled_crtc {
+	/* 0 if the lease is not granted */
+	uint32_t crtc_id;
+	uint32_t refresh_hz;
+
+	/* Changed on each start and stop, so that samples taken meanwhile
+	 * are dropped */
+	uint32_t generation;
+
+	/* Framebuffer at the last sample.  The framebuffer seen first was
+	 * presented before the lease was granted, so it is not a frame. */
+	bool sampled;
+	uint32_t fb_id;
+
+	/* vblank count at the last sample */
+	uint64_t sample_seq;
+
+	/* vblank count and time of the sample that saw the last frame */
+	bool has_frame;
+	uint64_t frame_seq;
+	uint64_t frame_time;
+
+	/* Frames since the start of the frame rate period */
+	uint64_t period_start;
+	uint32_t period_frames;
+
+	/* Counted over all the holders of the lease */
+	struct lease_frame_stats stats;
+};
+
+/* CRTC state read by the sampler thread without holding the lock, so
+ * that leases can be granted and revoked meanwhile */
+struct crtc_sample {
+	int index;
+	uint32_t crtc_id;
+	uint32_t generation;
+
+	/* false while the CRTC is off */
+	bool valid;
+	uint64_t seq;
+	uint64_t time;
+	uint32_t fb_id;
+	uint32_t refresh_hz;
+};
+
+struct frame_sampler {
+	int drm_fd;
+	struct lease_status *status;
+
+	struct sampled_crtc *crtcs;
+	int nleases;
+	int nsampled;
+
+	/* Only used by the sampler thread */
+	struct crtc_sample *samples;
+
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The frame was presented at a vblank after the previous sample, and up
+ * to the vblank of this one.  Only the vblanks that can't be explained by
+ * the time between samples count as missed. */
+static void count_frame(struct sampled_crtc *crtc, uint64_t seq,
+			uint64_t time)
+{
+	struct lease_frame_stats *stats = &crtc->stats;
+
+	stats->frames++;
+	crtc->period_frames++;
+
+	if (crtc->has_frame) {
+		uint64_t gap = time - crtc->frame_time;
+		if (gap >= STALL_THRESHOLD_NS) {
+			uint32_t gap_ms = gap / 1000000;
+			stats->stalls++;
+			stats->stall_time_ms += gap_ms;
+			if (gap_ms > stats->max_stall_ms)
+				stats->max_stall_ms = gap_ms;
+		} else if (crtc->sample_seq > crtc->frame_seq) {
+			stats->missed_frames +=
+			    crtc->sample_seq - crtc->frame_seq;
+		}
+	}
+
+	crtc->has_frame = true;
+	crtc->frame_seq = seq;
+	crtc->frame_time = time;
+}
+
+static void read_sample(struct frame_sampler *sampler,
+			struct crtc_sample *sample)
+{
+	sample->valid = false;
+	sample->refresh_hz = 0;
+
+	/* Fails while the CRTC is off */
+	if (DRM_CALL(drmCrtcGetSequence, sampler->drm_fd, sample->crtc_id,
+		     &sample->seq, &sample->time))
+		return;
+
+	struct drm_mode_crtc state = {.crtc_id = sample->crtc_id};
+	if (DRM_CALL(drmIoctl, sampler->drm_fd, DRM_IOCTL_MODE_GETCRTC, &state))
+		return;
+
+	if (state.mode_valid && state.mode.vrefresh)
+		sample->refresh_hz = state.mode.vrefresh;
+	sample->fb_id = state.fb_id;
+	sample->valid = true;
+}
+
+/* Returns true if the stats of the CRTC have changed */
+static bool apply_sample(struct sampled_crtc *crtc,
+			 const struct crtc_sample *sample, uint64_t now)
+{
+	bool changed = false;
+
+	if (now - crtc->period_start >= FRAME_RATE_PERIOD_NS) {
+		crtc->stats.frame_rate = crtc->period_frames *
+					 1000000000000ull /
+					 (now - crtc->period_start);
+		crtc->period_start = now;
+		crtc->period_frames = 0;
+		changed = true;
+	}
+
+	if (!sample->valid)
+		return changed;
+
+	if (sample->refresh_hz)
+		crtc->refresh_hz = sample->refresh_hz;
+
+	if (crtc->sampled && sample->fb_id && sample->fb_id != crtc->fb_id) {
+		count_frame(crtc, sample->seq, sample->time);
+		changed = true;
+	}
+	crtc->sampled = true;
+	crtc->sample_seq = sample->seq;
+	crtc->fb_id = sample->fb_id;
+	return changed;
+}
+
+/* Called with the lock held, which is dropped while the CRTCs are read.
+ * Returns the time of the next sample. */
+static uint64_t sample_crtcs(struct frame_sampler *sampler)
+{
+	int nsamples = 0;
+	for (int i = 0; i < sampler->nleases; i++) {
+		struct sampled_crtc *crtc = &sampler->crtcs[i];
+		if (!crtc->crtc_id)
+			continue;
+
+		sampler->samples[nsamples++] = (struct crtc_sample){
+		    .index = i,
+		    .crtc_id = crtc->crtc_id,
+		    .generation = crtc->generation,
+		};
+	}
+
+	pthread_mutex_unlock(&sampler->lock);
+	for (int i = 0; i < nsamples; i++)
+		read_sample(sampler, &sampler->samples[i]);
+	pthread_mutex_lock(&sampler->lock);
+
+	uint64_t now = get_time_ns();
+	uint32_t max_refresh_hz = 1;
+
+	for (int i = 0; i < nsamples; i++) {
+		struct crtc_sample *sample = &sampler->samples[i];
+		struct sampled_crtc *crtc = &sampler->crtcs[sample->index];
+
+		/* The lease was revoked or granted again meanwhile */
+		if (crtc->generation != sample->generation)
+			continue;
+
+		if (apply_sample(crtc, sample, now))
+			lease_status_set_frame_stats(sampler->status,
+						     sample->index,
+						     &crtc->stats);
+		if (crtc->refresh_hz > max_refresh_hz)
+			max_refresh_hz = crtc->refresh_hz;
+	}
+	return now + 1000000000ull / (2 * max_refresh_hz);
+}
+
+static void *sampler_task(void *arg)
+{
+	struct frame_sampler *sampler = arg;
+
+	pthread_mutex_lock(&sampler->lock);
+	while (!sampler->quit) {
+		if (sampler->nsampled == 0) {
+			pthread_cond_wait(&sampler->cond, &sampler->lock);
+			continue;
+		}
+
+		uint64_t next = sample_crtcs(sampler);
+		struct timespec deadline = {
+		    .tv_sec = next / 1000000000ull,
+		    .tv_nsec = next % 1000000000ull,
+		};
+		pthread_cond_timedwait(&sampler->cond, &sampler->lock,
+				       &deadline);
+	}
+	pthread_mutex_unlock(&sampler->lock);
+	return NULL;
+}
+
+struct frame_sampler *frame_sampler_create(int drm_fd,
+					   struct lease_status *status,
+					   int nleases)
+{
+	struct frame_sampler *sampler = calloc(1, sizeof(*sampler));
+	if (!sampler) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	sampler->crtcs = calloc(nleases, sizeof(struct sampled_crtc));
+	sampler->samples = calloc(nleases, sizeof(struct crtc_sample));
+	if (!sampler->crtcs || !sampler->samples) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	sampler->drm_fd = drm_fd;
+	sampler->status = status;
+	sampler->nleases = nleases;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&sampler->lock, NULL);
+
+	int ret = pthread_create(&sampler->tid, NULL, sampler_task, sampler);
+	if (ret) {
+		DEBUG_LOG("Can't start frame sampler thread: %s\n",
+			  strerror(ret));
+		pthread_mutex_destroy(&sampler->lock);
+		pthread_cond_destroy(&sampler->cond);
+		goto err;
+	}
+	return sampler;
+
+err:
+	free(sampler->crtcs);
+	free(sampler->samples);
+	free(sampler);
+	return NULL;
+}
+
+void frame_sampler_destroy(struct frame_sampler *sampler)
+{
+	if (!sampler)
+		return;
+
+	pthread_mutex_lock(&sampler->lock);
+	sampler->quit = true;
+	pthread_cond_signal(&sampler->cond);
+	pthread_mutex_unlock(&sampler->lock);
+	pthread_join(sampler->tid, NULL);
+
+	pthread_mutex_destroy(&sampler->lock);
+	pthread_cond_destroy(&sampler->cond);
+	free(sampler->crtcs);
+	free(sampler->samples);
+	free(sampler);
+}
+
+void frame_sampler_start(struct frame_sampler *sampler, int index,
+			 uint32_t crtc_id)
+{
+	if (!sampler)
+		return;
+
+	pthread_mutex_lock(&sampler->lock);
+
+	struct sampled_crtc *crtc = &sampler->crtcs[index];
+	if (!crtc->crtc_id)
+		sampler->nsampled++;
+
+	*crtc = (struct sampled_crtc){
+	    .crtc_id = crtc_id,
+	    .refresh_hz = DEFAULT_REFRESH_HZ,
+	    .generation = crtc->generation + 1,
+	    .period_start = get_time_ns(),
+	    .stats = crtc->stats,
+	};
+	pthread_cond_signal(&sampler->cond);
+
+	pthread_mutex_unlock(&sampler->lock);
+}
+
+void frame_sampler_stop(struct frame_sampler *sampler, int index)
+{
+	if (!sampler)
+		return;
+
+	pthread_mutex_lock(&sampler->lock);
+
+	struct sampled_crtc *crtc = &sampler->crtcs[index];
+	if (crtc->crtc_id) {
+		crtc->crtc_id = 0;
+		crtc->generation++;
+		sampler->nsampled--;
+
+		crtc->stats.frame_rate = 0;
+		lease_status_set_frame_stats(sampler->status, index,
+					     &crtc->stats);
+	}
+
+	pthread_mutex_unlock(&sampler->lock);
+}
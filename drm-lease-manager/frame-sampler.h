@@ -0,0 +1,39 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_SAMPLER_H
+#define FRAME_SAMPLER_H
+
+#include "lease-status.h"
+
+#include <stdint.h>
+
+/* Frame timing sampler
+ * Samples the framebuffer scanned out by the CRTC of each granted lease,
+ * to measure how regularly the lease holder presents new frames, and
+ * publishes the results in the lease status page.
+ * All functions may be called with a NULL sampler, and do nothing. */
+struct frame_sampler;
+
+struct frame_sampler *frame_sampler_create(int drm_fd,
+					   struct lease_status *status,
+					   int nleases);
+void frame_sampler_destroy(struct frame_sampler *sampler);
+
+/* Sample the CRTC of a lease, from its grant until it is revoked */
+void frame_sampler_start(struct frame_sampler *sampler, int index,
+			 uint32_t crtc_id);
+void frame_sampler_stop(struct frame_sampler *sampler, int index);
+#endif
@@ -0,0 +1,555 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include "log.h"
+#include "socket-path.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Time the two instances wait for each other during a handoff */
+#define HANDOFF_TIMEOUT_MS 1000
+
+static void close_fd(int *fd)
+{
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+static int dup_fd(int fd)
+{
+	int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (copy < 0)
+		DEBUG_LOG("Can't duplicate fd: %s\n", strerror(errno));
+	return copy;
+}
+
+struct handoff *handoff_create(void)
+{
+	struct handoff *handoff = calloc(1, sizeof(struct handoff));
+	if (!handoff) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	handoff->drm_fd = -1;
+	return handoff;
+}
+
+void handoff_destroy(struct handoff *handoff)
+{
+	if (!handoff)
+		return;
+
+	close_fd(&handoff->drm_fd);
+
+	for (int i = 0; i < handoff->nservers; i++) {
+		struct handoff_server *server = &handoff->servers[i];
+		free(server->name);
+		close_fd(&server->listen_fd);
+		close_fd(&server->lock_fd);
+	}
+
+	for (int i = 0; i < handoff->nleases; i++) {
+		struct handoff_lease *lease = &handoff->leases[i];
+		free(lease->name);
+		close_fd(&lease->lease_fd);
+		close_fd(&lease->client_fd);
+	}
+
+	free(handoff->servers);
+	free(handoff->leases);
+	free(handoff);
+}
+
+bool handoff_set_device(struct handoff *handoff, int drm_fd)
+{
+	assert(handoff);
+
+	close_fd(&handoff->drm_fd);
+	handoff->drm_fd = dup_fd(drm_fd);
+	return handoff->drm_fd >= 0;
+}
+
+static struct handoff_server *add_server(struct handoff *handoff,
+					 const char *name)
+{
+	struct handoff_server *servers =
+	    realloc(handoff->servers,
+		    (handoff->nservers + 1) * sizeof(struct handoff_server));
+	if (!servers) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+	handoff->servers = servers;
+
+	struct handoff_server *server = &servers[handoff->nservers];
+	*server = (struct handoff_server){
+	    .name = strdup(name),
+	    .listen_fd = -1,
+	    .lock_fd = -1,
+	};
+	if (!server->name) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	handoff->nservers++;
+	return server;
+}
+
+bool handoff_add_server(struct handoff *handoff, const char *name,
+			int listen_fd, int lock_fd)
+{
+	assert(handoff);
+	assert(name);
+
+	struct handoff_server *server = add_server(handoff, name);
+	if (!server)
+		return false;
+
+	server->listen_fd = dup_fd(listen_fd);
+	server->lock_fd = dup_fd(lock_fd);
+	return server->listen_fd >= 0 && server->lock_fd >= 0;
+}
+
+static struct handoff_lease *add_lease(struct handoff *handoff,
+				       const char *name)
+{
+	struct handoff_lease *leases =
+	    realloc(handoff->leases,
+		    (handoff->nleases + 1) * sizeof(struct handoff_lease));
+	if (!leases) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+	handoff->leases = leases;
+
+	struct handoff_lease *lease = &leases[handoff->nleases];
+	*lease = (struct handoff_lease){
+	    .name = strdup(name),
+	    .lease_fd = -1,
+	    .client_fd = -1,
+	};
+	if (!lease->name) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	handoff->nleases++;
+	return lease;
+}
+
+struct handoff_lease *handoff_add_lease(struct handoff *handoff,
+					const char *name, uint32_t lessee_id,
+					int lease_fd)
+{
+	assert(handoff);
+	assert(name);
+
+	struct handoff_lease *lease = add_lease(handoff, name);
+	if (!lease)
+		return NULL;
+
+	lease->lessee_id = lessee_id;
+	lease->lease_fd = dup_fd(lease_fd);
+	return lease->lease_fd >= 0 ? lease : NULL;
+}
+
+bool handoff_lease_set_client(struct handoff_lease *lease, int client_fd)
+{
+	assert(lease);
+
+	close_fd(&lease->client_fd);
+	lease->client_fd = dup_fd(client_fd);
+	return lease->client_fd >= 0;
+}
+
+struct handoff_server *handoff_find_server(struct handoff *handoff,
+					   const char *name)
+{
+	assert(handoff);
+	assert(name);
+
+	for (int i = 0; i < handoff->nservers; i++) {
+		if (!strcmp(handoff->servers[i].name, name))
+			return &handoff->servers[i];
+	}
+	return NULL;
+}
+
+struct handoff_lease *handoff_find_lease(struct handoff *handoff,
+					 const char *name)
+{
+	assert(handoff);
+	assert(name);
+
+	for (int i = 0; i < handoff->nleases; i++) {
+		if (!strcmp(handoff->leases[i].name, name))
+			return &handoff->leases[i];
+	}
+	return NULL;
+}
+
+static bool add_name(struct dlm_msg *msg, const char *name)
+{
+	return dlm_msg_add_attr(msg, DLM_ATTR_LEASE_NAME, name,
+				strlen(name) + 1);
+}
+
+static bool send_lease(int socket, const struct handoff_lease *lease)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HANDOFF_LEASE, 0);
+
+	if (!add_name(&msg, lease->name) ||
+	    !dlm_msg_add_u32(&msg, DLM_ATTR_LESSEE_ID, lease->lessee_id) ||
+	    !dlm_msg_add_fd(&msg, lease->lease_fd))
+		return false;
+
+	if (dlm_resume_token_is_valid(&lease->resume_token) &&
+	    !dlm_msg_add_attr(&msg, DLM_ATTR_RESUME_TOKEN, &lease->resume_token,
+			      sizeof(lease->resume_token)))
+		return false;
+
+	if (lease->client_fd >= 0) {
+		if (!dlm_msg_add_u32(&msg, DLM_ATTR_CLIENT_FD, msg.nfds) ||
+		    !dlm_msg_add_fd(&msg, lease->client_fd) ||
+		    !dlm_msg_add_u32(&msg, DLM_ATTR_CLIENT_PID,
+				     lease->client_pid) ||
+		    !dlm_msg_add_u32(&msg, DLM_ATTR_VERSION,
+				     lease->client_version) ||
+		    !dlm_msg_add_u32(&msg, DLM_ATTR_CAPS, lease->client_caps))
+			return false;
+	}
+
+	return dlm_send_msg(socket, &msg);
+}
+
+bool handoff_send(int socket, const struct handoff *handoff)
+{
+	assert(handoff);
+
+	struct dlm_msg msg;
+
+	if (handoff->drm_fd >= 0) {
+		dlm_msg_init(&msg, DLM_MSG_HANDOFF_DEVICE, 0);
+		dlm_msg_add_fd(&msg, handoff->drm_fd);
+		if (!dlm_send_msg(socket, &msg))
+			goto err;
+	}
+
+	for (int i = 0; i < handoff->nservers; i++) {
+		const struct handoff_server *server = &handoff->servers[i];
+		dlm_msg_init(&msg, DLM_MSG_HANDOFF_SERVER, 0);
+		if (!add_name(&msg, server->name) ||
+		    !dlm_msg_add_fd(&msg, server->listen_fd) ||
+		    !dlm_msg_add_fd(&msg, server->lock_fd) ||
+		    !dlm_send_msg(socket, &msg))
+			goto err;
+	}
+
+	for (int i = 0; i < handoff->nleases; i++) {
+		if (!send_lease(socket, &handoff->leases[i]))
+			goto err;
+	}
+
+	dlm_msg_init(&msg, DLM_MSG_HANDOFF_DONE, 0);
+	if (!dlm_send_msg(socket, &msg))
+		goto err;
+
+	return true;
+err:
+	DEBUG_LOG("Can't send lease manager state: %s\n", strerror(errno));
+	return false;
+}
+
+bool handoff_send_lease(int socket, const struct handoff_lease *lease)
+{
+	assert(lease);
+
+	struct dlm_msg msg;
+	bool ok;
+
+	if (lease->lease_fd >= 0) {
+		ok = send_lease(socket, lease);
+	} else {
+		dlm_msg_init(&msg, DLM_MSG_HANDOFF_LEASE, 0);
+		ok = add_name(&msg, lease->name) && dlm_send_msg(socket, &msg);
+	}
+
+	if (!ok)
+		DEBUG_LOG("Can't send lease state: %s\n", strerror(errno));
+	return ok;
+}
+
+static const char *get_name(const struct dlm_msg *msg)
+{
+	size_t len;
+	const char *name = dlm_msg_get_attr(msg, DLM_ATTR_LEASE_NAME, &len);
+	if (!name || len == 0 || name[len - 1] != '\0')
+		return NULL;
+	return name;
+}
+
+/* Take an fd out of a message, so that it is not closed with the rest */
+static int take_fd(struct dlm_msg *msg, uint32_t index)
+{
+	if (index >= (uint32_t)msg->nfds)
+		return -1;
+
+	int fd = msg->fds[index];
+	msg->fds[index] = -1;
+	return fd;
+}
+
+static bool receive_lease(struct handoff *handoff, struct dlm_msg *msg)
+{
+	const char *name = get_name(msg);
+	if (!name)
+		return false;
+
+	struct handoff_lease *lease = add_lease(handoff, name);
+	if (!lease)
+		return false;
+
+	if (!dlm_msg_get_u32(msg, DLM_ATTR_LESSEE_ID, &lease->lessee_id))
+		return false;
+
+	lease->lease_fd = take_fd(msg, 0);
+	if (lease->lease_fd < 0)
+		return false;
+
+	size_t len;
+	const void *token = dlm_msg_get_attr(msg, DLM_ATTR_RESUME_TOKEN, &len);
+	if (token && len == sizeof(lease->resume_token))
+		memcpy(&lease->resume_token, token, len);
+
+	uint32_t client_fd, value;
+	if (!dlm_msg_get_u32(msg, DLM_ATTR_CLIENT_FD, &client_fd))
+		return true;
+
+	lease->client_fd = take_fd(msg, client_fd);
+	if (lease->client_fd < 0)
+		return false;
+
+	if (dlm_msg_get_u32(msg, DLM_ATTR_CLIENT_PID, &value))
+		lease->client_pid = value;
+	if (dlm_msg_get_u32(msg, DLM_ATTR_VERSION, &value))
+		lease->client_version = value;
+	dlm_msg_get_u32(msg, DLM_ATTR_CAPS, &lease->client_caps);
+	return true;
+}
+
+static bool receive_msg(struct handoff *handoff, struct dlm_msg *msg)
+{
+	switch (msg->hdr.type) {
+	case DLM_MSG_HANDOFF_DEVICE:
+		close_fd(&handoff->drm_fd);
+		handoff->drm_fd = take_fd(msg, 0);
+		return handoff->drm_fd >= 0;
+	case DLM_MSG_HANDOFF_SERVER: {
+		const char *name = get_name(msg);
+		if (!name || msg->nfds != 2)
+			return false;
+
+		struct handoff_server *server = add_server(handoff, name);
+		if (!server)
+			return false;
+
+		server->listen_fd = take_fd(msg, 0);
+		server->lock_fd = take_fd(msg, 1);
+		return true;
+	}
+	case DLM_MSG_HANDOFF_LEASE:
+		return receive_lease(handoff, msg);
+	default:
+		return false;
+	}
+}
+
+struct handoff *handoff_receive(int socket)
+{
+	struct handoff *handoff = handoff_create();
+	if (!handoff)
+		return NULL;
+
+	struct dlm_msg msg;
+	while (dlm_receive_msg(socket, &msg)) {
+		if (msg.hdr.type == DLM_MSG_HANDOFF_DONE) {
+			dlm_msg_close_fds(&msg);
+			return handoff;
+		}
+
+		if (msg.hdr.type == DLM_MSG_REPLY) {
+			ERROR_LOG("Lease manager handoff refused\n");
+			dlm_msg_close_fds(&msg);
+			goto err;
+		}
+
+		bool ok = receive_msg(handoff, &msg);
+		for (int i = 0; i < msg.nfds; i++)
+			close_fd(&msg.fds[i]);
+
+		if (!ok) {
+			ERROR_LOG("Invalid lease manager state received\n");
+			goto err;
+		}
+	}
+
+	DEBUG_LOG("Can't receive lease manager state: %s\n", strerror(errno));
+err:
+	handoff_destroy(handoff);
+	return NULL;
+}
+
+static void remove_lease(struct handoff *handoff, const char *name)
+{
+	struct handoff_lease *lease = handoff_find_lease(handoff, name);
+	if (!lease)
+		return;
+
+	free(lease->name);
+	close_fd(&lease->lease_fd);
+	close_fd(&lease->client_fd);
+	*lease = handoff->leases[--handoff->nleases];
+}
+
+bool handoff_receive_update(int socket, struct handoff *handoff)
+{
+	assert(handoff);
+
+	struct dlm_msg msg;
+	if (!dlm_receive_msg(socket, &msg))
+		return false;
+
+	bool ok = false;
+	const char *name = get_name(&msg);
+	if (msg.hdr.type == DLM_MSG_HANDOFF_LEASE && name) {
+		remove_lease(handoff, name);
+		ok = msg.nfds == 0 || receive_lease(handoff, &msg);
+
+		/* Drop what was received of an invalid update */
+		if (!ok)
+			remove_lease(handoff, name);
+	}
+
+	for (int i = 0; i < msg.nfds; i++)
+		close_fd(&msg.fds[i]);
+
+	if (!ok)
+		ERROR_LOG("Invalid lease manager state update received\n");
+	return ok;
+}
+
+static void set_timeout(int socket)
+{
+	struct timeval tv = {
+	    .tv_sec = HANDOFF_TIMEOUT_MS / 1000,
+	    .tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000,
+	};
+	if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		DEBUG_LOG("Can't set handoff timeout: %s\n", strerror(errno));
+}
+
+int handoff_connect(void)
+{
+	struct sockaddr_un address = {
+	    .sun_family = AF_UNIX,
+	};
+
+	if (!sockaddr_set_lease_server_path(&address, DLM_HANDOFF_SERVER_NAME))
+		return -1;
+
+	int socket_fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (socket_fd < 0) {
+		DEBUG_LOG("Socket creation failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address))) {
+		DEBUG_LOG("Can't connect to %s: %s\n", address.sun_path,
+			  strerror(errno));
+		goto err;
+	}
+
+	set_timeout(socket_fd);
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, 0);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	if (!dlm_send_msg(socket_fd, &msg))
+		goto err;
+
+	if (!dlm_receive_msg(socket_fd, &msg))
+		goto err;
+	dlm_msg_close_fds(&msg);
+
+	uint32_t status;
+	if (msg.hdr.type != DLM_MSG_REPLY ||
+	    !dlm_msg_get_u32(&msg, DLM_ATTR_STATUS, &status) ||
+	    status != DLM_STATUS_OK)
+		goto err;
+
+	dlm_msg_init(&msg, DLM_MSG_HANDOFF, 1);
+	if (!dlm_send_msg(socket_fd, &msg))
+		goto err;
+
+	return socket_fd;
+err:
+	close(socket_fd);
+	return -1;
+}
+
+bool handoff_send_ack(int socket)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_REPLY, 1);
+	return dlm_msg_add_u32(&msg, DLM_ATTR_STATUS, DLM_STATUS_OK) &&
+	       dlm_send_msg(socket, &msg);
+}
+
+bool handoff_wait_ack(int socket)
+{
+	set_timeout(socket);
+
+	struct dlm_msg msg;
+	if (!dlm_receive_msg(socket, &msg))
+		return false;
+	dlm_msg_close_fds(&msg);
+
+	uint32_t status;
+	return msg.hdr.type == DLM_MSG_REPLY &&
+	       dlm_msg_get_u32(&msg, DLM_ATTR_STATUS, &status) &&
+	       status == DLM_STATUS_OK;
+}
+
+void handoff_wait_close(int socket)
+{
+	char buf[64];
+	while (read(socket, buf, sizeof(buf)) > 0)
+		;
+}
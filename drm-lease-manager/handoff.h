@@ -0,0 +1,97 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "dlm-protocol.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* State of a lease manager instance, handed over to its successor (see
+ * DLM_MSG_HANDOFF).  The handoff owns all the fds it lists.  Users taking
+ * over an fd set it to -1. */
+struct handoff_server {
+	char *name;
+	int listen_fd;
+	int lock_fd;
+};
+
+struct handoff_lease {
+	char *name;
+	uint32_t lessee_id;
+	int lease_fd;
+
+	/* Resume token of the lease server, may be invalid */
+	struct dlm_resume_token resume_token;
+
+	/* Connection of the client holding the lease, -1 if there is none */
+	int client_fd;
+	pid_t client_pid;
+	uint16_t client_version;
+	uint32_t client_caps;
+};
+
+struct handoff {
+	int drm_fd;
+
+	struct handoff_server *servers;
+	int nservers;
+
+	struct handoff_lease *leases;
+	int nleases;
+};
+
+struct handoff *handoff_create(void);
+void handoff_destroy(struct handoff *handoff);
+
+/* Add copies of the fds of the lease manager state */
+bool handoff_set_device(struct handoff *handoff, int drm_fd);
+bool handoff_add_server(struct handoff *handoff, const char *name,
+			int listen_fd, int lock_fd);
+struct handoff_lease *handoff_add_lease(struct handoff *handoff,
+					const char *name, uint32_t lessee_id,
+					int lease_fd);
+bool handoff_lease_set_client(struct handoff_lease *lease, int client_fd);
+
+struct handoff_server *handoff_find_server(struct handoff *handoff,
+					   const char *name);
+struct handoff_lease *handoff_find_lease(struct handoff *handoff,
+					 const char *name);
+
+/* Send the state on a blocking socket, ending with DLM_MSG_HANDOFF_DONE */
+bool handoff_send(int socket, const struct handoff *handoff);
+/* Receive a state sent with handoff_send().  Returns NULL on error. */
+struct handoff *handoff_receive(int socket);
+
+/* Update a state sent with handoff_send() one lease at a time.  A lease
+ * sent without a lease fd is removed from the state. */
+bool handoff_send_lease(int socket, const struct handoff_lease *lease);
+/* Apply one lease update to a received state.  Returns false on error, or
+ * once the connection is closed. */
+bool handoff_receive_update(int socket, struct handoff *handoff);
+
+/* Connect to the handoff socket of a running instance, and request its
+ * state.  Returns the connection, or -1 if there is no running instance. */
+int handoff_connect(void);
+
+/* The new instance acknowledges the state once it has received it, and
+ * waits for the running instance to exit before taking over. */
+bool handoff_send_ack(int socket);
+bool handoff_wait_ack(int socket);
+void handoff_wait_close(int socket);
+#endif
@@ -16,8 +16,13 @@
 #define _GNU_SOURCE
 #include "lease-manager.h"
 
+#include "drm-calls.h"
 #include "drm-lease.h"
+#include "frame-sampler.h"
+#include "lease-status.h"
+#include "lease-topology.h"
 #include "log.h"
+#include "startup-profile.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -28,8 +33,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -40,8 +48,28 @@
 
 #define ARRAY_LENGTH(x) (sizeof(x) / sizeof(x[0]))
 
+struct lease;
+
+struct lm_plane {
+	struct lease_plane_caps caps;
+	uint32_t possible_crtcs;
+
+	/* Lease a shared plane has been added to, NULL if it is free */
+	struct lease *lease;
+};
+
+/* A writeback connector attached to display leases */
+struct lm_writeback {
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+
+	/* Lease the connector has been added to, NULL if it is free */
+	struct lease *lease;
+};
+
 struct lease {
 	struct lease_handle base;
+	int index;
 
 	bool is_granted;
 	uint32_t lessee_id;
@@ -50,10 +78,59 @@ struct lease {
 	uint32_t *object_ids;
 	int nobject_ids;
 
-	/* for lease transfer completion */
+	/* The planes that can only be used with the lease CRTC come first,
+	 * followed by the shared planes added while the lease is granted */
+	struct lm_plane **planes;
+	int nplanes;
+	int nfixed_planes;
+	struct lease_plane_demand plane_demand;
+
+	/* Lease of a writeback connector, or the writeback connector
+	 * attached to a display lease while it is granted */
+	bool is_writeback;
+	struct lm_writeback *writeback;
+
+	/* CRTC used by the lease, bound to it while it is granted */
+	uint32_t possible_crtcs;
+	int crtc_index;
 	uint32_t crtc_id;
-	pthread_t transition_tid;
-	bool transition_running;
+	struct transition *transition;
+
+	/* Vblank wait queued for a transfer, 0 if there is none */
+	uint64_t vblank_wait_id;
+	uint64_t vblank_deadline;
+	bool vblank_arrived;
+
+	/* connector state, updated by the background probe */
+	uint32_t connector_id;
+	drmModeConnection connection;
+	drmModeModeInfo *modes;
+	int nmodes;
+
+	/* sealed memfd describing the lease, built on first use, in a buffer
+	 * large enough for any objects the lease can have */
+	int topology_fd;
+	struct lease_object_props connector_props;
+	uint8_t *topology_buf;
+	size_t topology_buf_size;
+
+	/* Mode and framebuffer left on the CRTC at startup, handed to the
+	 * first client of the lease */
+	uint32_t boot_fb_id;
+	drmModeModeInfo boot_mode;
+};
+
+/* Outcome of the last lease reassignment, set by its transition thread
+ * and reported by lm_dispatch_events().  Outcomes of earlier
+ * reassignments, whose transitions are cancelled by a later one, are
+ * dropped. */
+struct reassign_result {
+	pthread_mutex_t lock;
+	int notify_fd;
+	uint64_t seq;
+	bool done;
+	bool switched;
+	uint32_t switch_time_us;
 };
 
 struct lm {
@@ -64,8 +141,46 @@ struct lm {
 	drmModePlaneResPtr drm_plane_resource;
 	uint32_t available_crtcs;
 
+	/* Properties of each CRTC, for lease topologies */
+	struct lease_object_props *crtc_props;
+	int max_crtc_props;
+
+	/* CRTCs not bound to a granted lease */
+	uint32_t free_crtcs;
+
+	struct lm_plane *planes;
+	int nplanes;
+	enum lm_cursor_policy cursor_policy;
+
+	enum lm_writeback_mode writeback_mode;
+
+	/* Transfer leases at the next vblank of their CRTC */
+	bool vblank_transfers;
+	uint64_t vblank_wait_id;
+	int nvblank_waits;
+	struct lm_writeback *writebacks;
+	int nwritebacks;
+
 	struct lease **leases;
 	int nleases;
+
+	struct lease_status *status;
+	struct frame_sampler *frame_sampler;
+
+	/* Real-time mode: nothing is allocated once the lease manager is
+	 * created */
+	bool realtime;
+	struct transition *transitions;
+	int ntransitions;
+
+	/* Lease manager events (see lm_get_fd()) */
+	int epoll_fd;
+	struct reassign_result reassign;
+
+	/* Deferred connector probing */
+	pthread_mutex_t connector_lock;
+	pthread_t probe_tid;
+	bool probe_running;
 };
 
 static const char *const connector_type_names[] = {
@@ -132,7 +247,7 @@ static int drm_get_active_crtc_index(struct lm *lm,
 				     drmModeConnectorPtr connector)
 {
 	drmModeEncoder *encoder =
-	    drmModeGetEncoder(lm->drm_fd, connector->encoder_id);
+	    DRM_CALL(drmModeGetEncoder, lm->drm_fd, connector->encoder_id);
 	if (!encoder)
 		return -1;
 
@@ -141,7 +256,28 @@ static int drm_get_active_crtc_index(struct lm *lm,
 	return crtc_idx;
 }
 
-static int drm_get_crtc_index(struct lm *lm, drmModeConnectorPtr connector)
+static uint32_t drm_get_possible_crtcs(struct lm *lm,
+				       drmModeConnectorPtr connector)
+{
+	uint32_t possible_crtcs = 0;
+
+	for (int i = 0; i < connector->count_encoders; i++) {
+		drmModeEncoder *encoder = DRM_CALL(
+		    drmModeGetEncoder, lm->drm_fd, connector->encoders[i]);
+		if (!encoder)
+			continue;
+
+		possible_crtcs |= encoder->possible_crtcs;
+		drmModeFreeEncoder(encoder);
+	}
+	return possible_crtcs;
+}
+
+/* Pick the CRTC a lease uses by default.  CRTCs are only bound to leases
+ * when they are granted, so if all the usable CRTCs are already picked by
+ * other leases, one of them is shared. */
+static int drm_get_crtc_index(struct lm *lm, drmModeConnectorPtr connector,
+			      uint32_t possible_crtcs)
 {
 
 	// try the active CRTC first
@@ -151,8 +287,8 @@ static int drm_get_crtc_index(struct lm *lm, drmModeConnectorPtr connector)
 
 	// If not try the first available CRTC on the connector/encoder
 	for (int i = 0; i < connector->count_encoders; i++) {
-		drmModeEncoder *encoder =
-		    drmModeGetEncoder(lm->drm_fd, connector->encoders[i]);
+		drmModeEncoder *encoder = DRM_CALL(
+		    drmModeGetEncoder, lm->drm_fd, connector->encoders[i]);
 
 		assert(encoder);
 
@@ -166,6 +302,9 @@ static int drm_get_crtc_index(struct lm *lm, drmModeConnectorPtr connector)
 		lm->available_crtcs &= ~(1 << crtc_index);
 		break;
 	}
+
+	if (crtc_index == -1)
+		crtc_index = ffs(possible_crtcs) - 1;
 	return crtc_index;
 }
 
@@ -177,7 +316,8 @@ static void drm_find_available_crtcs(struct lm *lm)
 	// then remove any that are in use. */
 	for (int i = 0; i < lm->drm_resource->count_encoders; i++) {
 		int enc_id = lm->drm_resource->encoders[i];
-		drmModeEncoderPtr enc = drmModeGetEncoder(lm->drm_fd, enc_id);
+		drmModeEncoderPtr enc =
+		    DRM_CALL(drmModeGetEncoder, lm->drm_fd, enc_id);
 		if (!enc)
 			continue;
 
@@ -189,319 +329,1933 @@ static void drm_find_available_crtcs(struct lm *lm)
 	}
 }
 
-static bool lease_add_planes(struct lm *lm, struct lease *lease, int crtc_index)
+static bool drm_get_planes(struct lm *lm)
 {
-	for (uint32_t i = 0; i < lm->drm_plane_resource->count_planes; i++) {
+	uint32_t count = lm->drm_plane_resource->count_planes;
+	if (count == 0)
+		return true;
+
+	lm->planes = calloc(count, sizeof(struct lm_plane));
+	if (!lm->planes) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
 		uint32_t plane_id = lm->drm_plane_resource->planes[i];
-		drmModePlanePtr plane = drmModeGetPlane(lm->drm_fd, plane_id);
+		drmModePlanePtr plane =
+		    DRM_CALL(drmModeGetPlane, lm->drm_fd, plane_id);
 
 		assert(plane);
 
-		// Exclude planes that can be used with multiple CRTCs for now
-		if (plane->possible_crtcs == (1u << crtc_index)) {
-			lease->object_ids[lease->nobject_ids++] = plane_id;
-		}
+		struct lm_plane *lm_plane = &lm->planes[lm->nplanes];
+		lm_plane->possible_crtcs = plane->possible_crtcs;
+		bool ok =
+		    lease_plane_caps_init(lm->drm_fd, plane, &lm_plane->caps);
 		drmModeFreePlane(plane);
+		if (!ok)
+			return false;
+
+		if (lm_plane->caps.type == DRM_PLANE_TYPE_CURSOR &&
+		    lm->cursor_policy == LM_CURSOR_NONE) {
+			lease_plane_caps_fini(&lm_plane->caps);
+			continue;
+		}
+
+		lm->nplanes++;
 	}
 	return true;
 }
 
-/* Lease transition
- * Wait for a client to update the DRM framebuffer on the CRTC managed by
- * a lease.  Once the framebuffer has been updated, it is safe to close
- * the fd associated with the previous lease client, freeing the previous
- * framebuffer if there are no other references to it. */
-static void wait_for_fb_update(struct lease *lease, uint32_t old_fb)
+static bool drm_get_crtc_props(struct lm *lm)
 {
-	uint32_t current_fb = old_fb;
+	int count = lm->drm_resource->count_crtcs;
+	if (count == 0)
+		return true;
 
-	struct pollfd drm_poll = {
-	    .fd = lease->lease_fd,
-	    .events = POLLIN,
-	};
-
-	while (current_fb == old_fb) {
-		drmModeCrtcPtr crtc;
-		if (poll(&drm_poll, 1, -1) < 0) {
-			if (errno == EINTR)
-				continue;
-			break;
-		}
-
-		crtc = drmModeGetCrtc(lease->lease_fd, lease->crtc_id);
-		current_fb = crtc->buffer_id;
-		drmModeFreeCrtc(crtc);
+	lm->crtc_props = calloc(count, sizeof(struct lease_object_props));
+	if (!lm->crtc_props) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return false;
 	}
-}
 
-struct transition_ctx {
-	struct lease *lease;
-	int close_fd;
-	uint32_t old_fb;
-};
+	for (int i = 0; i < count; i++) {
+		struct lease_object_props *props = &lm->crtc_props[i];
+		if (!lease_object_props_init(lm->drm_fd,
+					     lm->drm_resource->crtcs[i],
+					     DRM_MODE_OBJECT_CRTC, props))
+			return false;
 
-static void transition_done(void *arg)
-{
-	struct transition_ctx *ctx = arg;
-	close(ctx->close_fd);
-	free(ctx);
+		if (props->count > lm->max_crtc_props)
+			lm->max_crtc_props = props->count;
+	}
+	return true;
 }
 
-static void *finish_transition_task(void *arg)
+static bool plane_is_shared(const struct lm_plane *plane)
 {
-	struct transition_ctx *ctx = arg;
-	pthread_cleanup_push(transition_done, ctx);
-	wait_for_fb_update(ctx->lease, ctx->old_fb);
-	pthread_cleanup_pop(true);
-	return NULL;
+	return plane->possible_crtcs & (plane->possible_crtcs - 1);
 }
 
-static void close_after_lease_transition(struct lease *lease, int close_fd)
+static void lease_add_planes(struct lm *lm, struct lease *lease, int crtc_index)
 {
-	struct transition_ctx *ctx = calloc(1, sizeof(*ctx));
+	for (int i = 0; i < lm->nplanes; i++) {
+		struct lm_plane *plane = &lm->planes[i];
 
-	assert(ctx);
-
-	drmModeCrtcPtr crtc = drmModeGetCrtc(lease->lease_fd, lease->crtc_id);
-
-	ctx->lease = lease;
-	ctx->close_fd = close_fd;
-	ctx->old_fb = crtc->buffer_id;
-
-	drmModeFreeCrtc(crtc);
+		// Planes that can be used with multiple CRTCs are only added
+		// on demand, when the lease is granted
+		if (plane->possible_crtcs != (1u << crtc_index))
+			continue;
 
-	int ret = pthread_create(&lease->transition_tid, NULL,
-				 finish_transition_task, ctx);
+		lease->planes[lease->nplanes++] = plane;
+		lease->object_ids[lease->nobject_ids++] = plane->caps.plane_id;
+	}
+	lease->nfixed_planes = lease->nplanes;
+}
 
-	lease->transition_running = (ret == 0);
+/* Plane demand
+ * Shared planes are handed out from a pool when a lease is granted, to
+ * meet the demand of its client, and returned to the pool on revoke. */
+static void count_plane(struct lease_plane_demand *count,
+			const struct lease_plane_caps *caps)
+{
+	if (caps->type == DRM_PLANE_TYPE_OVERLAY)
+		count->overlay++;
+	if (caps->type == DRM_PLANE_TYPE_CURSOR)
+		count->cursor++;
+	if (caps->scaling)
+		count->scaling++;
 }
 
-static void cancel_lease_transition_thread(struct lease *lease)
+static bool demand_is_met(const struct lease_plane_demand *have,
+			  const struct lease_plane_demand *demand)
 {
+	return have->overlay >= demand->overlay &&
+	       have->cursor >= demand->cursor &&
+	       have->scaling >= demand->scaling;
+}
 
-	if (lease->transition_running) {
-		pthread_cancel(lease->transition_tid);
-		pthread_join(lease->transition_tid, NULL);
-	}
+static bool plane_fills_demand(const struct lease_plane_caps *caps,
+			       const struct lease_plane_demand *have,
+			       const struct lease_plane_demand *demand)
+{
+	if (caps->scaling && have->scaling < demand->scaling)
+		return true;
+	if (caps->type == DRM_PLANE_TYPE_OVERLAY &&
+	    have->overlay < demand->overlay)
+		return true;
+	if (caps->type == DRM_PLANE_TYPE_CURSOR &&
+	    have->cursor < demand->cursor)
+		return true;
+	return false;
+}
 
-	lease->transition_running = false;
+/* Check if a shared plane is free, and can be used on a CRTC */
+static bool plane_is_available(const struct lm_plane *plane, int crtc_index)
+{
+	return plane_is_shared(plane) && !plane->lease &&
+	       (plane->possible_crtcs & (1u << crtc_index));
 }
 
-static void lease_free(struct lease *lease)
+static void lease_take_plane(struct lease *lease, struct lm_plane *plane)
 {
-	free(lease->base.name);
-	free(lease->object_ids);
-	free(lease);
+	plane->lease = lease;
+	lease->planes[lease->nplanes++] = plane;
+	lease->object_ids[lease->nobject_ids++] = plane->caps.plane_id;
 }
 
-static struct lease *lease_create(struct lm *lm, drmModeConnectorPtr connector)
+static void lease_put_shared_planes(struct lease *lease)
 {
-	struct lease *lease = calloc(1, sizeof(struct lease));
-	if (!lease) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		return NULL;
-	}
+	for (int i = lease->nfixed_planes; i < lease->nplanes; i++)
+		lease->planes[i]->lease = NULL;
 
-	lease->base.name = drm_create_lease_name(lm, connector);
-	if (!lease->base.name) {
-		DEBUG_LOG("Can't create lease name: %s\n", strerror(errno));
-		goto err;
-	}
+	lease->nplanes = lease->nfixed_planes;
+	lease->nobject_ids = lease->nfixed_planes + DRM_LEASE_MIN_RES;
+}
 
-	int nobjects = lm->drm_plane_resource->count_planes + DRM_LEASE_MIN_RES;
-	lease->object_ids = calloc(nobjects, sizeof(uint32_t));
-	if (!lease->object_ids) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		goto err;
-	}
+/* Add free shared planes usable on crtc_index to a lease, until a demand
+ * is met along with the planes dedicated to that CRTC.  Scaling planes are
+ * picked for the scaling demand first, and only used to meet the rest of
+ * the demand when no other plane will do.
+ * Returns false, without adding any planes, if the demand can't be met. */
+static bool lease_get_shared_planes(struct lm *lm, struct lease *lease,
+				    int crtc_index,
+				    const struct lease_plane_demand *demand)
+{
+	struct lease_plane_demand have = {0};
+	struct lease_plane_demand scaling_demand = {
+	    .scaling = demand->scaling,
+	};
+	const struct {
+		bool scaling;
+		const struct lease_plane_demand *demand;
+	} passes[] = {
+	    {true, &scaling_demand},
+	    {false, demand},
+	    {true, demand},
+	};
 
-	int crtc_index = drm_get_crtc_index(lm, connector);
-	if (crtc_index < 0) {
-		DEBUG_LOG("No crtc found for connector: %s\n",
-			  lease->base.name);
-		goto err;
+	for (int i = 0; i < lm->nplanes; i++) {
+		if (lm->planes[i].possible_crtcs == (1u << crtc_index))
+			count_plane(&have, &lm->planes[i].caps);
 	}
 
-	if (!lease_add_planes(lm, lease, crtc_index))
-		goto err;
-
-	uint32_t crtc_id = lm->drm_resource->crtcs[crtc_index];
-	lease->crtc_id = crtc_id;
-	lease->object_ids[lease->nobject_ids++] = crtc_id;
-	lease->object_ids[lease->nobject_ids++] = connector->connector_id;
+	for (unsigned p = 0; p < ARRAY_LENGTH(passes); p++) {
+		for (int i = 0; i < lm->nplanes; i++) {
+			struct lm_plane *plane = &lm->planes[i];
 
-	lease->is_granted = false;
-	lease->lease_fd = -1;
+			if (!plane_is_available(plane, crtc_index) ||
+			    plane->caps.scaling != passes[p].scaling ||
+			    !plane_fills_demand(&plane->caps, &have,
+						passes[p].demand))
+				continue;
 
-	return lease;
+			lease_take_plane(lease, plane);
+			count_plane(&have, &plane->caps);
+		}
+	}
 
-err:
-	lease_free(lease);
-	return NULL;
+	if (!demand_is_met(&have, demand)) {
+		lease_put_shared_planes(lease);
+		return false;
+	}
+	return true;
 }
 
-struct lm *lm_create(const char *device)
+/* Add a free shared plane of the given type to a lease, unless it already
+ * has one.  Leases without such a plane are still granted. */
+static void lease_add_default_plane(struct lm *lm, struct lease *lease,
+				    uint32_t type)
 {
-	struct lm *lm = calloc(1, sizeof(struct lm));
-	if (!lm) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		return NULL;
-	}
-	lm->drm_fd = open(device, O_RDWR);
-	if (lm->drm_fd < 0) {
-		ERROR_LOG("Cannot open DRM device (%s): %s\n", device,
-			  strerror(errno));
-		goto err;
+	for (int i = 0; i < lease->nplanes; i++) {
+		if (lease->planes[i]->caps.type == type)
+			return;
 	}
 
-	lm->drm_resource = drmModeGetResources(lm->drm_fd);
-	if (!lm->drm_resource) {
-		ERROR_LOG("Invalid DRM device(%s)\n", device);
-		DEBUG_LOG("drmModeGetResources failed: %s\n", strerror(errno));
-		goto err;
+	for (int i = 0; i < lm->nplanes; i++) {
+		struct lm_plane *plane = &lm->planes[i];
+		if (plane->caps.type == type &&
+		    plane_is_available(plane, lease->crtc_index)) {
+			lease_take_plane(lease, plane);
+			return;
+		}
 	}
+}
 
-	lm->drm_plane_resource = drmModeGetPlaneResources(lm->drm_fd);
-	if (!lm->drm_plane_resource) {
-		DEBUG_LOG("drmModeGetPlaneResources failed: %s\n",
-			  strerror(errno));
-		goto err;
+/* Writeback connectors
+ * A writeback connector captures the output of the CRTC it is used with.
+ * In attached mode, it is added to a granted display lease with a CRTC it
+ * can be used with, and returned on revoke.  Leases without a free
+ * writeback connector are still granted. */
+/* Writeback connectors are only listed to atomic clients, but the atomic
+ * cap is only needed to enable them.  It is dropped again, so that the
+ * master fd keeps reporting the same modes, without aspect ratio flags. */
+static bool drm_enable_writeback(struct lm *lm)
+{
+	if (DRM_CALL(drmSetClientCap, lm->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		WARN_LOG("Writeback connectors not supported: %s\n",
+			 strerror(errno));
+		return false;
 	}
 
-	struct stat st;
-	if (fstat(lm->drm_fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
-		DEBUG_LOG("%s is not a valid device file\n", device);
-		goto err;
-	}
+	bool enabled = !DRM_CALL(drmSetClientCap, lm->drm_fd,
+				 DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+	if (!enabled)
+		WARN_LOG("Writeback connectors not supported: %s\n",
+			 strerror(errno));
+
+	/* Dropping the atomic cap drops the universal planes cap too */
+	if (DRM_CALL(drmSetClientCap, lm->drm_fd, DRM_CLIENT_CAP_ATOMIC, 0) ||
+	    DRM_CALL(drmSetClientCap, lm->drm_fd,
+		     DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+		WARN_LOG("Can't restore DRM client caps: %s\n",
+			 strerror(errno));
+	return enabled;
+}
 
-	lm->dev_id = st.st_rdev;
+static void drm_add_writeback(struct lm *lm, drmModeConnectorPtr connector)
+{
+	struct lm_writeback *writeback = &lm->writebacks[lm->nwritebacks++];
+	writeback->connector_id = connector->connector_id;
+	writeback->possible_crtcs = drm_get_possible_crtcs(lm, connector);
+}
 
-	int num_leases = lm->drm_resource->count_connectors;
+static void lease_attach_writeback(struct lm *lm, struct lease *lease)
+{
+	for (int i = 0; i < lm->nwritebacks; i++) {
+		struct lm_writeback *writeback = &lm->writebacks[i];
+		if (writeback->lease ||
+		    !(writeback->possible_crtcs & (1u << lease->crtc_index)))
+			continue;
 
-	lm->leases = calloc(num_leases, sizeof(struct lease *));
-	if (!lm->leases) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		goto err;
+		writeback->lease = lease;
+		lease->writeback = writeback;
+		lease->object_ids[lease->nobject_ids++] =
+		    writeback->connector_id;
+		return;
 	}
+}
 
-	drm_find_available_crtcs(lm);
+static void lease_detach_writeback(struct lease *lease)
+{
+	if (!lease->writeback)
+		return;
 
-	for (int i = 0; i < num_leases; i++) {
-		uint32_t connector_id = lm->drm_resource->connectors[i];
-		drmModeConnectorPtr connector =
-		    drmModeGetConnector(lm->drm_fd, connector_id);
+	lease->writeback->lease = NULL;
+	lease->writeback = NULL;
+	lease->nobject_ids = lease->nplanes + DRM_LEASE_MIN_RES;
+}
 
-		if (!connector)
-			continue;
+/* Lease transition
+ * Wait for clients to update the DRM framebuffer on the CRTCs managed by
+ * a set of leases.  Once the framebuffer has been updated, it is safe to
+ * close the fd associated with the previous lease client, freeing the
+ * previous framebuffer if there are no other references to it.
+ *
+ * Leases reassigned together share a single transition thread, so that
+ * the time until all of their displays have switched can be measured.
+ *
+ * In real-time mode, the transitions are preallocated, one per lease,
+ * since a lease is part of at most one transition at a time.  Each one
+ * has a worker thread, started with the lease manager, which runs the
+ * transition handed to it and is cancelled through cancel_fd. */
+struct transition {
+	pthread_t tid;
+	bool running;
+
+	/* Number of leases still referring to the transition */
+	int refs;
+
+	/* Preallocated transitions only */
+	bool preallocated;
+	bool in_use;
+	struct transition_ctx *ctx;
+	int cancel_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool busy;
+	bool quit;
+};
 
-		struct lease *lease = lease_create(lm, connector);
-		drmModeFreeConnector(connector);
+struct transition_entry {
+	struct lease *lease;
+	int lease_fd;
+	int close_fd;
+	uint32_t old_fb;
+};
 
-		if (!lease)
-			continue;
+struct transition_ctx {
+	int drm_fd;
+	struct lease_status *status;
+	uint64_t start_time;
+	uint64_t end_time;
+	bool switched;
 
-		lm->leases[lm->nleases] = lease;
-		lm->nleases++;
-	}
-	if (lm->nleases == 0)
-		goto err;
+	/* Set for the transitions of lease reassignments */
+	struct reassign_result *reassign;
+	uint64_t reassign_seq;
 
-	return lm;
+	/* The preallocated transition owning the context, if any */
+	struct transition *transition;
 
-err:
-	lm_destroy(lm);
-	return NULL;
-}
+	int nentries;
+	struct transition_entry entries[];
+};
 
-void lm_destroy(struct lm *lm)
+static uint64_t get_time_us(void)
 {
-	assert(lm);
-
-	for (int i = 0; i < lm->nleases; i++) {
-		struct lease_handle *lease_handle = &lm->leases[i]->base;
-		lm_lease_revoke(lm, lease_handle);
-		lm_lease_close(lease_handle);
-		lease_free(lm->leases[i]);
-	}
-
-	free(lm->leases);
-	drmModeFreeResources(lm->drm_resource);
-	drmModeFreePlaneResources(lm->drm_plane_resource);
-	close(lm->drm_fd);
-	free(lm);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-int lm_get_lease_handles(struct lm *lm, struct lease_handle ***handles)
+/* Unlike drmModeGetCrtc(), this doesn't allocate memory */
+static uint32_t get_crtc_fb(int fd, uint32_t crtc_id)
 {
-	assert(lm);
-	assert(handles);
-
-	*handles = (struct lease_handle **)lm->leases;
-	return lm->nleases;
+	struct drm_mode_crtc crtc = {.crtc_id = crtc_id};
+	if (DRM_CALL(drmIoctl, fd, DRM_IOCTL_MODE_GETCRTC, &crtc))
+		return 0;
+	return crtc.fb_id;
 }
 
-int lm_lease_grant(struct lm *lm, struct lease_handle *handle)
+/* Returns false if the wait was cancelled through cancel_fd */
+static bool wait_for_fb_updates(struct transition_ctx *ctx, int cancel_fd)
 {
-	assert(lm);
-	assert(handle);
+	struct pollfd drm_poll[ctx->nentries + 1];
+	int remaining = ctx->nentries;
 
-	struct lease *lease = (struct lease *)handle;
-	if (lease->is_granted) {
-		/* Lease is already claimed */
-		return -1;
+	for (int i = 0; i < ctx->nentries; i++) {
+		drm_poll[i].fd = ctx->entries[i].lease_fd;
+		drm_poll[i].events = POLLIN;
 	}
+	drm_poll[ctx->nentries].fd = cancel_fd;
+	drm_poll[ctx->nentries].events = POLLIN;
 
-	int lease_fd =
-	    drmModeCreateLease(lm->drm_fd, lease->object_ids,
-			       lease->nobject_ids, 0, &lease->lessee_id);
-	if (lease_fd < 0) {
-		ERROR_LOG("drmModeCreateLease failed on lease %s: %s\n",
-			  lease->base.name, strerror(errno));
-		return -1;
-	}
+	while (remaining > 0) {
+		if (poll(drm_poll, ctx->nentries + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
 
-	lease->is_granted = true;
+		if (drm_poll[ctx->nentries].revents)
+			return false;
 
-	int old_lease_fd = lease->lease_fd;
-	lease->lease_fd = lease_fd;
+		for (int i = 0; i < ctx->nentries; i++) {
+			struct transition_entry *entry = &ctx->entries[i];
+			if (drm_poll[i].fd < 0 || !drm_poll[i].revents)
+				continue;
 
-	if (old_lease_fd >= 0)
-		close_after_lease_transition(lease, old_lease_fd);
+			if (get_crtc_fb(entry->lease_fd,
+					entry->lease->crtc_id) == entry->old_fb)
+				continue;
 
-	return lease_fd;
+			/* Ignore this lease from now on */
+			drm_poll[i].fd = -1;
+			remaining--;
+		}
+	}
+	return true;
 }
 
-int lm_lease_transfer(struct lm *lm, struct lease_handle *handle)
+static void reassign_report(struct reassign_result *result, uint64_t seq,
+			    bool switched, uint64_t switch_time)
 {
-	assert(lm);
-	assert(handle);
-
-	struct lease *lease = (struct lease *)handle;
-	if (!lease->is_granted)
-		return -1;
-
-	lm_lease_revoke(lm, handle);
-	if (lm_lease_grant(lm, handle) < 0) {
-		lm_lease_close(handle);
-		return -1;
+	pthread_mutex_lock(&result->lock);
+	if (seq == result->seq) {
+		result->done = true;
+		result->switched = switched;
+		result->switch_time_us = switch_time;
+		eventfd_write(result->notify_fd, 1);
 	}
-
-	return lease->lease_fd;
+	pthread_mutex_unlock(&result->lock);
 }
 
-void lm_lease_revoke(struct lm *lm, struct lease_handle *handle)
+static void run_transition(struct transition_ctx *ctx, int cancel_fd)
 {
-	assert(lm);
-	assert(handle);
+	ctx->switched = wait_for_fb_updates(ctx, cancel_fd);
+	ctx->end_time = get_time_us();
+	if (ctx->switched && ctx->nentries > 1) {
+		INFO_LOG("%d leases switched in %llu us\n", ctx->nentries,
+			 (unsigned long long)(ctx->end_time - ctx->start_time));
+	}
+}
+
+static void transition_done(void *arg)
+{
+	struct transition_ctx *ctx = arg;
+
+	for (int i = 0; i < ctx->nentries; i++) {
+		struct transition_entry *entry = &ctx->entries[i];
+		if (entry->close_fd >= 0)
+			close(entry->close_fd);
+		lease_status_update(ctx->status, entry->lease->index,
+				    LEASE_STATUS_TRANSITION_DONE);
+	}
+
+	/* Cancelled transitions end now */
+	if (!ctx->end_time)
+		ctx->end_time = get_time_us();
+	if (ctx->reassign)
+		reassign_report(ctx->reassign, ctx->reassign_seq,
+				ctx->switched, ctx->end_time - ctx->start_time);
+
+	/* Preallocated contexts are reused */
+	if (!ctx->transition)
+		free(ctx);
+}
+
+static void *finish_transition_task(void *arg)
+{
+	struct transition_ctx *ctx = arg;
+	pthread_cleanup_push(transition_done, ctx);
+	run_transition(ctx, -1);
+	pthread_cleanup_pop(true);
+	return NULL;
+}
+
+static void *transition_worker_task(void *arg)
+{
+	struct transition *transition = arg;
+
+	pthread_mutex_lock(&transition->lock);
+	for (;;) {
+		while (!transition->busy && !transition->quit)
+			pthread_cond_wait(&transition->cond, &transition->lock);
+		if (transition->quit)
+			break;
+		pthread_mutex_unlock(&transition->lock);
+
+		run_transition(transition->ctx, transition->cancel_fd);
+		transition_done(transition->ctx);
+
+		pthread_mutex_lock(&transition->lock);
+		transition->busy = false;
+		pthread_cond_broadcast(&transition->cond);
+	}
+	pthread_mutex_unlock(&transition->lock);
+	return NULL;
+}
+
+static bool start_transition_workers(struct lm *lm)
+{
+	lm->transitions = calloc(lm->nleases, sizeof(struct transition));
+	if (!lm->transitions) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (int i = 0; i < lm->nleases; i++) {
+		struct transition *transition = &lm->transitions[i];
+		transition->preallocated = true;
+		size_t size = sizeof(struct transition_ctx) +
+			      lm->nleases * sizeof(struct transition_entry);
+		transition->ctx = calloc(1, size);
+		if (!transition->ctx) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			return false;
+		}
+
+		transition->cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (transition->cancel_fd < 0) {
+			DEBUG_LOG("eventfd failed: %s\n", strerror(errno));
+			free(transition->ctx);
+			return false;
+		}
+
+		pthread_mutex_init(&transition->lock, NULL);
+		pthread_cond_init(&transition->cond, NULL);
+		int ret = pthread_create(&transition->tid, NULL,
+					 transition_worker_task, transition);
+		if (ret) {
+			DEBUG_LOG("Can't start transition thread: %s\n",
+				  strerror(ret));
+			pthread_cond_destroy(&transition->cond);
+			pthread_mutex_destroy(&transition->lock);
+			close(transition->cancel_fd);
+			free(transition->ctx);
+			return false;
+		}
+		lm->ntransitions++;
+	}
+	return true;
+}
+
+static void stop_transition_workers(struct lm *lm)
+{
+	for (int i = 0; i < lm->ntransitions; i++) {
+		struct transition *transition = &lm->transitions[i];
+
+		pthread_mutex_lock(&transition->lock);
+		transition->quit = true;
+		pthread_cond_signal(&transition->cond);
+		pthread_mutex_unlock(&transition->lock);
+		pthread_join(transition->tid, NULL);
+
+		pthread_cond_destroy(&transition->cond);
+		pthread_mutex_destroy(&transition->lock);
+		close(transition->cancel_fd);
+		free(transition->ctx);
+	}
+	free(lm->transitions);
+}
+
+static struct transition_ctx *transition_ctx_create(struct lm *lm,
+						    int nentries,
+						    uint64_t start_time)
+{
+	struct transition_ctx *ctx = NULL;
+
+	if (lm->transitions) {
+		for (int i = 0; i < lm->ntransitions && !ctx; i++) {
+			struct transition *transition = &lm->transitions[i];
+			if (transition->in_use)
+				continue;
+
+			transition->in_use = true;
+			ctx = transition->ctx;
+			memset(ctx, 0, sizeof(*ctx));
+			ctx->transition = transition;
+		}
+		if (!ctx) {
+			ERROR_LOG("No free lease transition\n");
+			return NULL;
+		}
+	} else {
+		ctx = calloc(1,
+			     sizeof(*ctx) + nentries * sizeof(ctx->entries[0]));
+		if (!ctx) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			return NULL;
+		}
+	}
+	ctx->start_time = start_time;
+	return ctx;
+}
+
+static void transition_put(struct transition *transition)
+{
+	if (transition->preallocated)
+		transition->in_use = false;
+	else
+		free(transition);
+}
+
+/* Release a context that was never started */
+static void transition_ctx_destroy(struct transition_ctx *ctx)
+{
+	if (ctx->transition)
+		transition_put(ctx->transition);
+	else
+		free(ctx);
+}
+
+/* Record a lease whose previous lease fd (close_fd) can be closed once the
+ * new client has updated the framebuffer */
+static void transition_ctx_add(struct transition_ctx *ctx, struct lease *lease,
+			       int close_fd)
+{
+	struct transition_entry *entry = &ctx->entries[ctx->nentries++];
+
+	entry->lease = lease;
+	entry->lease_fd = lease->lease_fd;
+	entry->close_fd = close_fd;
+	entry->old_fb = get_crtc_fb(lease->lease_fd, lease->crtc_id);
+}
+
+/* Start the thread that finishes the transitions in ctx, which it takes
+ * ownership of */
+static void start_transition(struct lm *lm, struct transition_ctx *ctx)
+{
+	ctx->drm_fd = lm->drm_fd;
+	ctx->status = lm->status;
+
+	struct transition *transition = ctx->transition;
+	if (transition) {
+		pthread_mutex_lock(&transition->lock);
+		transition->busy = true;
+		pthread_cond_signal(&transition->cond);
+		pthread_mutex_unlock(&transition->lock);
+	} else {
+		transition = calloc(1, sizeof(*transition));
+		if (!transition) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			goto err;
+		}
+
+		if (pthread_create(&transition->tid, NULL,
+				   finish_transition_task, ctx)) {
+			free(transition);
+			goto err;
+		}
+	}
+	transition->running = true;
+
+	for (int i = 0; i < ctx->nentries; i++) {
+		struct lease *lease = ctx->entries[i].lease;
+		lease->transition = transition;
+		transition->refs++;
+		lease_status_update(lm->status, lease->index,
+				    LEASE_STATUS_TRANSITION_STARTED);
+	}
+	return;
+err:
+	/* Without the thread, the old lease fds can only be closed now */
+	transition_done(ctx);
+}
+
+static void close_after_lease_transition(struct lm *lm, struct lease *lease,
+					 int close_fd)
+{
+	struct transition_ctx *ctx =
+	    transition_ctx_create(lm, 1, get_time_us());
+	if (!ctx) {
+		if (close_fd >= 0)
+			close(close_fd);
+		return;
+	}
+
+	transition_ctx_add(ctx, lease, close_fd);
+	start_transition(lm, ctx);
+}
+
+static void stop_transition(struct transition *transition)
+{
+	if (!transition->preallocated) {
+		pthread_cancel(transition->tid);
+		pthread_join(transition->tid, NULL);
+		return;
+	}
+
+	eventfd_write(transition->cancel_fd, 1);
+	pthread_mutex_lock(&transition->lock);
+	while (transition->busy)
+		pthread_cond_wait(&transition->cond, &transition->lock);
+	pthread_mutex_unlock(&transition->lock);
+
+	/* Clear the cancellation, in case the transition was already over */
+	eventfd_t count;
+	eventfd_read(transition->cancel_fd, &count);
+}
+
+/* Stop waiting for the transition of a lease.  If the transition is shared
+ * with other leases, it is finished for all of them. */
+static void cancel_lease_transition_thread(struct lease *lease)
+{
+	struct transition *transition = lease->transition;
+	if (!transition)
+		return;
+
+	if (transition->running) {
+		stop_transition(transition);
+		transition->running = false;
+	}
+
+	lease->transition = NULL;
+	if (--transition->refs == 0)
+		transition_put(transition);
+}
+
+static void lease_free(struct lease *lease)
+{
+	free(lease->base.name);
+	free(lease->object_ids);
+	free(lease->planes);
+	free(lease->modes);
+	if (lease->topology_fd >= 0)
+		close(lease->topology_fd);
+	lease_object_props_fini(&lease->connector_props);
+	free(lease->topology_buf);
+	free(lease);
+}
+
+static void lease_drop_topology(struct lease *lease)
+{
+	if (lease->topology_fd >= 0) {
+		close(lease->topology_fd);
+		lease->topology_fd = -1;
+	}
+}
+
+/* Make the topology buffer large enough for all the planes that could be
+ * added to the lease, so that the topology can be rebuilt without
+ * allocating memory */
+static void lease_reserve_topology(struct lm *lm, struct lease *lease)
+{
+	const struct lease_plane_caps *planes[lm->nplanes + 1];
+	for (int i = 0; i < lm->nplanes; i++)
+		planes[i] = &lm->planes[i].caps;
+
+	struct lease_object_props crtc_props = {.count = lm->max_crtc_props};
+	struct lease_topology_objects objects = {
+	    .nmodes = lease->nmodes,
+	    .planes = planes,
+	    .nplanes = lm->nplanes,
+	    .crtc_props = &crtc_props,
+	    .connector_props = &lease->connector_props,
+	};
+
+	size_t size = lease_topology_size(&objects);
+	if (size <= lease->topology_buf_size)
+		return;
+
+	uint8_t *buf = realloc(lease->topology_buf, size);
+	if (!buf) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return;
+	}
+	lease->topology_buf = buf;
+	lease->topology_buf_size = size;
+}
+
+static void lease_update_connector_state(struct lm *lm, struct lease *lease,
+					 drmModeConnectorPtr connector)
+{
+	drmModeModeInfo *modes = NULL;
+	int nmodes = connector->count_modes;
+
+	if (nmodes > 0) {
+		modes = calloc(nmodes, sizeof(drmModeModeInfo));
+		if (!modes) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			nmodes = 0;
+		} else {
+			memcpy(modes, connector->modes,
+			       nmodes * sizeof(drmModeModeInfo));
+		}
+	}
+
+	free(lease->modes);
+	lease->modes = modes;
+	lease->nmodes = nmodes;
+	lease->connection = connector->connection;
+
+	/* The topology includes the connector modes, so rebuild it */
+	lease_drop_topology(lease);
+	lease_reserve_topology(lm, lease);
+}
+
+/* Seamless boot handoff
+ * If the bootloader or a splash screen left the CRTC of a lease lit, its
+ * mode is handed to the first client, so that it can keep the mode and
+ * start with a page flip instead of a modeset.  The boot framebuffer is
+ * only reported: it belongs to whoever created it, and goes away with
+ * them. */
+static void lease_get_boot_state(struct lm *lm, struct lease *lease)
+{
+	drmModeCrtcPtr crtc =
+	    DRM_CALL(drmModeGetCrtc, lm->drm_fd, lease->crtc_id);
+	if (!crtc)
+		return;
+
+	if (crtc->mode_valid && crtc->buffer_id) {
+		lease->boot_fb_id = crtc->buffer_id;
+		lease->boot_mode = crtc->mode;
+	}
+	drmModeFreeCrtc(crtc);
+}
+
+static void lease_put_boot_state(struct lease *lease)
+{
+	lease->boot_fb_id = 0;
+}
+
+/* Use a CRTC, and the planes dedicated to it, in a lease */
+static void lease_set_crtc(struct lm *lm, struct lease *lease, int crtc_index)
+{
+	lease->nplanes = 0;
+	lease->nobject_ids = 0;
+	lease_add_planes(lm, lease, crtc_index);
+
+	lease->crtc_index = crtc_index;
+	lease->crtc_id = lm->drm_resource->crtcs[crtc_index];
+	lease->object_ids[lease->nobject_ids++] = lease->crtc_id;
+	lease->object_ids[lease->nobject_ids++] = lease->connector_id;
+
+	/* The topology lists the CRTC and its planes */
+	pthread_mutex_lock(&lm->connector_lock);
+	lease_drop_topology(lease);
+	pthread_mutex_unlock(&lm->connector_lock);
+}
+
+/* Late CRTC binding
+ * A CRTC is only bound to a lease while it is granted, so that there can
+ * be a lease for every connector, even if there are fewer CRTCs.  A lease
+ * keeps the CRTC it used last, if it is free, and switches to another
+ * usable CRTC otherwise. */
+static int lease_next_crtc(struct lm *lm, struct lease *lease)
+{
+	uint32_t usable_crtcs = lm->free_crtcs & lease->possible_crtcs;
+	if (!usable_crtcs)
+		return -1;
+
+	if (usable_crtcs & (1u << lease->crtc_index))
+		return lease->crtc_index;
+	return ffs(usable_crtcs) - 1;
+}
+
+static bool lease_bind_crtc(struct lm *lm, struct lease *lease)
+{
+	int crtc_index = lease_next_crtc(lm, lease);
+	if (crtc_index < 0) {
+		ERROR_LOG("No free CRTC for lease %s\n", lease->base.name);
+		return false;
+	}
+
+	if (crtc_index != lease->crtc_index) {
+		/* The boot state belongs to the old CRTC */
+		lease_put_boot_state(lease);
+		lease_set_crtc(lm, lease, crtc_index);
+	}
+
+	lm->free_crtcs &= ~(1u << lease->crtc_index);
+	return true;
+}
+
+static void lease_unbind_crtc(struct lm *lm, struct lease *lease)
+{
+	lm->free_crtcs |= 1u << lease->crtc_index;
+}
+
+static struct lease *lease_create(struct lm *lm, drmModeConnectorPtr connector)
+{
+	struct lease *lease = calloc(1, sizeof(struct lease));
+	if (!lease) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	lease->topology_fd = -1;
+	lease->base.name = drm_create_lease_name(lm, connector);
+	if (!lease->base.name) {
+		DEBUG_LOG("Can't create lease name: %s\n", strerror(errno));
+		goto err;
+	}
+
+	/* Leave room for an attached writeback connector */
+	int nplanes = lm->nplanes;
+	int nobjects = nplanes + DRM_LEASE_MIN_RES + 1;
+	lease->object_ids = calloc(nobjects, sizeof(uint32_t));
+	if (!lease->object_ids) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (nplanes > 0) {
+		lease->planes = calloc(nplanes, sizeof(*lease->planes));
+		if (!lease->planes) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			goto err;
+		}
+	}
+
+	lease->is_writeback =
+	    connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK;
+
+	/* Writeback connectors are never active at startup, so don't let
+	 * them claim a CRTC that a display could use */
+	uint32_t possible_crtcs = drm_get_possible_crtcs(lm, connector);
+	int crtc_index =
+	    lease->is_writeback
+		? ffs(possible_crtcs) - 1
+		: drm_get_crtc_index(lm, connector, possible_crtcs);
+	if (crtc_index < 0) {
+		DEBUG_LOG("No crtc found for connector: %s\n",
+			  lease->base.name);
+		goto err;
+	}
+
+	lease->possible_crtcs = possible_crtcs | (1u << crtc_index);
+	lease->connector_id = connector->connector_id;
+	if (!lease_object_props_init(lm->drm_fd, lease->connector_id,
+				     DRM_MODE_OBJECT_CONNECTOR,
+				     &lease->connector_props))
+		goto err;
+
+	lease_set_crtc(lm, lease, crtc_index);
+	lease_update_connector_state(lm, lease, connector);
+
+	if (drm_get_active_crtc_index(lm, connector) == crtc_index)
+		lease_get_boot_state(lm, lease);
+
+	lease->is_granted = false;
+	lease->lease_fd = -1;
+
+	return lease;
+
+err:
+	lease_free(lease);
+	return NULL;
+}
+
+/* Deferred connector probing
+ * drmModeGetConnector() forces the kernel to probe the connector, which can
+ * include slow DDC/EDID reads.  When fast enumeration is enabled, the leases
+ * are created from the current (cached) connector state, and the full probe
+ * is run here, in the background, once the lease servers are already up. */
+static void *probe_connectors_task(void *arg)
+{
+	struct lm *lm = arg;
+
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease *lease = lm->leases[i];
+		drmModeConnectorPtr connector = DRM_CALL(
+		    drmModeGetConnector, lm->drm_fd, lease->connector_id);
+
+		if (!connector) {
+			DEBUG_LOG("Connector probe failed on lease %s: %s\n",
+				  lease->base.name, strerror(errno));
+			continue;
+		}
+
+		pthread_mutex_lock(&lm->connector_lock);
+		lease_update_connector_state(lm, lease, connector);
+		pthread_mutex_unlock(&lm->connector_lock);
+
+		DEBUG_LOG("Connector probed on lease %s: %s, %d modes\n",
+			  lease->base.name,
+			  connector->connection == DRM_MODE_CONNECTED
+			      ? "connected"
+			      : "not connected",
+			  connector->count_modes);
+		drmModeFreeConnector(connector);
+	}
+	return NULL;
+}
+
+static void start_connector_probe(struct lm *lm)
+{
+	int ret =
+	    pthread_create(&lm->probe_tid, NULL, probe_connectors_task, lm);
+	if (ret) {
+		WARN_LOG("Can't start background connector probe: %s\n",
+			 strerror(ret));
+		return;
+	}
+	lm->probe_running = true;
+}
+
+static void wait_for_connector_probe(struct lm *lm)
+{
+	if (lm->probe_running)
+		pthread_join(lm->probe_tid, NULL);
+
+	lm->probe_running = false;
+}
+
+/* Create a lease manager on an open DRM device.  The device name is only
+ * used in messages. */
+static bool create_event_fds(struct lm *lm)
+{
+	lm->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (lm->epoll_fd < 0) {
+		DEBUG_LOG("epoll_create failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	lm->reassign.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (lm->reassign.notify_fd < 0) {
+		DEBUG_LOG("eventfd failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN};
+	if (epoll_ctl(lm->epoll_fd, EPOLL_CTL_ADD, lm->reassign.notify_fd,
+		      &ev)) {
+		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* The vblank events of transfers are read from the master fd */
+	if (lm->vblank_transfers &&
+	    epoll_ctl(lm->epoll_fd, EPOLL_CTL_ADD, lm->drm_fd, &ev)) {
+		WARN_LOG("Can't poll DRM device, vblank transfers disabled: "
+			 "%s\n",
+			 strerror(errno));
+		lm->vblank_transfers = false;
+	}
+	return true;
+}
+
+static struct lm *create(int drm_fd, const char *device,
+			 const struct lm_options *options,
+			 struct startup_profile *profile)
+{
+	static const struct lm_options default_options;
+
+	if (!options)
+		options = &default_options;
+
+	struct lm *lm = calloc(1, sizeof(struct lm));
+	if (!lm) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		close(drm_fd);
+		return NULL;
+	}
+	pthread_mutex_init(&lm->connector_lock, NULL);
+	pthread_mutex_init(&lm->reassign.lock, NULL);
+	lm->drm_fd = drm_fd;
+	lm->epoll_fd = -1;
+	lm->reassign.notify_fd = -1;
+
+	lm->cursor_policy = options->cursor_policy;
+	lm->vblank_transfers = options->vblank_transfers;
+	lm->realtime = options->realtime;
+
+	/* The background probe updates the connector state after startup */
+	bool fast_enumeration = options->fast_enumeration;
+	if (lm->realtime && fast_enumeration) {
+		WARN_LOG("Connectors are probed at startup in real-time "
+			 "mode\n");
+		fast_enumeration = false;
+	}
+
+	/* Enumerate the primary and cursor planes too, so that they are
+	 * leased explicitly, along with the overlay planes */
+	if (DRM_CALL(drmSetClientCap, lm->drm_fd,
+		     DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+		WARN_LOG("Universal planes not supported: %s\n",
+			 strerror(errno));
+
+	lm->writeback_mode = options->writeback;
+	if (lm->writeback_mode != LM_WRITEBACK_NONE &&
+	    !drm_enable_writeback(lm))
+		lm->writeback_mode = LM_WRITEBACK_NONE;
+	startup_profile_phase(profile, "client caps", NULL);
+
+	lm->drm_resource = DRM_CALL(drmModeGetResources, lm->drm_fd);
+	if (!lm->drm_resource) {
+		ERROR_LOG("Invalid DRM device(%s)\n", device);
+		DEBUG_LOG("drmModeGetResources failed: %s\n", strerror(errno));
+		goto err;
+	}
+	startup_profile_phase(profile, "resources", NULL);
+
+	lm->drm_plane_resource =
+	    DRM_CALL(drmModeGetPlaneResources, lm->drm_fd);
+	if (!lm->drm_plane_resource) {
+		DEBUG_LOG("drmModeGetPlaneResources failed: %s\n",
+			  strerror(errno));
+		goto err;
+	}
+	startup_profile_phase(profile, "plane resources", NULL);
+
+	struct stat st;
+	if (fstat(lm->drm_fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+		DEBUG_LOG("%s is not a valid device file\n", device);
+		goto err;
+	}
+
+	lm->dev_id = st.st_rdev;
+
+	int num_leases = lm->drm_resource->count_connectors;
+
+	lm->leases = calloc(num_leases, sizeof(struct lease *));
+	if (!lm->leases) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (lm->writeback_mode == LM_WRITEBACK_ATTACHED) {
+		lm->writebacks =
+		    calloc(num_leases, sizeof(struct lm_writeback));
+		if (!lm->writebacks) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			goto err;
+		}
+	}
+
+	if (!drm_get_planes(lm) || !drm_get_crtc_props(lm))
+		goto err;
+	startup_profile_phase(profile, "planes", NULL);
+
+	drm_find_available_crtcs(lm);
+	for (int i = 0; i < lm->drm_resource->count_crtcs; i++)
+		lm->free_crtcs |= 1u << i;
+	startup_profile_phase(profile, "encoder scan", NULL);
+
+	for (int i = 0; i < num_leases; i++) {
+		uint32_t connector_id = lm->drm_resource->connectors[i];
+		drmModeConnectorPtr connector =
+		    fast_enumeration ? DRM_CALL(drmModeGetConnectorCurrent,
+						lm->drm_fd, connector_id)
+				     : DRM_CALL(drmModeGetConnector, lm->drm_fd,
+						connector_id);
+
+		if (!connector)
+			continue;
+
+		if (lm->writeback_mode == LM_WRITEBACK_ATTACHED &&
+		    connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			drm_add_writeback(lm, connector);
+			drmModeFreeConnector(connector);
+			startup_profile_phase(profile, "writeback connector",
+					      NULL);
+			continue;
+		}
+
+		struct lease *lease = lease_create(lm, connector);
+		drmModeFreeConnector(connector);
+
+		if (!lease)
+			continue;
+		startup_profile_phase(profile, "connector", lease->base.name);
+
+		lease->index = lm->nleases;
+		lm->leases[lm->nleases] = lease;
+		lm->nleases++;
+	}
+	if (lm->nleases == 0)
+		goto err;
+
+	if (options->dry_run)
+		return lm;
+
+	/* The status page is only for monitoring, so carry on without it */
+	lm->status = lease_status_create((struct lease_handle **)lm->leases,
+					 lm->nleases);
+
+	if (options->frame_stats && lm->status) {
+		lm->frame_sampler =
+		    frame_sampler_create(lm->drm_fd, lm->status, lm->nleases);
+		if (!lm->frame_sampler)
+			WARN_LOG("Frame timing is not available\n");
+	}
+
+	if (!create_event_fds(lm))
+		goto err;
+
+	if (lm->realtime && !start_transition_workers(lm))
+		goto err;
+
+	if (fast_enumeration)
+		start_connector_probe(lm);
+	startup_profile_phase(profile, "status page and threads", NULL);
+
+	return lm;
+
+err:
+	lm_destroy(lm);
+	return NULL;
+}
+
+struct lm *lm_create(const char *device, const struct lm_options *options)
+{
+	struct startup_profile profile;
+	startup_profile_start(&profile, options && options->profile_startup);
+
+	int drm_fd = open(device, O_RDWR);
+	if (drm_fd < 0) {
+		ERROR_LOG("Cannot open DRM device (%s): %s\n", device,
+			  strerror(errno));
+		return NULL;
+	}
+	startup_profile_phase(&profile, "open device", NULL);
+
+	return create(drm_fd, device, options, &profile);
+}
+
+struct lm *lm_create_from_fd(int drm_fd, const struct lm_options *options)
+{
+	assert(drm_fd >= 0);
+
+	struct startup_profile profile;
+	startup_profile_start(&profile, options && options->profile_startup);
+
+	return create(drm_fd, "handed over", options, &profile);
+}
+
+int lm_get_drm_fd(struct lm *lm)
+{
+	assert(lm);
+
+	return lm->drm_fd;
+}
+
+void lm_destroy(struct lm *lm)
+{
+	assert(lm);
+
+	wait_for_connector_probe(lm);
+
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease_handle *lease_handle = &lm->leases[i]->base;
+		lm_lease_revoke(lm, lease_handle);
+		lm_lease_close(lease_handle);
+		lease_free(lm->leases[i]);
+	}
+
+	frame_sampler_destroy(lm->frame_sampler);
+	stop_transition_workers(lm);
+	lease_status_destroy(lm->status);
+	free(lm->leases);
+	free(lm->writebacks);
+	for (int i = 0; i < lm->nplanes; i++)
+		lease_plane_caps_fini(&lm->planes[i].caps);
+	free(lm->planes);
+	for (int i = 0; lm->crtc_props && i < lm->drm_resource->count_crtcs;
+	     i++)
+		lease_object_props_fini(&lm->crtc_props[i]);
+	free(lm->crtc_props);
+	drmModeFreeResources(lm->drm_resource);
+	drmModeFreePlaneResources(lm->drm_plane_resource);
+	if (lm->epoll_fd >= 0)
+		close(lm->epoll_fd);
+	if (lm->reassign.notify_fd >= 0)
+		close(lm->reassign.notify_fd);
+	close(lm->drm_fd);
+	pthread_mutex_destroy(&lm->reassign.lock);
+	pthread_mutex_destroy(&lm->connector_lock);
+	free(lm);
+}
+
+int lm_get_lease_handles(struct lm *lm, struct lease_handle ***handles)
+{
+	assert(lm);
+	assert(handles);
+
+	*handles = (struct lease_handle **)lm->leases;
+	return lm->nleases;
+}
+
+/* Create a DRM lease with the objects of a lease, and the shared planes
+ * needed to meet the plane demand of its client */
+static int lease_create_fd(struct lm *lm, struct lease *lease)
+{
+	if (!lease_bind_crtc(lm, lease))
+		return -1;
+
+	if (!lease_get_shared_planes(lm, lease, lease->crtc_index,
+				     &lease->plane_demand)) {
+		ERROR_LOG("Not enough free planes for lease %s\n",
+			  lease->base.name);
+		lease_unbind_crtc(lm, lease);
+		return -1;
+	}
+
+	/* Clients need a primary plane for atomic commits */
+	lease_add_default_plane(lm, lease, DRM_PLANE_TYPE_PRIMARY);
+	if (lm->cursor_policy == LM_CURSOR_ALWAYS)
+		lease_add_default_plane(lm, lease, DRM_PLANE_TYPE_CURSOR);
+	lease_attach_writeback(lm, lease);
+
+	int lease_fd =
+	    DRM_CALL(drmModeCreateLease, lm->drm_fd, lease->object_ids,
+		     lease->nobject_ids, 0, &lease->lessee_id);
+	if (lease_fd < 0) {
+		ERROR_LOG("drmModeCreateLease failed on lease %s: %s\n",
+			  lease->base.name, strerror(errno));
+		lease_detach_writeback(lease);
+		lease_put_shared_planes(lease);
+		lease_unbind_crtc(lm, lease);
+		return -1;
+	}
+
+	/* The topology lists the shared planes too */
+	if (lease->nplanes > lease->nfixed_planes) {
+		pthread_mutex_lock(&lm->connector_lock);
+		lease_drop_topology(lease);
+		pthread_mutex_unlock(&lm->connector_lock);
+	}
+	return lease_fd;
+}
+
+int lm_lease_grant(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (lease->is_granted) {
+		/* Lease is already claimed */
+		return -1;
+	}
+
+	int lease_fd = lease_create_fd(lm, lease);
+	if (lease_fd < 0) {
+		lease_status_update(lm->status, lease->index,
+				    LEASE_STATUS_FAILED);
+		return -1;
+	}
+
+	lease->is_granted = true;
+	lease_status_update(lm->status, lease->index, LEASE_STATUS_GRANTED);
+	frame_sampler_start(lm->frame_sampler, lease->index, lease->crtc_id);
+
+	int old_lease_fd = lease->lease_fd;
+	lease->lease_fd = lease_fd;
+
+	if (old_lease_fd >= 0)
+		close_after_lease_transition(lm, lease, old_lease_fd);
+
+	return lease_fd;
+}
+
+/* Vblank-aligned transfers
+ * A transfer waits for the next vblank of the lease CRTC, so that the lease
+ * changes hands between frames, with a worst-case delay of one frame.  The
+ * wait is queued on the DRM master fd, which is polled with the other
+ * lease manager events, and the transfer is carried out once the vblank
+ * has been reported.  If the CRTC is off, or no vblank arrives in time,
+ * the wait ends anyway. */
+#define VBLANK_WAIT_TIMEOUT_MS 100
+
+bool lm_lease_wait_vblank(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (!lm->vblank_transfers || !lease->is_granted)
+		return false;
+
+	/* A transfer is already waiting for the same vblank */
+	if (lease->vblank_wait_id)
+		return true;
+
+	uint64_t wait_id = ++lm->vblank_wait_id;
+	uint64_t queued;
+	if (DRM_CALL(drmCrtcQueueSequence, lm->drm_fd, lease->crtc_id,
+		     DRM_CRTC_SEQUENCE_RELATIVE |
+			 DRM_CRTC_SEQUENCE_NEXT_ON_MISS,
+		     1, &queued, wait_id)) {
+		DEBUG_LOG("Can't wait for vblank on CRTC %u: %s\n",
+			  lease->crtc_id, strerror(errno));
+		return false;
+	}
+
+	lease->vblank_wait_id = wait_id;
+	lease->vblank_deadline =
+	    get_time_us() + VBLANK_WAIT_TIMEOUT_MS * 1000;
+	lease->vblank_arrived = false;
+	lm->nvblank_waits++;
+	return true;
+}
+
+/* Read one buffer of DRM events, false if there was nothing to read */
+static bool drm_read_event_batch(struct lm *lm)
+{
+	char buf[1024];
+	ssize_t len = read(lm->drm_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return false;
+
+	for (ssize_t i = 0; i + (ssize_t)sizeof(struct drm_event) <= len;) {
+		struct drm_event *event = (struct drm_event *)&buf[i];
+		if (event->length < sizeof(*event))
+			break;
+
+		if (event->type == DRM_EVENT_CRTC_SEQUENCE &&
+		    event->length >= sizeof(struct drm_event_crtc_sequence)) {
+			struct drm_event_crtc_sequence *seq =
+			    (struct drm_event_crtc_sequence *)event;
+			for (int j = 0; j < lm->nleases; j++) {
+				struct lease *lease = lm->leases[j];
+				if (lease->vblank_wait_id &&
+				    lease->vblank_wait_id == seq->user_data)
+					lease->vblank_arrived = true;
+			}
+		}
+		i += event->length;
+	}
+	return true;
+}
+
+/* Match the sequence events pending on the DRM master fd with the vblank
+ * waits of the leases.  Events of waits that have already timed out, or
+ * were cancelled, are dropped.  The fd is drained even if no wait is
+ * pending, since it is polled level-triggered. */
+static void drm_read_events(struct lm *lm)
+{
+	struct pollfd drm_poll = {.fd = lm->drm_fd, .events = POLLIN};
+	while (poll(&drm_poll, 1, 0) > 0 && (drm_poll.revents & POLLIN)) {
+		if (!drm_read_event_batch(lm))
+			return;
+	}
+}
+
+/* Report the vblank waits that are over */
+static void dispatch_vblank_waits(struct lm *lm, lm_event_handler handler,
+				  void *data)
+{
+	if (!lm->vblank_transfers)
+		return;
+
+	drm_read_events(lm);
+	if (!lm->nvblank_waits)
+		return;
+
+	uint64_t now = get_time_us();
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease *lease = lm->leases[i];
+		if (!lease->vblank_wait_id ||
+		    (!lease->vblank_arrived && now < lease->vblank_deadline))
+			continue;
+
+		if (!lease->vblank_arrived)
+			WARN_LOG("No vblank on CRTC %u, transferring lease "
+				 "anyway\n",
+				 lease->crtc_id);
+
+		lease->vblank_wait_id = 0;
+		lm->nvblank_waits--;
+
+		struct lm_event event = {
+		    .type = LM_EVENT_VBLANK,
+		    .lease_handle = &lease->base,
+		};
+		handler(&event, data);
+	}
+}
+
+int lm_get_timeout(struct lm *lm)
+{
+	assert(lm);
+
+	if (!lm->nvblank_waits)
+		return -1;
+
+	uint64_t now = get_time_us();
+	uint64_t timeout = UINT64_MAX;
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease *lease = lm->leases[i];
+		if (!lease->vblank_wait_id)
+			continue;
+		if (lease->vblank_deadline <= now)
+			return 0;
+		if (lease->vblank_deadline - now < timeout)
+			timeout = lease->vblank_deadline - now;
+	}
+	return (timeout + 999) / 1000;
+}
+
+int lm_get_fd(struct lm *lm)
+{
+	assert(lm);
+
+	return lm->epoll_fd;
+}
+
+void lm_dispatch_events(struct lm *lm, lm_event_handler handler, void *data)
+{
+	assert(lm);
+	assert(handler);
+
+	eventfd_t count;
+	eventfd_read(lm->reassign.notify_fd, &count);
+
+	struct lm_event event = {.type = LM_EVENT_REASSIGN_DONE};
+	pthread_mutex_lock(&lm->reassign.lock);
+	bool done = lm->reassign.done;
+	lm->reassign.done = false;
+	event.switched = lm->reassign.switched;
+	event.switch_time_us = lm->reassign.switch_time_us;
+	pthread_mutex_unlock(&lm->reassign.lock);
+
+	if (done)
+		handler(&event, data);
+
+	dispatch_vblank_waits(lm, handler, data);
+}
+
+int lm_lease_transfer(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (!lease->is_granted)
+		return -1;
+
+	lm_lease_revoke(lm, handle);
+	if (lm_lease_grant(lm, handle) < 0) {
+		lm_lease_close(handle);
+		return -1;
+	}
+
+	lease_status_update(lm->status, lease->index, LEASE_STATUS_TRANSFERRED);
+	return lease->lease_fd;
+}
+
+/* Lease reassignment
+ * Revoke a set of leases back to back, then grant them all again, so that
+ * the displays of all the leases switch to their new clients at the same
+ * time.  The previous lease fds are closed once all the new clients have
+ * updated their framebuffers. */
+bool lm_lease_reassign(struct lm *lm, struct lease_handle **handles,
+		       int count, int *fds)
+{
+	assert(lm);
+	assert(handles);
+	assert(fds);
+
+	bool ok = true;
+	int old_fds[count];
+
+	uint64_t start_time = get_time_us();
+
+	/* Drop the outcome of the previous reassignment, if it is still
+	 * pending */
+	pthread_mutex_lock(&lm->reassign.lock);
+	uint64_t seq = ++lm->reassign.seq;
+	lm->reassign.done = false;
+	pthread_mutex_unlock(&lm->reassign.lock);
+
+	for (int i = 0; i < count; i++) {
+		struct lease *lease = (struct lease *)handles[i];
+		old_fds[i] = lease->lease_fd;
+		if (lease->is_granted)
+			lm_lease_revoke(lm, handles[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct lease *lease = (struct lease *)handles[i];
+		fds[i] = lease_create_fd(lm, lease);
+		if (fds[i] < 0) {
+			lease_status_update(lm->status, lease->index,
+					    LEASE_STATUS_FAILED);
+			ok = false;
+			continue;
+		}
+		lease->is_granted = true;
+		lease->lease_fd = fds[i];
+		lease_status_update(lm->status, lease->index,
+				    LEASE_STATUS_GRANTED);
+		frame_sampler_start(lm->frame_sampler, lease->index,
+				    lease->crtc_id);
+		if (old_fds[i] >= 0)
+			lease_status_update(lm->status, lease->index,
+					    LEASE_STATUS_TRANSFERRED);
+	}
+
+	struct transition_ctx *ctx =
+	    transition_ctx_create(lm, count, start_time);
+	for (int i = 0; i < count; i++) {
+		struct lease *lease = (struct lease *)handles[i];
+		if (old_fds[i] < 0)
+			continue;
+
+		if (fds[i] >= 0 && ctx) {
+			transition_ctx_add(ctx, lease, old_fds[i]);
+			continue;
+		}
+
+		/* Nothing to wait for */
+		if (old_fds[i] >= 0)
+			close(old_fds[i]);
+		if (fds[i] < 0)
+			lease->lease_fd = -1;
+	}
+
+	if (ctx && ctx->nentries > 0) {
+		ctx->reassign = &lm->reassign;
+		ctx->reassign_seq = seq;
+		start_transition(lm, ctx);
+		return ok;
+	}
+
+	if (ctx)
+		transition_ctx_destroy(ctx);
+
+	/* No display has a previous client to wait for */
+	reassign_report(&lm->reassign, seq, true, get_time_us() - start_time);
+	return ok;
+}
+
+/* Lease resume
+ * Hand out the currently granted lease again, without revoking it, so that
+ * the CRTC state set up by the previous holder is left intact. */
+int lm_lease_resume(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (!lease->is_granted)
+		return -1;
+
+	lease_status_update(lm->status, lease->index, LEASE_STATUS_RESUMED);
+	return lease->lease_fd;
+}
+
+void lm_lease_set_plane_demand(struct lm *lm, struct lease_handle *handle,
+			       const struct lease_plane_demand *demand)
+{
+	assert(lm);
+	assert(handle);
+	assert(demand);
+
+	struct lease *lease = (struct lease *)handle;
+	lease->plane_demand = *demand;
+}
+
+void lm_lease_set_holder(struct lm *lm, struct lease_handle *handle,
+			 pid_t pid)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	lease_status_set_holder(lm->status, lease->index, pid);
+}
+
+void lm_lease_set_admission_stats(struct lm *lm, struct lease_handle *handle,
+				  const struct lease_admission_stats *stats)
+{
+	assert(lm);
+	assert(handle);
+	assert(stats);
+
+	struct lease *lease = (struct lease *)handle;
+	lease_status_set_admission_stats(lm->status, lease->index, stats);
+}
+
+static bool plane_meets_constraints(const struct lease_plane_caps *plane,
+				    const struct lease_constraints *c)
+{
+	if (c->has_plane_type && plane->type != c->plane_type)
+		return false;
+
+	if (c->has_plane_modifier) {
+		for (int i = 0; i < plane->nmodifiers; i++) {
+			const struct dlm_topology_modifier *mod =
+			    &plane->modifiers[i];
+			if (mod->modifier != c->plane_modifier)
+				continue;
+			if (!c->plane_format || mod->format == c->plane_format)
+				return true;
+		}
+		return false;
+	}
+
+	if (c->plane_format) {
+		for (int i = 0; i < plane->nformats; i++) {
+			if (plane->formats[i] == c->plane_format)
+				return true;
+		}
+		return false;
+	}
+	return true;
+}
+
+/* Check the planes dedicated to the CRTC a lease would be granted with */
+static bool lease_find_plane(struct lm *lm, int crtc_index,
+			     const struct lease_constraints *c)
+{
+	if (!c->has_plane_type && !c->plane_format && !c->has_plane_modifier)
+		return true;
+
+	for (int i = 0; i < lm->nplanes; i++) {
+		struct lm_plane *plane = &lm->planes[i];
+		if (plane->possible_crtcs == (1u << crtc_index) &&
+		    plane_meets_constraints(&plane->caps, c))
+			return true;
+	}
+	return false;
+}
+
+/* Check that a free lease can get enough shared planes for a demand, on
+ * the CRTC it would be granted with */
+static bool lease_can_meet_demand(struct lm *lm, struct lease *lease,
+				  int crtc_index,
+				  const struct lease_plane_demand *demand)
+{
+	bool ok = lease_get_shared_planes(lm, lease, crtc_index, demand);
+	lease_put_shared_planes(lease);
+	return ok;
+}
+
+/* Find the smallest mode (in pixels) that meets the constraints.
+ * Returns false if there is none. */
+static bool lease_find_mode(struct lease *lease,
+			    const struct lease_constraints *c, uint64_t *area)
+{
+	*area = 0;
+	if (!c->min_width && !c->min_height && !c->min_refresh)
+		return true;
+
+	bool found = false;
+	for (int i = 0; i < lease->nmodes; i++) {
+		const drmModeModeInfo *mode = &lease->modes[i];
+		if (mode->hdisplay < c->min_width ||
+		    mode->vdisplay < c->min_height ||
+		    mode->vrefresh < c->min_refresh)
+			continue;
+
+		uint64_t mode_area = (uint64_t)mode->hdisplay * mode->vdisplay;
+		if (!found || mode_area < *area)
+			*area = mode_area;
+		found = true;
+	}
+	return found;
+}
+
+/* Lease selection
+ * Of the free leases that meet the constraints, prefer connected outputs,
+ * then the one with the smallest matching mode, so that larger outputs
+ * are left for clients that need them. */
+struct lease_handle *
+lm_select_lease(struct lm *lm, const struct lease_constraints *constraints)
+{
+	assert(lm);
+	assert(constraints);
+
+	struct lease *best = NULL;
+	bool best_connected = false;
+	uint64_t best_area = 0;
+
+	pthread_mutex_lock(&lm->connector_lock);
+
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease *lease = lm->leases[i];
+		bool connected = lease->connection == DRM_MODE_CONNECTED;
+		uint64_t area;
+
+		/* Only display leases are selected */
+		if (lease->is_granted || lease->is_writeback)
+			continue;
+
+		/* Constraints are checked against the CRTC that the grant
+		 * will bind */
+		int crtc_index = lease_next_crtc(lm, lease);
+		if (crtc_index < 0)
+			continue;
+
+		if (constraints->connected && !connected)
+			continue;
+
+		if (!lease_find_mode(lease, constraints, &area))
+			continue;
+
+		if (!lease_find_plane(lm, crtc_index, constraints))
+			continue;
+
+		if (!lease_can_meet_demand(lm, lease, crtc_index,
+					   &constraints->planes))
+			continue;
+
+		if (best && best_connected && !connected)
+			continue;
+
+		if (best && best_connected == connected && area >= best_area)
+			continue;
+
+		best = lease;
+		best_connected = connected;
+		best_area = area;
+	}
+
+	pthread_mutex_unlock(&lm->connector_lock);
+
+	if (!best)
+		return NULL;
+
+	DEBUG_LOG("Lease %s selected\n", best->base.name);
+	return &best->base;
+}
+
+int lm_lease_topology_fd(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	int fd = -1;
+
+	pthread_mutex_lock(&lm->connector_lock);
+
+	if (lease->topology_fd < 0) {
+		const struct lease_plane_caps *planes[lease->nplanes + 1];
+		for (int i = 0; i < lease->nplanes; i++)
+			planes[i] = &lease->planes[i]->caps;
+
+		struct lease_topology_objects objects = {
+		    .connector_id = lease->connector_id,
+		    .crtc_id = lease->crtc_id,
+		    .connection = lease->connection,
+		    .modes = lease->modes,
+		    .nmodes = lease->nmodes,
+		    .planes = planes,
+		    .nplanes = lease->nplanes,
+		    .crtc_props = &lm->crtc_props[lease->crtc_index],
+		    .connector_props = &lease->connector_props,
+		    .boot_fb_id = lease->boot_fb_id,
+		    .boot_mode = &lease->boot_mode,
+		};
+		lease->topology_fd =
+		    lease_topology_create(&objects, lease->topology_buf,
+					  lease->topology_buf_size);
+	}
+
+	if (lease->topology_fd >= 0)
+		fd = fcntl(lease->topology_fd, F_DUPFD_CLOEXEC, 0);
+
+	pthread_mutex_unlock(&lm->connector_lock);
+
+	if (fd < 0)
+		WARN_LOG("Can't describe topology of lease %s\n",
+			 lease->base.name);
+	return fd;
+}
+
+static const char *plane_type_name(uint32_t type)
+{
+	switch (type) {
+	case DRM_PLANE_TYPE_PRIMARY:
+		return "primary";
+	case DRM_PLANE_TYPE_CURSOR:
+		return "cursor";
+	default:
+		return "overlay";
+	}
+}
+
+static void print_plane(FILE *out, const struct lm_plane *plane)
+{
+	fprintf(out, " %u (%s%s)", plane->caps.plane_id,
+		plane_type_name(plane->caps.type),
+		plane->caps.scaling ? ", scaling" : "");
+}
+
+void lm_print_plan(struct lm *lm, FILE *out)
+{
+	assert(lm);
+	assert(out);
+
+	for (int i = 0; i < lm->nleases; i++) {
+		struct lease *lease = lm->leases[i];
+
+		bool connected = lease->connection == DRM_MODE_CONNECTED;
+		fprintf(out, "%s: connector %u (%s%s), CRTC %u",
+			lease->base.name, lease->connector_id,
+			connected ? "connected" : "not connected",
+			lease->is_writeback ? ", writeback" : "",
+			lease->crtc_id);
+		if (lease->possible_crtcs & ~(1u << lease->crtc_index))
+			fprintf(out, " (possible CRTCs 0x%x)",
+				lease->possible_crtcs);
+		if (lease->boot_fb_id)
+			fprintf(out, ", boot mode %ux%u",
+				lease->boot_mode.hdisplay,
+				lease->boot_mode.vdisplay);
+
+		fprintf(out, "\n  planes:");
+		for (int j = 0; j < lease->nfixed_planes; j++)
+			print_plane(out, lease->planes[j]);
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "Shared planes:");
+	for (int i = 0; i < lm->nplanes; i++) {
+		struct lm_plane *plane = &lm->planes[i];
+		if (!plane_is_shared(plane))
+			continue;
+		print_plane(out, plane);
+		fprintf(out, " on CRTCs 0x%x", plane->possible_crtcs);
+	}
+	fprintf(out, "\n");
+
+	for (int i = 0; i < lm->nwritebacks; i++)
+		fprintf(out, "Attached writeback connector %u on CRTCs 0x%x\n",
+			lm->writebacks[i].connector_id,
+			lm->writebacks[i].possible_crtcs);
+}
+
+void lm_lease_revoke(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
 
 	struct lease *lease = (struct lease *)handle;
 
 	if (!lease->is_granted)
 		return;
 
-	drmModeRevokeLease(lm->drm_fd, lease->lessee_id);
+	DRM_CALL(drmModeRevokeLease, lm->drm_fd, lease->lessee_id);
 	cancel_lease_transition_thread(lease);
+	frame_sampler_stop(lm->frame_sampler, lease->index);
 	lease->is_granted = false;
+
+	lease_detach_writeback(lease);
+
+	/* The boot state is only handed to the first client */
+	bool had_boot_state = lease->boot_fb_id != 0;
+	lease_put_boot_state(lease);
+
+	if (lease->nplanes > lease->nfixed_planes || had_boot_state) {
+		lease_put_shared_planes(lease);
+		pthread_mutex_lock(&lm->connector_lock);
+		lease_drop_topology(lease);
+		pthread_mutex_unlock(&lm->connector_lock);
+	}
+	lease_unbind_crtc(lm, lease);
+	lease_status_update(lm->status, lease->index, LEASE_STATUS_REVOKED);
 }
 
 void lm_lease_close(struct lease_handle *handle)
@@ -512,3 +2266,125 @@ void lm_lease_close(struct lease_handle *handle)
 	close(lease->lease_fd);
 	lease->lease_fd = -1;
 }
+
+int lm_lease_export(struct lm *lm, struct lease_handle *handle,
+		    uint32_t *lessee_id)
+{
+	assert(lm);
+	assert(handle);
+	assert(lessee_id);
+
+	struct lease *lease = (struct lease *)handle;
+	if (!lease->is_granted)
+		return -1;
+
+	*lessee_id = lease->lessee_id;
+	return lease->lease_fd;
+}
+
+static int find_crtc_index(struct lm *lm, drmModeObjectListPtr objects)
+{
+	for (uint32_t i = 0; i < objects->count; i++) {
+		for (int j = 0; j < lm->drm_resource->count_crtcs; j++) {
+			if (lm->drm_resource->crtcs[j] == objects->objects[i])
+				return j;
+		}
+	}
+	return -1;
+}
+
+static void lease_adopt_object(struct lm *lm, struct lease *lease,
+			       uint32_t object_id)
+{
+	for (int i = 0; i < lm->nplanes; i++) {
+		struct lm_plane *plane = &lm->planes[i];
+		if (plane->caps.plane_id == object_id &&
+		    plane_is_available(plane, lease->crtc_index)) {
+			lease_take_plane(lease, plane);
+			return;
+		}
+	}
+
+	for (int i = 0; i < lm->nwritebacks; i++) {
+		struct lm_writeback *writeback = &lm->writebacks[i];
+		if (writeback->connector_id == object_id && !writeback->lease) {
+			writeback->lease = lease;
+			lease->writeback = writeback;
+			lease->object_ids[lease->nobject_ids++] = object_id;
+			return;
+		}
+	}
+}
+
+/* Lease adoption
+ * Take over a lease granted by a previous lease manager instance.  The
+ * CRTC and shared planes of the lease are looked up from the objects that
+ * the kernel lists for it. */
+bool lm_lease_adopt(struct lm *lm, struct lease_handle *handle,
+		    uint32_t lessee_id, int lease_fd)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (lease->is_granted)
+		return false;
+
+	drmModeObjectListPtr objects = DRM_CALL(drmModeGetLease, lease_fd);
+	if (!objects) {
+		DEBUG_LOG("drmModeGetLease failed on lease %s: %s\n",
+			  lease->base.name, strerror(errno));
+		return false;
+	}
+
+	int crtc_index = find_crtc_index(lm, objects);
+	if (crtc_index < 0 || !(lm->free_crtcs & (1u << crtc_index))) {
+		ERROR_LOG("Can't adopt lease %s: CRTC not available\n",
+			  lease->base.name);
+		drmFree(objects);
+		return false;
+	}
+
+	/* The client already owns the CRTC state */
+	lease_put_boot_state(lease);
+
+	if (crtc_index != lease->crtc_index)
+		lease_set_crtc(lm, lease, crtc_index);
+	lm->free_crtcs &= ~(1u << crtc_index);
+
+	for (uint32_t i = 0; i < objects->count; i++)
+		lease_adopt_object(lm, lease, objects->objects[i]);
+	drmFree(objects);
+
+	if (lease->nplanes > lease->nfixed_planes) {
+		pthread_mutex_lock(&lm->connector_lock);
+		lease_drop_topology(lease);
+		pthread_mutex_unlock(&lm->connector_lock);
+	}
+
+	lease->lessee_id = lessee_id;
+	lease->lease_fd = lease_fd;
+	lease->is_granted = true;
+	lease_status_update(lm->status, lease->index, LEASE_STATUS_GRANTED);
+	frame_sampler_start(lm->frame_sampler, lease->index, lease->crtc_id);
+	return true;
+}
+
+void lm_lease_disown(struct lm *lm, struct lease_handle *handle)
+{
+	assert(lm);
+	assert(handle);
+
+	struct lease *lease = (struct lease *)handle;
+	if (!lease->is_granted)
+		return;
+
+	cancel_lease_transition_thread(lease);
+	frame_sampler_stop(lm->frame_sampler, lease->index);
+	lease->is_granted = false;
+
+	lease_detach_writeback(lease);
+	lease_put_shared_planes(lease);
+	lease_unbind_crtc(lm, lease);
+	lm_lease_close(handle);
+}
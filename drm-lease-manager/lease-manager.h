@@ -17,15 +17,167 @@
 #define LEASE_MANAGER_H
 #include "drm-lease.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
 struct lm;
 
-struct lm *lm_create(const char *path);
+/* Which cursor planes are added to leases */
+enum lm_cursor_policy {
+	/* Cursor planes of the lease CRTC, and shared ones on demand */
+	LM_CURSOR_DEDICATED,
+	/* Also add a shared cursor plane to leases that have none */
+	LM_CURSOR_ALWAYS,
+	/* Never lease cursor planes */
+	LM_CURSOR_NONE,
+};
+
+/* How writeback connectors are leased */
+enum lm_writeback_mode {
+	/* Writeback connectors are not used */
+	LM_WRITEBACK_NONE,
+	/* Each writeback connector has a lease of its own */
+	LM_WRITEBACK_SEPARATE,
+	/* Writeback connectors are added to display leases on grant */
+	LM_WRITEBACK_ATTACHED,
+};
+
+struct lm_options {
+	/* Enumerate connectors without forcing a probe, and run the
+	 * full probe in the background after startup. */
+	bool fast_enumeration;
+
+	enum lm_cursor_policy cursor_policy;
+	enum lm_writeback_mode writeback;
+
+	/* Let transfers wait for the next vblank of the lease CRTC (see
+	 * lm_lease_wait_vblank()), instead of happening as soon as the
+	 * request arrives. */
+	bool vblank_transfers;
+
+	/* Allocate everything, including the lease transition threads, when
+	 * the lease manager is created, so that no memory is allocated while
+	 * handling requests.  Implies a full connector probe at startup. */
+	bool realtime;
+
+	/* Sample the framebuffers scanned out by the CRTCs of granted
+	 * leases, and publish frame timing in the lease status page. */
+	bool frame_stats;
+
+	/* Log the time spent in each phase of startup, and on each
+	 * connector. */
+	bool profile_startup;
+
+	/* Only plan the leases, to print them: don't publish the status
+	 * page, or start any threads. */
+	bool dry_run;
+};
+
+struct lm *lm_create(const char *path, const struct lm_options *options);
 void lm_destroy(struct lm *lm);
 
 int lm_get_lease_handles(struct lm *lm, struct lease_handle ***lease_handles);
 
 int lm_lease_grant(struct lm *lm, struct lease_handle *lease_handle);
 int lm_lease_transfer(struct lm *lm, struct lease_handle *lease_handle);
+int lm_lease_resume(struct lm *lm, struct lease_handle *lease_handle);
+
+/* Revoke all the given leases, then grant them all, as a single batch.
+ * fds receives the new lease fds, or -1 for leases that could not be
+ * granted.  Returns false if any lease could not be granted.
+ * A LM_EVENT_REASSIGN_DONE follows once the new clients have updated the
+ * displays of the leases. */
+bool lm_lease_reassign(struct lm *lm, struct lease_handle **lease_handles,
+		       int count, int *fds);
+
+/* Lease manager events
+ * Some operations finish after the call that started them.  The fd
+ * returned by lm_get_fd() becomes readable when they may have finished,
+ * and lm_dispatch_events() reports the ones that have, without blocking. */
+enum lm_event_type {
+	LM_EVENT_REASSIGN_DONE,
+	LM_EVENT_VBLANK,
+};
+
+struct lm_event {
+	enum lm_event_type type;
+
+	/* LM_EVENT_VBLANK: Lease whose vblank wait is over */
+	struct lease_handle *lease_handle;
+
+	/* LM_EVENT_REASSIGN_DONE: Time from the start of the reassignment to
+	 * the last display update, and whether all the displays were updated
+	 * before a lease was revoked again */
+	uint32_t switch_time_us;
+	bool switched;
+};
+
+typedef void (*lm_event_handler)(const struct lm_event *event, void *data);
+
+int lm_get_fd(struct lm *lm);
+/* Time in ms until lm_dispatch_events() must be called again, even if the
+ * fd is not readable, or -1 if there is no such deadline */
+int lm_get_timeout(struct lm *lm);
+void lm_dispatch_events(struct lm *lm, lm_event_handler handler, void *data);
+
+/* Wait for the next vblank of the CRTC of a granted lease, before
+ * transferring it.  A LM_EVENT_VBLANK is reported for the lease once the
+ * vblank has arrived, or after a timeout if it doesn't.  Returns false if
+ * vblank transfers are disabled, or the wait could not be queued, in which
+ * case the lease can be transferred right away. */
+bool lm_lease_wait_vblank(struct lm *lm, struct lease_handle *lease_handle);
+
+/* Set the planes needed by the client of a lease.  Shared planes are
+ * added to the lease to meet the demand when it is next granted, and
+ * the grant fails if there are not enough free planes. */
+void lm_lease_set_plane_demand(struct lm *lm,
+			       struct lease_handle *lease_handle,
+			       const struct lease_plane_demand *demand);
+
+/* Record the pid of the client holding a lease in the status page.
+ * A pid of 0 means the lease has no holder. */
+void lm_lease_set_holder(struct lm *lm, struct lease_handle *lease_handle,
+			 pid_t pid);
+
+/* Publish the admission control counters of the socket of a lease in the
+ * status page */
+void lm_lease_set_admission_stats(struct lm *lm,
+				  struct lease_handle *lease_handle,
+				  const struct lease_admission_stats *stats);
+
+/* Find the free lease that best meets a set of constraints.
+ * Returns NULL if no free lease meets them. */
+struct lease_handle *
+lm_select_lease(struct lm *lm, const struct lease_constraints *constraints);
+
+/* Get a sealed memfd describing the objects of a lease.
+ * The returned fd is owned by the caller. */
+int lm_lease_topology_fd(struct lm *lm, struct lease_handle *lease_handle);
+
+/* Print the connector, CRTC and planes of each lease, and the planes
+ * shared between them */
+void lm_print_plan(struct lm *lm, FILE *out);
+
 void lm_lease_revoke(struct lm *lm, struct lease_handle *lease_handle);
 void lm_lease_close(struct lease_handle *lease_handle);
+
+/* Seamless restarts
+ * The DRM master fd and the granted leases are handed over to a new lease
+ * manager instance, which adopts the leases without revoking them. */
+struct lm *lm_create_from_fd(int drm_fd, const struct lm_options *options);
+int lm_get_drm_fd(struct lm *lm);
+
+/* Get the lessee id and fd of a granted lease.  Returns the lease fd, or
+ * -1 if the lease is not granted. */
+int lm_lease_export(struct lm *lm, struct lease_handle *lease_handle,
+		    uint32_t *lessee_id);
+
+/* Adopt a lease granted by the previous instance.  On success, the lease
+ * manager owns lease_fd. */
+bool lm_lease_adopt(struct lm *lm, struct lease_handle *lease_handle,
+		    uint32_t lessee_id, int lease_fd);
+
+/* Forget a lease handed over to the new instance, without revoking it */
+void lm_lease_disown(struct lm *lm, struct lease_handle *lease_handle);
 #endif
@@ -13,9 +13,12 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "lease-server.h"
 
 #include "dlm-protocol.h"
+#include "dlm-trace.h"
+#include "handoff.h"
 #include "log.h"
 #include "socket-path.h"
 
@@ -23,17 +26,29 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SOCK_LOCK_SUFFIX ".lock"
 
+/* CLIENT_QUEUE_LEN
+ * Client sockets are non-blocking.  Messages that can't be sent right
+ * away are queued, and sent once the client socket becomes writable.
+ * A client that does not read its messages within CLIENT_SEND_TIMEOUT_MS
+ * is reported as disconnected. */
+#define CLIENT_QUEUE_LEN 4
+#define CLIENT_SEND_TIMEOUT_MS 1000
+
 /* ACTIVE_CLIENTS
  * An 'active' client is one that either
  *  - owns a lease, or
@@ -46,6 +61,60 @@
  */
 #define ACTIVE_CLIENTS 2
 
+/* SESSION_CLIENTS
+ * A session client (DLM_CAP_SESSION) that released its lease, or whose
+ * lease request failed, stays connected as an idle client, which doesn't
+ * take one of the ACTIVE_CLIENTS slots.  Up to SESSION_CLIENTS idle
+ * clients are kept per server.  An idle client becomes active again with
+ * its next lease request, if an active slot is free.
+ */
+#define SESSION_CLIENTS 2
+#define CLIENT_SLOTS (ACTIVE_CLIENTS + SESSION_CLIENTS)
+
+/* ADMISSION CONTROL
+ * New connections are admitted at a limited rate, so that a client that
+ * reconnects in a loop can't keep the lease manager from serving the
+ * other leases.
+ *
+ * Each server admits SERVER_CONNECT_RATE connections per second, in bursts
+ * of up to SERVER_CONNECT_BURST.  A server that runs out is left out of the
+ * poll set until it can admit a connection again.  New connections wait in
+ * the listen backlog meanwhile, and are refused by the kernel once it is
+ * full, without waking up the lease manager.
+ *
+ * Each peer process (SO_PEERCRED) is admitted PEER_CONNECT_RATE connections
+ * per second over all servers, in bursts of up to PEER_CONNECT_BURST.  The
+ * connections of a peer that runs out are closed as soon as they are
+ * accepted.  PEER_TABLE_LEN peers are tracked at a time.
+ *
+ * epoll reports ready level-triggered sockets in turn, and a single
+ * connection is accepted per event, so each lease socket gets its turn
+ * however many connections are pending on the others. */
+#define SERVER_CONNECT_RATE 10
+#define SERVER_CONNECT_BURST 8
+#define PEER_CONNECT_RATE 20
+#define PEER_CONNECT_BURST 16
+#define PEER_TABLE_LEN 16
+
+/* Token buckets count in thousandths of a connection, so that a bucket
+ * refilled at rate connections per second gains rate tokens per ms */
+#define CONNECTION_TOKENS 1000
+
+/* Capabilities supported by this lease server */
+#define LS_SERVER_CAPS                                                    \
+	(DLM_CAP_RESUME_TOKEN | DLM_CAP_TOPOLOGY | DLM_CAP_LEASE_EVENTS | \
+	 DLM_CAP_SESSION)
+
+struct token_bucket {
+	uint64_t tokens;
+	uint64_t time_ms;
+};
+
+struct ls_peer {
+	pid_t pid;
+	struct token_bucket bucket;
+};
+
 struct ls_socket {
 	int fd;
 	bool is_server;
@@ -59,15 +128,70 @@ struct ls_client {
 	struct ls_socket socket;
 	struct ls_server *serv;
 	bool is_connected;
+	/* Session client without a lease request (see SESSION_CLIENTS) */
+	bool idle;
+
+	/* Process ID of the peer, or 0 if unknown */
+	pid_t pid;
+	uid_t uid;
+
+	/* Negotiated protocol version and capabilities.  The version is 0
+	 * until the first message, and is then only changed by a handshake. */
+	uint16_t version;
+	uint32_t caps;
+
+	/* Sequence number of the request being handled */
+	uint32_t request_seq;
+	/* Trace ID of the request being handled, 0 if it is not traced */
+	uint64_t trace_id;
+
+	/* Constraints of a pending lease selection request */
+	struct lease_constraints constraints;
+
+	/* Planes needed by the client, sent with its lease request */
+	struct lease_plane_demand plane_demand;
+
+	/* Leases of a pending reassignment request, allocated along with the
+	 * admin server */
+	struct lease_handle **plan;
+	int nplan;
+
+	/* outbound message queue */
+	struct dlm_msg queue[CLIENT_QUEUE_LEN];
+	int queue_head;
+	int nqueued;
+	uint64_t send_deadline;
+};
+
+enum ls_server_type {
+	LS_SERVER_LEASE,
+	LS_SERVER_SELECT,
+	LS_SERVER_ADMIN,
+	LS_SERVER_HANDOFF,
 };
 
 struct ls_server {
+	enum ls_server_type type;
+
+	/* NULL for the lease selection and admin servers */
 	struct lease_handle *lease_handle;
 	struct sockaddr_un address;
 	int server_socket_lock;
 
 	struct ls_socket listen;
-	struct ls_client clients[ACTIVE_CLIENTS];
+	struct ls_client clients[CLIENT_SLOTS];
+
+	/* Token given to the client that was last sent the lease fd */
+	struct dlm_resume_token resume_token;
+
+	/* Admission control.  A throttled server is out of the poll set
+	 * until resume_time. */
+	struct token_bucket bucket;
+	bool throttled;
+	uint64_t throttle_start;
+	uint64_t resume_time;
+	struct lease_admission_stats stats;
+	bool stats_changed;
 };
 
 struct ls {
@@ -75,295 +199,1306 @@ struct ls {
 
 	struct ls_server *servers;
 	int nservers;
-};
 
-static void client_connect(struct ls *ls, struct ls_server *serv)
-{
-	int cfd = accept(serv->listen.fd, NULL, NULL);
-	if (cfd < 0) {
-		DEBUG_LOG("accept failed on %s: %s\n", serv->address.sun_path,
-			  strerror(errno));
-		return;
-	}
+	/* Reassignment plans of the admin server clients */
+	struct lease_handle **plans;
 
-	struct ls_client *client = NULL;
+	/* The sockets have been handed over to another instance */
+	bool disowned;
 
-	for (int i = 0; i < ACTIVE_CLIENTS; i++) {
-		if (!serv->clients[i].is_connected) {
-			client = &serv->clients[i];
-			break;
-		}
-	}
-	if (!client) {
-		close(cfd);
-		return;
-	}
+	/* Request trace file, owned by the caller */
+	int trace_fd;
 
-	client->socket.fd = cfd;
+	struct ls_peer peers[PEER_TABLE_LEN];
+	int nthrottled;
+};
 
-	struct epoll_event ev = {
-	    .events = POLLIN,
-	    .data.ptr = &client->socket,
-	};
-	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_ADD, cfd, &ev)) {
-		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
-		close(cfd);
-		return;
+/* Check that a request is handled by a server: lease servers only handle
+ * requests for their own lease, the selection server only handles
+ * selection requests, the admin server only reassignment requests and the
+ * handoff server only handoff requests */
+static bool server_handles_msg(struct ls_server *serv, uint16_t type)
+{
+	switch (type) {
+	case DLM_MSG_HELLO:
+		return true;
+	case DLM_MSG_SELECT_LEASE:
+		return serv->type == LS_SERVER_SELECT;
+	case DLM_MSG_REASSIGN_LEASES:
+		return serv->type == LS_SERVER_ADMIN;
+	case DLM_MSG_HANDOFF:
+		return serv->type == LS_SERVER_HANDOFF;
+	default:
+		return serv->type == LS_SERVER_LEASE;
 	}
-
-	client->is_connected = true;
 }
 
-static int parse_client_request(struct ls_socket *client)
+static uint64_t get_time_ms(void)
 {
-	int ret = -1;
-	struct dlm_client_request hdr;
-	if (!receive_dlm_client_request(client->fd, &hdr))
-		return ret;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	switch (hdr.opcode) {
-	case DLM_GET_LEASE:
-		ret = LS_REQ_GET_LEASE;
-		break;
-	case DLM_RELEASE_LEASE:
-		ret = LS_REQ_RELEASE_LEASE;
-		break;
-	default:
-		ERROR_LOG("Unexpected client request received\n");
-		break;
-	};
+static void bucket_refill(struct token_bucket *bucket, uint32_t rate,
+			  uint32_t burst, uint64_t now)
+{
+	uint64_t max = (uint64_t)burst * CONNECTION_TOKENS;
+	uint64_t tokens = bucket->tokens + (now - bucket->time_ms) * rate;
 
-	return ret;
+	bucket->tokens = tokens < max ? tokens : max;
+	bucket->time_ms = now;
 }
 
-static int create_socket_lock(struct sockaddr_un *addr)
+static bool bucket_take(struct token_bucket *bucket, uint32_t rate,
+			uint32_t burst, uint64_t now)
 {
-	int lock_fd;
+	bucket_refill(bucket, rate, burst, now);
+	if (bucket->tokens < CONNECTION_TOKENS)
+		return false;
 
-	int lockfile_len = sizeof(addr->sun_path) + sizeof(SOCK_LOCK_SUFFIX);
-	char lockfile[lockfile_len];
-	int len = snprintf(lockfile, lockfile_len, "%s%s", addr->sun_path,
-			   SOCK_LOCK_SUFFIX);
+	bucket->tokens -= CONNECTION_TOKENS;
+	return true;
+}
 
-	if (len < 0 || len >= lockfile_len) {
-		DEBUG_LOG("Can't create socket lock filename\n");
-		return -1;
-	}
+/* Time until a connection can be taken from the bucket, in ms */
+static uint64_t bucket_wait_time(const struct token_bucket *bucket,
+				 uint32_t rate)
+{
+	if (bucket->tokens >= CONNECTION_TOKENS)
+		return 0;
+	return (CONNECTION_TOKENS - bucket->tokens + rate - 1) / rate;
+}
 
-	lock_fd = open(lockfile, O_CREAT | O_RDWR,
-		       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+/* Find the bucket of a peer.  A peer that is not tracked yet replaces the
+ * one with the most tokens left: the peers worth tracking are the ones
+ * running out. */
+static struct token_bucket *find_peer_bucket(struct ls *ls, pid_t pid,
+					     uint64_t now)
+{
+	struct ls_peer *replaced = &ls->peers[0];
 
-	if (lock_fd < 0) {
-		ERROR_LOG("Cannot access runtime directory\n");
-		return -1;
-	}
+	for (int i = 0; i < PEER_TABLE_LEN; i++) {
+		struct ls_peer *peer = &ls->peers[i];
+		if (peer->pid == pid)
+			return &peer->bucket;
 
-	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
-		ERROR_LOG(
-		    "socket %s: in use.  Possible duplicate lease name or "
-		    "mutiple drm-lease-manager instances running\n",
-		    addr->sun_path);
-		close(lock_fd);
-		return -1;
+		bucket_refill(&peer->bucket, PEER_CONNECT_RATE,
+			      PEER_CONNECT_BURST, now);
+		if (peer->bucket.tokens > replaced->bucket.tokens)
+			replaced = peer;
 	}
 
-	return lock_fd;
+	replaced->pid = pid;
+	replaced->bucket.tokens = PEER_CONNECT_BURST * CONNECTION_TOKENS;
+	replaced->bucket.time_ms = now;
+	return &replaced->bucket;
 }
 
-static bool server_setup(struct ls *ls, struct ls_server *serv,
-			 struct lease_handle *lease_handle)
+static bool server_set_polled(struct ls *ls, struct ls_server *serv,
+			      bool polled)
 {
-	struct sockaddr_un *address = &serv->address;
-
-	if (!sockaddr_set_lease_server_path(address, lease_handle->name))
+	struct epoll_event ev = {
+	    .events = polled ? POLLIN : 0,
+	    .data.ptr = &serv->listen,
+	};
+	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_MOD, serv->listen.fd, &ev)) {
+		DEBUG_LOG("epoll_ctl mod failed: %s\n", strerror(errno));
 		return false;
+	}
+	return true;
+}
 
-	int socket_lock = create_socket_lock(address);
-	if (socket_lock < 0)
-		return false;
+static void server_throttle(struct ls *ls, struct ls_server *serv,
+			    uint64_t now)
+{
+	if (!server_set_polled(ls, serv, false))
+		return;
 
-	/* The socket address is now owned by this instance, so any existing
-	 * sockets can safely be removed */
-	unlink(address->sun_path);
+	serv->throttled = true;
+	serv->throttle_start = now;
+	serv->resume_time =
+	    now + bucket_wait_time(&serv->bucket, SERVER_CONNECT_RATE);
+	ls->nthrottled++;
+}
 
-	address->sun_family = AF_UNIX;
+/* Put the throttled servers that can admit a connection again back in
+ * the poll set */
+static void resume_servers(struct ls *ls)
+{
+	if (ls->nthrottled == 0)
+		return;
 
-	int server_socket = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
-	if (server_socket < 0) {
-		DEBUG_LOG("Socket creation failed: %s\n", strerror(errno));
-		return false;
-	}
+	uint64_t now = get_time_ms();
+	for (int i = 0; i < ls->nservers; i++) {
+		struct ls_server *serv = &ls->servers[i];
+		if (!serv->throttled || serv->resume_time > now)
+			continue;
+		if (!server_set_polled(ls, serv, true))
+			continue;
 
-	if (bind(server_socket, (struct sockaddr *)address, sizeof(*address))) {
-		ERROR_LOG("Failed to create named socket at %s: %s\n",
-			  address->sun_path, strerror(errno));
-		close(server_socket);
-		return false;
+		serv->throttled = false;
+		serv->stats.throttle_time_ms += now - serv->throttle_start;
+		serv->stats_changed = true;
+		ls->nthrottled--;
 	}
+}
 
-	if (listen(server_socket, 0)) {
-		DEBUG_LOG("listen failed on %s: %s\n", address->sun_path,
-			  strerror(errno));
-		close(server_socket);
-		unlink(address->sun_path);
+static bool client_set_events(struct ls *ls, struct ls_client *client,
+			      uint32_t events)
+{
+	struct epoll_event ev = {
+	    .events = events,
+	    .data.ptr = &client->socket,
+	};
+	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_MOD, client->socket.fd, &ev)) {
+		DEBUG_LOG("epoll_ctl mod failed: %s\n", strerror(errno));
 		return false;
 	}
+	return true;
+}
 
-	for (int i = 0; i < ACTIVE_CLIENTS; i++) {
-		struct ls_client *client = &serv->clients[i];
-		client->serv = serv;
-		client->socket.client = client;
+static bool client_queue_msg(struct ls *ls, struct ls_client *client,
+			     const struct dlm_msg *msg)
+{
+	if (client->nqueued == CLIENT_QUEUE_LEN) {
+		DEBUG_LOG("Send queue full on %s\n",
+			  client->serv->address.sun_path);
+		errno = ENOBUFS;
+		return false;
 	}
 
-	serv->lease_handle = lease_handle;
-	serv->server_socket_lock = socket_lock;
-
-	serv->listen.fd = server_socket;
-	serv->listen.server = serv;
-	serv->listen.is_server = true;
+	int tail = (client->queue_head + client->nqueued) % CLIENT_QUEUE_LEN;
+	struct dlm_msg *queued = &client->queue[tail];
+	*queued = *msg;
 
-	struct epoll_event ev = {
-	    .events = POLLIN,
-	    .data.ptr = &serv->listen,
-	};
+	/* The caller may close its fds before the message is sent */
+	for (int i = 0; i < msg->nfds; i++) {
+		queued->fds[i] = fcntl(msg->fds[i], F_DUPFD_CLOEXEC, 0);
+		if (queued->fds[i] < 0) {
+			queued->nfds = i;
+			goto err;
+		}
+	}
 
-	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_ADD, server_socket, &ev)) {
-		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
-		close(server_socket);
-		unlink(address->sun_path);
-		return false;
+	if (client->nqueued == 0) {
+		if (!client_set_events(ls, client, POLLIN | POLLOUT))
+			goto err;
+		client->send_deadline = get_time_ms() + CLIENT_SEND_TIMEOUT_MS;
 	}
 
-	INFO_LOG("Lease server (%s) initialized at %s\n", lease_handle->name,
-		 address->sun_path);
+	client->nqueued++;
 	return true;
+err:
+	dlm_msg_close_fds(queued);
+	return false;
 }
 
-static void server_shutdown(struct ls *ls, struct ls_server *serv)
+static void client_dequeue(struct ls_client *client)
 {
-	if (unlink(serv->address.sun_path)) {
-		WARN_LOG("Server socket %s delete failed: %s\n",
-			 serv->address.sun_path, strerror(errno));
-	}
+	dlm_msg_close_fds(&client->queue[client->queue_head]);
 
-	epoll_ctl(ls->epoll_fd, EPOLL_CTL_DEL, serv->listen.fd, NULL);
-	close(serv->listen.fd);
+	client->queue_head = (client->queue_head + 1) % CLIENT_QUEUE_LEN;
+	client->nqueued--;
+}
 
-	for (int i = 0; i < ACTIVE_CLIENTS; i++)
-		ls_disconnect_client(ls, &serv->clients[i]);
+static bool client_send_msg(struct ls_client *client, const struct dlm_msg *msg)
+{
+	if (client->version >= 2)
+		return dlm_send_msg(client->socket.fd, msg);
+
+	/* Version 1 clients are only ever sent the lease fd.  Anything else
+	 * is answered by closing the connection, which is then reported as a
+	 * disconnect. */
+	if (msg->nfds == 0) {
+		shutdown(client->socket.fd, SHUT_RDWR);
+		return true;
+	}
 
-	close(serv->server_socket_lock);
+	struct dlm_resume_token token;
+	const void *data =
+	    dlm_msg_get_attr(msg, DLM_ATTR_RESUME_TOKEN, NULL);
+	if (data)
+		memcpy(&token, data, sizeof(token));
+
+	return send_lease_fd(client->socket.fd, msg->fds[0],
+			     data ? &token : NULL);
 }
 
-struct ls *ls_create(struct lease_handle **lease_handles, int count)
+static bool client_flush_queue(struct ls *ls, struct ls_client *client)
 {
-	assert(lease_handles);
-	assert(count > 0);
-
-	struct ls *ls = calloc(1, sizeof(struct ls));
-	if (!ls) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		return NULL;
+	while (client->nqueued > 0) {
+		struct dlm_msg *msg = &client->queue[client->queue_head];
+		if (!client_send_msg(client, msg)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+
+			DEBUG_LOG("sendmsg failed on %s: %s\n",
+				  client->serv->address.sun_path,
+				  strerror(errno));
+			return false;
+		}
+		client_dequeue(client);
+		client->send_deadline = get_time_ms() + CLIENT_SEND_TIMEOUT_MS;
 	}
 
-	ls->servers = calloc(count, sizeof(struct ls_server));
-	if (!ls->servers) {
-		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
-		goto err;
-	}
+	return client_set_events(ls, client, POLLIN);
+}
 
-	ls->epoll_fd = epoll_create1(0);
-	if (ls->epoll_fd < 0) {
-		DEBUG_LOG("epoll_create failed: %s\n", strerror(errno));
-		goto err;
+static bool client_send(struct ls *ls, struct ls_client *client,
+			const struct dlm_msg *msg)
+{
+	/* Send right away if possible, without blocking on clients
+	 * that are slow to read their messages */
+	if (client->nqueued == 0) {
+		if (client_send_msg(client, msg))
+			return true;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			DEBUG_LOG("sendmsg failed on %s: %s\n",
+				  client->serv->address.sun_path,
+				  strerror(errno));
+			return false;
+		}
 	}
 
-	for (int i = 0; i < count; i++) {
-		if (!server_setup(ls, &ls->servers[i], lease_handles[i]))
-			goto err;
-		ls->nservers++;
-	}
-	return ls;
-err:
-	ls_destroy(ls);
-	return NULL;
+	return client_queue_msg(ls, client, msg);
 }
 
-void ls_destroy(struct ls *ls)
+static bool client_send_status(struct ls *ls, struct ls_client *client,
+			       uint32_t seq, enum dlm_status status)
 {
-	assert(ls);
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, seq);
 
-	for (int i = 0; i < ls->nservers; i++)
-		server_shutdown(ls, &ls->servers[i]);
+	if (!dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, status))
+		return false;
 
-	close(ls->epoll_fd);
-	free(ls->servers);
-	free(ls);
+	return client_send(ls, client, &reply);
 }
 
-bool ls_get_request(struct ls *ls, struct ls_req *req)
+/* Get the time until the earliest send timeout of any client, or until a
+ * throttled server can admit connections again, in ms.  -1 if no clients
+ * have queued messages, and no servers are throttled. */
+static int get_timeout(struct ls *ls)
 {
-	assert(ls);
-	assert(req);
+	int timeout = -1;
+	uint64_t now = get_time_ms();
+
+	for (int i = 0; i < ls->nservers; i++) {
+		struct ls_server *serv = &ls->servers[i];
+		if (serv->throttled) {
+			int remaining = 0;
+			if (serv->resume_time > now)
+				remaining = serv->resume_time - now;
+
+			if (timeout < 0 || remaining < timeout)
+				timeout = remaining;
+		}
 
-	int request = -1;
-	while (request < 0) {
-		struct epoll_event ev;
-		if (epoll_wait(ls->epoll_fd, &ev, 1, -1) < 0) {
-			if (errno == EINTR)
+		for (int j = 0; j < CLIENT_SLOTS; j++) {
+			struct ls_client *client = &ls->servers[i].clients[j];
+			if (!client->is_connected || client->nqueued == 0)
 				continue;
-			DEBUG_LOG("epoll_wait failed: %s\n", strerror(errno));
-			return false;
-		}
 
-		struct ls_socket *sock = ev.data.ptr;
-		assert(sock);
+			int remaining = 0;
+			if (client->send_deadline > now)
+				remaining = client->send_deadline - now;
 
-		if (sock->is_server) {
-			if (ev.events & POLLIN)
-				client_connect(ls, sock->server);
-			continue;
+			if (timeout < 0 || remaining < timeout)
+				timeout = remaining;
 		}
+	}
+	return timeout;
+}
 
-		if (ev.events & POLLIN)
-			request = parse_client_request(sock);
-
-		if (request < 0 && (ev.events & POLLHUP))
-			request = LS_REQ_CLIENT_DISCONNECT;
+static struct ls_client *find_stalled_client(struct ls *ls)
+{
+	uint64_t now = get_time_ms();
+
+	for (int i = 0; i < ls->nservers; i++) {
+		for (int j = 0; j < CLIENT_SLOTS; j++) {
+			struct ls_client *client = &ls->servers[i].clients[j];
+			if (client->is_connected && client->nqueued > 0 &&
+			    client->send_deadline <= now)
+				return client;
+		}
+	}
+	return NULL;
+}
 
-		struct ls_client *client = sock->client;
-		struct ls_server *server = client->serv;
+static int count_clients(struct ls_server *serv, bool idle)
+{
+	int count = 0;
 
-		req->lease_handle = server->lease_handle;
-		req->client = client;
-		req->type = request;
+	for (int i = 0; i < CLIENT_SLOTS; i++) {
+		struct ls_client *client = &serv->clients[i];
+		if (client->is_connected && client->idle == idle)
+			count++;
 	}
-	return true;
+	return count;
 }
 
-bool ls_send_fd(struct ls *ls, struct ls_client *client, int fd)
+/* Get a free slot for a new active client, or NULL if the server already
+ * has ACTIVE_CLIENTS of them */
+static struct ls_client *find_free_client(struct ls_server *serv)
 {
-	assert(ls);
-	assert(client);
+	if (count_clients(serv, false) >= ACTIVE_CLIENTS)
+		return NULL;
 
-	struct ls_server *serv = client->serv;
+	for (int i = 0; i < CLIENT_SLOTS; i++) {
+		if (!serv->clients[i].is_connected)
+			return &serv->clients[i];
+	}
+	return NULL;
+}
 
-	if (fd < 0)
-		return false;
+static void client_connect(struct ls *ls, struct ls_server *serv)
+{
+	uint64_t now = get_time_ms();
+	if (!bucket_take(&serv->bucket, SERVER_CONNECT_RATE,
+			 SERVER_CONNECT_BURST, now)) {
+		server_throttle(ls, serv, now);
+		return;
+	}
 
-	if (!send_lease_fd(client->socket.fd, fd)) {
-		DEBUG_LOG("sendmsg failed on %s: %s\n", serv->address.sun_path,
+	int cfd = accept4(serv->listen.fd, NULL, NULL,
+			  SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0) {
+		DEBUG_LOG("accept failed on %s: %s\n", serv->address.sun_path,
 			  strerror(errno));
-		return false;
+		return;
 	}
 
-	if (fd > 0)
-		INFO_LOG("Lease request granted on %s\n",
-			 serv->address.sun_path);
+	serv->stats.connections++;
+	serv->stats_changed = true;
+
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len)) {
+		DEBUG_LOG("Cannot get client credentials: %s\n",
+			  strerror(errno));
+		cred.pid = 0;
+		cred.uid = (uid_t)-1;
+	}
+
+	if (cred.pid > 0 &&
+	    !bucket_take(find_peer_bucket(ls, cred.pid, now),
+			 PEER_CONNECT_RATE, PEER_CONNECT_BURST, now))
+		goto shed;
+
+	struct ls_client *client = find_free_client(serv);
+	if (!client)
+		goto shed;
+
+	client->socket.fd = cfd;
+	client->pid = cred.pid;
+	client->uid = cred.uid;
+	client->version = 0;
+	client->caps = 0;
+	client->queue_head = 0;
+	client->nqueued = 0;
+
+	struct epoll_event ev = {
+	    .events = POLLIN,
+	    .data.ptr = &client->socket,
+	};
+	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_ADD, cfd, &ev)) {
+		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
+		close(cfd);
+		return;
+	}
+
+	client->is_connected = true;
+	return;
+
+shed:
+	serv->stats.shed++;
+	serv->stats_changed = true;
+	close(cfd);
+}
+
+static void generate_resume_token(struct dlm_resume_token *token)
+{
+	size_t len = sizeof(token->data);
+
+	if (getrandom(token->data, len, GRND_NONBLOCK) == (ssize_t)len)
+		return;
+
+	/* The entropy pool may not be initialized yet this early in boot.
+	 * Fall back to /dev/urandom, which never blocks. */
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		ssize_t ret = read(fd, token->data, len);
+		close(fd);
+		if (ret == (ssize_t)len)
+			return;
+	}
+
+	DEBUG_LOG("Cannot generate resume token\n");
+	memset(token, 0, sizeof(*token));
+}
+
+static bool resume_token_matches(struct ls_server *serv,
+				 const struct dlm_resume_token *token)
+{
+	if (!dlm_resume_token_is_valid(&serv->resume_token))
+		return false;
+
+	uint8_t diff = 0;
+	for (int i = 0; i < DLM_RESUME_TOKEN_LEN; i++)
+		diff |= serv->resume_token.data[i] ^ token->data[i];
+
+	return diff == 0;
+}
+
+static bool handle_hello(struct ls *ls, struct ls_client *client,
+			 const struct dlm_msg *msg)
+{
+	uint32_t version;
+	uint32_t caps = 0;
+
+	if (!dlm_msg_get_u32(msg, DLM_ATTR_VERSION, &version)) {
+		return client_send_status(ls, client, msg->hdr.seq,
+					  DLM_STATUS_INVALID_REQUEST);
+	}
+
+	if (version > DLM_PROTOCOL_VERSION)
+		version = DLM_PROTOCOL_VERSION;
+
+	if (version < 2) {
+		return client_send_status(ls, client, msg->hdr.seq,
+					  DLM_STATUS_UNSUPPORTED_VERSION);
+	}
+
+	dlm_msg_get_u32(msg, DLM_ATTR_CAPS, &caps);
+	client->version = version;
+	client->caps = caps & LS_SERVER_CAPS;
+
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, msg->hdr.seq);
+	if (!dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, DLM_STATUS_OK) ||
+	    !dlm_msg_add_u32(&reply, DLM_ATTR_VERSION, client->version) ||
+	    !dlm_msg_add_u32(&reply, DLM_ATTR_CAPS, client->caps))
+		return false;
+
+	return client_send(ls, client, &reply);
+}
+
+static bool get_resume_token(const struct dlm_msg *msg,
+			     struct dlm_resume_token *token)
+{
+	size_t len;
+	const void *data = dlm_msg_get_attr(msg, DLM_ATTR_RESUME_TOKEN, &len);
+	if (!data || len != sizeof(*token))
+		return false;
+
+	memcpy(token, data, sizeof(*token));
+	return true;
+}
+
+static void get_plane_demand(const struct dlm_msg *msg,
+			     struct lease_plane_demand *demand)
+{
+	memset(demand, 0, sizeof(*demand));
+
+	dlm_msg_get_u32(msg, DLM_ATTR_OVERLAY_PLANES, &demand->overlay);
+	dlm_msg_get_u32(msg, DLM_ATTR_CURSOR_PLANES, &demand->cursor);
+	dlm_msg_get_u32(msg, DLM_ATTR_SCALING_PLANES, &demand->scaling);
+}
+
+static void get_trace_id(struct ls *ls, struct ls_client *client,
+			 const struct dlm_msg *msg)
+{
+	size_t len;
+	const void *id = dlm_msg_get_attr(msg, DLM_ATTR_TRACE_ID, &len);
+
+	client->trace_id = 0;
+	if (id && len == sizeof(client->trace_id))
+		memcpy(&client->trace_id, id, len);
+
+	dlm_trace_record(ls->trace_fd, client->trace_id,
+			 DLM_TRACE_SERVER_RECEIVED);
+}
+
+static void get_constraints(const struct dlm_msg *msg,
+			    struct lease_constraints *constraints)
+{
+	uint32_t flags = 0;
+	size_t len;
+
+	memset(constraints, 0, sizeof(*constraints));
+
+	dlm_msg_get_u32(msg, DLM_ATTR_SELECT_FLAGS, &flags);
+	constraints->connected = flags & DLM_SELECT_CONNECTED;
+
+	dlm_msg_get_u32(msg, DLM_ATTR_MIN_WIDTH, &constraints->min_width);
+	dlm_msg_get_u32(msg, DLM_ATTR_MIN_HEIGHT, &constraints->min_height);
+	dlm_msg_get_u32(msg, DLM_ATTR_MIN_REFRESH, &constraints->min_refresh);
+
+	constraints->has_plane_type = dlm_msg_get_u32(
+	    msg, DLM_ATTR_PLANE_TYPE, &constraints->plane_type);
+	dlm_msg_get_u32(msg, DLM_ATTR_PLANE_FORMAT,
+			&constraints->plane_format);
+
+	const void *modifier =
+	    dlm_msg_get_attr(msg, DLM_ATTR_PLANE_MODIFIER, &len);
+	if (modifier && len == sizeof(constraints->plane_modifier)) {
+		memcpy(&constraints->plane_modifier, modifier, len);
+		constraints->has_plane_modifier = true;
+	}
+
+	get_plane_demand(msg, &constraints->planes);
+}
+
+static struct ls_server *find_lease_server(struct ls *ls, const char *name)
+{
+	for (int i = 0; i < ls->nservers; i++) {
+		struct lease_handle *lease_handle = ls->servers[i].lease_handle;
+		if (lease_handle && !strcmp(lease_handle->name, name))
+			return &ls->servers[i];
+	}
+	return NULL;
+}
+
+/* Look up the leases listed in a reassignment request */
+static bool get_reassign_plan(struct ls *ls, struct ls_client *client,
+			      const struct dlm_msg *msg)
+{
+	size_t len;
+	const char *list = dlm_msg_get_attr(msg, DLM_ATTR_LEASE_LIST, &len);
+	if (!list || len == 0 || list[len - 1] != '\0')
+		return false;
+
+	client->nplan = 0;
+	for (const char *name = list; name < list + len;
+	     name += strlen(name) + 1) {
+		struct ls_server *serv = find_lease_server(ls, name);
+		if (!serv) {
+			DEBUG_LOG("Unknown lease in reassignment: %s\n", name);
+			return false;
+		}
+
+		for (int i = 0; i < client->nplan; i++) {
+			if (client->plan[i] == serv->lease_handle) {
+				DEBUG_LOG("Duplicate lease in reassignment: "
+					  "%s\n",
+					  name);
+				return false;
+			}
+		}
+		client->plan[client->nplan++] = serv->lease_handle;
+	}
+	return true;
+}
+
+static int reject_client_request(struct ls *ls, struct ls_client *client,
+				 uint32_t seq)
+{
+	ERROR_LOG("Unexpected client request received\n");
+
+	/* Version 1 clients are notified by closing the connection */
+	if (client->version < 2 ||
+	    !client_send_status(ls, client, seq, DLM_STATUS_INVALID_REQUEST))
+		return LS_REQ_CLIENT_DISCONNECT;
+
+	return -1;
+}
+
+/* An idle session client can only request the lease again once an active
+ * slot is free.  Returns false if the request was refused. */
+static bool activate_client(struct ls *ls, struct ls_client *client,
+			    uint32_t seq)
+{
+	if (!client->idle)
+		return true;
+
+	if (count_clients(client->serv, false) >= ACTIVE_CLIENTS) {
+		DEBUG_LOG("No active client slot on %s\n",
+			  client->serv->address.sun_path);
+		client_send_status(ls, client, seq, DLM_STATUS_LEASE_BUSY);
+		return false;
+	}
+
+	client->idle = false;
+	return true;
+}
+
+/* Returns the request type, or -1 if the message did not result in a
+ * request for the lease manager (e.g. it was handled by the server) */
+static int parse_client_request(struct ls *ls, struct ls_client *client)
+{
+	int ret = -1;
+	struct ls_server *serv = client->serv;
+	struct dlm_msg msg;
+	if (!dlm_receive_msg(client->socket.fd, &msg)) {
+		if (errno == EPROTO)
+			ERROR_LOG("Malformed client request received\n");
+		return ret;
+	}
+
+	/* Clients have no reason to send fds */
+	dlm_msg_close_fds(&msg);
+
+	if (!client->version) {
+		client->version = msg.hdr.version < DLM_PROTOCOL_VERSION
+				      ? msg.hdr.version
+				      : DLM_PROTOCOL_VERSION;
+	}
+
+	struct dlm_resume_token token;
+
+	if (!server_handles_msg(serv, msg.hdr.type))
+		return reject_client_request(ls, client, msg.hdr.seq);
+
+	switch (msg.hdr.type) {
+	case DLM_MSG_HELLO:
+		if (!handle_hello(ls, client, &msg))
+			ret = LS_REQ_CLIENT_DISCONNECT;
+		break;
+	case DLM_MSG_GET_LEASE:
+		if (!activate_client(ls, client, msg.hdr.seq))
+			break;
+		client->request_seq = msg.hdr.seq;
+		get_trace_id(ls, client, &msg);
+		get_plane_demand(&msg, &client->plane_demand);
+		ret = LS_REQ_GET_LEASE;
+		break;
+	case DLM_MSG_RESUME_LEASE:
+		if (!activate_client(ls, client, msg.hdr.seq))
+			break;
+		client->request_seq = msg.hdr.seq;
+		get_trace_id(ls, client, &msg);
+		get_plane_demand(&msg, &client->plane_demand);
+		/* Requests with an invalid or stale token are handled as
+		 * regular lease requests. */
+		if (get_resume_token(&msg, &token) &&
+		    resume_token_matches(serv, &token)) {
+			ret = LS_REQ_RESUME_LEASE;
+		} else {
+			DEBUG_LOG("Invalid resume token on %s\n",
+				  serv->address.sun_path);
+			ret = LS_REQ_GET_LEASE;
+		}
+		break;
+	case DLM_MSG_RELEASE_LEASE:
+		ret = LS_REQ_RELEASE_LEASE;
+		break;
+	case DLM_MSG_SELECT_LEASE:
+		client->request_seq = msg.hdr.seq;
+		get_trace_id(ls, client, &msg);
+		get_constraints(&msg, &client->constraints);
+		client->plane_demand = client->constraints.planes;
+		ret = LS_REQ_SELECT_LEASE;
+		break;
+	case DLM_MSG_REASSIGN_LEASES:
+		client->request_seq = msg.hdr.seq;
+		if (get_reassign_plan(ls, client, &msg)) {
+			ret = LS_REQ_REASSIGN_LEASES;
+		} else {
+			ret = reject_client_request(ls, client, msg.hdr.seq);
+		}
+		break;
+	case DLM_MSG_HANDOFF:
+		/* The handoff includes the DRM master fd, so only hand it to
+		 * processes running as the same user */
+		client->request_seq = msg.hdr.seq;
+		if (client->uid == geteuid()) {
+			ret = LS_REQ_HANDOFF;
+		} else {
+			ret = reject_client_request(ls, client, msg.hdr.seq);
+		}
+		break;
+	default:
+		ret = reject_client_request(ls, client, msg.hdr.seq);
+		break;
+	};
+
+	return ret;
+}
+
+static int create_socket_lock(struct sockaddr_un *addr)
+{
+	int lock_fd;
+
+	int lockfile_len = sizeof(addr->sun_path) + sizeof(SOCK_LOCK_SUFFIX);
+	char lockfile[lockfile_len];
+	int len = snprintf(lockfile, lockfile_len, "%s%s", addr->sun_path,
+			   SOCK_LOCK_SUFFIX);
+
+	if (len < 0 || len >= lockfile_len) {
+		DEBUG_LOG("Can't create socket lock filename\n");
+		return -1;
+	}
+
+	lock_fd = open(lockfile, O_CREAT | O_RDWR,
+		       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+	if (lock_fd < 0) {
+		ERROR_LOG("Cannot access runtime directory\n");
+		return -1;
+	}
+
+	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		ERROR_LOG(
+		    "socket %s: in use.  Possible duplicate lease name or "
+		    "mutiple drm-lease-manager instances running\n",
+		    addr->sun_path);
+		close(lock_fd);
+		return -1;
+	}
+
+	return lock_fd;
+}
+
+/* Get the address of a socket with a '.' prepended to its file name.
+ * Returns false if it doesn't fit. */
+static bool hidden_socket_address(struct sockaddr_un *dest,
+				  const struct sockaddr_un *address)
+{
+	const char *path = address->sun_path;
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+
+	int dir_len = name - path;
+	int len = snprintf(dest->sun_path, sizeof(dest->sun_path), "%.*s.%s",
+			   dir_len, path, name);
+	if (len < 0 || len >= (int)sizeof(dest->sun_path))
+		return false;
+
+	dest->sun_family = AF_UNIX;
+	return true;
+}
+
+/* Create the listening socket of a server, and lock its address */
+static int server_create_socket(struct sockaddr_un *address, int *socket_lock)
+{
+	*socket_lock = create_socket_lock(address);
+	if (*socket_lock < 0)
+		return -1;
+
+	/* The socket address is now owned by this instance, so any existing
+	 * sockets can safely be removed */
+	unlink(address->sun_path);
+
+	/* Bind to a hidden name, and only move the socket into place once
+	 * it is listening.  Clients waiting for the socket to appear can
+	 * then connect as soon as they see it. */
+	struct sockaddr_un bind_address;
+	if (!hidden_socket_address(&bind_address, address))
+		bind_address = *address;
+
+	int server_socket = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+	if (server_socket < 0) {
+		DEBUG_LOG("Socket creation failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	unlink(bind_address.sun_path);
+	if (bind(server_socket, (struct sockaddr *)&bind_address,
+		 sizeof(bind_address))) {
+		ERROR_LOG("Failed to create named socket at %s: %s\n",
+			  bind_address.sun_path, strerror(errno));
+		close(server_socket);
+		return -1;
+	}
+
+	if (listen(server_socket, 0)) {
+		DEBUG_LOG("listen failed on %s: %s\n", bind_address.sun_path,
+			  strerror(errno));
+		goto err;
+	}
+
+	if (strcmp(bind_address.sun_path, address->sun_path) &&
+	    rename(bind_address.sun_path, address->sun_path)) {
+		ERROR_LOG("Failed to create named socket at %s: %s\n",
+			  address->sun_path, strerror(errno));
+		goto err;
+	}
+	return server_socket;
+
+err:
+	close(server_socket);
+	unlink(bind_address.sun_path);
+	return -1;
+}
+
+static bool server_setup(struct ls *ls, struct ls_server *serv,
+			 const char *name, enum ls_server_type type,
+			 struct lease_handle *lease_handle,
+			 struct handoff *handoff)
+{
+	struct sockaddr_un *address = &serv->address;
+
+	if (!sockaddr_set_lease_server_path(address, name))
+		return false;
+
+	address->sun_family = AF_UNIX;
+
+	/* Take over the socket, and its lock, from the previous instance */
+	struct handoff_server *handed_over =
+	    handoff ? handoff_find_server(handoff, name) : NULL;
+
+	int socket_lock;
+	int server_socket;
+	if (handed_over) {
+		socket_lock = handed_over->lock_fd;
+		server_socket = handed_over->listen_fd;
+		handed_over->lock_fd = -1;
+		handed_over->listen_fd = -1;
+	} else {
+		server_socket = server_create_socket(address, &socket_lock);
+		if (server_socket < 0)
+			return false;
+	}
+
+	for (int i = 0; i < CLIENT_SLOTS; i++) {
+		struct ls_client *client = &serv->clients[i];
+		client->serv = serv;
+		client->socket.client = client;
+	}
+
+	serv->type = type;
+	serv->lease_handle = lease_handle;
+	serv->server_socket_lock = socket_lock;
+
+	serv->listen.fd = server_socket;
+	serv->listen.server = serv;
+	serv->listen.is_server = true;
+
+	serv->bucket.tokens = SERVER_CONNECT_BURST * CONNECTION_TOKENS;
+	serv->bucket.time_ms = get_time_ms();
+
+	struct epoll_event ev = {
+	    .events = POLLIN,
+	    .data.ptr = &serv->listen,
+	};
+
+	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_ADD, server_socket, &ev)) {
+		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
+		close(server_socket);
+		unlink(address->sun_path);
+		return false;
+	}
+
+	INFO_LOG("Lease server (%s) initialized at %s\n", name,
+		 address->sun_path);
+	return true;
+}
+
+static void server_shutdown(struct ls *ls, struct ls_server *serv)
+{
+	if (!ls->disowned && unlink(serv->address.sun_path)) {
+		WARN_LOG("Server socket %s delete failed: %s\n",
+			 serv->address.sun_path, strerror(errno));
+	}
+
+	epoll_ctl(ls->epoll_fd, EPOLL_CTL_DEL, serv->listen.fd, NULL);
+	close(serv->listen.fd);
+
+	for (int i = 0; i < CLIENT_SLOTS; i++)
+		ls_disconnect_client(ls, &serv->clients[i]);
+
+	close(serv->server_socket_lock);
+}
+
+static struct ls *create(struct lease_handle **lease_handles, int count,
+			 struct handoff *handoff)
+{
+
+	struct ls *ls = calloc(1, sizeof(struct ls));
+	if (!ls) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	/* One server per lease, plus the lease selection, admin and handoff
+	 * servers */
+	ls->servers = calloc(count + 3, sizeof(struct ls_server));
+	if (!ls->servers) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	/* A reassignment plan lists each lease at most once */
+	ls->plans =
+	    calloc(CLIENT_SLOTS * count, sizeof(struct lease_handle *));
+	if (!ls->plans) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	ls->trace_fd = -1;
+	ls->epoll_fd = epoll_create1(0);
+	if (ls->epoll_fd < 0) {
+		DEBUG_LOG("epoll_create failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct lease_handle *lease_handle = lease_handles[i];
+		if (!server_setup(ls, &ls->servers[i], lease_handle->name,
+				  LS_SERVER_LEASE, lease_handle, handoff))
+			goto err;
+		ls->nservers++;
+	}
+
+	/* Lease selection is optional.  The selection socket is already
+	 * taken if another lease manager instance shares the runtime
+	 * directory. */
+	if (server_setup(ls, &ls->servers[ls->nservers],
+			 DLM_SELECT_SERVER_NAME, LS_SERVER_SELECT, NULL,
+			 handoff))
+		ls->nservers++;
+	else
+		WARN_LOG("Lease selection is not available\n");
+
+	/* Likewise for lease reassignment */
+	if (server_setup(ls, &ls->servers[ls->nservers], DLM_ADMIN_SERVER_NAME,
+			 LS_SERVER_ADMIN, NULL, handoff)) {
+		struct ls_server *serv = &ls->servers[ls->nservers++];
+		for (int i = 0; i < CLIENT_SLOTS; i++)
+			serv->clients[i].plan = &ls->plans[i * count];
+	} else {
+		WARN_LOG("Lease reassignment is not available\n");
+	}
+
+	/* And for handoffs to a new instance */
+	if (server_setup(ls, &ls->servers[ls->nservers],
+			 DLM_HANDOFF_SERVER_NAME, LS_SERVER_HANDOFF, NULL,
+			 handoff))
+		ls->nservers++;
+	else
+		WARN_LOG("Lease manager handoff is not available\n");
+
+	return ls;
+err:
+	ls_destroy(ls);
+	return NULL;
+}
+
+struct ls *ls_create(struct lease_handle **lease_handles, int count)
+{
+	assert(lease_handles);
+	assert(count > 0);
+
+	return create(lease_handles, count, NULL);
+}
+
+struct ls *ls_create_from_handoff(struct lease_handle **lease_handles,
+				  int count, struct handoff *handoff)
+{
+	assert(lease_handles);
+	assert(count > 0);
+	assert(handoff);
+
+	return create(lease_handles, count, handoff);
+}
+
+void ls_destroy(struct ls *ls)
+{
+	assert(ls);
+
+	for (int i = 0; i < ls->nservers; i++)
+		server_shutdown(ls, &ls->servers[i]);
+
+	close(ls->epoll_fd);
+	free(ls->plans);
+	free(ls->servers);
+	free(ls);
+}
+
+/* Get the next request, waiting for one if block is set.
+ * Returns 1 if there is a request, 0 if there is none and -1 on error. */
+static int get_request(struct ls *ls, struct ls_req *req, bool block)
+{
+	int request = -1;
+	while (request < 0) {
+		resume_servers(ls);
+
+		/* Checked on every iteration, so that a client that stopped
+		 * reading is disconnected even while other clients keep the
+		 * server busy */
+		struct ls_client *stalled = find_stalled_client(ls);
+		if (stalled) {
+			/* Clients of the selection server hold no lease */
+			if (stalled->serv->type == LS_SERVER_SELECT) {
+				ls_disconnect_client(ls, stalled);
+				continue;
+			}
+
+			WARN_LOG("Client on %s is not reading, disconnecting\n",
+				 stalled->serv->address.sun_path);
+			req->lease_handle = stalled->serv->lease_handle;
+			req->client = stalled;
+			req->type = LS_REQ_CLIENT_DISCONNECT;
+			return 1;
+		}
+
+		struct epoll_event ev;
+		int timeout = block ? get_timeout(ls) : 0;
+		int nevents = epoll_wait(ls->epoll_fd, &ev, 1, timeout);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+			DEBUG_LOG("epoll_wait failed: %s\n", strerror(errno));
+			return -1;
+		}
+
+		if (nevents == 0) {
+			if (!block)
+				return 0;
+			continue;
+		}
+
+		struct ls_socket *sock = ev.data.ptr;
+		assert(sock);
+
+		if (sock->is_server) {
+			if (ev.events & POLLIN)
+				client_connect(ls, sock->server);
+			continue;
+		}
+
+		struct ls_client *client = sock->client;
+		struct ls_server *server = client->serv;
+
+		if ((ev.events & POLLOUT) && !client_flush_queue(ls, client))
+			request = LS_REQ_CLIENT_DISCONNECT;
+
+		if (request < 0 && (ev.events & POLLIN))
+			request = parse_client_request(ls, client);
+
+		if (request < 0 && (ev.events & POLLHUP))
+			request = LS_REQ_CLIENT_DISCONNECT;
+
+		if (request == LS_REQ_CLIENT_DISCONNECT &&
+		    server->type == LS_SERVER_SELECT) {
+			ls_disconnect_client(ls, client);
+			request = -1;
+			continue;
+		}
+
+		if (request == LS_REQ_SELECT_LEASE)
+			req->constraints = client->constraints;
+
+		req->plane_demand = client->plane_demand;
+
+		if (request == LS_REQ_REASSIGN_LEASES) {
+			req->lease_handles = client->plan;
+			req->nlease_handles = client->nplan;
+		}
+
+		req->lease_handle = server->lease_handle;
+		req->client = client;
+		req->type = request;
+	}
+	return 1;
+}
+
+bool ls_get_request(struct ls *ls, struct ls_req *req)
+{
+	assert(ls);
+	assert(req);
+
+	return get_request(ls, req, true) > 0;
+}
+
+int ls_poll_request(struct ls *ls, struct ls_req *req)
+{
+	assert(ls);
+	assert(req);
+
+	return get_request(ls, req, false);
+}
+
+int ls_get_fd(struct ls *ls)
+{
+	assert(ls);
+
+	return ls->epoll_fd;
+}
+
+int ls_get_timeout(struct ls *ls)
+{
+	assert(ls);
+
+	return get_timeout(ls);
+}
+
+bool ls_send_fd(struct ls *ls, struct ls_client *client, int fd)
+{
+	return ls_send_lease(ls, client, fd, -1);
+}
+
+bool ls_send_lease(struct ls *ls, struct ls_client *client, int fd,
+		   int topology_fd)
+{
+	assert(ls);
+	assert(client);
+
+	struct ls_server *serv = client->serv;
+
+	if (fd < 0)
+		return false;
+
+	struct dlm_resume_token token;
+	generate_resume_token(&token);
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_REPLY, client->request_seq);
+	dlm_msg_add_u32(&msg, DLM_ATTR_STATUS, DLM_STATUS_OK);
+	dlm_msg_add_fd(&msg, fd);
+
+	if (client->version < 2 || (client->caps & DLM_CAP_RESUME_TOKEN))
+		dlm_msg_add_attr(&msg, DLM_ATTR_RESUME_TOKEN, &token,
+				 sizeof(token));
+
+	/* Clients of the selection server learn which lease they got */
+	if (client->version >= 2) {
+		const char *name = serv->lease_handle->name;
+		dlm_msg_add_attr(&msg, DLM_ATTR_LEASE_NAME, name,
+				 strlen(name) + 1);
+	}
+
+	if (topology_fd >= 0 && (client->caps & DLM_CAP_TOPOLOGY)) {
+		dlm_msg_add_u32(&msg, DLM_ATTR_TOPOLOGY_FD, msg.nfds);
+		dlm_msg_add_fd(&msg, topology_fd);
+	}
+
+	if (!client_send(ls, client, &msg))
+		return false;
+
+	dlm_trace_record(ls->trace_fd, client->trace_id, DLM_TRACE_SERVER_SENT);
+	serv->resume_token = token;
+
+	if (fd > 0)
+		INFO_LOG("Lease request granted on %s\n",
+			 serv->address.sun_path);
 
 	return true;
 }
 
+bool ls_send_error(struct ls *ls, struct ls_client *client,
+		   enum ls_error error)
+{
+	assert(ls);
+	assert(client);
+
+	/* Version 1 clients are notified by closing the connection */
+	if (client->version < 2)
+		return true;
+
+	enum dlm_status status = DLM_STATUS_LEASE_FAILED;
+	if (error == LS_ERR_LEASE_BUSY)
+		status = DLM_STATUS_LEASE_BUSY;
+	else if (error == LS_ERR_NO_MATCH)
+		status = DLM_STATUS_NO_MATCH;
+
+	return client_send_status(ls, client, client->request_seq, status);
+}
+
+bool ls_send_lease_event(struct ls *ls, struct ls_client *client,
+			 enum ls_lease_event event)
+{
+	assert(ls);
+	assert(client);
+
+	if (!(client->caps & DLM_CAP_LEASE_EVENTS))
+		return true;
+
+	enum dlm_lease_event_type type = DLM_LEASE_EVENT_REVOKED;
+	if (event == LS_EVENT_TRANSFER_PENDING)
+		type = DLM_LEASE_EVENT_TRANSFER_PENDING;
+	else if (event == LS_EVENT_TRANSFER_CANCELLED)
+		type = DLM_LEASE_EVENT_TRANSFER_CANCELLED;
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_LEASE_EVENT, 0);
+	if (!dlm_msg_add_u32(&msg, DLM_ATTR_LEASE_EVENT, type))
+		return false;
+
+	return client_send(ls, client, &msg);
+}
+
+bool ls_send_reassign_accepted(struct ls *ls, struct ls_client *client)
+{
+	assert(ls);
+	assert(client);
+
+	return client_send_status(ls, client, client->request_seq,
+				  DLM_STATUS_OK);
+}
+
+bool ls_send_reassign_done(struct ls *ls, struct ls_client *client,
+			   uint32_t switch_time_us)
+{
+	assert(ls);
+	assert(client);
+
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, client->request_seq);
+	if (!dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, DLM_STATUS_OK) ||
+	    !dlm_msg_add_u32(&reply, DLM_ATTR_SWITCH_TIME, switch_time_us))
+		return false;
+
+	return client_send(ls, client, &reply);
+}
+
+struct ls_client *ls_assign_client(struct ls *ls, struct ls_client *client,
+				   struct lease_handle *lease_handle)
+{
+	assert(ls);
+	assert(client);
+	assert(lease_handle);
+
+	struct ls_server *serv = NULL;
+	for (int i = 0; i < ls->nservers; i++) {
+		if (ls->servers[i].lease_handle == lease_handle) {
+			serv = &ls->servers[i];
+			break;
+		}
+	}
+	if (!serv)
+		return NULL;
+
+	struct ls_client *dest = find_free_client(serv);
+	if (!dest) {
+		DEBUG_LOG("No free client slot on %s\n",
+			  serv->address.sun_path);
+		return NULL;
+	}
+
+	/* The connection, along with any queued messages, now belongs to
+	 * the lease server */
+	*dest = *client;
+	dest->serv = serv;
+	dest->socket.client = dest;
+
+	uint32_t events = dest->nqueued > 0 ? POLLIN | POLLOUT : POLLIN;
+	if (!client_set_events(ls, dest, events)) {
+		dest->is_connected = false;
+		dest->nqueued = 0;
+		return NULL;
+	}
+
+	client->is_connected = false;
+	client->nqueued = 0;
+	return dest;
+}
+
+/* Forget a client, leaving its connection open */
+static void client_release(struct ls *ls, struct ls_client *client)
+{
+	while (client->nqueued > 0)
+		client_dequeue(client);
+
+	epoll_ctl(ls->epoll_fd, EPOLL_CTL_DEL, client->socket.fd, NULL);
+	client->is_connected = false;
+	client->idle = false;
+	client->nplan = 0;
+}
+
 void ls_disconnect_client(struct ls *ls, struct ls_client *client)
 {
 	assert(ls);
@@ -372,7 +1507,218 @@ void ls_disconnect_client(struct ls *ls, struct ls_client *client)
 	if (!client->is_connected)
 		return;
 
-	epoll_ctl(ls->epoll_fd, EPOLL_CTL_DEL, client->socket.fd, NULL);
+	client_release(ls, client);
+
+	/* A supervisor may hold a copy of the connection, so end it for the
+	 * client too, unless it now belongs to another instance */
+	if (!ls->disowned)
+		shutdown(client->socket.fd, SHUT_RDWR);
 	close(client->socket.fd);
-	client->is_connected = false;
+}
+
+void ls_idle_client(struct ls *ls, struct ls_client *client)
+{
+	assert(ls);
+	assert(client);
+
+	if (!client->is_connected || client->idle)
+		return;
+
+	if (count_clients(client->serv, true) >= SESSION_CLIENTS) {
+		DEBUG_LOG("No session client slot on %s\n",
+			  client->serv->address.sun_path);
+		ls_disconnect_client(ls, client);
+		return;
+	}
+
+	client->idle = true;
+}
+
+void ls_set_trace_fd(struct ls *ls, int fd)
+{
+	assert(ls);
+
+	ls->trace_fd = fd;
+}
+
+void ls_trace_request(struct ls *ls, struct ls_client *client,
+		      enum dlm_trace_stage stage)
+{
+	assert(ls);
+	assert(client);
+
+	dlm_trace_record(ls->trace_fd, client->trace_id, stage);
+}
+
+bool ls_client_has_session(struct ls_client *client)
+{
+	assert(client);
+
+	return client->caps & DLM_CAP_SESSION;
+}
+
+pid_t ls_client_pid(struct ls_client *client)
+{
+	assert(client);
+
+	return client->pid;
+}
+
+static struct ls_server *find_server(struct ls *ls,
+				     struct lease_handle *lease_handle)
+{
+	for (int i = 0; i < ls->nservers; i++) {
+		if (ls->servers[i].lease_handle == lease_handle)
+			return &ls->servers[i];
+	}
+	return NULL;
+}
+
+bool ls_get_admission_stats(struct ls *ls, struct lease_handle *lease_handle,
+			    struct lease_admission_stats *stats)
+{
+	assert(ls);
+	assert(lease_handle);
+	assert(stats);
+
+	struct ls_server *serv = find_server(ls, lease_handle);
+	if (!serv)
+		return false;
+
+	*stats = serv->stats;
+	if (serv->throttled)
+		stats->throttle_time_ms += get_time_ms() - serv->throttle_start;
+
+	bool changed = serv->stats_changed || serv->throttled;
+	serv->stats_changed = false;
+	return changed;
+}
+
+void ls_clear_resume_token(struct ls *ls, struct lease_handle *lease_handle)
+{
+	assert(ls);
+	assert(lease_handle);
+
+	struct ls_server *serv = find_server(ls, lease_handle);
+	if (serv)
+		memset(&serv->resume_token, 0, sizeof(serv->resume_token));
+}
+
+bool ls_export(struct ls *ls, struct handoff *handoff)
+{
+	assert(ls);
+	assert(handoff);
+
+	for (int i = 0; i < ls->nservers; i++) {
+		struct ls_server *serv = &ls->servers[i];
+		const char *name = strrchr(serv->address.sun_path, '/');
+		name = name ? name + 1 : serv->address.sun_path;
+
+		if (!handoff_add_server(handoff, name, serv->listen.fd,
+					serv->server_socket_lock))
+			return false;
+	}
+	return true;
+}
+
+bool ls_export_lease(struct ls *ls, struct lease_handle *lease_handle,
+		     struct ls_client *client, struct handoff_lease *lease)
+{
+	assert(ls);
+	assert(lease_handle);
+	assert(lease);
+
+	struct ls_server *serv = find_server(ls, lease_handle);
+	if (!serv)
+		return false;
+
+	lease->resume_token = serv->resume_token;
+	if (!client || !client->is_connected)
+		return true;
+
+	/* Messages still queued for the client would be lost, so it has to
+	 * reconnect, and resume its lease, after a restart */
+	if (client->nqueued > 0)
+		return true;
+
+	lease->client_pid = client->pid;
+	lease->client_version = client->version;
+	lease->client_caps = client->caps;
+	return handoff_lease_set_client(lease, client->socket.fd);
+}
+
+struct ls_client *ls_adopt_lease(struct ls *ls,
+				 struct lease_handle *lease_handle,
+				 struct handoff_lease *lease)
+{
+	assert(ls);
+	assert(lease_handle);
+	assert(lease);
+
+	struct ls_server *serv = find_server(ls, lease_handle);
+	if (!serv)
+		return NULL;
+
+	serv->resume_token = lease->resume_token;
+	if (lease->client_fd < 0)
+		return NULL;
+
+	struct ls_client *client = &serv->clients[0];
+	assert(!client->is_connected);
+
+	int cfd = lease->client_fd;
+	lease->client_fd = -1;
+
+	int flags = fcntl(cfd, F_GETFL);
+	if (flags < 0 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		DEBUG_LOG("Can't adopt client on %s: %s\n",
+			  serv->address.sun_path, strerror(errno));
+		close(cfd);
+		return NULL;
+	}
+
+	client->socket.fd = cfd;
+	client->pid = lease->client_pid;
+	client->uid = (uid_t)-1;
+	client->version = lease->client_version;
+	client->caps = lease->client_caps & LS_SERVER_CAPS;
+	client->queue_head = 0;
+	client->nqueued = 0;
+
+	struct epoll_event ev = {
+	    .events = POLLIN,
+	    .data.ptr = &client->socket,
+	};
+	if (epoll_ctl(ls->epoll_fd, EPOLL_CTL_ADD, cfd, &ev)) {
+		DEBUG_LOG("epoll_ctl add failed: %s\n", strerror(errno));
+		close(cfd);
+		return NULL;
+	}
+
+	client->is_connected = true;
+	return client;
+}
+
+void ls_disown(struct ls *ls)
+{
+	assert(ls);
+
+	ls->disowned = true;
+}
+
+int ls_take_client_socket(struct ls *ls, struct ls_client *client)
+{
+	assert(ls);
+	assert(client);
+
+	if (!client->is_connected)
+		return -1;
+
+	int fd = client->socket.fd;
+	client_release(ls, client);
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags >= 0)
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	return fd;
 }
@@ -16,28 +16,148 @@
 #ifndef LEASE_SERVER_H
 #define LEASE_SERVER_H
 #include <stdbool.h>
+#include <sys/types.h>
 
+#include "dlm-trace.h"
 #include "drm-lease.h"
 
 struct ls;
 struct ls_client;
+struct handoff;
+struct handoff_lease;
 enum ls_req_type {
 	LS_REQ_GET_LEASE,
+	LS_REQ_RESUME_LEASE,
 	LS_REQ_RELEASE_LEASE,
 	LS_REQ_CLIENT_DISCONNECT,
+	LS_REQ_SELECT_LEASE,
+	LS_REQ_REASSIGN_LEASES,
+	LS_REQ_HANDOFF,
+};
+
+enum ls_error {
+	LS_ERR_LEASE_BUSY,   /* The lease is owned by another client */
+	LS_ERR_LEASE_FAILED, /* The lease could not be created */
+	LS_ERR_NO_MATCH,     /* No free lease meets the constraints */
+};
+
+enum ls_lease_event {
+	LS_EVENT_REVOKED,	     /* The lease has been revoked */
+	LS_EVENT_TRANSFER_PENDING,   /* The lease is about to be moved */
+	LS_EVENT_TRANSFER_CANCELLED, /* The lease is no longer being moved */
 };
 
 struct ls_req {
 	struct lease_handle *lease_handle;
 	struct ls_client *client;
 	enum ls_req_type type;
+
+	/* LS_REQ_SELECT_LEASE requests have no lease_handle yet */
+	struct lease_constraints constraints;
+
+	/* Planes needed by the client, from its last lease request */
+	struct lease_plane_demand plane_demand;
+
+	/* Leases of a LS_REQ_REASSIGN_LEASES request, valid until the client
+	 * sends another request or is disconnected.  Requests and disconnects
+	 * of admin and handoff clients have no lease_handle. */
+	struct lease_handle **lease_handles;
+	int nlease_handles;
 };
 
 struct ls *ls_create(struct lease_handle **lease_handles, int count);
 void ls_destroy(struct ls *ls);
 
 bool ls_get_request(struct ls *ls, struct ls_req *req);
+
+/* Get a pending request without waiting.  Returns 1 if there is one,
+ * 0 if there is none and -1 on error. */
+int ls_poll_request(struct ls *ls, struct ls_req *req);
+
+/* Fd that becomes readable when there may be pending requests, and the
+ * time in ms until ls_poll_request() must be called again to disconnect
+ * clients that stopped reading (-1 if there is no such deadline). */
+int ls_get_fd(struct ls *ls);
+int ls_get_timeout(struct ls *ls);
 bool ls_send_fd(struct ls *ls, struct ls_client *client, int fd);
+/* Send the lease fd, along with the lease topology memfd to clients
+ * that support it.  topology_fd may be -1. */
+bool ls_send_lease(struct ls *ls, struct ls_client *client, int fd,
+		   int topology_fd);
+bool ls_send_error(struct ls *ls, struct ls_client *client,
+		   enum ls_error error);
+
+/* Stop accepting the resume token last sent with a lease, once its holder
+ * has released it */
+void ls_clear_resume_token(struct ls *ls, struct lease_handle *lease_handle);
+
+/* Notify the holder of a lease, if it supports lease events */
+bool ls_send_lease_event(struct ls *ls, struct ls_client *client,
+			 enum ls_lease_event event);
+
+/* Replies to a reassignment request: once the plan is accepted, and once
+ * it has been carried out */
+bool ls_send_reassign_accepted(struct ls *ls, struct ls_client *client);
+bool ls_send_reassign_done(struct ls *ls, struct ls_client *client,
+			   uint32_t switch_time_us);
+
+/* Move a client of the lease selection server to the server of the
+ * selected lease, so that its requests now apply to that lease.
+ * Returns the moved client, or NULL if the lease server is busy. */
+struct ls_client *ls_assign_client(struct ls *ls, struct ls_client *client,
+				   struct lease_handle *lease_handle);
 
 void ls_disconnect_client(struct ls *ls, struct ls_client *client);
+
+/* Session clients stay connected once they release their lease, or their
+ * lease request fails (see DLM_CAP_SESSION) */
+bool ls_client_has_session(struct ls_client *client);
+/* Keep a session client connected without taking an active client slot,
+ * until its next lease request.  The client is disconnected if the
+ * server has no room for another idle client. */
+void ls_idle_client(struct ls *ls, struct ls_client *client);
+
+/* Process ID of a client, or 0 if unknown */
+pid_t ls_client_pid(struct ls_client *client);
+
+/* Get the admission control counters of a lease server (see the
+ * ADMISSION CONTROL comment in lease-server.c).  Returns true if they
+ * changed since the last call. */
+bool ls_get_admission_stats(struct ls *ls, struct lease_handle *lease_handle,
+			    struct lease_admission_stats *stats);
+
+/* Request tracing (see dlm-trace.h)
+ * Traced lease requests are recorded when they are received and when the
+ * lease is sent.  The trace fd stays owned by the caller. */
+void ls_set_trace_fd(struct ls *ls, int fd);
+/* Record a stage of the last lease request of a client, if it is traced */
+void ls_trace_request(struct ls *ls, struct ls_client *client,
+		      enum dlm_trace_stage stage);
+
+/* Seamless restarts
+ * The server sockets, and the connections of the lease holders, are handed
+ * over to a new lease manager instance (see handoff.h). */
+struct ls *ls_create_from_handoff(struct lease_handle **lease_handles,
+				  int count, struct handoff *handoff);
+
+/* Add the server sockets to a handoff */
+bool ls_export(struct ls *ls, struct handoff *handoff);
+/* Add the resume token of a lease, and the connection of its holder, if
+ * there is one, to a handoff.  A holder with messages still queued is
+ * left out. */
+bool ls_export_lease(struct ls *ls, struct lease_handle *lease_handle,
+		     struct ls_client *client, struct handoff_lease *lease);
+/* Take over the resume token and holder of a lease.  Returns the holder,
+ * or NULL if the lease has none. */
+struct ls_client *ls_adopt_lease(struct ls *ls,
+				 struct lease_handle *lease_handle,
+				 struct handoff_lease *lease);
+
+/* Leave the sockets open for the new instance when destroyed */
+void ls_disown(struct ls *ls);
+
+/* Take the connection of a client away from the server, to reply to a
+ * LS_REQ_HANDOFF.  The returned socket is blocking, and owned by the
+ * caller. */
+int ls_take_client_socket(struct ls *ls, struct ls_client *client);
 #endif
@@ -0,0 +1,248 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "lease-status.h"
+
+#include "dlm-status.h"
+#include "log.h"
+#include "socket-path.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct lease_status {
+	int fd;
+	char path[PATH_MAX];
+
+	struct dlm_status_header *page;
+	size_t size;
+
+	/* Serializes writers: the main loop and lease transition threads */
+	pthread_mutex_t lock;
+};
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Make seq odd, so readers discard anything they copy until
+ * write_end() is called */
+static void write_begin(struct lease_status *status)
+{
+	struct dlm_status_header *page = status->page;
+
+	pthread_mutex_lock(&status->lock);
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct lease_status *status)
+{
+	struct dlm_status_header *page = status->page;
+
+	page->update_time = realtime_ns();
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&status->lock);
+}
+
+struct lease_status *lease_status_create(struct lease_handle **leases,
+					 int nleases)
+{
+	struct lease_status *status = calloc(1, sizeof(*status));
+	if (!status) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	pthread_mutex_init(&status->lock, NULL);
+	status->size = sizeof(struct dlm_status_header) +
+		       nleases * sizeof(struct dlm_status_lease);
+
+	if (!get_runtime_file_path(status->path, sizeof(status->path),
+				   DLM_STATUS_FILE_NAME))
+		goto err;
+
+	/* Don't truncate the file until it is locked, in case it is in use
+	 * by another lease manager instance */
+	status->fd = open(status->path, O_CREAT | O_RDWR | O_CLOEXEC,
+			  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (status->fd < 0) {
+		DEBUG_LOG("Cannot open %s: %s\n", status->path,
+			  strerror(errno));
+		goto err;
+	}
+
+	if (flock(status->fd, LOCK_EX | LOCK_NB)) {
+		DEBUG_LOG("%s is in use by another lease manager\n",
+			  status->path);
+		goto err_close;
+	}
+
+	if (ftruncate(status->fd, 0) < 0 ||
+	    ftruncate(status->fd, status->size) < 0) {
+		DEBUG_LOG("Cannot resize %s: %s\n", status->path,
+			  strerror(errno));
+		goto err_unlink;
+	}
+
+	status->page = mmap(NULL, status->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, status->fd, 0);
+	if (status->page == MAP_FAILED) {
+		DEBUG_LOG("Cannot map %s: %s\n", status->path, strerror(errno));
+		goto err_unlink;
+	}
+
+	struct dlm_status_header *page = status->page;
+	for (int i = 0; i < nleases; i++) {
+		strncpy(page->leases[i].name, leases[i]->name,
+			DLM_STATUS_NAME_LEN - 1);
+	}
+	page->nleases = nleases;
+	page->version = DLM_STATUS_VERSION;
+	page->update_time = realtime_ns();
+
+	/* Readers check the magic last, once the page is complete */
+	__atomic_store_n(&page->magic, DLM_STATUS_MAGIC, __ATOMIC_RELEASE);
+	return status;
+
+err_unlink:
+	unlink(status->path);
+err_close:
+	close(status->fd);
+err:
+	WARN_LOG("Lease status page is not available\n");
+	pthread_mutex_destroy(&status->lock);
+	free(status);
+	return NULL;
+}
+
+void lease_status_destroy(struct lease_status *status)
+{
+	if (!status)
+		return;
+
+	/* Tell readers that still have the page mapped */
+	write_begin(status);
+	status->page->flags |= DLM_STATUS_CLOSED;
+	write_end(status);
+
+	unlink(status->path);
+	munmap(status->page, status->size);
+	close(status->fd);
+	pthread_mutex_destroy(&status->lock);
+	free(status);
+}
+
+void lease_status_update(struct lease_status *status, int index,
+			 enum lease_status_event event)
+{
+	if (!status)
+		return;
+
+	write_begin(status);
+
+	struct dlm_status_lease *lease = &status->page->leases[index];
+	switch (event) {
+	case LEASE_STATUS_GRANTED:
+		lease->state = DLM_STATUS_LEASE_GRANTED;
+		lease->grant_time = realtime_ns();
+		lease->grants++;
+		break;
+	case LEASE_STATUS_TRANSITION_STARTED:
+		lease->state = DLM_STATUS_LEASE_IN_TRANSITION;
+		break;
+	case LEASE_STATUS_TRANSITION_DONE:
+		/* The lease may have been revoked in the meantime */
+		if (lease->state == DLM_STATUS_LEASE_IN_TRANSITION)
+			lease->state = DLM_STATUS_LEASE_GRANTED;
+		break;
+	case LEASE_STATUS_TRANSFERRED:
+		lease->transfers++;
+		break;
+	case LEASE_STATUS_RESUMED:
+		lease->resumes++;
+		break;
+	case LEASE_STATUS_REVOKED:
+		lease->state = DLM_STATUS_LEASE_FREE;
+		lease->holder_pid = 0;
+		lease->revokes++;
+		break;
+	case LEASE_STATUS_FAILED:
+		lease->failures++;
+		break;
+	}
+
+	write_end(status);
+}
+
+void lease_status_set_holder(struct lease_status *status, int index,
+			     pid_t pid)
+{
+	if (!status)
+		return;
+
+	write_begin(status);
+	status->page->leases[index].holder_pid = pid;
+	write_end(status);
+}
+
+void lease_status_set_frame_stats(struct lease_status *status, int index,
+				  const struct lease_frame_stats *stats)
+{
+	if (!status)
+		return;
+
+	write_begin(status);
+
+	struct dlm_status_lease *lease = &status->page->leases[index];
+	lease->frame_rate = stats->frame_rate;
+	lease->max_stall_ms = stats->max_stall_ms;
+	lease->frames = stats->frames;
+	lease->missed_frames = stats->missed_frames;
+	lease->stalls = stats->stalls;
+	lease->stall_time_ms = stats->stall_time_ms;
+
+	write_end(status);
+}
+
+void lease_status_set_admission_stats(
+    struct lease_status *status, int index,
+    const struct lease_admission_stats *stats)
+{
+	if (!status)
+		return;
+
+	write_begin(status);
+
+	struct dlm_status_lease *lease = &status->page->leases[index];
+	lease->connections = stats->connections;
+	lease->connections_shed = stats->shed;
+	lease->throttle_time_ms = stats->throttle_time_ms;
+
+	write_end(status);
+}
@@ -0,0 +1,61 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LEASE_STATUS_H
+#define LEASE_STATUS_H
+
+#include "drm-lease.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Publisher of the lease status page (see dlm-status.h).
+ * All functions may be called with a NULL status, and do nothing. */
+struct lease_status;
+
+enum lease_status_event {
+	LEASE_STATUS_GRANTED,
+	LEASE_STATUS_TRANSITION_STARTED,
+	LEASE_STATUS_TRANSITION_DONE,
+	LEASE_STATUS_TRANSFERRED,
+	LEASE_STATUS_RESUMED,
+	LEASE_STATUS_REVOKED,
+	LEASE_STATUS_FAILED,
+};
+
+/* Frame timing of a lease (see struct dlm_status_lease) */
+struct lease_frame_stats {
+	uint32_t frame_rate;
+	uint32_t max_stall_ms;
+	uint64_t frames;
+	uint64_t missed_frames;
+	uint64_t stalls;
+	uint64_t stall_time_ms;
+};
+
+struct lease_status *lease_status_create(struct lease_handle **leases,
+					 int nleases);
+void lease_status_destroy(struct lease_status *status);
+
+void lease_status_update(struct lease_status *status, int index,
+			 enum lease_status_event event);
+void lease_status_set_holder(struct lease_status *status, int index,
+			     pid_t pid);
+void lease_status_set_frame_stats(struct lease_status *status, int index,
+				  const struct lease_frame_stats *stats);
+void lease_status_set_admission_stats(
+    struct lease_status *status, int index,
+    const struct lease_admission_stats *stats);
+#endif
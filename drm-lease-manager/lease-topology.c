@@ -0,0 +1,489 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include "lease-topology.h"
+
+#include "dlm-topology.h"
+#include "drm-calls.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+_Static_assert(sizeof(drmModeModeInfo) == sizeof(struct dlm_topology_mode),
+	       "drmModeModeInfo and dlm_topology_mode layouts differ");
+
+#define TOPOLOGY_SEALS \
+	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/* The topology blob is built in a buffer sized by lease_topology_size(),
+ * and every part of it is referred to by its offset. */
+struct blob {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+};
+
+static size_t blob_align(size_t len)
+{
+	return (len + DLM_TOPOLOGY_ALIGN - 1) &
+	       ~(size_t)(DLM_TOPOLOGY_ALIGN - 1);
+}
+
+static uint32_t blob_alloc(struct blob *blob, size_t len)
+{
+	size_t offset = blob->size;
+	size_t aligned_len = blob_align(len);
+
+	if (blob->failed)
+		return 0;
+
+	if (offset + aligned_len > blob->capacity) {
+		DEBUG_LOG("Topology buffer too small\n");
+		blob->failed = true;
+		return 0;
+	}
+
+	memset(blob->data + offset, 0, aligned_len);
+	blob->size += aligned_len;
+	return offset;
+}
+
+static void *blob_at(struct blob *blob, uint32_t offset)
+{
+	return blob->data + offset;
+}
+
+struct prop_list {
+	struct dlm_topology_prop *props;
+	int count;
+	int capacity;
+};
+
+static bool prop_list_add(struct prop_list *list, uint32_t object_id,
+			  drmModePropertyPtr prop)
+{
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 32;
+		struct dlm_topology_prop *props =
+		    realloc(list->props, capacity * sizeof(*props));
+		if (!props) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			return false;
+		}
+		list->props = props;
+		list->capacity = capacity;
+	}
+
+	struct dlm_topology_prop *entry = &list->props[list->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->object_id = object_id;
+	entry->prop_id = prop->prop_id;
+	strncpy(entry->name, prop->name, sizeof(entry->name) - 1);
+	return true;
+}
+
+static void prop_list_move(struct prop_list *list,
+			   struct lease_object_props *props)
+{
+	props->props = list->props;
+	props->count = list->count;
+}
+
+bool lease_object_props_init(int drm_fd, uint32_t object_id,
+			     uint32_t object_type,
+			     struct lease_object_props *object_props)
+{
+	struct prop_list list = {0};
+
+	memset(object_props, 0, sizeof(*object_props));
+	drmModeObjectPropertiesPtr props = DRM_CALL(
+	    drmModeObjectGetProperties, drm_fd, object_id, object_type);
+
+	/* Objects without properties are still described */
+	if (!props)
+		return true;
+
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < props->count_props; i++) {
+		drmModePropertyPtr prop =
+		    DRM_CALL(drmModeGetProperty, drm_fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		ok = prop_list_add(&list, object_id, prop);
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	prop_list_move(&list, object_props);
+	if (!ok)
+		lease_object_props_fini(object_props);
+	return ok;
+}
+
+void lease_object_props_fini(struct lease_object_props *props)
+{
+	free(props->props);
+	memset(props, 0, sizeof(*props));
+}
+
+/* Properties of a plane needed to describe its capabilities */
+struct plane_props {
+	uint32_t type;
+	uint32_t in_formats_blob;
+	bool has_scaling_filter;
+};
+
+/* Read the properties of a plane, and keep their IDs and names for its
+ * topology */
+static bool get_plane_props(int drm_fd, uint32_t plane_id,
+			    struct plane_props *plane_props,
+			    struct lease_object_props *object_props)
+{
+	struct prop_list list = {0};
+	drmModeObjectPropertiesPtr props =
+	    DRM_CALL(drmModeObjectGetProperties, drm_fd, plane_id,
+		     DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return true;
+
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < props->count_props; i++) {
+		drmModePropertyPtr prop =
+		    DRM_CALL(drmModeGetProperty, drm_fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, "type"))
+			plane_props->type = props->prop_values[i];
+		if (!strcmp(prop->name, "IN_FORMATS"))
+			plane_props->in_formats_blob = props->prop_values[i];
+		if (!strcmp(prop->name, "SCALING_FILTER"))
+			plane_props->has_scaling_filter = true;
+
+		ok = prop_list_add(&list, plane_id, prop);
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	prop_list_move(&list, object_props);
+	return ok;
+}
+
+static bool format_blob_is_valid(drmModePropertyBlobPtr prop_blob)
+{
+	const struct drm_format_modifier_blob *fmt_blob = prop_blob->data;
+	uint64_t formats_end, modifiers_end;
+
+	if (prop_blob->length < sizeof(*fmt_blob))
+		return false;
+
+	formats_end = fmt_blob->formats_offset +
+		      (uint64_t)fmt_blob->count_formats * sizeof(uint32_t);
+	modifiers_end = fmt_blob->modifiers_offset +
+			(uint64_t)fmt_blob->count_modifiers *
+			    sizeof(struct drm_format_modifier);
+
+	return formats_end <= prop_blob->length &&
+	       modifiers_end <= prop_blob->length;
+}
+
+static bool get_plane_modifiers(int drm_fd, uint32_t blob_id,
+				struct lease_plane_caps *caps)
+{
+	bool ok = true;
+	drmModePropertyBlobPtr prop_blob =
+	    DRM_CALL(drmModeGetPropertyBlob, drm_fd, blob_id);
+	if (!prop_blob)
+		return true;
+
+	const struct drm_format_modifier_blob *fmt_blob = prop_blob->data;
+	if (!format_blob_is_valid(prop_blob))
+		goto done;
+
+	const uint32_t *formats =
+	    (const uint32_t *)((const uint8_t *)fmt_blob +
+			       fmt_blob->formats_offset);
+	const struct drm_format_modifier *mods =
+	    (const struct drm_format_modifier *)((const uint8_t *)fmt_blob +
+						 fmt_blob->modifiers_offset);
+
+	/* Each modifier applies to up to 64 formats, selected by a bitmask
+	 * relative to the format at 'offset' */
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < fmt_blob->count_modifiers; i++) {
+		for (int j = 0; j < 64; j++) {
+			if ((mods[i].formats & (1ull << j)) &&
+			    mods[i].offset + j < fmt_blob->count_formats)
+				count++;
+		}
+	}
+
+	if (count == 0)
+		goto done;
+
+	caps->modifiers = calloc(count, sizeof(struct dlm_topology_modifier));
+	if (!caps->modifiers) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		ok = false;
+		goto done;
+	}
+
+	for (uint32_t i = 0; i < fmt_blob->count_modifiers; i++) {
+		for (int j = 0; j < 64; j++) {
+			uint32_t idx = mods[i].offset + j;
+			if (!(mods[i].formats & (1ull << j)) ||
+			    idx >= fmt_blob->count_formats)
+				continue;
+
+			struct dlm_topology_modifier *entry =
+			    &caps->modifiers[caps->nmodifiers++];
+			entry->format = formats[idx];
+			entry->modifier = mods[i].modifier;
+		}
+	}
+done:
+	drmModeFreePropertyBlob(prop_blob);
+	return ok;
+}
+
+bool lease_plane_caps_init(int drm_fd, drmModePlanePtr plane,
+			   struct lease_plane_caps *caps)
+{
+	struct plane_props plane_props = {
+	    .type = DRM_PLANE_TYPE_OVERLAY,
+	};
+
+	memset(caps, 0, sizeof(*caps));
+	caps->plane_id = plane->plane_id;
+
+	if (!get_plane_props(drm_fd, plane->plane_id, &plane_props,
+			     &caps->props)) {
+		lease_plane_caps_fini(caps);
+		return false;
+	}
+	caps->type = plane_props.type;
+	caps->scaling = plane_props.has_scaling_filter;
+
+	if (plane->count_formats > 0) {
+		caps->formats = calloc(plane->count_formats, sizeof(uint32_t));
+		if (!caps->formats) {
+			DEBUG_LOG("Memory allocation failed: %s\n",
+				  strerror(errno));
+			lease_plane_caps_fini(caps);
+			return false;
+		}
+		memcpy(caps->formats, plane->formats,
+		       plane->count_formats * sizeof(uint32_t));
+		caps->nformats = plane->count_formats;
+	}
+
+	if (plane_props.in_formats_blob &&
+	    !get_plane_modifiers(drm_fd, plane_props.in_formats_blob, caps)) {
+		lease_plane_caps_fini(caps);
+		return false;
+	}
+	return true;
+}
+
+void lease_plane_caps_fini(struct lease_plane_caps *caps)
+{
+	free(caps->formats);
+	free(caps->modifiers);
+	lease_object_props_fini(&caps->props);
+	memset(caps, 0, sizeof(*caps));
+}
+
+static bool add_plane(struct blob *blob, uint32_t plane_offset,
+		      const struct lease_plane_caps *caps)
+{
+	uint32_t formats_offset =
+	    blob_alloc(blob, caps->nformats * sizeof(uint32_t));
+	uint32_t modifiers_offset = blob_alloc(
+	    blob, caps->nmodifiers * sizeof(struct dlm_topology_modifier));
+	if (blob->failed)
+		return false;
+
+	if (caps->nformats > 0) {
+		memcpy(blob_at(blob, formats_offset), caps->formats,
+		       caps->nformats * sizeof(uint32_t));
+	}
+	if (caps->nmodifiers > 0) {
+		memcpy(blob_at(blob, modifiers_offset), caps->modifiers,
+		       caps->nmodifiers * sizeof(struct dlm_topology_modifier));
+	}
+
+	struct dlm_topology_plane *plane = blob_at(blob, plane_offset);
+	plane->plane_id = caps->plane_id;
+	plane->type = caps->type;
+	plane->formats.offset = caps->nformats ? formats_offset : 0;
+	plane->formats.count = caps->nformats;
+	plane->modifiers.offset = caps->nmodifiers ? modifiers_offset : 0;
+	plane->modifiers.count = caps->nmodifiers;
+	return true;
+}
+
+static void copy_props(struct blob *blob, uint32_t *offset,
+		       const struct lease_object_props *props)
+{
+	if (props->count == 0)
+		return;
+
+	size_t len = props->count * sizeof(struct dlm_topology_prop);
+	memcpy(blob_at(blob, *offset), props->props, len);
+	*offset += len;
+}
+
+static int count_props(const struct lease_topology_objects *objects)
+{
+	int count = objects->crtc_props->count +
+		    objects->connector_props->count;
+	for (int i = 0; i < objects->nplanes; i++)
+		count += objects->planes[i]->props.count;
+	return count;
+}
+
+size_t lease_topology_size(const struct lease_topology_objects *objects)
+{
+	size_t size = blob_align(sizeof(struct dlm_topology_header)) +
+		      blob_align(objects->nmodes * sizeof(drmModeModeInfo)) +
+		      blob_align(sizeof(drmModeModeInfo)) +
+		      blob_align(objects->nplanes *
+				 sizeof(struct dlm_topology_plane)) +
+		      blob_align(count_props(objects) *
+				 sizeof(struct dlm_topology_prop));
+
+	for (int i = 0; i < objects->nplanes; i++) {
+		const struct lease_plane_caps *caps = objects->planes[i];
+		size += blob_align(caps->nformats * sizeof(uint32_t)) +
+			blob_align(caps->nmodifiers *
+				   sizeof(struct dlm_topology_modifier));
+	}
+	return size;
+}
+
+static int create_sealed_memfd(const void *data, size_t size)
+{
+	int fd = memfd_create("dlm-topology", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		DEBUG_LOG("memfd_create failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t ret = write(fd, (const uint8_t *)data + written,
+				    size - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			DEBUG_LOG("Topology write failed: %s\n",
+				  strerror(errno));
+			goto err;
+		}
+		written += ret;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, TOPOLOGY_SEALS)) {
+		DEBUG_LOG("Topology sealing failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+int lease_topology_create(const struct lease_topology_objects *objects,
+			  void *buf, size_t size)
+{
+	struct blob blob = {
+	    .data = buf,
+	    .capacity = size,
+	};
+
+	uint32_t hdr_offset =
+	    blob_alloc(&blob, sizeof(struct dlm_topology_header));
+
+	uint32_t modes_offset =
+	    blob_alloc(&blob, objects->nmodes * sizeof(drmModeModeInfo));
+	if (blob.failed)
+		return -1;
+	if (objects->nmodes > 0) {
+		memcpy(blob_at(&blob, modes_offset), objects->modes,
+		       objects->nmodes * sizeof(drmModeModeInfo));
+	}
+
+	uint32_t nboot_modes = objects->boot_fb_id ? 1 : 0;
+	uint32_t boot_mode_offset =
+	    blob_alloc(&blob, nboot_modes * sizeof(drmModeModeInfo));
+	if (blob.failed)
+		return -1;
+	if (nboot_modes > 0) {
+		memcpy(blob_at(&blob, boot_mode_offset), objects->boot_mode,
+		       sizeof(drmModeModeInfo));
+	}
+
+	uint32_t planes_offset = blob_alloc(
+	    &blob, objects->nplanes * sizeof(struct dlm_topology_plane));
+
+	for (int i = 0; i < objects->nplanes; i++) {
+		uint32_t plane_offset =
+		    planes_offset + i * sizeof(struct dlm_topology_plane);
+		if (!add_plane(&blob, plane_offset, objects->planes[i]))
+			return -1;
+	}
+
+	/* Plane properties come first, then the CRTC and connector ones */
+	int nprops = count_props(objects);
+	uint32_t props_offset =
+	    blob_alloc(&blob, nprops * sizeof(struct dlm_topology_prop));
+	if (blob.failed)
+		return -1;
+
+	uint32_t offset = props_offset;
+	for (int i = 0; i < objects->nplanes; i++)
+		copy_props(&blob, &offset, &objects->planes[i]->props);
+	copy_props(&blob, &offset, objects->crtc_props);
+	copy_props(&blob, &offset, objects->connector_props);
+
+	struct dlm_topology_header *hdr = blob_at(&blob, hdr_offset);
+	*hdr = (struct dlm_topology_header){
+	    .magic = DLM_TOPOLOGY_MAGIC,
+	    .version = DLM_TOPOLOGY_VERSION,
+	    .size = blob.size,
+	    .connector_id = objects->connector_id,
+	    .crtc_id = objects->crtc_id,
+	    .connection = objects->connection,
+	    .modes = {modes_offset, objects->nmodes},
+	    .planes = {planes_offset, objects->nplanes},
+	    .props = {props_offset, nprops},
+	    .boot_fb_id = objects->boot_fb_id,
+	    .boot_mode = {boot_mode_offset, nboot_modes},
+	};
+
+	return create_sealed_memfd(blob.data, blob.size);
+}
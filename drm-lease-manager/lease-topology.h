@@ -0,0 +1,86 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LEASE_TOPOLOGY_H
+#define LEASE_TOPOLOGY_H
+
+#include "dlm-topology.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/* IDs and names of the properties of an object, read once at startup */
+struct lease_object_props {
+	struct dlm_topology_prop *props;
+	int count;
+};
+
+bool lease_object_props_init(int drm_fd, uint32_t object_id,
+			     uint32_t object_type,
+			     struct lease_object_props *props);
+void lease_object_props_fini(struct lease_object_props *props);
+
+/* Type and supported formats / modifiers of a plane */
+struct lease_plane_caps {
+	uint32_t plane_id;
+	uint32_t type;
+
+	/* The plane can scale (it has a SCALING_FILTER property) */
+	bool scaling;
+
+	uint32_t *formats;
+	int nformats;
+
+	struct dlm_topology_modifier *modifiers;
+	int nmodifiers;
+
+	struct lease_object_props props;
+};
+
+bool lease_plane_caps_init(int drm_fd, drmModePlanePtr plane,
+			   struct lease_plane_caps *caps);
+void lease_plane_caps_fini(struct lease_plane_caps *caps);
+
+struct lease_topology_objects {
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	drmModeConnection connection;
+
+	const drmModeModeInfo *modes;
+	int nmodes;
+
+	const struct lease_plane_caps *const *planes;
+	int nplanes;
+
+	const struct lease_object_props *crtc_props;
+	const struct lease_object_props *connector_props;
+
+	/* Only described if boot_fb_id is set */
+	uint32_t boot_fb_id;
+	const drmModeModeInfo *boot_mode;
+};
+
+/* Size of the buffer needed to describe a set of objects.  The boot mode
+ * is always counted, so the size doesn't change when it is dropped. */
+size_t lease_topology_size(const struct lease_topology_objects *objects);
+
+/* Describe the objects of a lease in a sealed memfd (see dlm-topology.h),
+ * using buf to build the description, without allocating memory.
+ * Returns the memfd, or -1 on failure. */
+int lease_topology_create(const struct lease_topology_objects *objects,
+			  void *buf, size_t size);
+#endif
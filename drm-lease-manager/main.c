@@ -13,14 +13,16 @@
  * limitations under the License.
  */
 
-#include "lease-manager.h"
-#include "lease-server.h"
-#include "log.h"
+#define _GNU_SOURCE
+#include "dlmserver.h"
 
-#include <assert.h>
+#include <errno.h>
 #include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
 
 static void usage(const char *progname)
 {
@@ -29,16 +31,133 @@ static void usage(const char *progname)
 	       "-h, --help \tPrint this help\n"
 	       "-v, --verbose \tEnable verbose debug messages\n"
 	       "-t, --lease-transfer \tAllow lease transfter to new clients\n"
-	       "-k, --keep-on-crash \tDon't close lease on client crash\n",
+	       "-k, --keep-on-crash \tDon't close lease on client crash\n"
+	       "-f, --fast-enumeration \tDon't wait for connector probing at "
+	       "startup\n"
+	       "-r, --resume-leases \tKeep lease on client crash, and let a "
+	       "restarted client resume it\n"
+	       "-c, --cursor-planes=<dedicated|always|none> \tCursor planes to "
+	       "include in leases (default: dedicated)\n"
+	       "-w, --writeback=<separate|attached> \tLease writeback "
+	       "connectors on their own, or with display leases\n"
+	       "-b, --vblank-transfer \tTransfer leases at the next vblank\n"
+	       "-u, --takeover \tTake over the leases of a running "
+	       "drm-lease-manager\n"
+	       "-s, --supervise \tRestart on crash, without revoking leases\n"
+	       "-F, --frame-stats \tPublish the frame timing of leases in the "
+	       "status page\n"
+	       "-R, --realtime=<priority> \tRun with SCHED_FIFO priority, "
+	       "without allocating memory after startup\n"
+	       "-a, --cpu-affinity=<mask> \tMask of the CPUs to run on in "
+	       "real-time mode\n"
+	       "-T, --trace-file=<path> \tAppend lease request traces to "
+	       "<path>\n"
+	       "-P, --profile-startup \tLog the time spent in each phase of "
+	       "startup\n"
+	       "-n, --dry-run \tPrint the planned leases, and exit without "
+	       "creating them\n",
 	       progname);
 }
 
-const char *opts = "vtkh";
-const struct option options[] = {
+static bool parse_cursor_planes(const char *arg,
+				enum dlm_server_cursor_planes *policy)
+{
+	if (!strcmp(arg, "dedicated"))
+		*policy = DLM_SERVER_CURSOR_DEDICATED;
+	else if (!strcmp(arg, "always"))
+		*policy = DLM_SERVER_CURSOR_ALWAYS;
+	else if (!strcmp(arg, "none"))
+		*policy = DLM_SERVER_CURSOR_NONE;
+	else
+		return false;
+	return true;
+}
+
+static bool parse_writeback_mode(const char *arg,
+				 enum dlm_server_writeback *mode)
+{
+	if (!strcmp(arg, "separate"))
+		*mode = DLM_SERVER_WRITEBACK_SEPARATE;
+	else if (!strcmp(arg, "attached"))
+		*mode = DLM_SERVER_WRITEBACK_ATTACHED;
+	else
+		return false;
+	return true;
+}
+
+static bool parse_number(const char *arg, unsigned long *value)
+{
+	char *end;
+	errno = 0;
+	*value = strtoul(arg, &end, 0);
+	return !errno && *arg && !*end;
+}
+
+/* SIGUSR1 logs the libdrm calls made so far */
+static volatile sig_atomic_t drm_calls_requested;
+
+static void request_drm_calls(int sig)
+{
+	(void)sig;
+	drm_calls_requested = 1;
+}
+
+/* Like dlm_server_run(), but SIGUSR1 is only delivered while waiting for
+ * requests, so that it never interrupts a request half way */
+static void run(struct dlm_server *server)
+{
+	sigset_t usr1, wait_mask;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &usr1, &wait_mask);
+	sigdelset(&wait_mask, SIGUSR1);
+
+	struct sigaction action = {.sa_handler = request_drm_calls};
+	sigaction(SIGUSR1, &action, NULL);
+
+	struct pollfd server_poll = {
+	    .fd = dlm_server_get_fd(server),
+	    .events = POLLIN,
+	};
+
+	do {
+		int timeout = dlm_server_get_timeout(server);
+		struct timespec ts = {
+		    .tv_sec = timeout / 1000,
+		    .tv_nsec = (timeout % 1000) * 1000000,
+		};
+		if (ppoll(&server_poll, 1, timeout < 0 ? NULL : &ts,
+			  &wait_mask) < 0 &&
+		    errno != EINTR) {
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			return;
+		}
+		if (drm_calls_requested) {
+			drm_calls_requested = 0;
+			dlm_server_log_drm_calls(server);
+		}
+	} while (dlm_server_dispatch(server));
+}
+
+const char *opts = "vtkfrc:w:bushFR:a:T:Pn";
+const struct option long_options[] = {
     {"help", no_argument, NULL, 'h'},
     {"verbose", no_argument, NULL, 'v'},
     {"lease-transfer", no_argument, NULL, 't'},
     {"keep-on-crash", no_argument, NULL, 'k'},
+    {"fast-enumeration", no_argument, NULL, 'f'},
+    {"resume-leases", no_argument, NULL, 'r'},
+    {"cursor-planes", required_argument, NULL, 'c'},
+    {"writeback", required_argument, NULL, 'w'},
+    {"vblank-transfer", no_argument, NULL, 'b'},
+    {"takeover", no_argument, NULL, 'u'},
+    {"supervise", no_argument, NULL, 's'},
+    {"frame-stats", no_argument, NULL, 'F'},
+    {"realtime", required_argument, NULL, 'R'},
+    {"cpu-affinity", required_argument, NULL, 'a'},
+    {"trace-file", required_argument, NULL, 'T'},
+    {"profile-startup", no_argument, NULL, 'P'},
+    {"dry-run", no_argument, NULL, 'n'},
     {NULL, 0, NULL, 0},
 };
 
@@ -47,21 +166,78 @@ int main(int argc, char **argv)
 	char *device = "/dev/dri/card0";
 
 	bool debug_log = false;
-	bool can_transfer_leases = false;
-	bool keep_on_crash = false;
+	bool supervise = false;
+	bool dry_run = false;
+	struct dlm_server_options options = {0};
 
+	unsigned long value;
 	int c;
-	while ((c = getopt_long(argc, argv, opts, options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, opts, long_options, NULL)) != -1) {
 		int ret = EXIT_FAILURE;
 		switch (c) {
 		case 'v':
 			debug_log = true;
 			break;
 		case 't':
-			can_transfer_leases = true;
+			options.lease_transfer = true;
 			break;
 		case 'k':
-			keep_on_crash = true;
+			options.keep_on_crash = true;
+			break;
+		case 'f':
+			options.fast_enumeration = true;
+			break;
+		case 'r':
+			options.resume_leases = true;
+			break;
+		case 'c':
+			if (!parse_cursor_planes(optarg,
+						 &options.cursor_planes)) {
+				usage(argv[0]);
+				return ret;
+			}
+			break;
+		case 'w':
+			if (!parse_writeback_mode(optarg, &options.writeback)) {
+				usage(argv[0]);
+				return ret;
+			}
+			break;
+		case 'b':
+			options.vblank_transfer = true;
+			break;
+		case 'u':
+			options.takeover = true;
+			break;
+		case 's':
+			supervise = true;
+			break;
+		case 'F':
+			options.frame_stats = true;
+			break;
+		case 'R':
+			if (!parse_number(optarg, &value) || value < 1 ||
+			    value > 99) {
+				usage(argv[0]);
+				return ret;
+			}
+			options.realtime_priority = value;
+			break;
+		case 'a':
+			if (!parse_number(optarg, &value) || !value) {
+				usage(argv[0]);
+				return ret;
+			}
+			options.cpu_affinity = value;
+			break;
+		case 'T':
+			options.trace_file = optarg;
+			break;
+		case 'P':
+			options.profile_startup = true;
+			break;
+		case 'n':
+			dry_run = true;
 			break;
 		case 'h':
 			ret = EXIT_SUCCESS;
@@ -75,75 +251,25 @@ int main(int argc, char **argv)
 	if (optind < argc)
 		device = argv[optind];
 
-	dlm_log_enable_debug(debug_log);
-
-	struct lm *lm = lm_create(device);
-	if (!lm) {
-		ERROR_LOG("DRM Lease initialization failed\n");
-		return EXIT_FAILURE;
-	}
+	dlm_server_enable_debug_log(debug_log);
 
-	struct lease_handle **lease_handles = NULL;
-	int count_ids = lm_get_lease_handles(lm, &lease_handles);
-	assert(count_ids > 0);
+	if (dry_run)
+		return dlm_server_dry_run(device, &options, stdout)
+			   ? EXIT_SUCCESS
+			   : EXIT_FAILURE;
 
-	struct ls *ls = ls_create(lease_handles, count_ids);
-	if (!ls) {
-		lm_destroy(lm);
-		ERROR_LOG("Client socket initialization failed\n");
+	if (supervise && !dlm_server_supervise()) {
+		fprintf(stderr, "Can't start supervisor\n");
 		return EXIT_FAILURE;
 	}
 
-	struct ls_req req;
-	while (ls_get_request(ls, &req)) {
-		switch (req.type) {
-		case LS_REQ_GET_LEASE: {
-			int fd = lm_lease_grant(lm, req.lease_handle);
-
-			if (fd < 0 && can_transfer_leases)
-				fd = lm_lease_transfer(lm, req.lease_handle);
-
-			if (fd < 0) {
-				ERROR_LOG(
-				    "Can't fulfill lease request: lease=%s\n",
-				    req.lease_handle->name);
-				ls_disconnect_client(ls, req.client);
-				break;
-			}
-
-			struct ls_client *active_client =
-			    req.lease_handle->user_data;
-			if (active_client)
-				ls_disconnect_client(ls, active_client);
-
-			req.lease_handle->user_data = req.client;
-
-			if (!ls_send_fd(ls, req.client, fd)) {
-				ERROR_LOG(
-				    "Client communication error: lease=%s\n",
-				    req.lease_handle->name);
-				ls_disconnect_client(ls, req.client);
-				lm_lease_revoke(lm, req.lease_handle);
-			}
-			break;
-		}
-		case LS_REQ_RELEASE_LEASE:
-		case LS_REQ_CLIENT_DISCONNECT:
-			ls_disconnect_client(ls, req.client);
-			req.lease_handle->user_data = NULL;
-			lm_lease_revoke(lm, req.lease_handle);
+	struct dlm_server *server = dlm_server_create(device, &options);
+	if (!server)
+		return EXIT_FAILURE;
 
-			if (!keep_on_crash || req.type == LS_REQ_RELEASE_LEASE)
-				lm_lease_close(req.lease_handle);
+	run(server);
 
-			break;
-		default:
-			ERROR_LOG("Internal error: Invalid lease request\n");
-			goto done;
-		}
-	}
-done:
-	ls_destroy(ls);
-	lm_destroy(lm);
-	return EXIT_FAILURE;
+	int ret = dlm_server_handed_off(server) ? EXIT_SUCCESS : EXIT_FAILURE;
+	dlm_server_destroy(server);
+	return ret;
 }
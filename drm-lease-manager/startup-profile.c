@@ -0,0 +1,57 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "startup-profile.h"
+
+#include "drm-calls.h"
+#include "log.h"
+
+#include <time.h>
+
+static void get_counters(uint64_t *time_ns, uint64_t *calls)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*time_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	struct drm_call_stats stats;
+	drm_calls_get_total(&stats);
+	*calls = stats.calls;
+}
+
+void startup_profile_start(struct startup_profile *profile, bool enabled)
+{
+	profile->enabled = enabled;
+	if (enabled)
+		get_counters(&profile->time_ns, &profile->calls);
+}
+
+void startup_profile_phase(struct startup_profile *profile, const char *phase,
+			   const char *object)
+{
+	if (!profile->enabled)
+		return;
+
+	uint64_t time_ns, calls;
+	get_counters(&time_ns, &calls);
+
+	INFO_LOG("Startup: %s%s%s: %llu us, %llu libdrm calls\n", phase,
+		 object ? " " : "", object ? object : "",
+		 (unsigned long long)(time_ns - profile->time_ns) / 1000,
+		 (unsigned long long)(calls - profile->calls));
+
+	profile->time_ns = time_ns;
+	profile->calls = calls;
+}
@@ -0,0 +1,38 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STARTUP_PROFILE_H
+#define STARTUP_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Startup profiling
+ * Logs the time spent in each phase of startup, and the libdrm calls made
+ * in it.  Each phase starts where the previous one ended.  Nothing is
+ * logged unless the profile is enabled. */
+struct startup_profile {
+	bool enabled;
+	uint64_t time_ns;
+	uint64_t calls;
+};
+
+void startup_profile_start(struct startup_profile *profile, bool enabled);
+
+/* End the current phase.  object, if not NULL, is the DRM object the
+ * phase was spent on. */
+void startup_profile_phase(struct startup_profile *profile, const char *phase,
+			   const char *object);
+#endif
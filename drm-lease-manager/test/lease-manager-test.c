@@ -13,18 +13,38 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <check.h>
 #include <fff.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
 #include <unistd.h>
+#include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "dlm-protocol.h"
+#include "dlm-status.h"
+#include "dlm-topology.h"
+#include "dlmserver.h"
+#include "drm-calls.h"
 #include "lease-manager.h"
 #include "log.h"
+#include "socket-path.h"
 #include "test-drm-device.h"
 #include "test-helpers.h"
 
+#define RUNTIME_DIR "/tmp"
+#define STATUS_FILE RUNTIME_DIR "/" DLM_STATUS_FILE_NAME
+
 /* CHECK_LEASE_OBJECTS
  *
  * Checks the list of objects associated with a given lease_index.
@@ -44,6 +64,7 @@
 /**************  Mock functions  *************/
 DEFINE_FFF_GLOBALS;
 
+FAKE_VALUE_FUNC(int, drmSetClientCap, int, uint64_t, uint64_t);
 FAKE_VALUE_FUNC(drmModeResPtr, drmModeGetResources, int);
 FAKE_VOID_FUNC(drmModeFreeResources, drmModeResPtr);
 FAKE_VALUE_FUNC(drmModePlaneResPtr, drmModeGetPlaneResources, int);
@@ -52,6 +73,8 @@ FAKE_VOID_FUNC(drmModeFreePlaneResources, drmModePlaneResPtr);
 FAKE_VALUE_FUNC(drmModePlanePtr, drmModeGetPlane, int, uint32_t);
 FAKE_VOID_FUNC(drmModeFreePlane, drmModePlanePtr);
 FAKE_VALUE_FUNC(drmModeConnectorPtr, drmModeGetConnector, int, uint32_t);
+FAKE_VALUE_FUNC(drmModeConnectorPtr, drmModeGetConnectorCurrent, int,
+		uint32_t);
 FAKE_VOID_FUNC(drmModeFreeConnector, drmModeConnectorPtr);
 FAKE_VALUE_FUNC(drmModeEncoderPtr, drmModeGetEncoder, int, uint32_t);
 FAKE_VOID_FUNC(drmModeFreeEncoder, drmModeEncoderPtr);
@@ -60,10 +83,46 @@ FAKE_VALUE_FUNC(int, drmModeCreateLease, int, const uint32_t *, int, int,
 		uint32_t *);
 FAKE_VALUE_FUNC(int, drmModeRevokeLease, int, uint32_t);
 
+FAKE_VALUE_FUNC(drmModeObjectPropertiesPtr, drmModeObjectGetProperties, int,
+		uint32_t, uint32_t);
+FAKE_VOID_FUNC(drmModeFreeObjectProperties, drmModeObjectPropertiesPtr);
+FAKE_VALUE_FUNC(drmModePropertyPtr, drmModeGetProperty, int, uint32_t);
+FAKE_VOID_FUNC(drmModeFreeProperty, drmModePropertyPtr);
+FAKE_VALUE_FUNC(drmModePropertyBlobPtr, drmModeGetPropertyBlob, int,
+		uint32_t);
+FAKE_VOID_FUNC(drmModeFreePropertyBlob, drmModePropertyBlobPtr);
+FAKE_VALUE_FUNC(drmModeCrtcPtr, drmModeGetCrtc, int, uint32_t);
+FAKE_VALUE_FUNC(int, drmIoctl, int, unsigned long, void *);
+FAKE_VALUE_FUNC(int, drmCrtcQueueSequence, int, uint32_t, uint32_t, uint64_t,
+		uint64_t *, uint64_t);
+FAKE_VALUE_FUNC(int, drmCrtcGetSequence, int, uint32_t, uint64_t *,
+		uint64_t *);
+FAKE_VOID_FUNC(drmModeFreeCrtc, drmModeCrtcPtr);
+FAKE_VALUE_FUNC(drmModeObjectListPtr, drmModeGetLease, int);
+FAKE_VOID_FUNC(drmFree, void *);
+
 /************** Test fixutre functions *************************/
 
+/* CRTC state is read with the DRM_IOCTL_MODE_GETCRTC ioctl, which reports
+ * the CRTCs returned by the drmModeGetCrtc() fake */
+static int drm_ioctl(int fd, unsigned long request, void *arg)
+{
+	if (request == DRM_IOCTL_MODE_GETCRTC) {
+		struct drm_mode_crtc *crtc_req = arg;
+		drmModeCrtcPtr crtc = drmModeGetCrtc(fd, crtc_req->crtc_id);
+		if (!crtc)
+			return -1;
+		crtc_req->fb_id = crtc->buffer_id;
+		return 0;
+	}
+	return 0;
+}
+
 static void test_setup(void)
 {
+	setenv("DLM_RUNTIME_PATH", RUNTIME_DIR, 1);
+
+	RESET_FAKE(drmSetClientCap);
 	RESET_FAKE(drmModeGetResources);
 	RESET_FAKE(drmModeFreeResources);
 	RESET_FAKE(drmModeGetPlaneResources);
@@ -72,6 +131,7 @@ static void test_setup(void)
 	RESET_FAKE(drmModeGetPlane);
 	RESET_FAKE(drmModeFreePlane);
 	RESET_FAKE(drmModeGetConnector);
+	RESET_FAKE(drmModeGetConnectorCurrent);
 	RESET_FAKE(drmModeFreeConnector);
 	RESET_FAKE(drmModeGetEncoder);
 	RESET_FAKE(drmModeFreeEncoder);
@@ -79,13 +139,29 @@ static void test_setup(void)
 	RESET_FAKE(drmModeCreateLease);
 	RESET_FAKE(drmModeRevokeLease);
 
+	RESET_FAKE(drmModeObjectGetProperties);
+	RESET_FAKE(drmModeFreeObjectProperties);
+	RESET_FAKE(drmModeGetProperty);
+	RESET_FAKE(drmModeFreeProperty);
+	RESET_FAKE(drmModeGetPropertyBlob);
+	RESET_FAKE(drmModeFreePropertyBlob);
+	RESET_FAKE(drmModeGetCrtc);
+	RESET_FAKE(drmModeFreeCrtc);
+	RESET_FAKE(drmIoctl);
+	RESET_FAKE(drmCrtcQueueSequence);
+	RESET_FAKE(drmCrtcGetSequence);
+	RESET_FAKE(drmModeGetLease);
+	RESET_FAKE(drmFree);
+
 	drmModeGetResources_fake.return_val = TEST_DEVICE_RESOURCES;
 	drmModeGetPlaneResources_fake.return_val = TEST_DEVICE_PLANE_RESOURCES;
 
 	drmModeGetPlane_fake.custom_fake = get_plane;
 	drmModeGetConnector_fake.custom_fake = get_connector;
+	drmModeGetConnectorCurrent_fake.custom_fake = get_connector;
 	drmModeGetEncoder_fake.custom_fake = get_encoder;
 	drmModeCreateLease_fake.custom_fake = create_lease;
+	drmIoctl_fake.custom_fake = drm_ioctl;
 }
 
 static void test_shutdown(void)
@@ -129,7 +205,7 @@ START_TEST(all_outputs_connected)
 
 	setup_test_device_layout(connectors, encoders, NULL);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -170,7 +246,7 @@ START_TEST(no_outputs_connected)
 
 	setup_test_device_layout(connectors, encoders, NULL);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -210,7 +286,7 @@ START_TEST(some_outputs_connected)
 
 	setup_test_device_layout(connectors, encoders, NULL);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -226,9 +302,10 @@ END_TEST
 
 /* fewer_crtcs_than_connectors  */
 /* Test details: Create leases on a system with more connectors than CRTCs
- * Expected results: Number of leases generated should correspond to number of
- *                   CRTCs.
- *                   Leases contain one valid connector for each CRTC.
+ * Expected results: A lease is generated for each connector.
+ *                   CRTCs are bound to leases when they are granted, so a
+ *                   lease can only be granted when one of its CRTCs is
+ *                   free.
  */
 START_TEST(fewer_crtcs_than_connectors)
 {
@@ -251,15 +328,25 @@ START_TEST(fewer_crtcs_than_connectors)
 
 	setup_test_device_layout(connectors, encoders, NULL);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
-	ck_assert_int_eq(lm_get_lease_handles(lm, &handles), crtc_cnt);
+	ck_assert_int_eq(lm_get_lease_handles(lm, &handles), out_cnt);
 	ck_assert_ptr_ne(handles, NULL);
 
 	CHECK_LEASE_OBJECTS(handles[0], CRTC_ID(0), CONNECTOR_ID(0));
-	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(2));
+	CHECK_LEASE_OBJECTS(handles[2], CRTC_ID(1), CONNECTOR_ID(2));
+
+	/* The only CRTC usable by the second connector is in use */
+	ck_assert_int_lt(lm_lease_grant(lm, handles[1]), 0);
+
+	lm_lease_revoke(lm, handles[0]);
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(0), CONNECTOR_ID(1));
+
+	/* The first lease now switches to the CRTC left free */
+	lm_lease_revoke(lm, handles[2]);
+	CHECK_LEASE_OBJECTS(handles[0], CRTC_ID(1), CONNECTOR_ID(0));
 	lm_destroy(lm);
 }
 END_TEST
@@ -296,7 +383,7 @@ START_TEST(separate_overlay_planes_by_crtc)
 
 	setup_test_device_layout(connectors, encoders, planes);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -344,7 +431,7 @@ START_TEST(reject_planes_shared_between_multiple_crtcs)
 
 	setup_test_device_layout(connectors, encoders, planes);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -359,6 +446,170 @@ START_TEST(reject_planes_shared_between_multiple_crtcs)
 }
 END_TEST
 
+/* shared_planes_added_on_demand */
+/* Test details: Grant leases with a plane demand, on a device where some
+ *               planes are shared between CRTCs.
+ * Expected results: Shared planes are added to a lease only as needed to
+ *                   meet the demand, and returned when the lease is
+ *                   revoked.  A grant fails if the demand can't be met.
+ */
+START_TEST(shared_planes_added_on_demand)
+{
+	int out_cnt = 2, plane_cnt = 3;
+
+	ck_assert_int_eq(
+	    setup_drm_test_device(out_cnt, out_cnt, out_cnt, plane_cnt), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	    PLANE(PLANE_ID(1), 0x3),
+	    PLANE(PLANE_ID(2), 0x3),
+	};
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(out_cnt, lm_get_lease_handles(lm, &handles));
+
+	/* The dedicated plane counts towards the demand */
+	struct lease_plane_demand demand = {.overlay = 2};
+	lm_lease_set_plane_demand(lm, handles[0], &demand);
+	CHECK_LEASE_OBJECTS(handles[0], PLANE_ID(0), CRTC_ID(0),
+			    CONNECTOR_ID(0), PLANE_ID(1));
+
+	lm_lease_set_plane_demand(lm, handles[1], &demand);
+	ck_assert_int_lt(lm_lease_grant(lm, handles[1]), 0);
+
+	lm_lease_revoke(lm, handles[0]);
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    PLANE_ID(1), PLANE_ID(2));
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* writeback_connectors_are_leased */
+/* Test details: Create leases with writeback connectors leased separately,
+ *               then attached to display leases.
+ * Expected results: Writeback connectors are enabled, and the atomic cap
+ *                   is only held while enabling them.  A separate writeback
+ *                   connector has a lease of its own.  An attached one is
+ *                   added to a display lease granted with a CRTC it can be
+ *                   used with, and is free again once that lease is revoked.
+ */
+START_TEST(writeback_connectors_are_leased)
+{
+	ck_assert_int_eq(setup_drm_test_device(2, 3, 3, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	    CONNECTOR(CONNECTOR_ID(2), 0, &ENCODER_ID(2), 1),
+	};
+	connectors[2].connector_type = DRM_MODE_CONNECTOR_WRITEBACK;
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	    ENCODER(ENCODER_ID(2), 0, 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm_options options = {.writeback = LM_WRITEBACK_SEPARATE};
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+	ck_assert_int_eq(drmSetClientCap_fake.call_count, 5);
+	ck_assert_int_eq(drmSetClientCap_fake.arg1_history[1],
+			 DRM_CLIENT_CAP_ATOMIC);
+	ck_assert_int_eq(drmSetClientCap_fake.arg1_history[2],
+			 DRM_CLIENT_CAP_WRITEBACK_CONNECTORS);
+	ck_assert_int_eq(drmSetClientCap_fake.arg1_history[3],
+			 DRM_CLIENT_CAP_ATOMIC);
+	ck_assert_int_eq(drmSetClientCap_fake.arg2_history[3], 0);
+	ck_assert_int_eq(drmSetClientCap_fake.arg1_val,
+			 DRM_CLIENT_CAP_UNIVERSAL_PLANES);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(3, lm_get_lease_handles(lm, &handles));
+	CHECK_LEASE_OBJECTS(handles[2], CRTC_ID(1), CONNECTOR_ID(2));
+	lm_destroy(lm);
+
+	options.writeback = LM_WRITEBACK_ATTACHED;
+	lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+	CHECK_LEASE_OBJECTS(handles[0], CRTC_ID(0), CONNECTOR_ID(0));
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    CONNECTOR_ID(2));
+
+	lm_lease_revoke(lm, handles[1]);
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    CONNECTOR_ID(2));
+	lm_destroy(lm);
+}
+END_TEST
+
+/* fast_enumeration_defers_connector_probe */
+/* Test details: Create leases with fast enumeration enabled.
+ * Expected results: Leases are created from the current connector state
+ *                   without probing. Each connector is probed once, in the
+ *                   background, after the leases have been created.
+ */
+START_TEST(fast_enumeration_defers_connector_probe)
+{
+	int out_cnt = 2, plane_cnt = 0;
+
+	ck_assert_int_eq(
+	    setup_drm_test_device(out_cnt, out_cnt, out_cnt, plane_cnt), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm_options options = {
+	    .fast_enumeration = true,
+	};
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+	ck_assert_int_eq(drmModeGetConnectorCurrent_fake.call_count, out_cnt);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(out_cnt, lm_get_lease_handles(lm, &handles));
+	ck_assert_ptr_ne(handles, NULL);
+
+	CHECK_LEASE_OBJECTS(handles[0], CRTC_ID(0), CONNECTOR_ID(0));
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1));
+
+	/* lm_destroy() waits for the background probe to complete */
+	lm_destroy(lm);
+	ck_assert_int_eq(drmModeGetConnector_fake.call_count, out_cnt);
+}
+END_TEST
+
 static void add_connector_enum_tests(Suite *s)
 {
 	TCase *tc = tcase_create("Resource enumeration");
@@ -371,6 +622,9 @@ static void add_connector_enum_tests(Suite *s)
 	tcase_add_test(tc, some_outputs_connected);
 	tcase_add_test(tc, separate_overlay_planes_by_crtc);
 	tcase_add_test(tc, reject_planes_shared_between_multiple_crtcs);
+	tcase_add_test(tc, shared_planes_added_on_demand);
+	tcase_add_test(tc, writeback_connectors_are_leased);
+	tcase_add_test(tc, fast_enumeration_defers_connector_probe);
 	suite_add_tcase(s, tc);
 }
 
@@ -398,7 +652,7 @@ START_TEST(create_and_revoke_lease)
 
 	setup_test_device_layout(connectors, encoders, NULL);
 
-	struct lm *lm = lm_create(TEST_DRM_DEVICE);
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
 	ck_assert_ptr_ne(lm, NULL);
 
 	struct lease_handle **handles;
@@ -419,6 +673,1547 @@ START_TEST(create_and_revoke_lease)
 }
 END_TEST
 
+/* resume_granted_lease */
+/* Test details: Resume a lease that is currently granted, then revoke it
+ *               and try to resume it again.
+ * Expected results: The granted lease fd is returned without creating a new
+ *                   lease. A revoked lease can't be resumed.
+ */
+START_TEST(resume_granted_lease)
+{
+	bool res = setup_drm_test_device(1, 1, 1, 0);
+	ck_assert_int_eq(res, true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(1, lm_get_lease_handles(lm, &handles));
+	ck_assert_ptr_ne(handles, NULL);
+
+	ck_assert_int_eq(lm_lease_resume(lm, handles[0]), -1);
+
+	int lease_fd = lm_lease_grant(lm, handles[0]);
+	ck_assert_int_ge(lease_fd, 0);
+
+	ck_assert_int_eq(lm_lease_resume(lm, handles[0]), lease_fd);
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 1);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 0);
+
+	lm_lease_revoke(lm, handles[0]);
+	ck_assert_int_eq(lm_lease_resume(lm, handles[0]), -1);
+}
+END_TEST
+
+/* Plane properties reported by the test device:
+ * the plane type, and the supported formats with modifiers. */
+#define TYPE_PROP_ID 100
+#define IN_FORMATS_PROP_ID 101
+#define IN_FORMATS_BLOB_ID 200
+
+#define TEST_FORMAT_XRGB8888 0x34325258
+#define TEST_FORMAT_NV12 0x3231564e
+#define TEST_MODIFIER 0x0100000000000001ull
+
+static uint32_t plane_prop_ids[] = {TYPE_PROP_ID, IN_FORMATS_PROP_ID};
+static uint64_t plane_prop_values[] = {DRM_PLANE_TYPE_PRIMARY,
+				       IN_FORMATS_BLOB_ID};
+
+static drmModeObjectProperties plane_props = {
+    .count_props = ARRAY_LEN(plane_prop_ids),
+    .props = plane_prop_ids,
+    .prop_values = plane_prop_values,
+};
+
+static drmModePropertyRes properties[] = {
+    {.prop_id = TYPE_PROP_ID, .name = "type"},
+    {.prop_id = IN_FORMATS_PROP_ID, .name = "IN_FORMATS"},
+};
+
+static struct {
+	struct drm_format_modifier_blob hdr;
+	uint32_t formats[2];
+	struct drm_format_modifier modifiers[1];
+} in_formats = {
+    .hdr =
+	{
+	    .version = FORMAT_BLOB_CURRENT,
+	    .count_formats = 2,
+	    .formats_offset = offsetof(typeof(in_formats), formats),
+	    .count_modifiers = 1,
+	    .modifiers_offset = offsetof(typeof(in_formats), modifiers),
+	},
+    .formats = {TEST_FORMAT_XRGB8888, TEST_FORMAT_NV12},
+    /* The modifier only applies to the second format */
+    .modifiers = {{.formats = 0x2, .offset = 0, .modifier = TEST_MODIFIER}},
+};
+
+static drmModePropertyBlobRes in_formats_blob = {
+    .id = IN_FORMATS_BLOB_ID,
+    .length = sizeof(in_formats),
+    .data = &in_formats,
+};
+
+static drmModeObjectPropertiesPtr get_object_properties(int fd, uint32_t id,
+							 uint32_t type)
+{
+	UNUSED(fd);
+	UNUSED(id);
+	return type == DRM_MODE_OBJECT_PLANE ? &plane_props : NULL;
+}
+
+static drmModePropertyPtr get_property(int fd, uint32_t id)
+{
+	UNUSED(fd);
+	for (unsigned int i = 0; i < ARRAY_LEN(properties); i++) {
+		if (properties[i].prop_id == id)
+			return &properties[i];
+	}
+	return NULL;
+}
+
+static drmModePropertyBlobPtr get_property_blob(int fd, uint32_t id)
+{
+	UNUSED(fd);
+	return id == IN_FORMATS_BLOB_ID ? &in_formats_blob : NULL;
+}
+
+/* lease_topology_describes_lease_objects */
+/* Test details: Get the topology memfd of a lease.
+ * Expected results: The memfd is sealed, and describes the lease
+ *                   connector, CRTC, modes, planes and plane properties.
+ *                   The topology is only built once.
+ */
+START_TEST(lease_topology_describes_lease_objects)
+{
+	bool res = setup_drm_test_device(1, 1, 1, 1);
+	ck_assert_int_eq(res, true);
+
+	drmModeModeInfo modes[] = {
+	    {.hdisplay = 1920, .vdisplay = 1080, .vrefresh = 60},
+	    {.hdisplay = 1280, .vdisplay = 720, .vrefresh = 60},
+	};
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+	connectors[0].connection = DRM_MODE_CONNECTED;
+	connectors[0].modes = modes;
+	connectors[0].count_modes = ARRAY_LEN(modes);
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	uint32_t plane_formats[] = {TEST_FORMAT_XRGB8888, TEST_FORMAT_NV12};
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	};
+	planes[0].formats = plane_formats;
+	planes[0].count_formats = ARRAY_LEN(plane_formats);
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	drmModeObjectGetProperties_fake.custom_fake = get_object_properties;
+	drmModeGetProperty_fake.custom_fake = get_property;
+	drmModeGetPropertyBlob_fake.custom_fake = get_property_blob;
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(1, lm_get_lease_handles(lm, &handles));
+
+	int fd = lm_lease_topology_fd(lm, handles[0]);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE, F_SEAL_WRITE);
+
+	struct stat st;
+	ck_assert_int_eq(fstat(fd, &st), 0);
+	const void *data =
+	    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	ck_assert_ptr_ne(data, MAP_FAILED);
+	close(fd);
+
+	ck_assert_int_eq(dlm_topology_validate(data, st.st_size), true);
+
+	const struct dlm_topology_header *hdr = data;
+	ck_assert_uint_eq(hdr->connector_id, CONNECTOR_ID(0));
+	ck_assert_uint_eq(hdr->crtc_id, CRTC_ID(0));
+	ck_assert_uint_eq(hdr->connection, DRM_MODE_CONNECTED);
+
+	ck_assert_uint_eq(hdr->modes.count, ARRAY_LEN(modes));
+	const struct dlm_topology_mode *topo_modes =
+	    dlm_topology_array_data(data, &hdr->modes);
+	ck_assert_uint_eq(topo_modes[1].hdisplay, 1280);
+
+	ck_assert_uint_eq(hdr->planes.count, 1);
+	const struct dlm_topology_plane *plane =
+	    dlm_topology_array_data(data, &hdr->planes);
+	ck_assert_uint_eq(plane->plane_id, PLANE_ID(0));
+	ck_assert_uint_eq(plane->type, DRM_PLANE_TYPE_PRIMARY);
+
+	ck_assert_uint_eq(plane->formats.count, ARRAY_LEN(plane_formats));
+	check_uint_array_eq(dlm_topology_array_data(data, &plane->formats),
+			    plane_formats, ARRAY_LEN(plane_formats));
+
+	ck_assert_uint_eq(plane->modifiers.count, 1);
+	const struct dlm_topology_modifier *mod =
+	    dlm_topology_array_data(data, &plane->modifiers);
+	ck_assert_uint_eq(mod->format, TEST_FORMAT_NV12);
+	ck_assert(mod->modifier == TEST_MODIFIER);
+
+	ck_assert_uint_eq(hdr->props.count, ARRAY_LEN(properties));
+	const struct dlm_topology_prop *props =
+	    dlm_topology_array_data(data, &hdr->props);
+	ck_assert_uint_eq(props[0].object_id, PLANE_ID(0));
+	ck_assert_uint_eq(props[0].prop_id, TYPE_PROP_ID);
+	ck_assert_str_eq(props[0].name, "type");
+
+	munmap((void *)data, st.st_size);
+
+	/* The topology is cached */
+	int calls = drmModeObjectGetProperties_fake.call_count;
+	fd = lm_lease_topology_fd(lm, handles[0]);
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+	ck_assert_int_eq(drmModeObjectGetProperties_fake.call_count, calls);
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* Plane types, for planes 0 to 3 of the universal planes test */
+static uint64_t plane_types[] = {DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_CURSOR,
+				 DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_CURSOR};
+static uint32_t type_prop_id = TYPE_PROP_ID;
+static drmModeObjectProperties typed_plane_props[ARRAY_LEN(plane_types)];
+
+static drmModeObjectPropertiesPtr get_plane_type(int fd, uint32_t id,
+						 uint32_t type)
+{
+	UNUSED(fd);
+	UNUSED(type);
+	for (unsigned int i = 0; i < ARRAY_LEN(plane_types); i++) {
+		if (PLANE_ID(i) != id)
+			continue;
+		typed_plane_props[i] = (drmModeObjectProperties){
+		    .count_props = 1,
+		    .props = &type_prop_id,
+		    .prop_values = &plane_types[i],
+		};
+		return &typed_plane_props[i];
+	}
+	return NULL;
+}
+
+static struct lm *create_lm_with_cursor_policy(enum lm_cursor_policy policy)
+{
+	struct lm_options options = {.cursor_policy = policy};
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+	return lm;
+}
+
+/* universal_planes_are_leased */
+/* Test details: Create leases with each cursor plane policy, on a device
+ *               with primary and cursor planes.
+ * Expected results: Universal planes are enabled before the planes are
+ *                   enumerated.  Every lease gets a primary plane, taken
+ *                   from the shared planes if its CRTC has none.  Cursor
+ *                   planes are added according to the policy.
+ */
+START_TEST(universal_planes_are_leased)
+{
+	ck_assert_int_eq(setup_drm_test_device(2, 2, 2, 4), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	/* The second CRTC has no planes of its own */
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	    PLANE(PLANE_ID(1), 0x1),
+	    PLANE(PLANE_ID(2), 0x3),
+	    PLANE(PLANE_ID(3), 0x3),
+	};
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	drmModeObjectGetProperties_fake.custom_fake = get_plane_type;
+	drmModeGetProperty_fake.custom_fake = get_property;
+
+	struct lease_handle **handles;
+	struct lm *lm = create_lm_with_cursor_policy(LM_CURSOR_DEDICATED);
+	ck_assert_int_eq(drmSetClientCap_fake.call_count, 1);
+	ck_assert_int_eq(drmSetClientCap_fake.arg1_val,
+			 DRM_CLIENT_CAP_UNIVERSAL_PLANES);
+	ck_assert_int_eq(drmSetClientCap_fake.arg2_val, 1);
+
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+	CHECK_LEASE_OBJECTS(handles[0], PLANE_ID(0), PLANE_ID(1), CRTC_ID(0),
+			    CONNECTOR_ID(0));
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    PLANE_ID(2));
+	lm_destroy(lm);
+
+	lm = create_lm_with_cursor_policy(LM_CURSOR_ALWAYS);
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    PLANE_ID(2), PLANE_ID(3));
+	lm_destroy(lm);
+
+	lm = create_lm_with_cursor_policy(LM_CURSOR_NONE);
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+	CHECK_LEASE_OBJECTS(handles[0], PLANE_ID(0), CRTC_ID(0),
+			    CONNECTOR_ID(0));
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(1), CONNECTOR_ID(1),
+			    PLANE_ID(2));
+	lm_destroy(lm);
+}
+END_TEST
+
+/* select_lease_by_constraints */
+/* Test details: Select leases with different mode and plane constraints.
+ * Expected results: The free lease with the smallest matching mode is
+ *                   selected.  NULL is returned if no free lease matches.
+ */
+START_TEST(select_lease_by_constraints)
+{
+	int out_cnt = 2, plane_cnt = 2;
+	bool res = setup_drm_test_device(out_cnt, out_cnt, out_cnt, plane_cnt);
+	ck_assert_int_eq(res, true);
+
+	drmModeModeInfo hd_modes[] = {
+	    {.hdisplay = 1920, .vdisplay = 1080, .vrefresh = 60},
+	};
+	drmModeModeInfo uhd_modes[] = {
+	    {.hdisplay = 3840, .vdisplay = 2160, .vrefresh = 60},
+	    {.hdisplay = 1920, .vdisplay = 1080, .vrefresh = 60},
+	};
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+	connectors[0].connection = DRM_MODE_CONNECTED;
+	connectors[0].modes = hd_modes;
+	connectors[0].count_modes = ARRAY_LEN(hd_modes);
+	connectors[1].connection = DRM_MODE_CONNECTED;
+	connectors[1].modes = uhd_modes;
+	connectors[1].count_modes = ARRAY_LEN(uhd_modes);
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	uint32_t rgb_formats[] = {TEST_FORMAT_XRGB8888};
+	uint32_t yuv_formats[] = {TEST_FORMAT_XRGB8888, TEST_FORMAT_NV12};
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	    PLANE(PLANE_ID(1), 0x2),
+	};
+	planes[0].formats = rgb_formats;
+	planes[0].count_formats = ARRAY_LEN(rgb_formats);
+	planes[1].formats = yuv_formats;
+	planes[1].count_formats = ARRAY_LEN(yuv_formats);
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(out_cnt, lm_get_lease_handles(lm, &handles));
+
+	struct lease_constraints constraints = {
+	    .min_width = 1280,
+	    .min_height = 720,
+	    .min_refresh = 60,
+	};
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[0]);
+
+	constraints.plane_format = TEST_FORMAT_NV12;
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[1]);
+
+	constraints.has_plane_type = true;
+	constraints.plane_type = DRM_PLANE_TYPE_PRIMARY;
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), NULL);
+
+	constraints = (struct lease_constraints){
+	    .min_width = 3840,
+	    .min_height = 2160,
+	    .min_refresh = 60,
+	};
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[1]);
+
+	constraints.min_refresh = 120;
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), NULL);
+
+	/* Granted leases are not selected */
+	constraints = (struct lease_constraints){.connected = true};
+	ck_assert_int_ge(lm_lease_grant(lm, handles[0]), 0);
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[1]);
+
+	ck_assert_int_ge(lm_lease_grant(lm, handles[1]), 0);
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), NULL);
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* select_lease_on_crtc_to_be_bound */
+/* Test details: Select a lease whose last CRTC is in use by another lease,
+ *               so that it would be granted with another CRTC.
+ * Expected results: The plane constraints are checked against the planes of
+ *                   the CRTC the lease would be granted with.
+ */
+START_TEST(select_lease_on_crtc_to_be_bound)
+{
+	int out_cnt = 2, plane_cnt = 2, crtc_cnt = 2;
+	bool res = setup_drm_test_device(crtc_cnt, out_cnt, out_cnt, plane_cnt);
+	ck_assert_int_eq(res, true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), 0, &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), 0, &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), 0, 0x3),
+	    ENCODER(ENCODER_ID(1), 0, 0x1),
+	};
+
+	uint32_t rgb_formats[] = {TEST_FORMAT_XRGB8888};
+	uint32_t yuv_formats[] = {TEST_FORMAT_XRGB8888, TEST_FORMAT_NV12};
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	    PLANE(PLANE_ID(1), 0x2),
+	};
+	planes[0].formats = yuv_formats;
+	planes[0].count_formats = ARRAY_LEN(yuv_formats);
+	planes[1].formats = rgb_formats;
+	planes[1].count_formats = ARRAY_LEN(rgb_formats);
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(out_cnt, lm_get_lease_handles(lm, &handles));
+
+	struct lease_constraints constraints = {
+	    .plane_format = TEST_FORMAT_NV12,
+	};
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[0]);
+
+	/* The first lease can now only get the second CRTC, which has no
+	 * NV12 plane */
+	ck_assert_int_ge(lm_lease_grant(lm, handles[1]), 0);
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), NULL);
+
+	constraints.plane_format = TEST_FORMAT_XRGB8888;
+	ck_assert_ptr_eq(lm_select_lease(lm, &constraints), handles[0]);
+	CHECK_LEASE_OBJECTS(handles[0], PLANE_ID(1), CRTC_ID(1),
+			    CONNECTOR_ID(0));
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* lease_status_is_published */
+/* Test details: Grant a lease, set its holder and revoke it.
+ * Expected results: The status page shows the state, holder and counters
+ *                   of each lease, and is removed when the lease manager
+ *                   exits.
+ */
+START_TEST(lease_status_is_published)
+{
+	int lease_cnt = 2;
+	bool res = setup_drm_test_device(lease_cnt, lease_cnt, lease_cnt, 0);
+	ck_assert_int_eq(res, true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(lease_cnt, lm_get_lease_handles(lm, &handles));
+
+	int fd = open(STATUS_FILE, O_RDONLY);
+	ck_assert_int_ge(fd, 0);
+
+	size_t size = sizeof(struct dlm_status_header) +
+		      lease_cnt * sizeof(struct dlm_status_lease);
+	struct stat st;
+	ck_assert_int_eq(fstat(fd, &st), 0);
+	ck_assert_int_eq(st.st_size, size);
+
+	const struct dlm_status_header *page =
+	    mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	ck_assert_ptr_ne(page, MAP_FAILED);
+	close(fd);
+
+	ck_assert_uint_eq(page->magic, DLM_STATUS_MAGIC);
+	ck_assert_uint_eq(page->nleases, lease_cnt);
+	for (int i = 0; i < lease_cnt; i++)
+		ck_assert_str_eq(page->leases[i].name, handles[i]->name);
+
+	const struct dlm_status_lease *lease = &page->leases[1];
+	ck_assert_uint_eq(lease->state, DLM_STATUS_LEASE_FREE);
+
+	ck_assert_int_ge(lm_lease_grant(lm, handles[1]), 0);
+	lm_lease_set_holder(lm, handles[1], 1234);
+	ck_assert_uint_eq(lease->state, DLM_STATUS_LEASE_GRANTED);
+	ck_assert_int_eq(lease->holder_pid, 1234);
+	ck_assert_uint_eq(lease->grants, 1);
+	ck_assert_uint_ne(lease->grant_time, 0);
+
+	ck_assert_int_ge(lm_lease_resume(lm, handles[1]), 0);
+	ck_assert_uint_eq(lease->resumes, 1);
+
+	lm_lease_revoke(lm, handles[1]);
+	ck_assert_uint_eq(lease->state, DLM_STATUS_LEASE_FREE);
+	ck_assert_int_eq(lease->holder_pid, 0);
+	ck_assert_uint_eq(lease->revokes, 1);
+
+	drmModeCreateLease_fake.custom_fake = NULL;
+	drmModeCreateLease_fake.return_val = -1;
+	ck_assert_int_lt(lm_lease_grant(lm, handles[1]), 0);
+	ck_assert_uint_eq(lease->failures, 1);
+
+	/* The other lease is untouched */
+	ck_assert_uint_eq(page->leases[0].grants, 0);
+	ck_assert_uint_eq(page->seq % 2, 0);
+
+	lm_destroy(lm);
+	ck_assert_uint_eq(page->flags & DLM_STATUS_CLOSED, DLM_STATUS_CLOSED);
+	ck_assert_int_eq(access(STATUS_FILE, F_OK), -1);
+	munmap((void *)page, size);
+}
+END_TEST
+
+/* Lease fds of the reassignment test are pipes, so that the test can wake
+ * up the lease transition thread */
+#define MAX_TEST_LEASE_FDS 4
+static int lease_pipes[MAX_TEST_LEASE_FDS][2];
+static int nlease_pipes;
+
+static int create_pipe_lease(int fd, const uint32_t *objects, int num_objects,
+			     int flags, uint32_t *lessee_id)
+{
+	create_lease(fd, objects, num_objects, flags, lessee_id);
+
+	ck_assert_int_lt(nlease_pipes, MAX_TEST_LEASE_FDS);
+	ck_assert_int_eq(pipe(lease_pipes[nlease_pipes]), 0);
+	return lease_pipes[nlease_pipes++][0];
+}
+
+/* Number of leases created when each lease was revoked */
+static int creates_at_revoke[MAX_TEST_LEASE_FDS];
+
+static int record_revoke(int fd, uint32_t lessee_id)
+{
+	UNUSED(fd);
+	UNUSED(lessee_id);
+
+	int n = drmModeRevokeLease_fake.call_count - 1;
+	creates_at_revoke[n] = drmModeCreateLease_fake.call_count;
+	return 0;
+}
+
+static drmModeCrtc test_crtc = {.buffer_id = 1};
+
+static drmModeCrtcPtr get_crtc(int fd, uint32_t crtc_id)
+{
+	UNUSED(fd);
+	UNUSED(crtc_id);
+	return &test_crtc;
+}
+
+static bool fd_is_closed(int fd)
+{
+	/* Give the lease transition thread some time */
+	for (int i = 0; i < 1000; i++) {
+		if (fcntl(fd, F_GETFD) < 0)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+static struct lm_event last_event;
+static int nevents;
+
+static void record_event(const struct lm_event *event, void *data)
+{
+	UNUSED(data);
+
+	last_event = *event;
+	nevents++;
+}
+
+/* reassign_leases_in_one_batch */
+/* Test details: Reassign two granted leases.
+ * Expected results: Both leases are revoked before either is granted
+ *                   again.  The previous lease fds are closed, and the
+ *                   reassignment is reported as done, once the
+ *                   framebuffers of both CRTCs have been updated.
+ */
+START_TEST(reassign_leases_in_one_batch)
+{
+	int lease_cnt = 2;
+	bool res = setup_drm_test_device(lease_cnt, lease_cnt, lease_cnt, 0);
+	ck_assert_int_eq(res, true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	drmModeCreateLease_fake.custom_fake = create_pipe_lease;
+	drmModeRevokeLease_fake.custom_fake = record_revoke;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(lease_cnt, lm_get_lease_handles(lm, &handles));
+
+	int old_fds[2];
+	for (int i = 0; i < lease_cnt; i++) {
+		old_fds[i] = lm_lease_grant(lm, handles[i]);
+		ck_assert_int_ge(old_fds[i], 0);
+	}
+
+	int fds[2];
+	ck_assert_int_eq(lm_lease_reassign(lm, handles, lease_cnt, fds), true);
+
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, lease_cnt);
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 2 * lease_cnt);
+	for (int i = 0; i < lease_cnt; i++) {
+		ck_assert_int_eq(creates_at_revoke[i], lease_cnt);
+		ck_assert_int_eq(fds[i], lease_pipes[lease_cnt + i][0]);
+	}
+
+	/* The previous clients keep their fds until both CRTCs have been
+	 * updated by the new clients */
+	nevents = 0;
+	test_crtc.buffer_id = 2;
+	ck_assert_int_eq(write(lease_pipes[lease_cnt][1], "", 1), 1);
+	ck_assert_int_eq(fcntl(old_fds[0], F_GETFD) >= 0, true);
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 0);
+	ck_assert_int_eq(write(lease_pipes[lease_cnt + 1][1], "", 1), 1);
+
+	for (int i = 0; i < lease_cnt; i++)
+		ck_assert_int_eq(fd_is_closed(old_fds[i]), true);
+
+	struct pollfd pfd = {.fd = lm_get_fd(lm), .events = POLLIN};
+	ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 1);
+	ck_assert_int_eq(last_event.type, LM_EVENT_REASSIGN_DONE);
+	ck_assert_int_eq(last_event.switched, true);
+
+	lm_destroy(lm);
+}
+END_TEST
+
+#define BOOT_FB_ID 100
+
+static drmModeCrtc boot_crtc = {
+    .buffer_id = BOOT_FB_ID,
+    .mode_valid = 1,
+    .mode = {.hdisplay = 1280},
+};
+
+static drmModeCrtcPtr get_boot_crtc(int fd, uint32_t crtc_id)
+{
+	UNUSED(fd);
+	UNUSED(crtc_id);
+	return &boot_crtc;
+}
+
+/* Get the boot framebuffer and mode width from the topology of a lease */
+static uint32_t get_topology_boot_fb(struct lm *lm,
+				     struct lease_handle *handle,
+				     uint16_t *hdisplay)
+{
+	int fd = lm_lease_topology_fd(lm, handle);
+	ck_assert_int_ge(fd, 0);
+
+	struct stat st;
+	ck_assert_int_eq(fstat(fd, &st), 0);
+	const void *data =
+	    mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	ck_assert_ptr_ne(data, MAP_FAILED);
+	close(fd);
+	ck_assert_int_eq(dlm_topology_validate(data, st.st_size), true);
+
+	const struct dlm_topology_header *hdr = data;
+	const struct dlm_topology_mode *mode =
+	    dlm_topology_array_data(data, &hdr->boot_mode);
+	uint32_t fb_id = hdr->boot_fb_id;
+	*hdisplay = mode ? mode->hdisplay : 0;
+
+	munmap((void *)data, st.st_size);
+	return fb_id;
+}
+
+/* boot_state_handed_to_first_client */
+/* Test details: Create a lease on a CRTC lit at startup, grant it, revoke
+ *               it, then grant it again.
+ * Expected results: Only the first client gets the boot mode and
+ *                   framebuffer in the lease topology.
+ */
+START_TEST(boot_state_handed_to_first_client)
+{
+	ck_assert_int_eq(setup_drm_test_device(2, 2, 2, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), 0, 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	drmModeGetCrtc_fake.custom_fake = get_boot_crtc;
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+
+	uint16_t hdisplay;
+	ck_assert_int_ge(lm_lease_grant(lm, handles[0]), 0);
+	ck_assert_uint_eq(get_topology_boot_fb(lm, handles[0], &hdisplay),
+			  BOOT_FB_ID);
+	ck_assert_uint_eq(hdisplay, 1280);
+
+	/* The second CRTC was not lit */
+	ck_assert_uint_eq(get_topology_boot_fb(lm, handles[1], &hdisplay), 0);
+
+	lm_lease_revoke(lm, handles[0]);
+	ck_assert_int_ge(lm_lease_grant(lm, handles[0]), 0);
+	ck_assert_uint_eq(get_topology_boot_fb(lm, handles[0], &hdisplay), 0);
+	ck_assert_uint_eq(hdisplay, 0);
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* Vblank transfers read events from the DRM device, so they are tested on
+ * a pty master, which can be polled, and fed events through its slave */
+#define POLLABLE_DRM_DEVICE "/dev/ptmx"
+
+static int open_event_feed(int drm_fd)
+{
+	ck_assert_int_eq(unlockpt(drm_fd), 0);
+	int feed = open(ptsname(drm_fd), O_RDWR | O_NOCTTY);
+	ck_assert_int_ge(feed, 0);
+
+	struct termios tio;
+	ck_assert_int_eq(tcgetattr(feed, &tio), 0);
+	cfmakeraw(&tio);
+	ck_assert_int_eq(tcsetattr(feed, TCSANOW, &tio), 0);
+	return feed;
+}
+
+static void send_sequence_event(int feed, uint64_t user_data)
+{
+	struct drm_event_crtc_sequence event = {
+	    .base =
+		{
+		    .type = DRM_EVENT_CRTC_SEQUENCE,
+		    .length = sizeof(event),
+		},
+	    .user_data = user_data,
+	};
+	ck_assert_int_eq(write(feed, &event, sizeof(event)), sizeof(event));
+}
+
+/* transfer_at_next_vblank */
+/* Test details: Wait for the next vblank before transferring a lease, with
+ *               vblank-aligned transfers enabled, and send the vblank
+ *               event.  Then wait again, without an event.
+ * Expected results: A wait for the next vblank of the lease CRTC is queued
+ *                   without blocking, or revoking the lease.  The wait is
+ *                   reported as over once its event arrives on the DRM fd,
+ *                   or once the timeout expires.  A late event is drained
+ *                   without being reported.
+ */
+START_TEST(transfer_at_next_vblank)
+{
+	ck_assert_int_eq(setup_drm_test_device(1, 1, 1, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm_options options = {.vblank_transfers = true};
+	struct lm *lm = lm_create(POLLABLE_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+	int feed = open_event_feed(lm_get_drm_fd(lm));
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(1, lm_get_lease_handles(lm, &handles));
+
+	ck_assert_int_ge(lm_lease_grant(lm, handles[0]), 0);
+	ck_assert_int_eq(lm_lease_wait_vblank(lm, handles[0]), true);
+
+	ck_assert_int_eq(drmCrtcQueueSequence_fake.call_count, 1);
+	ck_assert_uint_eq(drmCrtcQueueSequence_fake.arg1_val, CRTC_ID(0));
+	ck_assert_uint_eq(drmCrtcQueueSequence_fake.arg2_val,
+			  DRM_CRTC_SEQUENCE_RELATIVE |
+			      DRM_CRTC_SEQUENCE_NEXT_ON_MISS);
+	ck_assert_uint_eq(drmCrtcQueueSequence_fake.arg3_val, 1);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 0);
+
+	int timeout = lm_get_timeout(lm);
+	ck_assert_int_gt(timeout, 0);
+	ck_assert_int_le(timeout, 100);
+
+	nevents = 0;
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 0);
+
+	send_sequence_event(feed, drmCrtcQueueSequence_fake.arg5_val);
+	struct pollfd pfd = {.fd = lm_get_fd(lm), .events = POLLIN};
+	ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 1);
+	ck_assert_int_eq(last_event.type, LM_EVENT_VBLANK);
+	ck_assert_ptr_eq(last_event.lease_handle, handles[0]);
+	ck_assert_int_eq(lm_get_timeout(lm), -1);
+
+	ck_assert_int_ge(lm_lease_transfer(lm, handles[0]), 0);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 1);
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 2);
+
+	/* No vblank arrives the second time */
+	ck_assert_int_eq(lm_lease_wait_vblank(lm, handles[0]), true);
+	ck_assert_int_eq(poll(&pfd, 1, lm_get_timeout(lm)), 0);
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 2);
+	ck_assert_ptr_eq(last_event.lease_handle, handles[0]);
+
+	/* The late event of the timed out wait is drained and dropped */
+	send_sequence_event(feed, drmCrtcQueueSequence_fake.arg5_val);
+	ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+	lm_dispatch_events(lm, record_event, NULL);
+	ck_assert_int_eq(nevents, 2);
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+
+	close(feed);
+	lm_destroy(lm);
+}
+END_TEST
+
+/* adopt_handed_over_lease */
+/* Test details: Adopt a lease granted by another lease manager instance,
+ *               on a different CRTC than the one assigned at startup.
+ * Expected results: The lease is granted without creating a new lease, the
+ *                   adopted CRTC is no longer free, and revoking the lease
+ *                   revokes the adopted lessee.
+ */
+START_TEST(adopt_handed_over_lease)
+{
+	ck_assert_int_eq(setup_drm_test_device(2, 2, 2, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x3),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x3),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	/* Objects of the handed over lease */
+	struct {
+		drmModeObjectListRes list;
+		uint32_t objects[2];
+	} lease = {
+	    .list = {.count = 2},
+	    .objects = {CONNECTOR_ID(0), CRTC_ID(1)},
+	};
+	drmModeGetLease_fake.return_val = &lease.list;
+
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+
+	int lease_fd = get_dummy_fd();
+	uint32_t lessee_id = 100;
+	ck_assert_int_eq(lm_lease_adopt(lm, handles[0], lessee_id, lease_fd),
+			 true);
+	ck_assert_int_eq(drmModeGetLease_fake.arg0_val, lease_fd);
+	ck_assert_int_eq(drmFree_fake.call_count, 1);
+
+	uint32_t exported_id;
+	ck_assert_int_eq(lm_lease_export(lm, handles[0], &exported_id),
+			 lease_fd);
+	ck_assert_uint_eq(exported_id, lessee_id);
+	ck_assert_int_eq(lm_lease_grant(lm, handles[0]), -1);
+
+	/* The other lease can only use the CRTC left free */
+	CHECK_LEASE_OBJECTS(handles[1], CRTC_ID(0), CONNECTOR_ID(1));
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 1);
+
+	lm_lease_revoke(lm, handles[0]);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 1);
+	ck_assert_uint_eq(drmModeRevokeLease_fake.arg1_val, lessee_id);
+
+	lm_destroy(lm);
+}
+END_TEST
+
+/* Memory allocations are counted while count_allocations is set */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static bool count_allocations;
+static int allocations;
+
+void *malloc(size_t size)
+{
+	if (count_allocations)
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (count_allocations)
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (count_allocations)
+		__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+/* Check assertions may allocate, so this doesn't assert */
+static int create_dummy_lease(int fd, const uint32_t *objects,
+			      int num_objects, int flags, uint32_t *lessee_id)
+{
+	create_lease(fd, objects, num_objects, flags, lessee_id);
+	return get_dummy_fd();
+}
+
+/* realtime_mode_does_not_allocate */
+/* Test details: In real-time mode, grant two leases, get a lease topology,
+ *               transfer a lease, reassign both leases, then revoke them.
+ * Expected results: All requests succeed without allocating memory.
+ */
+START_TEST(realtime_mode_does_not_allocate)
+{
+	ck_assert_int_eq(setup_drm_test_device(2, 2, 2, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	drmModeCreateLease_fake.custom_fake = create_dummy_lease;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+
+	struct lm_options options = {.realtime = true};
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(2, lm_get_lease_handles(lm, &handles));
+
+	/* Results are only checked once counting stops */
+	int fds[2];
+	allocations = 0;
+	count_allocations = true;
+	int grant_fds[2] = {
+	    lm_lease_grant(lm, handles[0]),
+	    lm_lease_grant(lm, handles[1]),
+	};
+	int topology_fd = lm_lease_topology_fd(lm, handles[0]);
+	int transfer_fd = lm_lease_transfer(lm, handles[0]);
+	bool reassigned = lm_lease_reassign(lm, handles, 2, fds);
+	lm_lease_revoke(lm, handles[0]);
+	lm_lease_revoke(lm, handles[1]);
+	count_allocations = false;
+
+	ck_assert_int_ge(grant_fds[0], 0);
+	ck_assert_int_ge(grant_fds[1], 0);
+	ck_assert_int_ge(topology_fd, 0);
+	ck_assert_int_ge(transfer_fd, 0);
+	ck_assert_int_eq(reassigned, true);
+	ck_assert_int_eq(allocations, 0);
+
+	close(topology_fd);
+	lm_destroy(lm);
+}
+END_TEST
+
+/* Real-time mode is set up without privileges in the tests */
+static int sched_policy = SCHED_OTHER;
+static int nmunlockall;
+
+int sched_getscheduler(pid_t pid)
+{
+	UNUSED(pid);
+	return sched_policy;
+}
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param)
+{
+	UNUSED(pid);
+	UNUSED(param);
+	sched_policy = policy;
+	return 0;
+}
+
+int mlockall(int flags)
+{
+	UNUSED(flags);
+	return 0;
+}
+
+int munlockall(void)
+{
+	nmunlockall++;
+	return 0;
+}
+
+/* Connect to a lease server, and send it a version 1 request.  token may be
+ * NULL. */
+static int send_client_request(const char *name, enum dlm_opcode opcode,
+			       const struct dlm_resume_token *token)
+{
+	struct sockaddr_un address = {
+	    .sun_family = AF_UNIX,
+	};
+	ck_assert_int_eq(sockaddr_set_lease_server_path(&address, name), true);
+
+	int client = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	ck_assert_int_ge(client, 0);
+	ck_assert_int_eq(
+	    connect(client, (struct sockaddr *)&address, sizeof(address)), 0);
+
+	struct dlm_client_request req = {.opcode = opcode};
+	if (token)
+		req.token = *token;
+	ck_assert_int_eq(send_dlm_client_request(client, &req), true);
+	return client;
+}
+
+/* Let the server handle requests until the client gets a reply, or is
+ * disconnected.  Doesn't assert, so that it can run while allocations are
+ * counted. */
+static bool dispatch_until_reply(struct dlm_server *server, int client)
+{
+	struct pollfd pfd = {.fd = client, .events = POLLIN};
+	for (int i = 0; i < 10; i++) {
+		if (!dlm_server_dispatch(server))
+			return false;
+		if (poll(&pfd, 1, 0) > 0)
+			return true;
+	}
+	return false;
+}
+
+/* realtime_server_does_not_allocate */
+/* Test details: In real-time mode, grant a lease to a client through the
+ *               lease server, transfer it to a second client, and revoke
+ *               it when that client releases it.
+ * Expected results: Both clients get the lease, the first one is
+ *                   disconnected, the lease is revoked, and the server
+ *                   handles the requests without allocating memory.
+ */
+START_TEST(realtime_server_does_not_allocate)
+{
+	ck_assert_int_eq(setup_drm_test_device(1, 1, 1, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	drmModeCreateLease_fake.custom_fake = create_dummy_lease;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+
+	struct dlm_server_options options = {
+	    .lease_transfer = true,
+	    .realtime_priority = 1,
+	};
+	struct dlm_server *server =
+	    dlm_server_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(server, NULL);
+	const char *name = dlm_server_lease_name(server, 0);
+	ck_assert_ptr_ne(name, NULL);
+
+	int first = send_client_request(name, DLM_GET_LEASE, NULL);
+
+	/* Results are only checked once counting stops */
+	allocations = 0;
+	count_allocations = true;
+	bool granted = dispatch_until_reply(server, first);
+	int first_fd = granted ? receive_lease_fd(first, NULL) : -1;
+	count_allocations = false;
+
+	int second = send_client_request(name, DLM_GET_LEASE, NULL);
+
+	count_allocations = true;
+	bool transferred = dispatch_until_reply(server, second);
+	int second_fd = transferred ? receive_lease_fd(second, NULL) : -1;
+
+	struct dlm_client_request release = {.opcode = DLM_RELEASE_LEASE};
+	send_dlm_client_request(second, &release);
+	bool released = dispatch_until_reply(server, second);
+	count_allocations = false;
+
+	ck_assert_int_ge(first_fd, 0);
+	ck_assert_int_ge(second_fd, 0);
+	ck_assert_int_eq(released, true);
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 2);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 2);
+	ck_assert_int_eq(allocations, 0);
+
+	/* The first client was disconnected by the transfer */
+	char buf;
+	ck_assert_int_eq(recv(first, &buf, sizeof(buf), MSG_DONTWAIT), 0);
+
+	close(first_fd);
+	close(second_fd);
+	close(first);
+	close(second);
+	dlm_server_destroy(server);
+}
+END_TEST
+
+/* realtime_mode_undone_on_create_failure */
+/* Test details: Create a server in real-time mode on a missing DRM device.
+ * Expected results: Creating the server fails, the previous scheduling
+ *                   policy is restored and memory is unlocked.
+ */
+START_TEST(realtime_mode_undone_on_create_failure)
+{
+	sched_policy = SCHED_OTHER;
+	nmunlockall = 0;
+
+	struct dlm_server_options options = {.realtime_priority = 1};
+	ck_assert_ptr_eq(dlm_server_create("/dev/missing-dri-card", &options),
+			 NULL);
+	ck_assert_int_eq(sched_policy, SCHED_OTHER);
+	ck_assert_int_eq(nmunlockall, 1);
+}
+END_TEST
+
+/* resume_token_kept_on_release_by_other_client */
+/* Test details: With lease resume enabled, grant a lease through the lease
+ *               server, send a release from another client, then
+ *               disconnect the holder and resume the lease with its token.
+ * Expected results: The release from the client that doesn't hold the
+ *                   lease is ignored, so the token stays valid and the
+ *                   lease is resumed without being created again.
+ */
+START_TEST(resume_token_kept_on_release_by_other_client)
+{
+	ck_assert_int_eq(setup_drm_test_device(1, 1, 1, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	drmModeCreateLease_fake.custom_fake = create_dummy_lease;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+
+	struct dlm_server_options options = {.resume_leases = true};
+	struct dlm_server *server =
+	    dlm_server_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(server, NULL);
+	const char *name = dlm_server_lease_name(server, 0);
+	ck_assert_ptr_ne(name, NULL);
+
+	int holder = send_client_request(name, DLM_GET_LEASE, NULL);
+	ck_assert_int_eq(dispatch_until_reply(server, holder), true);
+	struct dlm_resume_token token;
+	int lease_fd = receive_lease_fd(holder, &token);
+	ck_assert_int_ge(lease_fd, 0);
+
+	/* The other client is disconnected */
+	int other = send_client_request(name, DLM_RELEASE_LEASE, NULL);
+	ck_assert_int_eq(dispatch_until_reply(server, other), true);
+	close(other);
+
+	close(holder);
+	ck_assert_int_eq(dlm_server_dispatch(server), true);
+
+	int resumer = send_client_request(name, DLM_RESUME_LEASE, &token);
+	ck_assert_int_eq(dispatch_until_reply(server, resumer), true);
+	int resumed_fd = receive_lease_fd(resumer, NULL);
+	ck_assert_int_ge(resumed_fd, 0);
+
+	ck_assert_int_eq(drmModeCreateLease_fake.call_count, 1);
+	ck_assert_int_eq(drmModeRevokeLease_fake.call_count, 0);
+
+	close(lease_fd);
+	close(resumed_fd);
+	close(resumer);
+	dlm_server_destroy(server);
+}
+END_TEST
+
+/* Each frame timing sample is taken test_sample_vblanks vblanks after the
+ * previous one, and the lease holder presents a new framebuffer every
+ * test_frame_vblanks vblanks */
+static uint64_t test_vblank_seq;
+static uint64_t test_sample_vblanks;
+static uint64_t test_frame_vblanks;
+
+static int get_crtc_sequence(int fd, uint32_t crtc_id, uint64_t *sequence,
+			     uint64_t *ns)
+{
+	UNUSED(fd);
+	UNUSED(crtc_id);
+
+	uint64_t seq = test_vblank_seq + test_sample_vblanks;
+	if (seq / test_frame_vblanks != test_vblank_seq / test_frame_vblanks)
+		test_crtc.buffer_id++;
+
+	test_vblank_seq = seq;
+	*sequence = seq;
+	*ns = seq * 16666667;
+	return 0;
+}
+
+/* Sample a granted lease until three frames are counted, then revoke it.
+ * Returns the frame timing published in the status page. */
+static struct dlm_status_lease sample_frames(uint64_t sample_vblanks,
+					     uint64_t frame_vblanks)
+{
+	ck_assert_int_eq(setup_drm_test_device(1, 1, 1, 0), true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	};
+
+	setup_test_device_layout(connectors, encoders, NULL);
+
+	struct lm_options options = {.frame_stats = true};
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(1, lm_get_lease_handles(lm, &handles));
+
+	test_vblank_seq = 0;
+	test_sample_vblanks = sample_vblanks;
+	test_frame_vblanks = frame_vblanks;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+	drmCrtcGetSequence_fake.custom_fake = get_crtc_sequence;
+
+	size_t size = sizeof(struct dlm_status_header) +
+		      sizeof(struct dlm_status_lease);
+	int fd = open(STATUS_FILE, O_RDONLY);
+	ck_assert_int_ge(fd, 0);
+	const struct dlm_status_header *page =
+	    mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	ck_assert_ptr_ne(page, MAP_FAILED);
+	close(fd);
+
+	const struct dlm_status_lease *lease = &page->leases[0];
+	ck_assert_int_ge(lm_lease_grant(lm, handles[0]), 0);
+
+	/* Give the sampler thread some time */
+	for (int i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&lease->frames, __ATOMIC_ACQUIRE) >= 3)
+			break;
+		usleep(1000);
+	}
+	lm_lease_revoke(lm, handles[0]);
+
+	struct dlm_status_lease stats = *lease;
+	munmap((void *)page, size);
+	lm_destroy(lm);
+	return stats;
+}
+
+/* frame_timing_is_published */
+/* Test details: Sample the frame timing of a granted lease at every vblank,
+ *               while its holder presents a frame every third vblank.
+ * Expected results: The status page counts the frames, and the two vblanks
+ *                   missed before each frame but the first.  The frame
+ *                   rate is cleared when the lease is revoked.
+ */
+START_TEST(frame_timing_is_published)
+{
+	struct dlm_status_lease stats = sample_frames(1, 3);
+
+	ck_assert_uint_ge(stats.frames, 3);
+	ck_assert_uint_eq(stats.missed_frames, 2 * (stats.frames - 1));
+	ck_assert_uint_eq(stats.stalls, 0);
+	ck_assert_uint_eq(stats.frame_rate, 0);
+}
+END_TEST
+
+/* late_samples_are_not_missed_frames */
+/* Test details: Sample the frame timing of a granted lease every third
+ *               vblank, and see a new frame at each sample.
+ * Expected results: No vblank is counted as missed, since each frame may
+ *                   have been presented at any vblank since the previous
+ *                   sample.
+ */
+START_TEST(late_samples_are_not_missed_frames)
+{
+	struct dlm_status_lease stats = sample_frames(3, 3);
+
+	ck_assert_uint_ge(stats.frames, 3);
+	ck_assert_uint_eq(stats.missed_frames, 0);
+}
+END_TEST
+
+/* dry_run_prints_lease_plan */
+/* Test details: Create a lease manager in dry run mode, and print the
+ *               planned leases.
+ * Expected results: The status page is not published.  Each lease is
+ *                   printed with its CRTC and dedicated planes, followed
+ *                   by the shared planes.
+ */
+START_TEST(dry_run_prints_lease_plan)
+{
+	int lease_cnt = 2;
+	bool res = setup_drm_test_device(lease_cnt, lease_cnt, lease_cnt, 3);
+	ck_assert_int_eq(res, true);
+
+	drmModeConnector connectors[] = {
+	    CONNECTOR(CONNECTOR_ID(0), ENCODER_ID(0), &ENCODER_ID(0), 1),
+	    CONNECTOR(CONNECTOR_ID(1), ENCODER_ID(1), &ENCODER_ID(1), 1),
+	};
+
+	drmModeEncoder encoders[] = {
+	    ENCODER(ENCODER_ID(0), CRTC_ID(0), 0x1),
+	    ENCODER(ENCODER_ID(1), CRTC_ID(1), 0x2),
+	};
+
+	drmModePlane planes[] = {
+	    PLANE(PLANE_ID(0), 0x1),
+	    PLANE(PLANE_ID(1), 0x2),
+	    PLANE(PLANE_ID(2), 0x3),
+	};
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	struct lm_options options = {.dry_run = true};
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, &options);
+	ck_assert_ptr_ne(lm, NULL);
+	ck_assert_int_eq(access(STATUS_FILE, F_OK), -1);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(lease_cnt, lm_get_lease_handles(lm, &handles));
+
+	char *plan;
+	size_t plan_size;
+	FILE *out = open_memstream(&plan, &plan_size);
+	ck_assert_ptr_ne(out, NULL);
+	lm_print_plan(lm, out);
+	fclose(out);
+
+	char expected[512];
+	snprintf(expected, sizeof(expected),
+		 "%s: connector %u (not connected), CRTC %u\n"
+		 "  planes: %u (overlay)\n"
+		 "%s: connector %u (not connected), CRTC %u\n"
+		 "  planes: %u (overlay)\n"
+		 "Shared planes: %u (overlay) on CRTCs 0x3\n",
+		 handles[0]->name, CONNECTOR_ID(0), CRTC_ID(0), PLANE_ID(0),
+		 handles[1]->name, CONNECTOR_ID(1), CRTC_ID(1), PLANE_ID(1),
+		 PLANE_ID(2));
+	ck_assert_str_eq(plan, expected);
+
+	lm_destroy(lm);
+	free(plan);
+}
+END_TEST
+
+/* libdrm calls made since the last call */
+static uint64_t drm_calls_made(void)
+{
+	struct drm_call_stats stats;
+	drm_calls_get_total(&stats);
+	drm_calls_reset();
+	return stats.calls;
+}
+
+#define MAX_BUDGET_OUTPUTS 4
+#define BUDGET_PLANES_PER_OUTPUT 2
+
+/* Count the libdrm calls made for each lease operation on a device with
+ * one connector, encoder and CRTC per output, and two planes per CRTC */
+static void check_drm_call_budgets(int outputs)
+{
+	int plane_cnt = outputs * BUDGET_PLANES_PER_OUTPUT;
+	ck_assert_int_le(outputs, MAX_BUDGET_OUTPUTS);
+	ck_assert_int_eq(
+	    setup_drm_test_device(outputs, outputs, outputs, plane_cnt), true);
+
+	drmModeConnector connectors[MAX_BUDGET_OUTPUTS];
+	drmModeEncoder encoders[MAX_BUDGET_OUTPUTS];
+	drmModePlane planes[MAX_BUDGET_OUTPUTS * BUDGET_PLANES_PER_OUTPUT];
+
+	for (int i = 0; i < outputs; i++) {
+		connectors[i] = (drmModeConnector)CONNECTOR(
+		    CONNECTOR_ID(i), ENCODER_ID(i), &ENCODER_ID(i), 1);
+		encoders[i] = (drmModeEncoder)ENCODER(ENCODER_ID(i),
+						      CRTC_ID(i), 1 << i);
+	}
+	for (int i = 0; i < plane_cnt; i++)
+		planes[i] = (drmModePlane)PLANE(
+		    PLANE_ID(i), 1 << (i / BUDGET_PLANES_PER_OUTPUT));
+
+	setup_test_device_layout(connectors, encoders, planes);
+
+	/* Pipe lease fds let the test wake up the transition worker */
+	drmModeCreateLease_fake.custom_fake = create_pipe_lease;
+	drmModeGetCrtc_fake.custom_fake = get_crtc;
+	test_crtc.buffer_id = 1;
+
+	drm_calls_reset();
+	struct lm *lm = lm_create(TEST_DRM_DEVICE, NULL);
+	ck_assert_ptr_ne(lm, NULL);
+	/* Each plane is read along with its properties for the topology and
+	 * the lease objects.  Each output reads its connector and CRTC, and
+	 * its encoder four times, while the CRTCs are assigned. */
+	ck_assert_uint_eq(drm_calls_made(), 3 + 3 * plane_cnt + 6 * outputs);
+
+	struct lease_handle **handles;
+	ck_assert_int_eq(outputs, lm_get_lease_handles(lm, &handles));
+
+	int old_fd = lm_lease_grant(lm, handles[0]);
+	ck_assert_int_ge(old_fd, 0);
+	ck_assert_uint_eq(drm_calls_made(), 1);
+
+	/* Revoke, create, and read the framebuffer to wait for */
+	ck_assert_int_ge(lm_lease_transfer(lm, handles[0]), 0);
+	ck_assert_uint_eq(drm_calls_made(), 3);
+
+	/* The worker reads the CRTC once per wakeup */
+	test_crtc.buffer_id = 2;
+	ck_assert_int_eq(write(lease_pipes[1][1], "", 1), 1);
+	ck_assert_int_eq(fd_is_closed(old_fd), true);
+	ck_assert_uint_eq(drm_calls_made(), 1);
+
+	lm_lease_revoke(lm, handles[0]);
+	ck_assert_uint_eq(drm_calls_made(), 1);
+
+	lm_destroy(lm);
+}
+
+/* drm_call_budgets */
+/* Test details: Count the libdrm calls made to start the lease manager,
+ *               and to grant, transfer and revoke a lease, and to finish
+ *               the transfer once the new client updates the framebuffer,
+ *               on a device with one output.
+ * Expected results: The exact number of calls expected for the size of the
+ *                   device is made at startup.  No operation on a single
+ *                   lease scales with the device, and the transition
+ *                   worker reads the CRTC once per wakeup.
+ */
+START_TEST(drm_call_budgets)
+{
+	check_drm_call_budgets(1);
+}
+END_TEST
+
+/* drm_call_budgets_scale */
+/* Test details: Same as drm_call_budgets, with four outputs.
+ * Expected results: Same as drm_call_budgets.
+ */
+START_TEST(drm_call_budgets_scale)
+{
+	check_drm_call_budgets(MAX_BUDGET_OUTPUTS);
+}
+END_TEST
+
 static void add_lease_management_tests(Suite *s)
 {
 	TCase *tc = tcase_create("Lease management");
@@ -426,6 +2221,25 @@ static void add_lease_management_tests(Suite *s)
 	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
 
 	tcase_add_test(tc, create_and_revoke_lease);
+	tcase_add_test(tc, resume_granted_lease);
+	tcase_add_test(tc, lease_topology_describes_lease_objects);
+	tcase_add_test(tc, universal_planes_are_leased);
+	tcase_add_test(tc, select_lease_by_constraints);
+	tcase_add_test(tc, select_lease_on_crtc_to_be_bound);
+	tcase_add_test(tc, lease_status_is_published);
+	tcase_add_test(tc, reassign_leases_in_one_batch);
+	tcase_add_test(tc, boot_state_handed_to_first_client);
+	tcase_add_test(tc, transfer_at_next_vblank);
+	tcase_add_test(tc, adopt_handed_over_lease);
+	tcase_add_test(tc, realtime_mode_does_not_allocate);
+	tcase_add_test(tc, realtime_server_does_not_allocate);
+	tcase_add_test(tc, realtime_mode_undone_on_create_failure);
+	tcase_add_test(tc, resume_token_kept_on_release_by_other_client);
+	tcase_add_test(tc, frame_timing_is_published);
+	tcase_add_test(tc, late_samples_are_not_missed_frames);
+	tcase_add_test(tc, dry_run_prints_lease_plan);
+	tcase_add_test(tc, drm_call_budgets);
+	tcase_add_test(tc, drm_call_budgets_scale);
 	suite_add_tcase(s, tc);
 }
 
@@ -19,10 +19,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <poll.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "handoff.h"
 #include "lease-server.h"
 #include "log.h"
+#include "socket-path.h"
 #include "test-helpers.h"
 #include "test-socket-client.h"
 
@@ -170,6 +175,34 @@ START_TEST(issue_lease_request_and_early_release)
 }
 END_TEST
 
+/* poll_request_without_blocking
+ *
+ * Test details: Poll for requests before and after a client connects
+ * Expected results: ls_poll_request() returns 0 while no client is connected,
+ *                   and the get lease request once the server fd is readable.
+ */
+START_TEST(poll_request_without_blocking)
+{
+	struct ls *ls = create_default_server();
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_poll_request(ls, &req), 0);
+
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct pollfd server_poll = {.fd = ls_get_fd(ls), .events = POLLIN};
+	int ret;
+	do {
+		ck_assert_int_ge(poll(&server_poll, 1, -1), 1);
+	} while ((ret = ls_poll_request(ls, &req)) == 0);
+
+	ck_assert_int_eq(ret, 1);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	test_client_stop(cstate);
+	ls_destroy(ls);
+}
+END_TEST
+
 /* issue_multiple_lease_requests
  *
  * Test details: Generate multiple lease requests to the same lease server from
@@ -238,6 +271,61 @@ START_TEST(issue_multiple_lease_requests)
 }
 END_TEST
 
+/* connect_storm_is_throttled
+ *
+ * Test details: Connect to a lease socket in a loop, without sending any
+ *               request, then request another lease.
+ * Expected results: The connections that find both client slots in use
+ *                   are shed, and the lease socket stops accepting
+ *                   connections once its burst is used up.  The other
+ *                   lease is still served.
+ */
+START_TEST(connect_storm_is_throttled)
+{
+	struct lease_handle other_lease = {.name = "other-lease"};
+	struct lease_handle *leases[] = {&test_lease, &other_lease};
+	struct ls *ls = ls_create(leases, 2);
+	ck_assert_ptr_ne(ls, NULL);
+
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	ck_assert_int_eq(
+	    sockaddr_set_lease_server_path(&address, TEST_LEASE_NAME), true);
+
+	const int attempts = 20;
+	int fds[attempts];
+	struct ls_req req;
+	for (int i = 0; i < attempts; i++) {
+		fds[i] = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+		ck_assert_int_ge(fds[i], 0);
+
+		/* Fails once the listen backlog is full */
+		connect(fds[i], (struct sockaddr *)&address, sizeof(address));
+		ck_assert_int_eq(ls_poll_request(ls, &req), 0);
+	}
+
+	struct lease_admission_stats stats;
+	ck_assert_int_eq(ls_get_admission_stats(ls, &test_lease, &stats),
+			 true);
+	ck_assert_uint_lt(stats.connections, attempts);
+	ck_assert_uint_eq(stats.shed, stats.connections - 2);
+
+	struct test_config config = default_test_config;
+	config.lease = &other_lease;
+	struct client_state *cstate = test_client_start(&config);
+	get_and_check_request(ls, &other_lease, LS_REQ_GET_LEASE);
+	test_client_stop(cstate);
+
+	ck_assert_int_eq(ls_get_admission_stats(ls, &other_lease, &stats),
+			 true);
+	ck_assert_uint_eq(stats.connections, 1);
+	ck_assert_uint_eq(stats.shed, 0);
+
+	for (int i = 0; i < attempts; i++)
+		close(fds[i]);
+	ls_destroy(ls);
+}
+END_TEST
+
 static void add_client_request_tests(Suite *s)
 {
 	TCase *tc = tcase_create("Client request testing");
@@ -247,6 +335,8 @@ static void add_client_request_tests(Suite *s)
 	tcase_add_test(tc, issue_lease_request_and_release);
 	tcase_add_test(tc, issue_lease_request_and_early_release);
 	tcase_add_test(tc, issue_multiple_lease_requests);
+	tcase_add_test(tc, poll_request_without_blocking);
+	tcase_add_test(tc, connect_storm_is_throttled);
 	suite_add_tcase(s, tc);
 }
 
@@ -316,6 +406,93 @@ START_TEST(ls_send_fd_is_noop_when_fd_is_invalid)
 }
 END_TEST
 
+/* stalled_client_is_disconnected
+ *
+ * Test details: Send more fds to a client than it reads.
+ * Expected results: ls_send_fd() does not block. Once the client socket
+ *                   is full, messages are queued and ls_send_fd() fails
+ *                   when the queue overflows. The client is reported as
+ *                   disconnected when the queued messages can't be sent
+ *                   before the send timeout.
+ */
+START_TEST(stalled_client_is_disconnected)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.skip_release = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	bool req_valid = ls_get_request(ls, &req);
+	ck_assert_int_eq(req_valid, true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	int sent = 0;
+	while (ls_send_fd(ls, req.client, test_fd))
+		sent++;
+
+	ck_assert_int_gt(sent, 1);
+
+	struct ls_client *stalled_client = req.client;
+	get_and_check_request(ls, &test_lease, LS_REQ_CLIENT_DISCONNECT);
+	ls_disconnect_client(ls, stalled_client);
+
+	test_client_stop(cstate);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* stalled_client_is_disconnected_under_load
+ *
+ * Test details: Stall a client, while another client that has hung up
+ *               keeps the server busy, as its disconnect is never handled.
+ * Expected results: The stalled client is still reported as disconnected
+ *                   once its send timeout expires.
+ */
+START_TEST(stalled_client_is_disconnected_under_load)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.skip_release = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	while (ls_send_fd(ls, req.client, test_fd))
+		;
+	struct ls_client *stalled_client = req.client;
+
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	ck_assert_int_eq(
+	    sockaddr_set_lease_server_path(&address, TEST_LEASE_NAME), true);
+	int busy_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	ck_assert_int_ge(busy_fd, 0);
+	ck_assert_int_eq(
+	    connect(busy_fd, (struct sockaddr *)&address, sizeof(address)), 0);
+	close(busy_fd);
+
+	/* Each request is either the disconnect of the hung up client, or
+	 * that of the stalled client */
+	bool stalled_reported = false;
+	for (int i = 0; i < 10000000 && !stalled_reported; i++) {
+		ck_assert_int_eq(ls_get_request(ls, &req), true);
+		ck_assert_int_eq(req.type, LS_REQ_CLIENT_DISCONNECT);
+		stalled_reported = req.client == stalled_client;
+	}
+	ck_assert_int_eq(stalled_reported, true);
+	ls_disconnect_client(ls, stalled_client);
+
+	test_client_stop(cstate);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
 static void add_fd_send_tests(Suite *s)
 {
 	TCase *tc = tcase_create("File descriptor sending tests");
@@ -324,6 +501,914 @@ static void add_fd_send_tests(Suite *s)
 
 	tcase_add_test(tc, send_fd_to_client);
 	tcase_add_test(tc, ls_send_fd_is_noop_when_fd_is_invalid);
+	tcase_add_test(tc, stalled_client_is_disconnected);
+	tcase_add_test(tc, stalled_client_is_disconnected_under_load);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease resume tests ************/
+
+/* Test the handling of resume tokens sent to clients along with the
+ * lease fd, and presented by clients in resume requests.
+ */
+
+/* Grant the lease to a client that then exits without releasing it,
+ * and return the resume token the client received. */
+static struct dlm_resume_token grant_and_crash(struct ls *ls, int lease_fd)
+{
+	struct test_config config = default_test_config;
+	config.skip_release = true;
+
+	struct client_state *cstate = test_client_start(&config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_int_eq(ls_send_fd(ls, req.client, lease_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_CLIENT_DISCONNECT);
+	ls_disconnect_client(ls, req.client);
+
+	ck_assert_int_eq(config.has_data, true);
+	test_config_cleanup(&config);
+	return config.received_token;
+}
+
+/* resume_lease_with_valid_token
+ *
+ * Test details: Send a resume request with the token received by the
+ *               previous lease holder.
+ * Expected results: A valid resume token is sent with the lease fd.
+ *                   The resume request is returned as LS_REQ_RESUME_LEASE.
+ */
+START_TEST(resume_lease_with_valid_token)
+{
+	struct ls *ls = create_default_server();
+	int test_fd = get_dummy_fd();
+
+	struct dlm_resume_token token = grant_and_crash(ls, test_fd);
+	ck_assert_int_eq(dlm_resume_token_is_valid(&token), true);
+
+	default_test_config.resume = true;
+	default_test_config.resume_token = token;
+
+	struct client_state *cstate = test_client_start(&default_test_config);
+	get_and_check_request(ls, &test_lease, LS_REQ_RESUME_LEASE);
+	test_client_stop(cstate);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* resume_lease_with_invalid_token
+ *
+ * Test details: Send a resume request with a token that was never issued.
+ * Expected results: The request is returned as a regular LS_REQ_GET_LEASE.
+ */
+START_TEST(resume_lease_with_invalid_token)
+{
+	struct ls *ls = create_default_server();
+	int test_fd = get_dummy_fd();
+
+	struct dlm_resume_token token = grant_and_crash(ls, test_fd);
+	token.data[0] ^= 0xff;
+
+	default_test_config.resume = true;
+	default_test_config.resume_token = token;
+
+	struct client_state *cstate = test_client_start(&default_test_config);
+	get_and_check_request(ls, &test_lease, LS_REQ_GET_LEASE);
+	test_client_stop(cstate);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* resume_token_invalidated_on_release
+ *
+ * Test details: Send a resume request with the token of a lease that was
+ *               explicitly released by its client, once the token has been
+ *               cleared, as the lease manager does on a release from the
+ *               holder.
+ * Expected results: The request is returned as a regular LS_REQ_GET_LEASE.
+ */
+START_TEST(resume_token_invalidated_on_release)
+{
+	struct ls *ls = create_default_server();
+	int test_fd = get_dummy_fd();
+
+	struct test_config config = default_test_config;
+	struct client_state *cstate = test_client_start(&config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+	ls_disconnect_client(ls, req.client);
+	ls_clear_resume_token(ls, &test_lease);
+	test_config_cleanup(&config);
+
+	default_test_config.resume = true;
+	default_test_config.resume_token = config.received_token;
+
+	cstate = test_client_start(&default_test_config);
+	get_and_check_request(ls, &test_lease, LS_REQ_GET_LEASE);
+	test_client_stop(cstate);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* hand_over_lease_holder
+ *
+ * Test details: Grant the lease, then hand the server sockets and the
+ *               connection of the lease holder over to a new server.
+ * Expected results: The new server takes over the sockets of the old one,
+ *                   and returns the release request the client sends to the
+ *                   old server.
+ */
+START_TEST(hand_over_lease_holder)
+{
+	struct ls *ls = create_default_server();
+	int test_fd = get_dummy_fd();
+
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	struct handoff *handoff = handoff_create();
+	ck_assert_ptr_ne(handoff, NULL);
+	ck_assert_int_eq(ls_export(ls, handoff), true);
+
+	struct handoff_lease *lease =
+	    handoff_add_lease(handoff, TEST_LEASE_NAME, 1, test_fd);
+	ck_assert_ptr_ne(lease, NULL);
+	ck_assert_int_eq(ls_export_lease(ls, &test_lease, req.client, lease),
+			 true);
+	ck_assert_int_ge(lease->client_fd, 0);
+
+	ls_disown(ls);
+	ls_destroy(ls);
+
+	struct lease_handle *leases[] = {
+	    &test_lease,
+	};
+	ls = ls_create_from_handoff(leases, 1, handoff);
+	ck_assert_ptr_ne(ls, NULL);
+
+	struct handoff_server *serv =
+	    handoff_find_server(handoff, TEST_LEASE_NAME);
+	ck_assert_ptr_ne(serv, NULL);
+	ck_assert_int_eq(serv->listen_fd, -1);
+
+	ck_assert_ptr_ne(ls_adopt_lease(ls, &test_lease, lease), NULL);
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	handoff_destroy(handoff);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* supervisor_state_is_updated_per_lease
+ *
+ * Test details: Send a state with one lease, then an update dropping that
+ *               lease and an update adding another one.
+ * Expected results: The received state only lists the added lease, with
+ *                   its own lessee id.
+ */
+START_TEST(supervisor_state_is_updated_per_lease)
+{
+	int sockets[2];
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets), 0);
+	int test_fd = get_dummy_fd();
+
+	struct handoff *handoff = handoff_create();
+	ck_assert_ptr_ne(handoff, NULL);
+	ck_assert_ptr_ne(
+	    handoff_add_lease(handoff, TEST_LEASE_NAME, 1, test_fd), NULL);
+	ck_assert_int_eq(handoff_send(sockets[0], handoff), true);
+	handoff_destroy(handoff);
+
+	struct handoff_lease dropped = {
+	    .name = TEST_LEASE_NAME,
+	    .lease_fd = -1,
+	    .client_fd = -1,
+	};
+	struct handoff_lease added = {
+	    .name = "other-lease",
+	    .lessee_id = 2,
+	    .lease_fd = test_fd,
+	    .client_fd = -1,
+	};
+	ck_assert_int_eq(handoff_send_lease(sockets[0], &dropped), true);
+	ck_assert_int_eq(handoff_send_lease(sockets[0], &added), true);
+	close(sockets[0]);
+
+	struct handoff *state = handoff_receive(sockets[1]);
+	ck_assert_ptr_ne(state, NULL);
+	ck_assert_int_eq(state->nleases, 1);
+
+	ck_assert_int_eq(handoff_receive_update(sockets[1], state), true);
+	ck_assert_int_eq(state->nleases, 0);
+
+	ck_assert_int_eq(handoff_receive_update(sockets[1], state), true);
+	ck_assert_int_eq(handoff_receive_update(sockets[1], state), false);
+	ck_assert_int_eq(state->nleases, 1);
+	ck_assert_str_eq(state->leases[0].name, "other-lease");
+	ck_assert_int_eq(state->leases[0].lessee_id, 2);
+	ck_assert_int_ge(state->leases[0].lease_fd, 0);
+
+	handoff_destroy(state);
+	close(sockets[1]);
+	close(test_fd);
+}
+END_TEST
+
+static void add_resume_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease resume tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, resume_lease_with_valid_token);
+	tcase_add_test(tc, resume_lease_with_invalid_token);
+	tcase_add_test(tc, resume_token_invalidated_on_release);
+	tcase_add_test(tc, hand_over_lease_holder);
+	tcase_add_test(tc, supervisor_state_is_updated_per_lease);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Protocol version 2 tests ************/
+
+/* Test clients using protocol version 2, which negotiate the protocol
+ * version and capabilities, and may send requests before receiving
+ * the replies to earlier ones.
+ */
+
+/* v2_handshake_and_pipelined_request
+ *
+ * Test details: Send a handshake immediately followed by a lease request.
+ * Expected results: The handshake is handled by the lease server, and the
+ *                   negotiated version and capabilities are returned.
+ *                   The lease request is returned from ls_get_request(),
+ *                   and its reply carries the lease fd and a resume token.
+ */
+START_TEST(v2_handshake_and_pipelined_request)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	ck_assert_int_eq(default_test_config.negotiated_version,
+			 DLM_PROTOCOL_VERSION);
+	ck_assert_int_eq(default_test_config.negotiated_caps,
+			 DLM_CAP_RESUME_TOKEN);
+	ck_assert_int_eq(default_test_config.reply_status, DLM_STATUS_OK);
+	ck_assert_int_eq(default_test_config.has_data, true);
+	check_fd_equality(test_fd, default_test_config.received_fd);
+	ck_assert_int_eq(
+	    dlm_resume_token_is_valid(&default_test_config.received_token),
+	    true);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_lease_event_is_sent_to_holder
+ *
+ * Test details: Send a lease event to a client that supports lease events.
+ * Expected results: The lease events capability is negotiated, and the
+ *                   client receives the event after the lease fd.
+ */
+START_TEST(v2_lease_event_is_sent_to_holder)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.lease_events = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+	ck_assert_int_eq(
+	    ls_send_lease_event(ls, req.client, LS_EVENT_TRANSFER_PENDING),
+	    true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	ck_assert_int_eq(default_test_config.negotiated_caps,
+			 DLM_CAP_RESUME_TOKEN | DLM_CAP_LEASE_EVENTS);
+	ck_assert_int_eq(default_test_config.lease_event,
+			 DLM_LEASE_EVENT_TRANSFER_PENDING);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_traced_request_is_recorded
+ *
+ * Test details: Send a lease request with a trace ID, with a trace file set.
+ * Expected results: The reception of the request, the stages recorded with
+ *                   ls_trace_request() and the lease reply are appended to
+ *                   the trace file, under the trace ID.
+ */
+START_TEST(v2_traced_request_is_recorded)
+{
+	struct ls *ls = create_default_server();
+
+	FILE *trace = tmpfile();
+	ck_assert_ptr_ne(trace, NULL);
+	ls_set_trace_fd(ls, fileno(trace));
+
+	default_test_config.use_v2 = true;
+	default_test_config.trace_id = 0x0123456789abcdef;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	ls_trace_request(ls, req.client, DLM_TRACE_SERVER_GRANT);
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	const char *expected_stages[] = {
+	    "server-received",
+	    "server-grant",
+	    "server-sent",
+	};
+	char line[128];
+	rewind(trace);
+	for (unsigned i = 0; i < ARRAY_LENGTH(expected_stages); i++) {
+		char stage[32];
+		ck_assert_ptr_ne(fgets(line, sizeof(line), trace), NULL);
+		ck_assert_int_eq(sscanf(line, "0123456789abcdef %31s", stage),
+				 1);
+		ck_assert_str_eq(stage, expected_stages[i]);
+	}
+	ck_assert_ptr_eq(fgets(line, sizeof(line), trace), NULL);
+
+	fclose(trace);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_request_carries_plane_demand
+ *
+ * Test details: Send a lease request asking for overlay planes.
+ * Expected results: The request returned from ls_get_request() has the
+ *                   plane demand of the client.
+ */
+START_TEST(v2_request_carries_plane_demand)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.overlay_planes = 2;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_int_eq(req.plane_demand.overlay, 2);
+	ck_assert_int_eq(req.plane_demand.cursor, 0);
+	ck_assert_int_eq(req.plane_demand.scaling, 0);
+
+	ck_assert_int_eq(ls_send_error(ls, req.client, LS_ERR_LEASE_FAILED),
+			 true);
+
+	test_client_stop(cstate);
+	ls_disconnect_client(ls, req.client);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_lease_error_is_sent_to_client
+ *
+ * Test details: Reject a lease request with ls_send_error().
+ * Expected results: The client receives the error status, without a
+ *                   lease fd.
+ */
+START_TEST(v2_lease_error_is_sent_to_client)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	ck_assert_int_eq(ls_send_error(ls, req.client, LS_ERR_LEASE_BUSY),
+			 true);
+
+	test_client_stop(cstate);
+	ls_disconnect_client(ls, req.client);
+
+	ck_assert_int_eq(default_test_config.connection_completed, true);
+	ck_assert_int_eq(default_test_config.reply_status,
+			 DLM_STATUS_LEASE_BUSY);
+	ck_assert_int_eq(default_test_config.has_data, false);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_version_is_kept_after_handshake
+ *
+ * Test details: Send a handshake, followed by a lease request in the
+ *               version 1 format.
+ * Expected results: The lease is sent in a version 2 reply, as negotiated
+ *                   in the handshake.
+ */
+START_TEST(v2_version_is_kept_after_handshake)
+{
+	struct ls *ls = create_default_server();
+
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	ck_assert_int_eq(
+	    sockaddr_set_lease_server_path(&address, TEST_LEASE_NAME), true);
+	int client = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	ck_assert_int_ge(client, 0);
+	ck_assert_int_eq(
+	    connect(client, (struct sockaddr *)&address, sizeof(address)), 0);
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, 1);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+
+	struct dlm_client_request request = {.opcode = DLM_GET_LEASE};
+	ck_assert_int_eq(send_dlm_client_request(client, &request), true);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	ck_assert_int_eq(dlm_receive_msg(client, &msg), true);
+	ck_assert_int_eq(msg.hdr.type, DLM_MSG_REPLY);
+	ck_assert_int_eq(msg.hdr.seq, 1);
+
+	ck_assert_int_eq(dlm_receive_msg(client, &msg), true);
+	ck_assert_int_eq(msg.hdr.version, DLM_PROTOCOL_VERSION);
+	ck_assert_int_eq(msg.hdr.type, DLM_MSG_REPLY);
+	ck_assert_int_eq(msg.nfds, 1);
+	check_fd_equality(test_fd, msg.fds[0]);
+	dlm_msg_close_fds(&msg);
+
+	close(client);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_session_client_gets_lease_again
+ *
+ * Test details: A client that supports sessions releases its lease, and
+ *               requests it again on the same connection.
+ * Expected results: The session capability is negotiated.  The release and
+ *                   the second lease request come from the same client,
+ *                   which is granted the lease again.
+ */
+START_TEST(v2_session_client_gets_lease_again)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.session = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_int_eq(ls_client_has_session(req.client), true);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	struct ls_req next;
+	ck_assert_int_eq(ls_get_request(ls, &next), true);
+	check_request(&next, &test_lease, LS_REQ_RELEASE_LEASE);
+	ck_assert_ptr_eq(next.client, req.client);
+
+	ck_assert_int_eq(ls_get_request(ls, &next), true);
+	check_request(&next, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_ptr_eq(next.client, req.client);
+	ck_assert_int_eq(ls_send_fd(ls, next.client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_CLIENT_DISCONNECT);
+
+	ck_assert_int_eq(default_test_config.negotiated_caps,
+			 DLM_CAP_RESUME_TOKEN | DLM_CAP_SESSION);
+	ck_assert_int_eq(default_test_config.session_regranted, true);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+static int connect_test_lease(void)
+{
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	ck_assert_int_eq(
+	    sockaddr_set_lease_server_path(&address, TEST_LEASE_NAME), true);
+	int client = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	ck_assert_int_ge(client, 0);
+	ck_assert_int_eq(
+	    connect(client, (struct sockaddr *)&address, sizeof(address)), 0);
+	return client;
+}
+
+static void send_get_lease_msg(int client, uint32_t seq)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_GET_LEASE, seq);
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+}
+
+/* Connect to the test lease, and send a handshake (seq 1) followed by a
+ * lease request (seq 2) */
+static int connect_v2_client(uint32_t caps)
+{
+	int client = connect_test_lease();
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, 1);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	dlm_msg_add_u32(&msg, DLM_ATTR_CAPS, caps);
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+
+	send_get_lease_msg(client, 2);
+	return client;
+}
+
+static uint32_t receive_reply_status(int client, uint32_t seq)
+{
+	struct dlm_msg msg;
+	ck_assert_int_eq(dlm_receive_msg(client, &msg), true);
+	ck_assert_int_eq(msg.hdr.type, DLM_MSG_REPLY);
+	ck_assert_int_eq(msg.hdr.seq, seq);
+	dlm_msg_close_fds(&msg);
+
+	uint32_t status = DLM_STATUS_INVALID_REQUEST;
+	dlm_msg_get_u32(&msg, DLM_ATTR_STATUS, &status);
+	return status;
+}
+
+/* v2_idle_session_client_frees_its_slot
+ *
+ * Test details: Grant the lease to a client, refuse it to a session client,
+ *               which is kept connected as an idle client, and connect a
+ *               third client.  Then send a lease request from the idle
+ *               client, before and after the third client disconnects.
+ * Expected results: The request of the third client is returned.  The idle
+ *                   client is refused by the server while the holder and the
+ *                   third client are connected, and its request is returned
+ *                   once the third client is gone.
+ */
+START_TEST(v2_idle_session_client_frees_its_slot)
+{
+	struct ls *ls = create_default_server();
+	struct ls_req req;
+
+	int holder = connect_v2_client(0);
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	int session = connect_v2_client(DLM_CAP_SESSION);
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	struct ls_client *session_client = req.client;
+	ck_assert_int_eq(ls_send_error(ls, session_client, LS_ERR_LEASE_BUSY),
+			 true);
+	ls_idle_client(ls, session_client);
+
+	int requester = connect_v2_client(0);
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	struct ls_client *requester_client = req.client;
+	ck_assert_ptr_ne(requester_client, session_client);
+
+	send_get_lease_msg(session, 3);
+	ck_assert_int_eq(ls_poll_request(ls, &req), 0);
+
+	ck_assert_int_eq(receive_reply_status(session, 1), DLM_STATUS_OK);
+	ck_assert_int_eq(receive_reply_status(session, 2),
+			 DLM_STATUS_LEASE_BUSY);
+	ck_assert_int_eq(receive_reply_status(session, 3),
+			 DLM_STATUS_LEASE_BUSY);
+
+	ls_disconnect_client(ls, requester_client);
+	send_get_lease_msg(session, 4);
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+	ck_assert_ptr_eq(req.client, session_client);
+
+	close(holder);
+	close(session);
+	close(requester);
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v2_invalid_request_is_rejected
+ *
+ * Test details: Send a request of an unknown type between the handshake
+ *               and the lease request.
+ * Expected results: The unknown request is rejected with
+ *                   DLM_STATUS_INVALID_REQUEST, and the following lease
+ *                   request is handled normally.
+ */
+START_TEST(v2_invalid_request_is_rejected)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.send_invalid_request = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, req.client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	ck_assert_int_eq(default_test_config.invalid_request_status,
+			 DLM_STATUS_INVALID_REQUEST);
+	ck_assert_int_eq(default_test_config.reply_status, DLM_STATUS_OK);
+	check_fd_equality(test_fd, default_test_config.received_fd);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* v1_client_is_disconnected_instead_of_status_reply
+ *
+ * Test details: Send a version 1 lease request, followed by a handshake
+ *               asking for version 1.
+ * Expected results: The handshake can't be answered in version 1, so the
+ *                   connection is closed, without sending any data or fd,
+ *                   and reported as a disconnect.
+ */
+START_TEST(v1_client_is_disconnected_instead_of_status_reply)
+{
+	struct ls *ls = create_default_server();
+	int client = connect_test_lease();
+
+	struct dlm_client_request request = {.opcode = DLM_GET_LEASE};
+	ck_assert_int_eq(send_dlm_client_request(client, &request), true);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, 1);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, 1);
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+
+	struct ls_req next;
+	ck_assert_int_eq(ls_get_request(ls, &next), true);
+	check_request(&next, &test_lease, LS_REQ_CLIENT_DISCONNECT);
+	ck_assert_ptr_eq(next.client, req.client);
+	ls_disconnect_client(ls, next.client);
+
+	char buf;
+	ck_assert_int_eq(recv(client, &buf, sizeof(buf), 0), 0);
+
+	close(client);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* framed_version_1_message_is_rejected
+ *
+ * Test details: Send a lease request in the version 2 format, with a
+ *               header version of 1, then a valid one.
+ * Expected results: Only the valid request is returned.
+ */
+START_TEST(framed_version_1_message_is_rejected)
+{
+	struct ls *ls = create_default_server();
+	int client = connect_test_lease();
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_GET_LEASE, 1);
+	msg.hdr.version = 1;
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_poll_request(ls, &req), 0);
+
+	dlm_msg_init(&msg, DLM_MSG_GET_LEASE, 2);
+	ck_assert_int_eq(dlm_send_msg(client, &msg), true);
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, &test_lease, LS_REQ_GET_LEASE);
+
+	close(client);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* select_request_is_moved_to_lease_server
+ *
+ * Test details: Send a lease selection request to the selection server,
+ *               and assign the client to a lease.
+ * Expected results: The request carries the constraints, and the
+ *                   client receives the lease fd and name.  Its release
+ *                   request is reported for the assigned lease.
+ */
+START_TEST(select_request_is_moved_to_lease_server)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.select_lease = true;
+	default_test_config.select_min_width = 1920;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, NULL, LS_REQ_SELECT_LEASE);
+	ck_assert_int_eq(req.constraints.connected, true);
+	ck_assert_int_eq(req.constraints.min_width, 1920);
+	ck_assert_int_eq(req.constraints.has_plane_type, false);
+
+	struct ls_client *client =
+	    ls_assign_client(ls, req.client, &test_lease);
+	ck_assert_ptr_ne(client, NULL);
+
+	int test_fd = get_dummy_fd();
+	ck_assert_int_eq(ls_send_fd(ls, client, test_fd), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, &test_lease, LS_REQ_RELEASE_LEASE);
+
+	ck_assert_int_eq(default_test_config.reply_status, DLM_STATUS_OK);
+	check_fd_equality(test_fd, default_test_config.received_fd);
+	ck_assert_str_eq(default_test_config.received_lease_name,
+			 TEST_LEASE_NAME);
+
+	close(test_fd);
+	ls_destroy(ls);
+}
+END_TEST
+
+/* select_without_match_is_rejected
+ *
+ * Test details: Reject a lease selection request.
+ * Expected results: The client receives a DLM_STATUS_NO_MATCH reply.
+ */
+START_TEST(select_without_match_is_rejected)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.select_lease = true;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, NULL, LS_REQ_SELECT_LEASE);
+
+	ck_assert_int_eq(ls_send_error(ls, req.client, LS_ERR_NO_MATCH), true);
+	ls_disconnect_client(ls, req.client);
+
+	test_client_stop(cstate);
+
+	ck_assert_int_eq(default_test_config.reply_status,
+			 DLM_STATUS_NO_MATCH);
+	ck_assert_int_eq(default_test_config.has_data, false);
+
+	ls_destroy(ls);
+}
+END_TEST
+
+/* reassign_request_lists_leases
+ *
+ * Test details: Send a lease reassignment request to the admin server,
+ *               and carry it out.
+ * Expected results: The request lists the lease, and the client receives
+ *                   an acceptance reply followed by the switch time.
+ */
+START_TEST(reassign_request_lists_leases)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.reassign_lease = TEST_LEASE_NAME;
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	struct ls_req req;
+	ck_assert_int_eq(ls_get_request(ls, &req), true);
+	check_request(&req, NULL, LS_REQ_REASSIGN_LEASES);
+	ck_assert_int_eq(req.nlease_handles, 1);
+	ck_assert_ptr_eq(req.lease_handles[0], &test_lease);
+
+	ck_assert_int_eq(ls_send_reassign_accepted(ls, req.client), true);
+	ck_assert_int_eq(ls_send_reassign_done(ls, req.client, 1234), true);
+
+	test_client_stop(cstate);
+	get_and_check_request(ls, NULL, LS_REQ_CLIENT_DISCONNECT);
+
+	ck_assert_int_eq(default_test_config.reply_status, DLM_STATUS_OK);
+	ck_assert_int_eq(default_test_config.switch_time, 1234);
+
+	ls_destroy(ls);
+}
+END_TEST
+
+/* reassign_unknown_lease_is_rejected
+ *
+ * Test details: Send a lease reassignment request for an unknown lease.
+ * Expected results: The request is rejected by the server, without being
+ *                   reported to the lease manager.
+ */
+START_TEST(reassign_unknown_lease_is_rejected)
+{
+	struct ls *ls = create_default_server();
+
+	default_test_config.use_v2 = true;
+	default_test_config.reassign_lease = "unknown-lease";
+	struct client_state *cstate = test_client_start(&default_test_config);
+
+	get_and_check_request(ls, NULL, LS_REQ_CLIENT_DISCONNECT);
+	test_client_stop(cstate);
+
+	ck_assert_int_eq(default_test_config.reply_status,
+			 DLM_STATUS_INVALID_REQUEST);
+
+	ls_destroy(ls);
+}
+END_TEST
+
+static void add_v2_protocol_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Protocol version 2 tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, v2_handshake_and_pipelined_request);
+	tcase_add_test(tc, v2_lease_event_is_sent_to_holder);
+	tcase_add_test(tc, v2_traced_request_is_recorded);
+	tcase_add_test(tc, v2_request_carries_plane_demand);
+	tcase_add_test(tc, v2_lease_error_is_sent_to_client);
+	tcase_add_test(tc, v2_session_client_gets_lease_again);
+	tcase_add_test(tc, v2_idle_session_client_frees_its_slot);
+	tcase_add_test(tc, v2_version_is_kept_after_handshake);
+	tcase_add_test(tc, v2_invalid_request_is_rejected);
+	tcase_add_test(tc, v1_client_is_disconnected_instead_of_status_reply);
+	tcase_add_test(tc, framed_version_1_message_is_rejected);
+	tcase_add_test(tc, select_request_is_moved_to_lease_server);
+	tcase_add_test(tc, select_without_match_is_rejected);
+	tcase_add_test(tc, reassign_request_lists_leases);
+	tcase_add_test(tc, reassign_unknown_lease_is_rejected);
 	suite_add_tcase(s, tc);
 }
 
@@ -338,6 +1423,8 @@ int main(void)
 	add_error_tests(s);
 	add_client_request_tests(s);
 	add_fd_send_tests(s);
+	add_resume_tests(s);
+	add_v2_protocol_tests(s);
 
 	sr = srunner_create(s);
 
@@ -24,6 +24,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -40,14 +41,199 @@ struct client_state {
 	struct test_config *config;
 };
 
-static void send_lease_request(int socket, enum dlm_opcode opcode)
+static void send_lease_request(int socket, enum dlm_opcode opcode,
+			       struct dlm_resume_token *token)
 {
 	struct dlm_client_request req = {
 	    .opcode = opcode,
 	};
+	if (token)
+		req.token = *token;
 	send_dlm_client_request(socket, &req);
 }
 
+/* Sequence numbers of the version 2 requests sent by the client */
+enum client_seq {
+	SEQ_HELLO = 1,
+	SEQ_INVALID_REQUEST,
+	SEQ_LEASE_REQUEST,
+	SEQ_RELEASE,
+	SEQ_SESSION_REQUEST,
+};
+
+#define INVALID_MSG_TYPE 0xff
+
+static void send_hello(int socket, struct test_config *config)
+{
+	uint32_t caps = DLM_CAP_RESUME_TOKEN;
+	if (config->lease_events)
+		caps |= DLM_CAP_LEASE_EVENTS;
+	if (config->session)
+		caps |= DLM_CAP_SESSION;
+
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, SEQ_HELLO);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	dlm_msg_add_u32(&msg, DLM_ATTR_CAPS, caps);
+	dlm_send_msg(socket, &msg);
+}
+
+static void send_msg(int socket, enum dlm_msg_type type, uint32_t seq,
+		     struct dlm_resume_token *token)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, type, seq);
+
+	if (token)
+		dlm_msg_add_attr(&msg, DLM_ATTR_RESUME_TOKEN, token,
+				 sizeof(*token));
+
+	dlm_send_msg(socket, &msg);
+}
+
+static void send_select_msg(int socket, struct test_config *config)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_SELECT_LEASE, SEQ_LEASE_REQUEST);
+	dlm_msg_add_u32(&msg, DLM_ATTR_SELECT_FLAGS, DLM_SELECT_CONNECTED);
+	dlm_msg_add_u32(&msg, DLM_ATTR_MIN_WIDTH, config->select_min_width);
+	dlm_send_msg(socket, &msg);
+}
+
+static void send_get_msg(int socket, struct test_config *config, uint32_t seq)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_GET_LEASE, seq);
+	if (config->overlay_planes)
+		dlm_msg_add_u32(&msg, DLM_ATTR_OVERLAY_PLANES,
+				config->overlay_planes);
+	if (config->trace_id)
+		dlm_msg_add_attr(&msg, DLM_ATTR_TRACE_ID, &config->trace_id,
+				 sizeof(config->trace_id));
+	dlm_send_msg(socket, &msg);
+}
+
+static void send_reassign_msg(int socket, struct test_config *config)
+{
+	const char *name = config->reassign_lease;
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_REASSIGN_LEASES, SEQ_LEASE_REQUEST);
+	dlm_msg_add_attr(&msg, DLM_ATTR_LEASE_LIST, name, strlen(name) + 1);
+	dlm_send_msg(socket, &msg);
+}
+
+static bool receive_reply(int socket, struct test_config *config,
+			  uint32_t seq, struct dlm_msg *reply)
+{
+	struct pollfd pfd = {.fd = socket, .events = POLLIN};
+	if (poll(&pfd, 1, config->recv_timeout) <= 0)
+		return false;
+
+	if (!dlm_receive_msg(socket, reply))
+		return false;
+
+	ck_assert_int_eq(reply->hdr.type, DLM_MSG_REPLY);
+	ck_assert_int_eq(reply->hdr.seq, seq);
+	return true;
+}
+
+/* Send the handshake and lease request without waiting for replies,
+ * then collect all the replies. */
+static void run_v2_client(int socket, struct test_config *config)
+{
+	struct dlm_msg reply;
+
+	config->received_fd = -1;
+	config->connection_completed = false;
+
+	send_hello(socket, config);
+	if (config->send_invalid_request)
+		send_msg(socket, INVALID_MSG_TYPE, SEQ_INVALID_REQUEST, NULL);
+
+	if (config->select_lease)
+		send_select_msg(socket, config);
+	else if (config->reassign_lease)
+		send_reassign_msg(socket, config);
+	else if (config->resume)
+		send_msg(socket, DLM_MSG_RESUME_LEASE, SEQ_LEASE_REQUEST,
+			 &config->resume_token);
+	else
+		send_get_msg(socket, config, SEQ_LEASE_REQUEST);
+
+	if (!receive_reply(socket, config, SEQ_HELLO, &reply))
+		return;
+
+	dlm_msg_get_u32(&reply, DLM_ATTR_VERSION, &config->negotiated_version);
+	dlm_msg_get_u32(&reply, DLM_ATTR_CAPS, &config->negotiated_caps);
+
+	if (config->send_invalid_request) {
+		if (!receive_reply(socket, config, SEQ_INVALID_REQUEST,
+				   &reply))
+			return;
+		dlm_msg_get_u32(&reply, DLM_ATTR_STATUS,
+				&config->invalid_request_status);
+	}
+
+	if (!receive_reply(socket, config, SEQ_LEASE_REQUEST, &reply))
+		return;
+
+	config->connection_completed = true;
+	dlm_msg_get_u32(&reply, DLM_ATTR_STATUS, &config->reply_status);
+
+	/* An accepted reassignment is followed by a second reply, once the
+	 * leases have been moved */
+	if (config->reassign_lease) {
+		if (config->reply_status == DLM_STATUS_OK &&
+		    receive_reply(socket, config, SEQ_LEASE_REQUEST, &reply))
+			dlm_msg_get_u32(&reply, DLM_ATTR_SWITCH_TIME,
+					&config->switch_time);
+		return;
+	}
+
+	if (reply.nfds == 1) {
+		config->has_data = true;
+		config->received_fd = reply.fds[0];
+	}
+
+	size_t len;
+	const void *token =
+	    dlm_msg_get_attr(&reply, DLM_ATTR_RESUME_TOKEN, &len);
+	if (token && len == sizeof(config->received_token))
+		memcpy(&config->received_token, token, len);
+
+	const char *name = dlm_msg_get_attr(&reply, DLM_ATTR_LEASE_NAME, &len);
+	if (name && len <= sizeof(config->received_lease_name))
+		memcpy(config->received_lease_name, name, len);
+
+	if (config->lease_events) {
+		struct dlm_msg event;
+		struct pollfd pfd = {.fd = socket, .events = POLLIN};
+		if (poll(&pfd, 1, config->recv_timeout) <= 0 ||
+		    !dlm_receive_msg(socket, &event))
+			return;
+
+		ck_assert_int_eq(event.hdr.type, DLM_MSG_LEASE_EVENT);
+		ck_assert_int_eq(event.hdr.seq, 0);
+		dlm_msg_get_u32(&event, DLM_ATTR_LEASE_EVENT,
+				&config->lease_event);
+	}
+}
+
+/* Release the lease, and request it again on the same connection */
+static void run_session(int socket, struct test_config *config)
+{
+	struct dlm_msg reply;
+
+	send_msg(socket, DLM_MSG_RELEASE_LEASE, SEQ_RELEASE, NULL);
+	send_get_msg(socket, config, SEQ_SESSION_REQUEST);
+
+	if (!receive_reply(socket, config, SEQ_SESSION_REQUEST, &reply))
+		return;
+
+	config->session_regranted = reply.nfds == 1;
+	dlm_msg_close_fds(&reply);
+}
+
 static void client_gst_socket_status(int socket_fd, struct test_config *config)
 {
 
@@ -75,9 +261,13 @@ static void *test_client_thread(void *arg)
 	    .sun_family = AF_UNIX,
 	};
 
-	ck_assert_int_eq(
-	    sockaddr_set_lease_server_path(&address, config->lease->name),
-	    true);
+	const char *name = config->lease->name;
+	if (config->select_lease)
+		name = DLM_SELECT_SERVER_NAME;
+	else if (config->reassign_lease)
+		name = DLM_ADMIN_SERVER_NAME;
+
+	ck_assert_int_eq(sockaddr_set_lease_server_path(&address, name), true);
 
 	int client = socket(PF_UNIX, SOCK_SEQPACKET, 0);
 	ck_assert_int_ge(client, 0);
@@ -90,19 +280,44 @@ static void *test_client_thread(void *arg)
 		return NULL;
 	}
 
-	send_lease_request(client, DLM_GET_LEASE);
-
 	if (!config->recv_timeout)
 		config->recv_timeout = DEFAULT_RECV_TIMEOUT;
 
+	if (config->use_v2) {
+		run_v2_client(client, config);
+
+		/* Let the server see admin clients disconnect */
+		if (config->reassign_lease) {
+			close(client);
+			cstate->socket_fd = -1;
+			return NULL;
+		}
+
+		cstate->socket_fd = client;
+		if (config->session)
+			run_session(client, config);
+		else if (!config->skip_release)
+			send_msg(client, DLM_MSG_RELEASE_LEASE, SEQ_RELEASE,
+				 NULL);
+		return NULL;
+	}
+
+	if (config->resume)
+		send_lease_request(client, DLM_RESUME_LEASE,
+				   &config->resume_token);
+	else
+		send_lease_request(client, DLM_GET_LEASE, NULL);
+
 	client_gst_socket_status(client, config);
 
 	if (config->has_data) {
-		config->received_fd = receive_lease_fd(client);
+		config->received_fd =
+		    receive_lease_fd(client, &config->received_token);
 	}
 
 	cstate->socket_fd = client;
-	send_lease_request(client, DLM_RELEASE_LEASE);
+	if (!config->skip_release)
+		send_lease_request(client, DLM_RELEASE_LEASE, NULL);
 
 	return NULL;
 }
@@ -17,16 +17,38 @@
 #define TEST_SOCKET_CLIENT_H
 #include <stdbool.h>
 
+#include "dlm-protocol.h"
 #include "drm-lease.h"
 struct test_config {
 	// settings
 	struct lease_handle *lease;
 	int recv_timeout;
+	bool resume;
+	struct dlm_resume_token resume_token;
+	bool skip_release;
+	bool use_v2;
+	bool send_invalid_request;
+	bool select_lease; // v2 only
+	uint32_t select_min_width;
+	const char *reassign_lease; // v2 only, sent to the admin server
+	uint32_t overlay_planes;    // v2 only
+	bool lease_events;	    // v2 only, receive a lease event
+	uint64_t trace_id;	    // v2 only, sent with the lease request
+	bool session;		    // v2 only, get the lease again
 
 	// outputs
 	int received_fd;
+	struct dlm_resume_token received_token;
 	bool has_data;
 	bool connection_completed;
+	uint32_t negotiated_version;
+	uint32_t negotiated_caps;
+	uint32_t reply_status;
+	uint32_t invalid_request_status;
+	char received_lease_name[64];
+	uint32_t switch_time;
+	uint32_t lease_event;
+	bool session_regranted;
 };
 
 void test_config_cleanup(struct test_config *config);
@@ -13,20 +13,33 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "dlmclient.h"
 
 #include "dlm-protocol.h"
+#include "dlm-status.h"
+#include "dlm-topology.h"
+#include "dlm-trace.h"
 #include "log.h"
 #include "socket-path.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 void dlm_enable_debug_log(bool enable)
@@ -37,18 +50,46 @@ void dlm_enable_debug_log(bool enable)
 struct dlm_lease {
 	int dlm_server_sock;
 	int lease_fd;
+	char *name;
+	struct dlm_resume_token resume_token;
+
+	/* Session the lease was requested on, if any.  The connection then
+	 * belongs to the session. */
+	struct dlm_session *session;
+
+	const struct dlm_topology_header *topology;
+	size_t topology_size;
+
+	/* State of the lease request, until the lease is received */
+	bool hello_received;
+	int send_errno;
+	int trace_fd;
+	uint64_t trace_id;
 };
 
-static bool lease_connect(struct dlm_lease *lease, const char *name)
+_Static_assert(sizeof(struct dlm_mode_info) ==
+		   sizeof(struct dlm_topology_mode),
+	       "dlm_mode_info and dlm_topology_mode layouts differ");
+_Static_assert(sizeof(struct dlm_format_modifier) ==
+		   sizeof(struct dlm_topology_modifier),
+	       "dlm_format_modifier and dlm_topology_modifier layouts differ");
+
+/* Connect to the lease manager socket 'name'.  With 'nonblocking', fail
+ * with EAGAIN instead of waiting for the lease manager to accept the
+ * connection. */
+static bool lease_connect(struct dlm_lease *lease, const char *name,
+			  bool nonblocking)
 {
 	struct sockaddr_un sa = {
 	    .sun_family = AF_UNIX,
 	};
+	int saved_errno;
 
 	if (!sockaddr_set_lease_server_path(&sa, name))
 		return false;
 
-	int dlm_server_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	int dlm_server_sock = socket(
+	    AF_UNIX, SOCK_SEQPACKET | (nonblocking ? SOCK_NONBLOCK : 0), 0);
 	if (dlm_server_sock < 0) {
 		DEBUG_LOG("Socket creation failed: %s\n", strerror(errno));
 		return false;
@@ -60,32 +101,109 @@ static bool lease_connect(struct dlm_lease *lease, const char *name)
 			continue;
 		DEBUG_LOG("Cannot connect to %s: %s\n", sa.sun_path,
 			  strerror(errno));
-		close(dlm_server_sock);
-		return false;
+		goto err;
+	}
+
+	/* Replies are polled for, so the connection can block from now on,
+	 * like any other */
+	if (nonblocking && fcntl(dlm_server_sock, F_SETFL, 0) < 0) {
+		DEBUG_LOG("fcntl failed: %s\n", strerror(errno));
+		goto err;
 	}
+
 	lease->dlm_server_sock = dlm_server_sock;
 	return true;
+
+err:
+	saved_errno = errno;
+	close(dlm_server_sock);
+	errno = saved_errno;
+	return false;
 }
 
-static bool lease_send_request(struct dlm_lease *lease, enum dlm_opcode opcode)
-{
-	struct dlm_client_request request = {
-	    .opcode = opcode,
-	};
+/* Sequence numbers of the requests sent by the client.
+ * There is only one outstanding lease request per connection. */
+enum lease_seq {
+	SEQ_HELLO = 1,
+	SEQ_LEASE_REQUEST,
+	SEQ_RELEASE,
+};
 
-	if (!send_dlm_client_request(lease->dlm_server_sock, &request)) {
+static bool lease_send_msg(struct dlm_lease *lease, const struct dlm_msg *msg)
+{
+	if (!dlm_send_msg(lease->dlm_server_sock, msg)) {
 		DEBUG_LOG("Socket data send error: %s\n", strerror(errno));
 		return false;
 	}
 	return true;
 }
 
-static bool lease_recv_fd(struct dlm_lease *lease)
+/* Send the handshake, with the extra capabilities in 'caps' */
+static bool lease_send_hello(struct dlm_lease *lease, uint32_t caps)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_HELLO, SEQ_HELLO);
+	dlm_msg_add_u32(&msg, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	dlm_msg_add_u32(&msg, DLM_ATTR_CAPS,
+			DLM_CAP_RESUME_TOKEN | DLM_CAP_TOPOLOGY |
+			    DLM_CAP_LEASE_EVENTS | caps);
+	return lease_send_msg(lease, &msg);
+}
+
+static bool lease_send_release(struct dlm_lease *lease)
+{
+	struct dlm_msg msg;
+	dlm_msg_init(&msg, DLM_MSG_RELEASE_LEASE, SEQ_RELEASE);
+	return lease_send_msg(lease, &msg);
+}
+
+static int status_to_errno(uint32_t status)
+{
+	switch (status) {
+	case DLM_STATUS_OK:
+		return 0;
+	case DLM_STATUS_LEASE_BUSY:
+		return EBUSY;
+	case DLM_STATUS_LEASE_FAILED:
+		return EACCES;
+	case DLM_STATUS_UNSUPPORTED_VERSION:
+		return EPROTONOSUPPORT;
+	case DLM_STATUS_NO_MATCH:
+		return ENOENT;
+	case DLM_STATUS_INVALID_REQUEST:
+	default:
+		return EPROTO;
+	}
+}
+
+/* Receive the reply to request 'seq'.  On success, the caller must
+ * close any fds received with the reply. */
+static bool lease_recv_reply(struct dlm_lease *lease, uint32_t seq,
+			     struct dlm_msg *reply)
 {
-	lease->lease_fd = receive_lease_fd(lease->dlm_server_sock);
+	uint32_t status;
 
-	if (lease->lease_fd < 0)
+	if (!dlm_receive_msg(lease->dlm_server_sock, reply)) {
+		/* The lease manager closes the connection on requests
+		 * that it can't handle */
+		if (errno == ECONNRESET)
+			errno = EACCES;
 		goto err;
+	}
+
+	if (reply->hdr.version < 2 || reply->hdr.type != DLM_MSG_REPLY ||
+	    reply->hdr.seq != seq ||
+	    !dlm_msg_get_u32(reply, DLM_ATTR_STATUS, &status)) {
+		dlm_msg_close_fds(reply);
+		errno = EPROTO;
+		goto err;
+	}
+
+	if (status != DLM_STATUS_OK) {
+		dlm_msg_close_fds(reply);
+		errno = status_to_errno(status);
+		goto err;
+	}
 
 	return true;
 
@@ -94,9 +212,18 @@ err:
 	case EACCES:
 		DEBUG_LOG("Lease request rejected by DRM lease manager\n");
 		break;
+	case EBUSY:
+		DEBUG_LOG("Lease is in use by another client\n");
+		break;
 	case EPROTO:
 		DEBUG_LOG("Unexpected data received from lease manager\n");
 		break;
+	case EPROTONOSUPPORT:
+		DEBUG_LOG("Protocol version not supported by lease manager\n");
+		break;
+	case ENOENT:
+		DEBUG_LOG("No lease matches the selection constraints\n");
+		break;
 	default:
 		DEBUG_LOG("Lease manager receive data error: %s\n",
 			  strerror(errno));
@@ -105,7 +232,145 @@ err:
 	return false;
 }
 
-struct dlm_lease *dlm_get_lease(const char *name)
+#define TOPOLOGY_SEALS (F_SEAL_SHRINK | F_SEAL_WRITE)
+
+/* Map the lease topology.  The memfd must be sealed against writes and
+ * shrinking, so that the mapping can't change (or fault) under us. */
+static void lease_map_topology(struct dlm_lease *lease, int fd)
+{
+	struct stat st;
+	void *data;
+
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & TOPOLOGY_SEALS) != TOPOLOGY_SEALS) {
+		DEBUG_LOG("Lease topology is not sealed\n");
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		DEBUG_LOG("Invalid lease topology size\n");
+		return;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		DEBUG_LOG("Lease topology mmap failed: %s\n", strerror(errno));
+		return;
+	}
+
+	if (!dlm_topology_validate(data, st.st_size)) {
+		DEBUG_LOG("Invalid lease topology\n");
+		munmap(data, st.st_size);
+		return;
+	}
+
+	lease->topology = data;
+	lease->topology_size = st.st_size;
+}
+
+/* Receive the handshake reply, and the negotiated capabilities if 'caps'
+ * is set */
+static bool lease_recv_hello(struct dlm_lease *lease, uint32_t *caps)
+{
+	struct dlm_msg reply;
+
+	if (!lease_recv_reply(lease, SEQ_HELLO, &reply))
+		return false;
+
+	dlm_msg_close_fds(&reply);
+	if (caps && !dlm_msg_get_u32(&reply, DLM_ATTR_CAPS, caps))
+		*caps = 0;
+	return true;
+}
+
+static bool lease_recv_fd(struct dlm_lease *lease)
+{
+	struct dlm_msg reply;
+
+	if (!lease_recv_reply(lease, SEQ_LEASE_REQUEST, &reply))
+		return false;
+
+	/* The lease fd comes first, optionally followed by the topology */
+	uint32_t topology_idx;
+	bool has_topology =
+	    dlm_msg_get_u32(&reply, DLM_ATTR_TOPOLOGY_FD, &topology_idx);
+
+	if (reply.nfds != (has_topology ? 2 : 1) ||
+	    (has_topology && topology_idx != 1)) {
+		DEBUG_LOG("Unexpected data received from lease manager\n");
+		dlm_msg_close_fds(&reply);
+		errno = EPROTO;
+		return false;
+	}
+	lease->lease_fd = reply.fds[0];
+
+	if (has_topology) {
+		lease_map_topology(lease, reply.fds[topology_idx]);
+		close(reply.fds[topology_idx]);
+	}
+
+	size_t len;
+	const void *token =
+	    dlm_msg_get_attr(&reply, DLM_ATTR_RESUME_TOKEN, &len);
+
+	memset(&lease->resume_token, 0, sizeof(lease->resume_token));
+	if (token && len == sizeof(lease->resume_token))
+		memcpy(&lease->resume_token, token, len);
+
+	/* Selected leases are only known by the name in the reply */
+	const char *name = dlm_msg_get_attr(&reply, DLM_ATTR_LEASE_NAME, &len);
+	if (name && len > 0 && name[len - 1] == '\0') {
+		free(lease->name);
+		lease->name = strdup(name);
+		if (!lease->name) {
+			DEBUG_LOG("can't allocate memory : %s\n",
+				  strerror(errno));
+			return false;
+		}
+	}
+
+	if (!lease->name) {
+		DEBUG_LOG("Lease name not received from lease manager\n");
+		errno = EPROTO;
+		return false;
+	}
+
+	return true;
+}
+
+/* Requests are traced when DLM_TRACE_FILE is set (see dlm-trace.h) */
+static int trace_open(uint64_t *trace_id)
+{
+	*trace_id = 0;
+
+	const char *path = getenv("DLM_TRACE_FILE");
+	if (!path)
+		return -1;
+
+	int fd = dlm_trace_open(path);
+	if (fd >= 0)
+		*trace_id = dlm_trace_new_id();
+	return fd;
+}
+
+/* Abort a lease request on error, keeping errno */
+static void lease_abort_request(struct dlm_lease *lease)
+{
+	int saved_errno = errno;
+	if (lease->trace_fd >= 0)
+		close(lease->trace_fd);
+	dlm_release_lease(lease);
+	errno = saved_errno;
+}
+
+/* Connect to the lease manager socket 'server', and send 'request' right
+ * after the handshake, without waiting for the lease manager to reply.
+ * With 'nonblocking', fail with EAGAIN instead of waiting for the lease
+ * manager to accept the connection. */
+static struct dlm_lease *lease_send_request(const char *server,
+					    const char *name,
+					    const struct dlm_msg *request,
+					    bool nonblocking)
 {
 	int saved_errno;
 	struct dlm_lease *lease = calloc(1, sizeof(struct dlm_lease));
@@ -114,41 +379,1210 @@ struct dlm_lease *dlm_get_lease(const char *name)
 		return NULL;
 	}
 
-	if (!lease_connect(lease, name)) {
+	lease->lease_fd = -1;
+	lease->trace_fd = trace_open(&lease->trace_id);
+	dlm_trace_record(lease->trace_fd, lease->trace_id,
+			 DLM_TRACE_CLIENT_START);
+
+	if (!lease_connect(lease, server, nonblocking)) {
+		saved_errno = errno;
+		if (lease->trace_fd >= 0)
+			close(lease->trace_fd);
 		free(lease);
+		errno = saved_errno;
 		return NULL;
 	}
+	dlm_trace_record(lease->trace_fd, lease->trace_id,
+			 DLM_TRACE_CLIENT_CONNECTED);
+
+	struct dlm_msg traced_request;
+	if (lease->trace_id) {
+		traced_request = *request;
+		if (dlm_msg_add_attr(&traced_request, DLM_ATTR_TRACE_ID,
+				     &lease->trace_id,
+				     sizeof(lease->trace_id)))
+			request = &traced_request;
+	}
+
+	if (name) {
+		lease->name = strdup(name);
+		if (!lease->name) {
+			DEBUG_LOG("can't allocate memory : %s\n",
+				  strerror(errno));
+			goto err;
+		}
+	}
 
-	if (!lease_send_request(lease, DLM_GET_LEASE))
+	if (!lease_send_hello(lease, 0))
 		goto err;
 
+	/* If the handshake was rejected, the lease manager may have closed
+	 * the connection before the lease request was sent.  The handshake
+	 * reply has the reason. */
+	if (!lease_send_msg(lease, request))
+		lease->send_errno = errno;
+	else
+		dlm_trace_record(lease->trace_fd, lease->trace_id,
+				 DLM_TRACE_CLIENT_SENT);
+	return lease;
+
+err:
+	lease_abort_request(lease);
+	return NULL;
+}
+
+/* Check if a reply can be received without blocking */
+static bool lease_readable(struct dlm_lease *lease)
+{
+	struct pollfd pfd = {
+	    .fd = lease->dlm_server_sock,
+	    .events = POLLIN,
+	};
+	if (poll(&pfd, 1, 0) == 0) {
+		errno = EAGAIN;
+		return false;
+	}
+	return true;
+}
+
+/* Receive the replies to a request sent with lease_send_request().  With
+ * 'nonblocking', fail with EAGAIN until the replies have arrived. */
+static bool lease_recv_request(struct dlm_lease *lease, bool nonblocking)
+{
+	if (!lease->hello_received) {
+		if (nonblocking && !lease_readable(lease))
+			return false;
+		if (!lease_recv_hello(lease, NULL))
+			return false;
+		lease->hello_received = true;
+
+		if (lease->send_errno) {
+			errno = lease->send_errno;
+			return false;
+		}
+	}
+
+	if (nonblocking && !lease_readable(lease))
+		return false;
 	if (!lease_recv_fd(lease))
-		goto err;
+		return false;
+
+	dlm_trace_record(lease->trace_fd, lease->trace_id,
+			 DLM_TRACE_CLIENT_RECEIVED);
+	if (lease->trace_fd >= 0)
+		close(lease->trace_fd);
+	lease->trace_fd = -1;
+	return true;
+}
 
+/* Connect to the lease manager socket 'server', and send 'request' */
+static struct dlm_lease *lease_request(const char *server,
+				       const char *name,
+				       const struct dlm_msg *request)
+{
+	struct dlm_lease *lease =
+	    lease_send_request(server, name, request, false);
+	if (lease && !lease_recv_request(lease, false)) {
+		lease_abort_request(lease);
+		return NULL;
+	}
 	return lease;
+}
+
+struct dlm_lease *dlm_get_lease(const char *name)
+{
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_GET_LEASE, SEQ_LEASE_REQUEST);
+	return lease_request(name, name, &request);
+}
+
+struct dlm_lease *dlm_get_lease_with_planes(
+    const char *name, const struct dlm_plane_demand *planes)
+{
+	if (!planes) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_GET_LEASE, SEQ_LEASE_REQUEST);
+	dlm_msg_add_u32(&request, DLM_ATTR_OVERLAY_PLANES, planes->overlay);
+	dlm_msg_add_u32(&request, DLM_ATTR_CURSOR_PLANES, planes->cursor);
+	dlm_msg_add_u32(&request, DLM_ATTR_SCALING_PLANES, planes->scaling);
+	return lease_request(name, name, &request);
+}
+
+/* Delay before connecting again when the lease manager has not accepted
+ * the connection */
+#define LEASE_WAIT_RETRY_MS 10
+
+struct dlm_lease_wait {
+	char *name;
+	/* Runtime directory */
+	char *dir;
+
+	/* Polls the inotify fd, the retry timer, and the connection of the
+	 * lease request */
+	int epoll_fd;
+	int inotify_fd;
+	int retry_fd;
+
+	/* Watch of the runtime directory, or of its closest parent until
+	 * the directory is created */
+	int watch;
+	bool watching_dir;
+
+	/* Set when the lease socket may have appeared since the last try */
+	bool try_connect;
+
+	/* Lease requested, until the lease manager replies */
+	struct dlm_lease *lease;
+};
+
+static bool lease_wait_poll_fd(struct dlm_lease_wait *wait, int op, int fd)
+{
+	struct epoll_event ev = {
+	    .events = EPOLLIN,
+	};
+	if (epoll_ctl(wait->epoll_fd, op, fd, &ev) < 0) {
+		DEBUG_LOG("epoll_ctl failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Watch the closest existing directory on the runtime directory path */
+static bool lease_wait_watch_closest(struct dlm_lease_wait *wait)
+{
+	char path[PATH_MAX];
+	strcpy(path, wait->dir);
+
+	if (wait->watch >= 0)
+		inotify_rm_watch(wait->inotify_fd, wait->watch);
+
+	/* The lease manager moves sockets into place once they are ready
+	 * to accept connections */
+	wait->watching_dir = true;
+	while ((wait->watch = inotify_add_watch(wait->inotify_fd, path,
+						IN_CREATE | IN_MOVED_TO)) < 0) {
+		char *slash = strrchr(path, '/');
+		if (errno != ENOENT || !slash || slash == path) {
+			DEBUG_LOG("Cannot watch %s: %s\n", path,
+				  strerror(errno));
+			return false;
+		}
+		*slash = '\0';
+		wait->watching_dir = false;
+	}
+	return true;
+}
+
+static bool lease_wait_watch(struct dlm_lease_wait *wait)
+{
+	for (;;) {
+		if (!lease_wait_watch_closest(wait))
+			return false;
+
+		/* The directory may have been created before its parent
+		 * was watched */
+		if (wait->watching_dir || access(wait->dir, F_OK) < 0)
+			return true;
+	}
+}
+
+struct dlm_lease_wait *dlm_lease_wait_start(const char *name)
+{
+	char dir[PATH_MAX];
+	int saved_errno;
+
+	if (!name) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!get_runtime_file_path(dir, sizeof(dir), ""))
+		return NULL;
+
+	/* Drop the trailing '/' */
+	dir[strlen(dir) - 1] = '\0';
+
+	struct dlm_lease_wait *wait = calloc(1, sizeof(*wait));
+	if (!wait) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		return NULL;
+	}
+
+	wait->epoll_fd = -1;
+	wait->inotify_fd = -1;
+	wait->retry_fd = -1;
+	wait->watch = -1;
+	wait->try_connect = true;
+	wait->name = strdup(name);
+	wait->dir = strdup(dir);
+	if (!wait->name || !wait->dir) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		goto err;
+	}
+
+	wait->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (wait->epoll_fd < 0) {
+		DEBUG_LOG("epoll_create failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	wait->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wait->inotify_fd < 0) {
+		DEBUG_LOG("inotify_init failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	wait->retry_fd =
+	    timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wait->retry_fd < 0) {
+		DEBUG_LOG("timerfd_create failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (!lease_wait_watch(wait) ||
+	    !lease_wait_poll_fd(wait, EPOLL_CTL_ADD, wait->inotify_fd) ||
+	    !lease_wait_poll_fd(wait, EPOLL_CTL_ADD, wait->retry_fd))
+		goto err;
+	return wait;
 
 err:
 	saved_errno = errno;
-	dlm_release_lease(lease);
+	dlm_lease_wait_close(wait);
 	errno = saved_errno;
 	return NULL;
 }
 
-void dlm_release_lease(struct dlm_lease *lease)
+int dlm_lease_wait_fd(struct dlm_lease_wait *wait)
 {
-	if (!lease)
+	if (!wait)
+		return -1;
+
+	return wait->epoll_fd;
+}
+
+/* Read all pending inotify events, and check if the lease socket has
+ * been created */
+static bool lease_wait_read_events(struct dlm_lease_wait *wait)
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	bool dir_changed = false;
+
+	while ((len = read(wait->inotify_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *event;
+		for (char *ptr = buf; ptr < buf + len;
+		     ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			if (event->mask & IN_Q_OVERFLOW)
+				dir_changed = wait->try_connect = true;
+			else if (event->wd != wait->watch)
+				continue;
+			else if (!wait->watching_dir)
+				dir_changed = true;
+			else if (event->len && !strcmp(event->name, wait->name))
+				wait->try_connect = true;
+		}
+	}
+
+	/* A directory on the path to the runtime directory was created */
+	if (dir_changed && !wait->watching_dir) {
+		if (!lease_wait_watch(wait))
+			return false;
+		if (wait->watching_dir)
+			wait->try_connect = true;
+	}
+
+	uint64_t expirations;
+	if (read(wait->retry_fd, &expirations, sizeof(expirations)) > 0)
+		wait->try_connect = true;
+	return true;
+}
+
+/* Request the lease, without waiting for the lease manager to accept the
+ * connection */
+static bool lease_wait_send_request(struct dlm_lease_wait *wait)
+{
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_GET_LEASE, SEQ_LEASE_REQUEST);
+
+	wait->lease = lease_send_request(wait->name, wait->name, &request,
+					 true);
+	if (!wait->lease) {
+		/* Try again later if the lease manager is busy accepting
+		 * other connections */
+		if (errno == EAGAIN) {
+			struct itimerspec retry = {
+			    .it_value.tv_nsec = LEASE_WAIT_RETRY_MS * 1000000,
+			};
+			if (timerfd_settime(wait->retry_fd, 0, &retry, NULL))
+				return false;
+			errno = EAGAIN;
+		}
+
+		/* A socket left behind by a lease manager that has exited
+		 * refuses connections until it is replaced */
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			errno = EAGAIN;
+		return false;
+	}
+
+	if (!lease_wait_poll_fd(wait, EPOLL_CTL_ADD,
+				wait->lease->dlm_server_sock)) {
+		lease_abort_request(wait->lease);
+		wait->lease = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void lease_wait_end_request(struct dlm_lease_wait *wait)
+{
+	epoll_ctl(wait->epoll_fd, EPOLL_CTL_DEL, wait->lease->dlm_server_sock,
+		  NULL);
+	wait->lease = NULL;
+}
+
+struct dlm_lease *dlm_lease_wait_dispatch(struct dlm_lease_wait *wait)
+{
+	if (!wait) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!lease_wait_read_events(wait))
+		return NULL;
+
+	if (!wait->lease) {
+		if (!wait->try_connect) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		wait->try_connect = false;
+
+		if (!lease_wait_send_request(wait))
+			return NULL;
+	}
+
+	struct dlm_lease *lease = wait->lease;
+	if (!lease_recv_request(lease, true)) {
+		if (errno == EAGAIN)
+			return NULL;
+
+		lease_wait_end_request(wait);
+		lease_abort_request(lease);
+		return NULL;
+	}
+
+	lease_wait_end_request(wait);
+	return lease;
+}
+
+void dlm_lease_wait_close(struct dlm_lease_wait *wait)
+{
+	if (!wait)
 		return;
 
-	lease_send_request(lease, DLM_RELEASE_LEASE);
-	close(lease->lease_fd);
-	close(lease->dlm_server_sock);
-	free(lease);
+	if (wait->lease)
+		lease_abort_request(wait->lease);
+	if (wait->epoll_fd >= 0)
+		close(wait->epoll_fd);
+	if (wait->inotify_fd >= 0)
+		close(wait->inotify_fd);
+	if (wait->retry_fd >= 0)
+		close(wait->retry_fd);
+	free(wait->name);
+	free(wait->dir);
+	free(wait);
 }
 
-int dlm_lease_fd(struct dlm_lease *lease)
+static int64_t get_time_ms(void)
 {
-	if (!lease)
-		return -1;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	return lease->lease_fd;
+struct dlm_lease *dlm_wait_for_lease(const char *name, int timeout_ms)
+{
+	struct dlm_lease *lease = NULL;
+	int saved_errno;
+
+	struct dlm_lease_wait *wait = dlm_lease_wait_start(name);
+	if (!wait)
+		return NULL;
+
+	int64_t deadline = get_time_ms() + timeout_ms;
+	while (!(lease = dlm_lease_wait_dispatch(wait)) && errno == EAGAIN) {
+		/* Once the lease is offered, the timeout no longer applies,
+		 * like in dlm_get_lease() */
+		int timeout = -1;
+		if (timeout_ms >= 0 && !wait->lease) {
+			int64_t remaining = deadline - get_time_ms();
+			timeout = remaining > 0 ? remaining : 0;
+		}
+
+		struct pollfd pfd = {
+		    .fd = wait->epoll_fd,
+		    .events = POLLIN,
+		};
+		int ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR)
+			break;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			break;
+		}
+	}
+
+	saved_errno = errno;
+	dlm_lease_wait_close(wait);
+	errno = saved_errno;
+	return lease;
+}
+
+struct dlm_lease *
+dlm_select_lease(const struct dlm_lease_constraints *constraints)
+{
+	if (!constraints) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	uint32_t flags = 0;
+	if (constraints->flags & DLM_CONSTRAINT_CONNECTED)
+		flags |= DLM_SELECT_CONNECTED;
+
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_SELECT_LEASE, SEQ_LEASE_REQUEST);
+	dlm_msg_add_u32(&request, DLM_ATTR_SELECT_FLAGS, flags);
+	dlm_msg_add_u32(&request, DLM_ATTR_MIN_WIDTH, constraints->min_width);
+	dlm_msg_add_u32(&request, DLM_ATTR_MIN_HEIGHT,
+			constraints->min_height);
+	dlm_msg_add_u32(&request, DLM_ATTR_MIN_REFRESH,
+			constraints->min_refresh);
+	dlm_msg_add_u32(&request, DLM_ATTR_PLANE_FORMAT,
+			constraints->plane_format);
+
+	if (constraints->flags & DLM_CONSTRAINT_PLANE_TYPE)
+		dlm_msg_add_u32(&request, DLM_ATTR_PLANE_TYPE,
+				constraints->plane_type);
+
+	if (constraints->flags & DLM_CONSTRAINT_PLANE_MODIFIER)
+		dlm_msg_add_attr(&request, DLM_ATTR_PLANE_MODIFIER,
+				 &constraints->plane_modifier,
+				 sizeof(constraints->plane_modifier));
+
+	return lease_request(DLM_SELECT_SERVER_NAME, NULL, &request);
+}
+
+struct dlm_lease *dlm_resume_lease(const char *name,
+				   const uint8_t token[DLM_RESUME_TOKEN_LEN])
+{
+	if (!token) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_RESUME_LEASE, SEQ_LEASE_REQUEST);
+	dlm_msg_add_attr(&request, DLM_ATTR_RESUME_TOKEN, token,
+			 DLM_RESUME_TOKEN_LEN);
+	return lease_request(name, name, &request);
+}
+
+struct dlm_session {
+	/* Connection to the lease socket, conn.name is the lease name */
+	struct dlm_lease conn;
+	/* Lease currently held through the session, if any */
+	struct dlm_lease *lease;
+};
+
+static void lease_free(struct dlm_lease *lease)
+{
+	if (lease->lease_fd >= 0)
+		close(lease->lease_fd);
+	free(lease->name);
+	if (lease->topology)
+		munmap((void *)lease->topology, lease->topology_size);
+	free(lease);
+}
+
+void dlm_release_lease(struct dlm_lease *lease)
+{
+	if (!lease)
+		return;
+
+	lease_send_release(lease);
+
+	/* The session connection stays open for the next lease request */
+	if (lease->session)
+		lease->session->lease = NULL;
+	else
+		close(lease->dlm_server_sock);
+	lease_free(lease);
+}
+
+/* Connect to the lease socket, and check that the lease manager keeps the
+ * connection open when the lease is released */
+static bool session_connect(struct dlm_session *session)
+{
+	struct dlm_lease *conn = &session->conn;
+	uint32_t caps;
+	int saved_errno;
+
+	if (!lease_connect(conn, conn->name, false))
+		return false;
+
+	if (!lease_send_hello(conn, DLM_CAP_SESSION) ||
+	    !lease_recv_hello(conn, &caps))
+		goto err;
+
+	if (!(caps & DLM_CAP_SESSION)) {
+		DEBUG_LOG("Sessions not supported by lease manager\n");
+		errno = EPROTONOSUPPORT;
+		goto err;
+	}
+	return true;
+
+err:
+	saved_errno = errno;
+	close(conn->dlm_server_sock);
+	conn->dlm_server_sock = -1;
+	errno = saved_errno;
+	return false;
+}
+
+/* Discard the lease events left over from the last lease.  Returns false
+ * if the connection has been closed, as it is when a lease is revoked. */
+static bool session_drain_events(struct dlm_session *session)
+{
+	int sock = session->conn.dlm_server_sock;
+	struct pollfd pfd = {
+	    .fd = sock,
+	    .events = POLLIN,
+	};
+	struct dlm_msg msg;
+
+	if (sock < 0)
+		return false;
+
+	while (poll(&pfd, 1, 0) > 0) {
+		if (!dlm_receive_msg(sock, &msg))
+			return false;
+		dlm_msg_close_fds(&msg);
+	}
+	return true;
+}
+
+struct dlm_session *dlm_session_open(const char *name)
+{
+	int saved_errno;
+
+	if (!name) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct dlm_session *session = calloc(1, sizeof(*session));
+	if (!session) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		return NULL;
+	}
+
+	session->conn.dlm_server_sock = -1;
+	session->conn.name = strdup(name);
+	if (!session->conn.name) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (!session_connect(session))
+		goto err;
+	return session;
+
+err:
+	saved_errno = errno;
+	free(session->conn.name);
+	free(session);
+	errno = saved_errno;
+	return NULL;
+}
+
+struct dlm_lease *dlm_session_get_lease(struct dlm_session *session)
+{
+	struct dlm_lease *lease = NULL;
+	int saved_errno;
+
+	if (!session) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (session->lease) {
+		errno = EALREADY;
+		return NULL;
+	}
+
+	uint64_t trace_id;
+	int trace_fd = trace_open(&trace_id);
+	dlm_trace_record(trace_fd, trace_id, DLM_TRACE_CLIENT_START);
+
+	if (!session_drain_events(session)) {
+		DEBUG_LOG("Session connection closed, reconnecting\n");
+		if (session->conn.dlm_server_sock >= 0)
+			close(session->conn.dlm_server_sock);
+		session->conn.dlm_server_sock = -1;
+		if (!session_connect(session))
+			goto err;
+		dlm_trace_record(trace_fd, trace_id,
+				 DLM_TRACE_CLIENT_CONNECTED);
+	}
+
+	lease = calloc(1, sizeof(*lease));
+	if (!lease) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		goto err;
+	}
+
+	lease->lease_fd = -1;
+	lease->dlm_server_sock = session->conn.dlm_server_sock;
+	lease->session = session;
+	lease->name = strdup(session->conn.name);
+	if (!lease->name) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		goto err;
+	}
+
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_GET_LEASE, SEQ_LEASE_REQUEST);
+	if (trace_id)
+		dlm_msg_add_attr(&request, DLM_ATTR_TRACE_ID, &trace_id,
+				 sizeof(trace_id));
+
+	if (!lease_send_msg(lease, &request))
+		goto err;
+	dlm_trace_record(trace_fd, trace_id, DLM_TRACE_CLIENT_SENT);
+
+	if (!lease_recv_fd(lease))
+		goto err;
+
+	dlm_trace_record(trace_fd, trace_id, DLM_TRACE_CLIENT_RECEIVED);
+	if (trace_fd >= 0)
+		close(trace_fd);
+	session->lease = lease;
+	return lease;
+
+err:
+	saved_errno = errno;
+	if (trace_fd >= 0)
+		close(trace_fd);
+	if (lease) {
+		/* Give back a lease that was granted, but not fully
+		 * received */
+		if (lease->lease_fd >= 0)
+			lease_send_release(lease);
+		lease_free(lease);
+	}
+	errno = saved_errno;
+	return NULL;
+}
+
+void dlm_session_close(struct dlm_session *session)
+{
+	if (!session)
+		return;
+
+	/* A lease still held takes over the connection, which is closed
+	 * once the lease is released */
+	if (session->lease)
+		session->lease->session = NULL;
+	else if (session->conn.dlm_server_sock >= 0)
+		close(session->conn.dlm_server_sock);
+
+	free(session->conn.name);
+	free(session);
+}
+
+/* Reassignment requests share the connection handling of leases */
+struct dlm_reassign {
+	struct dlm_lease conn;
+};
+
+struct dlm_reassign *dlm_reassign_leases(const char *const *names,
+					 int count)
+{
+	char list[DLM_MSG_MAX_PAYLOAD];
+	size_t len = 0;
+	int saved_errno;
+
+	if (!names || count <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		size_t name_len = strlen(names[i]) + 1;
+		if (len + name_len > sizeof(list)) {
+			errno = E2BIG;
+			return NULL;
+		}
+		memcpy(&list[len], names[i], name_len);
+		len += name_len;
+	}
+
+	struct dlm_msg request;
+	dlm_msg_init(&request, DLM_MSG_REASSIGN_LEASES, SEQ_LEASE_REQUEST);
+	if (!dlm_msg_add_attr(&request, DLM_ATTR_LEASE_LIST, list, len)) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	struct dlm_reassign *reassign = calloc(1, sizeof(*reassign));
+	if (!reassign) {
+		DEBUG_LOG("can't allocate memory : %s\n", strerror(errno));
+		return NULL;
+	}
+
+	struct dlm_lease *conn = &reassign->conn;
+	if (!lease_connect(conn, DLM_ADMIN_SERVER_NAME, false)) {
+		free(reassign);
+		return NULL;
+	}
+
+	struct dlm_msg reply;
+	if (!lease_send_hello(conn, 0) || !lease_send_msg(conn, &request) ||
+	    !lease_recv_hello(conn, NULL) ||
+	    !lease_recv_reply(conn, SEQ_LEASE_REQUEST, &reply))
+		goto err;
+
+	dlm_msg_close_fds(&reply);
+	return reassign;
+
+err:
+	saved_errno = errno;
+	dlm_reassign_close(reassign);
+	errno = saved_errno;
+	return NULL;
+}
+
+bool dlm_reassign_wait(struct dlm_reassign *reassign,
+		       uint32_t *switch_time_us)
+{
+	struct dlm_msg reply;
+	uint32_t switch_time;
+
+	if (!reassign) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if (!lease_recv_reply(&reassign->conn, SEQ_LEASE_REQUEST, &reply))
+		return false;
+
+	dlm_msg_close_fds(&reply);
+	if (!dlm_msg_get_u32(&reply, DLM_ATTR_SWITCH_TIME, &switch_time)) {
+		DEBUG_LOG("Unexpected data received from lease manager\n");
+		errno = EPROTO;
+		return false;
+	}
+
+	if (switch_time_us)
+		*switch_time_us = switch_time;
+	return true;
+}
+
+void dlm_reassign_close(struct dlm_reassign *reassign)
+{
+	if (!reassign)
+		return;
+
+	close(reassign->conn.dlm_server_sock);
+	free(reassign);
+}
+
+int dlm_lease_fd(struct dlm_lease *lease)
+{
+	if (!lease)
+		return -1;
+
+	return lease->lease_fd;
+}
+
+const char *dlm_lease_name(struct dlm_lease *lease)
+{
+	if (!lease)
+		return NULL;
+
+	return lease->name;
+}
+
+bool dlm_lease_resume_token(struct dlm_lease *lease,
+			    uint8_t token[DLM_RESUME_TOKEN_LEN])
+{
+	if (!lease || !token)
+		return false;
+
+	if (!dlm_resume_token_is_valid(&lease->resume_token))
+		return false;
+
+	memcpy(token, lease->resume_token.data, DLM_RESUME_TOKEN_LEN);
+	return true;
+}
+
+int dlm_lease_event_fd(struct dlm_lease *lease)
+{
+	if (!lease)
+		return -1;
+
+	return lease->dlm_server_sock;
+}
+
+bool dlm_lease_read_event(struct dlm_lease *lease,
+			  enum dlm_lease_event *event)
+{
+	struct dlm_msg msg;
+	uint32_t type;
+
+	if (!lease || !event) {
+		errno = EINVAL;
+		return false;
+	}
+
+	struct pollfd pfd = {
+	    .fd = lease->dlm_server_sock,
+	    .events = POLLIN,
+	};
+	int ret;
+	while ((ret = poll(&pfd, 1, 0)) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	if (ret == 0) {
+		errno = EAGAIN;
+		return false;
+	}
+
+	if (!dlm_receive_msg(lease->dlm_server_sock, &msg)) {
+		/* The lease manager closes the connection when it revokes
+		 * the lease, even if it could not send an event first */
+		if (errno == ECONNRESET || errno == EPIPE) {
+			*event = DLM_LEASE_REVOKED;
+			return true;
+		}
+		DEBUG_LOG("Lease manager receive data error: %s\n",
+			  strerror(errno));
+		return false;
+	}
+	dlm_msg_close_fds(&msg);
+
+	if (msg.hdr.type != DLM_MSG_LEASE_EVENT ||
+	    !dlm_msg_get_u32(&msg, DLM_ATTR_LEASE_EVENT, &type))
+		goto err;
+
+	switch (type) {
+	case DLM_LEASE_EVENT_REVOKED:
+		*event = DLM_LEASE_REVOKED;
+		return true;
+	case DLM_LEASE_EVENT_TRANSFER_PENDING:
+		*event = DLM_LEASE_TRANSFER_PENDING;
+		return true;
+	case DLM_LEASE_EVENT_TRANSFER_CANCELLED:
+		*event = DLM_LEASE_TRANSFER_CANCELLED;
+		return true;
+	}
+
+err:
+	DEBUG_LOG("Unexpected data received from lease manager\n");
+	errno = EPROTO;
+	return false;
+}
+
+static const void *topology_array(struct dlm_lease *lease,
+				  const struct dlm_topology_array *array,
+				  int *count)
+{
+	if (count)
+		*count = array->count;
+	return dlm_topology_array_data(lease->topology, array);
+}
+
+static const struct dlm_topology_plane *topology_plane(struct dlm_lease *lease,
+							int index)
+{
+	if (!lease || !lease->topology)
+		return NULL;
+
+	if (index < 0 || (uint32_t)index >= lease->topology->planes.count)
+		return NULL;
+
+	const struct dlm_topology_plane *planes =
+	    topology_array(lease, &lease->topology->planes, NULL);
+	return &planes[index];
+}
+
+uint32_t dlm_lease_connector_id(struct dlm_lease *lease)
+{
+	if (!lease || !lease->topology)
+		return 0;
+
+	return lease->topology->connector_id;
+}
+
+uint32_t dlm_lease_crtc_id(struct dlm_lease *lease)
+{
+	if (!lease || !lease->topology)
+		return 0;
+
+	return lease->topology->crtc_id;
+}
+
+const struct dlm_mode_info *dlm_lease_modes(struct dlm_lease *lease,
+					    int *count)
+{
+	if (count)
+		*count = 0;
+
+	if (!lease || !lease->topology)
+		return NULL;
+
+	return topology_array(lease, &lease->topology->modes, count);
+}
+
+const struct dlm_mode_info *dlm_lease_boot_mode(struct dlm_lease *lease)
+{
+	if (!lease || !lease->topology)
+		return NULL;
+
+	return topology_array(lease, &lease->topology->boot_mode, NULL);
+}
+
+uint32_t dlm_lease_boot_fb_id(struct dlm_lease *lease)
+{
+	if (!lease || !lease->topology)
+		return 0;
+
+	return lease->topology->boot_fb_id;
+}
+
+int dlm_lease_plane_count(struct dlm_lease *lease)
+{
+	if (!lease || !lease->topology)
+		return 0;
+
+	return lease->topology->planes.count;
+}
+
+uint32_t dlm_lease_plane_id(struct dlm_lease *lease, int index)
+{
+	const struct dlm_topology_plane *plane = topology_plane(lease, index);
+	if (!plane)
+		return 0;
+
+	return plane->plane_id;
+}
+
+int dlm_lease_plane_type(struct dlm_lease *lease, int index)
+{
+	const struct dlm_topology_plane *plane = topology_plane(lease, index);
+	if (!plane)
+		return -1;
+
+	return plane->type;
+}
+
+const uint32_t *dlm_lease_plane_formats(struct dlm_lease *lease, int index,
+					int *count)
+{
+	const struct dlm_topology_plane *plane = topology_plane(lease, index);
+
+	if (count)
+		*count = 0;
+
+	if (!plane)
+		return NULL;
+
+	return topology_array(lease, &plane->formats, count);
+}
+
+const struct dlm_format_modifier *
+dlm_lease_plane_modifiers(struct dlm_lease *lease, int index, int *count)
+{
+	const struct dlm_topology_plane *plane = topology_plane(lease, index);
+
+	if (count)
+		*count = 0;
+
+	if (!plane)
+		return NULL;
+
+	return topology_array(lease, &plane->modifiers, count);
+}
+
+uint32_t dlm_lease_property_id(struct dlm_lease *lease, uint32_t object_id,
+			       const char *name)
+{
+	if (!lease || !lease->topology || !name)
+		return 0;
+
+	int count;
+	const struct dlm_topology_prop *props =
+	    topology_array(lease, &lease->topology->props, &count);
+
+	for (int i = 0; i < count; i++) {
+		if (props[i].object_id == object_id &&
+		    !strncmp(props[i].name, name, sizeof(props[i].name)))
+			return props[i].prop_id;
+	}
+	return 0;
+}
+
+_Static_assert(DLM_STATUS_LEASE_NAME_LEN == DLM_STATUS_NAME_LEN,
+	       "Lease status name lengths differ");
+
+/* Number of times to retry a status read while the page is being updated */
+#define STATUS_READ_RETRIES 1000
+
+struct dlm_status_page {
+	const struct dlm_status_header *page;
+	size_t size;
+	uint32_t nleases;
+};
+
+struct dlm_status_page *dlm_status_open(void)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!get_runtime_file_path(path, sizeof(path), DLM_STATUS_FILE_NAME))
+		return NULL;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		DEBUG_LOG("Cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct dlm_status_page *status = calloc(1, sizeof(*status));
+	if (!status) {
+		DEBUG_LOG("Memory allocation failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+	    st.st_size < (off_t)sizeof(struct dlm_status_header)) {
+		DEBUG_LOG("Invalid lease status page size\n");
+		errno = EPROTO;
+		goto err;
+	}
+
+	status->size = st.st_size;
+	status->page = mmap(NULL, status->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (status->page == MAP_FAILED) {
+		DEBUG_LOG("Lease status mmap failed: %s\n", strerror(errno));
+		goto err;
+	}
+	close(fd);
+
+	/* The magic is written last, once the page is set up */
+	const struct dlm_status_header *page = status->page;
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) !=
+		DLM_STATUS_MAGIC ||
+	    page->version != DLM_STATUS_VERSION) {
+		DEBUG_LOG("Invalid lease status page\n");
+		errno = EPROTO;
+		goto err_unmap;
+	}
+
+	status->nleases = page->nleases;
+	if (status->nleases > (status->size - sizeof(*page)) /
+				  sizeof(struct dlm_status_lease)) {
+		DEBUG_LOG("Lease status page is truncated\n");
+		errno = EPROTO;
+		goto err_unmap;
+	}
+	return status;
+
+err_unmap:
+	munmap((void *)status->page, status->size);
+	free(status);
+	return NULL;
+err:
+	free(status);
+	close(fd);
+	return NULL;
+}
+
+static void copy_lease_status(struct dlm_lease_status *dst,
+			      const struct dlm_status_lease *src)
+{
+	memcpy(dst->name, src->name, sizeof(dst->name));
+	dst->name[sizeof(dst->name) - 1] = '\0';
+	dst->state = src->state;
+	dst->holder_pid = src->holder_pid;
+	dst->grant_time = src->grant_time;
+	dst->grants = src->grants;
+	dst->transfers = src->transfers;
+	dst->resumes = src->resumes;
+	dst->revokes = src->revokes;
+	dst->failures = src->failures;
+	dst->frame_rate = src->frame_rate / 1000.0;
+	dst->frames = src->frames;
+	dst->missed_frames = src->missed_frames;
+	dst->stalls = src->stalls;
+	dst->stall_time_ms = src->stall_time_ms;
+	dst->max_stall_ms = src->max_stall_ms;
+	dst->connections = src->connections;
+	dst->connections_shed = src->connections_shed;
+	dst->throttle_time_ms = src->throttle_time_ms;
+}
+
+int dlm_status_read(struct dlm_status_page *status,
+		    struct dlm_lease_status *leases, int max)
+{
+	if (!status || max < 0 || (max > 0 && !leases)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const struct dlm_status_header *page = status->page;
+	uint32_t count = (uint32_t)max < status->nleases ? (uint32_t)max
+							 : status->nleases;
+
+	for (int i = 0; i < STATUS_READ_RETRIES; i++) {
+		uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		uint32_t flags = page->flags;
+		for (uint32_t j = 0; j < count; j++)
+			copy_lease_status(&leases[j], &page->leases[j]);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (flags & DLM_STATUS_CLOSED) {
+			errno = ESTALE;
+			return -1;
+		}
+		return status->nleases;
+	}
+
+	DEBUG_LOG("Lease status page is busy\n");
+	errno = EAGAIN;
+	return -1;
+}
+
+void dlm_status_close(struct dlm_status_page *status)
+{
+	if (!status)
+		return;
+
+	munmap((void *)status->page, status->size);
+	free(status);
 }
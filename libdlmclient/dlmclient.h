@@ -24,6 +24,38 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief Length in bytes of a lease resume token
+ */
+#define DLM_RESUME_TOKEN_LEN 16
+
+/**
+ * @brief Display mode of a connector
+ *
+ * @details Same layout as drmModeModeInfo, so it can be passed to libdrm
+ *          functions that take a drmModeModeInfoPtr.
+ */
+struct dlm_mode_info {
+	uint32_t clock;
+	uint16_t hdisplay, hsync_start, hsync_end, htotal, hskew;
+	uint16_t vdisplay, vsync_start, vsync_end, vtotal, vscan;
+	uint32_t vrefresh;
+	uint32_t flags;
+	uint32_t type;
+	char name[32];
+};
+
+/**
+ * @brief A pixel format and modifier combination supported by a plane
+ */
+struct dlm_format_modifier {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+};
 
 /**
  * @brief Enable debug logging
@@ -50,16 +82,235 @@ struct dlm_lease;
  *  -------------|-------------------------------------------------------------
  *  EACCESS      |  Cannot access lease manager socket directory
  *  EACCESS      |  Lease request denied by lease manager
+ *  EBUSY        |  Lease is owned by another client
  *  ENAMETOOLONG |  The path to the lease manager socket directory is too long
  *  ENOENT       |  Lease manager or requested lease not available
  *  ENOMEM       |  Out of memory during operation
  *  EPROTO       |  Protocol error in communication with lease manager
+ *  EPROTONOSUPPORT | Lease manager does not support the client protocol
  *
  *  This list is not exhaustive, and errno may be set to other error codes,
  *  especially those related to socket communication.
  */
 struct dlm_lease *dlm_get_lease(const char *name);
 
+/**
+ * @brief Planes needed in a lease, for dlm_get_lease_with_planes()
+ *
+ * @details Planes that can only be used with the CRTC of the lease are
+ *          always part of it, and count towards the demand.  Planes
+ *          shared between CRTCs are added as needed to meet it.
+ */
+struct dlm_plane_demand {
+	uint32_t overlay; /**< Number of overlay planes */
+	uint32_t cursor;  /**< Number of cursor planes */
+	uint32_t scaling; /**< Number of planes able to scale */
+};
+
+/**
+ * @brief  Get a DRM lease with enough planes for the client
+ *
+ * @details As dlm_get_lease(), but the lease manager adds free shared
+ *          planes to the lease to meet the plane demand.  The planes are
+ *          returned to the lease manager when the lease is released.
+ *
+ * @param[in] name requested lease
+ * @param[in] planes planes needed in the lease
+ * @return A pointer to a lease handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         EACCES means that there are not enough free planes.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_lease *dlm_get_lease_with_planes(
+    const char *name, const struct dlm_plane_demand *planes);
+
+/**
+ * @brief Lease selection constraint flags
+ */
+#define DLM_CONSTRAINT_CONNECTED (1u << 0) /**< Output must be connected */
+#define DLM_CONSTRAINT_PLANE_TYPE (1u << 1) /**< Check plane_type */
+#define DLM_CONSTRAINT_PLANE_MODIFIER (1u << 2) /**< Check plane_modifier */
+
+/**
+ * @brief Requirements on a lease, for dlm_select_lease()
+ *
+ * @details Zero valued fields match any lease.  The mode constraints must
+ *          all be met by a single connector mode, and the plane
+ *          constraints by a single plane of the lease.
+ */
+struct dlm_lease_constraints {
+	uint32_t flags;		 /**< DLM_CONSTRAINT_* flags */
+	uint32_t min_width;	 /**< Minimum mode width */
+	uint32_t min_height;	 /**< Minimum mode height */
+	uint32_t min_refresh;	 /**< Minimum mode refresh rate, in Hz */
+	uint32_t plane_type;	 /**< DRM_PLANE_TYPE_* of the plane */
+	uint32_t plane_format;	 /**< DRM fourcc format of the plane */
+	uint64_t plane_modifier; /**< Format modifier of the plane */
+};
+
+/**
+ * @brief  Wait for a DRM lease to be offered, then get it
+ *
+ * @details Clients that may start before the lease manager can use this
+ *          instead of retrying dlm_get_lease().  The runtime directory of
+ *          the lease manager is watched with inotify, and the lease is
+ *          requested as soon as its socket appears.  The runtime directory
+ *          doesn't need to exist yet.
+ *
+ * @param[in] name requested lease
+ * @param[in] timeout_ms maximum time to wait for the lease to be offered,
+ *            or -1 to wait forever
+ * @return A pointer to a lease handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         ETIMEDOUT means that the lease was not offered in time.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_lease *dlm_wait_for_lease(const char *name, int timeout_ms);
+
+/**
+ * @brief Handle of an asynchronous wait for a lease
+ */
+struct dlm_lease_wait;
+
+/**
+ * @brief  Start waiting for a DRM lease, without blocking
+ *
+ * @details Call dlm_lease_wait_dispatch() once after this function
+ *          returns, and then every time the fd returned by
+ *          dlm_lease_wait_fd() becomes readable, until it returns a lease.
+ *          If the runtime directory does not exist yet, its closest parent
+ *          is watched until it is created.
+ *
+ * @param[in] name requested lease
+ * @return A pointer to a wait handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ */
+struct dlm_lease_wait *dlm_lease_wait_start(const char *name);
+
+/**
+ * @brief Get the fd to poll for POLLIN while waiting for a lease
+ *
+ * @param[in] wait pointer to a wait handle
+ * @return A file descriptor owned by the wait handle.
+ *         -1 is returned when called with a NULL wait handle.
+ */
+int dlm_lease_wait_fd(struct dlm_lease_wait *wait);
+
+/**
+ * @brief  Get the lease if it has been offered, without blocking
+ *
+ * @details The lease is requested once it is offered, and returned by a
+ *          later call, once the lease manager has replied.
+ *
+ * @param[in] wait pointer to a wait handle
+ * @return A pointer to a lease handle, once the lease has been offered.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         EAGAIN means that the lease has not been offered yet.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_lease *dlm_lease_wait_dispatch(struct dlm_lease_wait *wait);
+
+/**
+ * @brief  Stop waiting for a lease, and release the wait handle
+ *
+ * @details Leases returned by dlm_lease_wait_dispatch() are not affected.
+ * @param[in] wait pointer to a wait handle
+ */
+void dlm_lease_wait_close(struct dlm_lease_wait *wait);
+
+/**
+ * @brief  Get the best matching free DRM lease from the lease manager
+ *
+ * @details Instead of requesting a lease by name, let the lease manager
+ *          pick a free lease that meets a set of constraints.  Connected
+ *          outputs are preferred, then the output with the smallest
+ *          matching mode.  Use dlm_lease_name() to find out which lease
+ *          was granted.
+ *
+ * @param[in] constraints requirements on the lease
+ * @return A pointer to a lease handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         ENOENT means that no free lease meets the constraints.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_lease *
+dlm_select_lease(const struct dlm_lease_constraints *constraints);
+
+/**
+ * @brief  Resume a DRM lease held by a previous instance of the client
+ *
+ * @details When the lease manager is started with the `-r` option, a lease
+ *          is not revoked when its client exits without releasing it.
+ *          A restarted client can get the same lease back, with the
+ *          display state left intact, by presenting the resume token
+ *          that was received with the lease (see dlm_lease_resume_token()).
+ *
+ *          If the token is not valid (or the lease is no longer available
+ *          for resume), a new lease is requested instead, as with
+ *          dlm_get_lease().
+ *
+ * @param[in] name requested lease
+ * @param[in] token resume token received with the previous lease
+ * @return A pointer to a lease handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         See dlm_get_lease() for the list of possible errors.
+ */
+struct dlm_lease *dlm_resume_lease(const char *name,
+				   const uint8_t token[DLM_RESUME_TOKEN_LEN]);
+
+/**
+ * @brief lease reassignment handle
+ */
+struct dlm_reassign;
+
+/**
+ * @brief  Start moving a set of leases to new clients in one batch
+ *
+ * @details Administrative operation for switching between display
+ *          configurations.  Once the lease manager has accepted the
+ *          reassignment, it holds back the dlm_get_lease() requests of new
+ *          clients for the listed leases.  When every listed lease has a
+ *          waiting client, all the leases are revoked from their current
+ *          holders, and then granted to the waiting clients, together.
+ *          Use dlm_reassign_wait() to wait for that to happen.
+ *
+ * @param[in] names names of the leases to reassign
+ * @param[in] count number of leases
+ * @return A pointer to a reassignment handle once the lease manager has
+ *         accepted the reassignment.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         EBUSY means that another reassignment is in progress, and EPROTO
+ *         that a lease name is unknown or listed twice.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_reassign *dlm_reassign_leases(const char *const *names,
+					 int count);
+
+/**
+ * @brief  Wait for a lease reassignment to be carried out
+ *
+ * @param[in] reassign pointer to a reassignment handle
+ * @param[out] switch_time_us time from the revocation of the leases to
+ *             the last display update by a new client, in microseconds.
+ *             May be NULL.
+ * @return true once all leases have been granted to their new clients,
+ *         and have updated the displays.
+ *         false on error, with errno set accordingly.  EACCES means that
+ *         some of the leases could not be granted, or were revoked before
+ *         the displays were updated.
+ */
+bool dlm_reassign_wait(struct dlm_reassign *reassign,
+		       uint32_t *switch_time_us);
+
+/**
+ * @brief  Release a lease reassignment handle
+ *
+ * @details If the reassignment has not been carried out yet, it is
+ *          cancelled, and the clients waiting for the leases get an error.
+ * @param[in] reassign pointer to a reassignment handle
+ */
+void dlm_reassign_close(struct dlm_reassign *reassign);
+
 /**
  * @brief  Release a lease handle
  *
@@ -70,6 +321,54 @@ struct dlm_lease *dlm_get_lease(const char *name);
  */
 void dlm_release_lease(struct dlm_lease *lease);
 
+/**
+ * @brief lease session handle
+ */
+struct dlm_session;
+
+/**
+ * @brief  Open a session with the lease manager, for repeated lease requests
+ *
+ * @details Connects to the socket of a lease, and keeps the connection
+ *          open across lease requests.  Getting the lease again after
+ *          releasing it then takes a single message exchange with the lease
+ *          manager, instead of a new connection and handshake.
+ *
+ * @param[in] name lease name
+ * @return A pointer to a session handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         EPROTONOSUPPORT means that the lease manager does not support
+ *         sessions.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_session *dlm_session_open(const char *name);
+
+/**
+ * @brief  Get the lease of a session
+ *
+ * @details As dlm_get_lease(), over the session connection.  Release the
+ *          lease with dlm_release_lease(), which leaves the connection
+ *          open.  If the lease manager has closed the connection, e.g.
+ *          because the lease was revoked, the session reconnects first.
+ *
+ * @param[in] session pointer to a session handle
+ * @return A pointer to a lease handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         EALREADY means that the lease of the session has not been
+ *         released yet.
+ *         See dlm_get_lease() for the list of other possible errors.
+ */
+struct dlm_lease *dlm_session_get_lease(struct dlm_session *session);
+
+/**
+ * @brief  Close a session
+ *
+ * @details A lease of the session that has not been released stays valid,
+ *          and the connection is closed once it is released.
+ * @param[in] session pointer to a session handle
+ */
+void dlm_session_close(struct dlm_session *session);
+
 /**
  * @brief Get a DRM Master fd from a valid lease handle
  *
@@ -79,6 +378,297 @@ void dlm_release_lease(struct dlm_lease *lease);
  */
 int dlm_lease_fd(struct dlm_lease *lease);
 
+/**
+ * @brief Get the name of a lease
+ *
+ * @param[in] lease pointer to a lease handle
+ * @return The lease name, valid until the lease is released.
+ *         NULL is returned when called with a NULL lease handle.
+ */
+const char *dlm_lease_name(struct dlm_lease *lease);
+
+/**
+ * @brief Get the resume token of a lease
+ *
+ * @details The token should be stored somewhere that outlives the client
+ *          process, so that a restarted client can pass it to
+ *          dlm_resume_lease().  A new token is issued every time a lease
+ *          is granted or resumed.
+ * @param[in] lease pointer to a lease handle
+ * @param[out] token buffer to receive the resume token
+ * @return true on success.
+ *         false if the lease handle is NULL, or the lease manager did not
+ *         send a resume token.
+ */
+bool dlm_lease_resume_token(struct dlm_lease *lease,
+			    uint8_t token[DLM_RESUME_TOKEN_LEN]);
+
+/**
+ * @brief Lease events sent by the lease manager to the lease holder
+ */
+enum dlm_lease_event {
+	/** The lease has been revoked.  The lease fd can no longer be used
+	 *  to access the lease objects. */
+	DLM_LEASE_REVOKED,
+	/** The lease will be transferred to another client when the
+	 *  current transition completes.  Finish the current frame. */
+	DLM_LEASE_TRANSFER_PENDING,
+	/** A pending transfer has been cancelled, the lease is kept */
+	DLM_LEASE_TRANSFER_CANCELLED,
+};
+
+/**
+ * @brief Get an fd to poll for lease events
+ *
+ * @details The fd becomes readable when the lease manager sends a lease
+ *          event.  Call dlm_lease_read_event() to read it.  After the lease
+ *          has been revoked, the fd stays readable until the lease is
+ *          released with dlm_release_lease().
+ * @param[in] lease pointer to a lease handle
+ * @return A file descriptor to poll for POLLIN, owned by the lease handle.
+ *         -1 is returned when called with a NULL lease handle.
+ */
+int dlm_lease_event_fd(struct dlm_lease *lease);
+
+/**
+ * @brief Read a pending lease event, without blocking
+ *
+ * @details Lease managers that don't send lease events still close the
+ *          connection when a lease is revoked, which is reported as
+ *          DLM_LEASE_REVOKED.
+ * @param[in] lease pointer to a lease handle
+ * @param[out] event the event read
+ * @return true on success.
+ *         On error this function returns false and errno is set to:
+ *         - EAGAIN: no event is pending
+ *         - EINVAL: invalid lease handle or event pointer
+ *         - EPROTO: unexpected data received from the lease manager
+ */
+bool dlm_lease_read_event(struct dlm_lease *lease,
+			  enum dlm_lease_event *event);
+
+/**
+ * @defgroup topology Lease topology
+ *
+ * The lease manager sends a description of the DRM objects in a lease
+ * along with the lease fd.  The functions below read it directly from
+ * shared memory, so clients can set up the display without first
+ * querying the lease objects, modes and properties through the lease fd.
+ *
+ * Pointers returned by these functions stay valid until the lease is
+ * released.  If the lease manager did not send a topology, the functions
+ * return 0, NULL or -1.
+ * @{
+ */
+
+/**
+ * @brief Get the connector ID of a lease
+ */
+uint32_t dlm_lease_connector_id(struct dlm_lease *lease);
+
+/**
+ * @brief Get the CRTC ID of a lease
+ */
+uint32_t dlm_lease_crtc_id(struct dlm_lease *lease);
+
+/**
+ * @brief Get the modes of the lease connector
+ *
+ * @param[in] lease pointer to a lease handle
+ * @param[out] count number of modes
+ * @return Array of modes, as reported by the connector
+ */
+const struct dlm_mode_info *dlm_lease_modes(struct dlm_lease *lease,
+					    int *count);
+
+/**
+ * @brief Get the mode the lease CRTC was left in at startup
+ *
+ * @details If the bootloader or a splash screen left the CRTC lit, the
+ *          first client of the lease gets its mode.  A client that keeps
+ *          this mode can show its first frame with a page flip instead of
+ *          a modeset.
+ * @param[in] lease pointer to a lease handle
+ * @return The boot mode, or NULL if there is none
+ */
+const struct dlm_mode_info *dlm_lease_boot_mode(struct dlm_lease *lease);
+
+/**
+ * @brief Get the framebuffer shown on the lease CRTC at startup
+ *
+ * @details The framebuffer is not kept alive by the lease manager.  It
+ *          is removed when the process that created it closes the DRM
+ *          device, and may already be gone.
+ * @return The framebuffer ID, or 0 if there is no boot mode
+ */
+uint32_t dlm_lease_boot_fb_id(struct dlm_lease *lease);
+
+/**
+ * @brief Get the number of planes in a lease
+ */
+int dlm_lease_plane_count(struct dlm_lease *lease);
+
+/**
+ * @brief Get the ID of a plane
+ *
+ * @param[in] lease pointer to a lease handle
+ * @param[in] index plane index, from 0 to dlm_lease_plane_count() - 1
+ */
+uint32_t dlm_lease_plane_id(struct dlm_lease *lease, int index);
+
+/**
+ * @brief Get the type of a plane
+ *
+ * @param[in] lease pointer to a lease handle
+ * @param[in] index plane index, from 0 to dlm_lease_plane_count() - 1
+ * @return The plane type (DRM_PLANE_TYPE_*) or -1 on error
+ */
+int dlm_lease_plane_type(struct dlm_lease *lease, int index);
+
+/**
+ * @brief Get the pixel formats supported by a plane
+ *
+ * @param[in] lease pointer to a lease handle
+ * @param[in] index plane index, from 0 to dlm_lease_plane_count() - 1
+ * @param[out] count number of formats
+ * @return Array of DRM fourcc formats
+ */
+const uint32_t *dlm_lease_plane_formats(struct dlm_lease *lease, int index,
+					int *count);
+
+/**
+ * @brief Get the format modifiers supported by a plane
+ *
+ * @details The list is empty if the driver does not report modifiers
+ *          (the plane has no IN_FORMATS property).
+ * @param[in] lease pointer to a lease handle
+ * @param[in] index plane index, from 0 to dlm_lease_plane_count() - 1
+ * @param[out] count number of format/modifier combinations
+ * @return Array of supported format/modifier combinations
+ */
+const struct dlm_format_modifier *
+dlm_lease_plane_modifiers(struct dlm_lease *lease, int index, int *count);
+
+/**
+ * @brief Look up a property ID by name
+ *
+ * @param[in] lease pointer to a lease handle
+ * @param[in] object_id connector, CRTC or plane ID
+ * @param[in] name property name
+ * @return The property ID, or 0 if the object has no such property.
+ */
+uint32_t dlm_lease_property_id(struct dlm_lease *lease, uint32_t object_id,
+			       const char *name);
+
+/** @} */
+
+/**
+ * @defgroup status Lease status
+ *
+ * The lease manager publishes the state of all its leases in a shared
+ * memory page.  Monitoring tools can read it as often as they like,
+ * without sending any requests to the lease manager.
+ * @{
+ */
+
+/**
+ * @brief Maximum length of a lease name in the status page
+ */
+#define DLM_STATUS_LEASE_NAME_LEN 64
+
+/**
+ * @brief State of a lease
+ */
+enum dlm_lease_state {
+	DLM_LEASE_FREE,	   /**< Not granted to any client */
+	DLM_LEASE_GRANTED, /**< Granted to a client */
+	/** Granted, but the previous client's framebuffer is still shown */
+	DLM_LEASE_IN_TRANSITION,
+};
+
+/**
+ * @brief Status of a lease
+ */
+struct dlm_lease_status {
+	char name[DLM_STATUS_LEASE_NAME_LEN]; /**< Lease name */
+	enum dlm_lease_state state;	      /**< Lease state */
+	pid_t holder_pid;     /**< PID of the lease holder, or 0 if none */
+	uint64_t grant_time;  /**< Time of the last grant (CLOCK_REALTIME ns) */
+	uint64_t grants;      /**< Number of times the lease was granted */
+	uint64_t transfers;   /**< Number of transfers to a new client */
+	uint64_t resumes;     /**< Number of times the lease was resumed */
+	uint64_t revokes;     /**< Number of times the lease was revoked */
+	uint64_t failures;    /**< Number of failed lease grants */
+
+	/** @name Frame timing
+	 *  Only published if the lease manager samples frame timing (-F).
+	 *  A frame is a new framebuffer scanned out by the CRTC of the lease.
+	 *  @{ */
+	double frame_rate;	/**< Frames per second, over the last second */
+	uint64_t frames;	/**< Number of frames */
+	uint64_t missed_frames; /**< vblanks without a new frame */
+	uint64_t stalls;	/**< Gaps of at least 100 ms between frames */
+	uint64_t stall_time_ms; /**< Total duration of the stalls */
+	uint32_t max_stall_ms;	/**< Duration of the longest stall */
+	/** @} */
+
+	/** @name Admission control
+	 *  Connections to the lease socket are admitted at a limited rate,
+	 *  per lease and per client process.
+	 *  @{ */
+	uint64_t connections;	   /**< Connections accepted */
+	uint64_t connections_shed; /**< Connections closed when accepted */
+	uint64_t throttle_time_ms; /**< Time connections were left waiting */
+	/** @} */
+};
+
+/**
+ * @brief lease status page handle
+ */
+struct dlm_status_page;
+
+/**
+ * @brief Open the lease status page
+ *
+ * @return A pointer to a status page handle on success.
+ *         On error this function returns NULL and errno is set accordingly.
+ *         ENOENT means that the lease manager is not running, or does not
+ *         publish a status page.
+ */
+struct dlm_status_page *dlm_status_open(void);
+
+/**
+ * @brief Read the status of all leases
+ *
+ * @details Takes a consistent snapshot of the lease table, without any
+ *          communication with the lease manager.
+ * @param[in] status pointer to a status page handle
+ * @param[out] leases array to receive the lease status
+ * @param[in] max number of entries in the leases array
+ * @return The total number of leases on success, which may be more than
+ *         max.  Only the first max leases are copied.
+ *         On error this function returns -1 and errno is set accordingly.
+ *
+ *  Possible errors:
+ *
+ *  errno        |  Meaning
+ *  -------------|-------------------------------------------------------------
+ *  EAGAIN       |  The page was being updated; try again
+ *  EINVAL       |  Invalid arguments
+ *  ESTALE       |  The lease manager has exited; close and reopen the page
+ */
+int dlm_status_read(struct dlm_status_page *status,
+		    struct dlm_lease_status *leases, int max);
+
+/**
+ * @brief Close a lease status page handle
+ *
+ * @param[in] status pointer to a status page handle
+ */
+void dlm_status_close(struct dlm_status_page *status);
+
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,11 +17,17 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "config.h"
+#include "dlm-status.h"
 #include "dlmclient.h"
 #include "test-helpers.h"
 #include "test-socket-server.h"
@@ -77,11 +83,8 @@ END_TEST
 /* no_data_from_manager
  *
  * Test details: Close the remote (lease manager) without sending any data.
- *               Currently this means that the lease request has been rejected
- *               for some reason.
- *
- * TODO: Update this when the client-server protocol is updated to
- *       include the reason for the lease rejection.
+ *               This means that the lease request has been rejected
+ *               without a reason.
  *
  * Expected results: dlm_get_lease() fails, errno set to EACCESS.
  */
@@ -130,6 +133,56 @@ START_TEST(no_lease_fd_from_manager)
 }
 END_TEST
 
+/* lease_busy_error_from_manager
+ *
+ * Test details: Simulate the lease manager rejecting the lease request
+ *               because the lease is owned by another client.
+ *
+ * Expected results: dlm_get_lease() fails, errno set to EBUSY.
+ */
+START_TEST(lease_busy_error_from_manager)
+{
+	struct test_config config = {
+	    .lease_name = TEST_LEASE_NAME,
+	    .reply_status = DLM_STATUS_LEASE_BUSY,
+	};
+
+	struct server_state *sstate = test_server_start(&config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+
+	ck_assert_ptr_eq(lease, NULL);
+	ck_assert_int_eq(errno, EBUSY);
+
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* unsupported_version_error_from_manager
+ *
+ * Test details: Simulate the lease manager rejecting the protocol version
+ *               requested by the client.
+ *
+ * Expected results: dlm_get_lease() fails, errno set to EPROTONOSUPPORT.
+ */
+START_TEST(unsupported_version_error_from_manager)
+{
+	struct test_config config = {
+	    .lease_name = TEST_LEASE_NAME,
+	    .send_unsupported_version = true,
+	};
+
+	struct server_state *sstate = test_server_start(&config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+
+	ck_assert_ptr_eq(lease, NULL);
+	ck_assert_int_eq(errno, EPROTONOSUPPORT);
+
+	test_server_stop(sstate);
+}
+END_TEST
+
 static void add_lease_manager_error_tests(Suite *s)
 {
 	TCase *tc = tcase_create("Lease manager error handling");
@@ -139,6 +192,8 @@ static void add_lease_manager_error_tests(Suite *s)
 	tcase_add_test(tc, manager_connection_err);
 	tcase_add_test(tc, no_data_from_manager);
 	tcase_add_test(tc, no_lease_fd_from_manager);
+	tcase_add_test(tc, lease_busy_error_from_manager);
+	tcase_add_test(tc, unsupported_version_error_from_manager);
 
 	suite_add_tcase(s, tc);
 }
@@ -233,6 +288,41 @@ START_TEST(dlm_lease_fd_always_returns_same_lease)
 }
 END_TEST
 
+/* get_lease_sends_plane_demand
+ *
+ * Test details: Request a lease with a plane demand.
+ * Expected results: The plane demand is sent with the lease request.
+ */
+START_TEST(get_lease_sends_plane_demand)
+{
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_plane_demand planes = {
+	    .overlay = 2,
+	    .cursor = 1,
+	    .scaling = 1,
+	};
+	struct dlm_lease *lease =
+	    dlm_get_lease_with_planes(TEST_LEASE_NAME, &planes);
+	ck_assert_ptr_ne(lease, NULL);
+
+	const struct dlm_msg *req = &default_test_config.received_get;
+	uint32_t value;
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_OVERLAY_PLANES, &value),
+			 true);
+	ck_assert_int_eq(value, 2);
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_CURSOR_PLANES, &value),
+			 true);
+	ck_assert_int_eq(value, 1);
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_SCALING_PLANES, &value),
+			 true);
+	ck_assert_int_eq(value, 1);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
 START_TEST(verify_that_unused_fds_are_not_leaked)
 {
 	int nopen_fds = count_open_fds();
@@ -258,6 +348,61 @@ START_TEST(verify_that_unused_fds_are_not_leaked)
 }
 END_TEST
 
+/* traced_lease_request
+ *
+ * Test details: Request a lease with DLM_TRACE_FILE set
+ * Expected results: The lease request carries a trace ID, and the client
+ *                   stages of the request are appended to the trace file
+ *                   under that ID.
+ */
+START_TEST(traced_lease_request)
+{
+	char path[] = "/tmp/dlm-trace-XXXXXX";
+	int fd = mkstemp(path);
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+	setenv("DLM_TRACE_FILE", path, 1);
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+	unsetenv("DLM_TRACE_FILE");
+
+	size_t len;
+	uint64_t trace_id;
+	const void *id = dlm_msg_get_attr(&default_test_config.received_get,
+					  DLM_ATTR_TRACE_ID, &len);
+	ck_assert_ptr_ne(id, NULL);
+	ck_assert_int_eq(len, sizeof(trace_id));
+	memcpy(&trace_id, id, len);
+	ck_assert(trace_id != 0);
+
+	const char *expected_stages[] = {
+	    "client-start",
+	    "client-connected",
+	    "client-sent",
+	    "client-received",
+	};
+	FILE *trace = fopen(path, "r");
+	ck_assert_ptr_ne(trace, NULL);
+	for (int i = 0; i < 4; i++) {
+		char line[128], stage[32];
+		uint64_t record_id;
+		ck_assert_ptr_ne(fgets(line, sizeof(line), trace), NULL);
+		ck_assert_int_eq(
+		    sscanf(line, "%" SCNx64 " %31s", &record_id, stage), 2);
+		ck_assert(record_id == trace_id);
+		ck_assert_str_eq(stage, expected_stages[i]);
+	}
+	fclose(trace);
+	unlink(path);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
 static void add_lease_handling_tests(Suite *s)
 {
 	TCase *tc = tcase_create("Lease processing tests");
@@ -267,7 +412,808 @@ static void add_lease_handling_tests(Suite *s)
 	tcase_add_test(tc, receive_fd_from_manager);
 	tcase_add_test(tc, lease_fd_is_closed_on_release);
 	tcase_add_test(tc, dlm_lease_fd_always_returns_same_lease);
+	tcase_add_test(tc, get_lease_sends_plane_demand);
 	tcase_add_test(tc, verify_that_unused_fds_are_not_leaked);
+	tcase_add_test(tc, traced_lease_request);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease wait tests  *****************/
+
+/* These tests verify that clients can wait for a lease manager that has
+ * not created its lease sockets yet.
+ */
+
+/* wait_for_lease_offered_later
+ *
+ * Test details: Start waiting for a lease before the lease server is
+ *               started, then start it.
+ * Expected results: dlm_lease_wait_dispatch() fails with EAGAIN until the
+ *                   server is started.  The wait fd then becomes readable
+ *                   until dlm_lease_wait_dispatch() returns the lease.
+ */
+START_TEST(wait_for_lease_offered_later)
+{
+	unlink(SOCKETDIR "/" TEST_LEASE_NAME);
+
+	struct dlm_lease_wait *wait = dlm_lease_wait_start(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(wait, NULL);
+
+	ck_assert_ptr_eq(dlm_lease_wait_dispatch(wait), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	/* The lease is requested once its socket appears, and received once
+	 * the server replies */
+	struct pollfd pfd = {
+	    .fd = dlm_lease_wait_fd(wait),
+	    .events = POLLIN,
+	};
+	struct dlm_lease *lease;
+	do {
+		ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+		lease = dlm_lease_wait_dispatch(wait);
+	} while (!lease && errno == EAGAIN);
+	ck_assert_ptr_ne(lease, NULL);
+	check_fd_equality(dlm_lease_fd(lease), default_test_config.fds[0]);
+
+	dlm_lease_wait_close(wait);
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+#define MISSING_PARENT_DIR SOCKETDIR "/dlm-wait-test"
+#define MISSING_RUNTIME_DIR MISSING_PARENT_DIR "/run"
+
+/* wait_for_lease_in_missing_runtime_dir
+ *
+ * Test details: Start waiting for a lease before the runtime directory and
+ *               its parent exist, then create them and start the lease
+ *               server.
+ * Expected results: dlm_lease_wait_start() succeeds, and the lease is
+ *                   returned once the server is started.
+ */
+START_TEST(wait_for_lease_in_missing_runtime_dir)
+{
+	unlink(MISSING_RUNTIME_DIR "/" TEST_LEASE_NAME);
+	rmdir(MISSING_RUNTIME_DIR);
+	rmdir(MISSING_PARENT_DIR);
+	setenv("DLM_RUNTIME_PATH", MISSING_RUNTIME_DIR, 1);
+
+	struct dlm_lease_wait *wait = dlm_lease_wait_start(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(wait, NULL);
+
+	ck_assert_ptr_eq(dlm_lease_wait_dispatch(wait), NULL);
+	ck_assert_int_eq(errno, EAGAIN);
+
+	ck_assert_int_eq(mkdir(MISSING_PARENT_DIR, 0700), 0);
+	ck_assert_int_eq(mkdir(MISSING_RUNTIME_DIR, 0700), 0);
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct pollfd pfd = {
+	    .fd = dlm_lease_wait_fd(wait),
+	    .events = POLLIN,
+	};
+	struct dlm_lease *lease;
+	do {
+		ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+		lease = dlm_lease_wait_dispatch(wait);
+	} while (!lease && errno == EAGAIN);
+	ck_assert_ptr_ne(lease, NULL);
+	check_fd_equality(dlm_lease_fd(lease), default_test_config.fds[0]);
+
+	dlm_lease_wait_close(wait);
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+
+	unlink(MISSING_RUNTIME_DIR "/" TEST_LEASE_NAME);
+	rmdir(MISSING_RUNTIME_DIR);
+	rmdir(MISSING_PARENT_DIR);
+}
+END_TEST
+
+/* wait_for_lease_already_offered
+ *
+ * Test details: Wait for a lease that is already offered
+ * Expected results: dlm_wait_for_lease() returns the lease without waiting.
+ */
+START_TEST(wait_for_lease_already_offered)
+{
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_wait_for_lease(TEST_LEASE_NAME, 0);
+	ck_assert_ptr_ne(lease, NULL);
+	check_fd_equality(dlm_lease_fd(lease), default_test_config.fds[0]);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* wait_for_lease_timeout
+ *
+ * Test details: Wait for a lease that is never offered
+ * Expected results: dlm_wait_for_lease() fails with ETIMEDOUT.
+ */
+START_TEST(wait_for_lease_timeout)
+{
+	unlink(SOCKETDIR "/" TEST_LEASE_NAME);
+
+	struct dlm_lease *lease = dlm_wait_for_lease(TEST_LEASE_NAME, 10);
+	ck_assert_ptr_eq(lease, NULL);
+	ck_assert_int_eq(errno, ETIMEDOUT);
+}
+END_TEST
+
+static void add_lease_wait_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease wait tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, wait_for_lease_offered_later);
+	tcase_add_test(tc, wait_for_lease_in_missing_runtime_dir);
+	tcase_add_test(tc, wait_for_lease_already_offered);
+	tcase_add_test(tc, wait_for_lease_timeout);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease resume tests  *****************/
+
+/* These tests verify that the client library stores the resume token
+ * sent by the lease manager, and presents it in resume requests.
+ */
+
+static const struct dlm_resume_token test_token = {
+    .data = {0xde, 0xad, 0xbe, 0xef, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12},
+};
+
+/* receive_resume_token
+ *
+ * Test details: Receive a resume token along with the lease fd.
+ * Expected results: dlm_lease_resume_token() returns the received token.
+ */
+START_TEST(receive_resume_token)
+{
+	default_test_config.send_resume_token = true;
+	default_test_config.resume_token = test_token;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+
+	uint8_t token[DLM_RESUME_TOKEN_LEN];
+	ck_assert_int_eq(dlm_lease_resume_token(lease, token), true);
+	ck_assert_mem_eq(token, test_token.data, DLM_RESUME_TOKEN_LEN);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* no_resume_token_from_manager
+ *
+ * Test details: Receive a lease fd without a resume token (as sent by lease
+ *               managers without resume support)
+ * Expected results: dlm_get_lease() succeeds.
+ *                   dlm_lease_resume_token() fails.
+ */
+START_TEST(no_resume_token_from_manager)
+{
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+
+	uint8_t token[DLM_RESUME_TOKEN_LEN];
+	ck_assert_int_eq(dlm_lease_resume_token(lease, token), false);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* resume_lease_sends_token
+ *
+ * Test details: Resume a lease with dlm_resume_lease()
+ * Expected results: A resume request with the given token is sent to
+ *                   the lease manager, and the lease fd is received.
+ */
+START_TEST(resume_lease_sends_token)
+{
+	default_test_config.expect_resume = true;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease =
+	    dlm_resume_lease(TEST_LEASE_NAME, test_token.data);
+	ck_assert_ptr_ne(lease, NULL);
+
+	ck_assert_mem_eq(default_test_config.received_token.data,
+			 test_token.data, DLM_RESUME_TOKEN_LEN);
+	check_fd_equality(dlm_lease_fd(lease), default_test_config.fds[0]);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* receive_lease_topology
+ *
+ * Test details: Receive a lease with a topology blob
+ * Expected results: the topology accessors return the contents of the blob.
+ */
+START_TEST(receive_lease_topology)
+{
+	default_test_config.send_topology = true;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+
+	ck_assert_int_eq(dlm_lease_connector_id(lease),
+			 TEST_TOPOLOGY_CONNECTOR_ID);
+	ck_assert_int_eq(dlm_lease_crtc_id(lease), TEST_TOPOLOGY_CRTC_ID);
+
+	int count;
+	const struct dlm_mode_info *modes = dlm_lease_modes(lease, &count);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(modes[0].hdisplay, TEST_TOPOLOGY_HDISPLAY);
+
+	const struct dlm_mode_info *boot_mode = dlm_lease_boot_mode(lease);
+	ck_assert_ptr_ne(boot_mode, NULL);
+	ck_assert_int_eq(boot_mode->hdisplay, TEST_TOPOLOGY_HDISPLAY);
+	ck_assert_int_eq(dlm_lease_boot_fb_id(lease), TEST_TOPOLOGY_BOOT_FB_ID);
+
+	ck_assert_int_eq(dlm_lease_plane_count(lease), 1);
+	ck_assert_int_eq(dlm_lease_plane_id(lease, 0), TEST_TOPOLOGY_PLANE_ID);
+
+	const uint32_t *formats = dlm_lease_plane_formats(lease, 0, &count);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(formats[0], TEST_TOPOLOGY_FORMAT);
+
+	ck_assert_int_eq(dlm_lease_property_id(lease, TEST_TOPOLOGY_PLANE_ID,
+					       TEST_TOPOLOGY_PROP_NAME),
+			 TEST_TOPOLOGY_PROP_ID);
+	ck_assert_int_eq(
+	    dlm_lease_property_id(lease, TEST_TOPOLOGY_CRTC_ID, "ACTIVE"), 0);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* unsealed_topology_is_ignored
+ *
+ * Test details: Receive a lease with a topology memfd that can still be
+ *               modified by the sender.
+ * Expected results: The lease is granted, but has no topology.
+ */
+START_TEST(unsealed_topology_is_ignored)
+{
+	default_test_config.send_topology = true;
+	default_test_config.unsealed_topology = true;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+	ck_assert_int_ge(dlm_lease_fd(lease), 0);
+
+	ck_assert_int_eq(dlm_lease_connector_id(lease), 0);
+	ck_assert_int_eq(dlm_lease_plane_count(lease), 0);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+static bool wait_for_event(struct dlm_lease *lease,
+			   enum dlm_lease_event *event)
+{
+	struct pollfd pfd = {
+	    .fd = dlm_lease_event_fd(lease),
+	    .events = POLLIN,
+	};
+	ck_assert_int_eq(poll(&pfd, 1, 1000), 1);
+	return dlm_lease_read_event(lease, event);
+}
+
+/* receive_lease_events
+ *
+ * Test details: The lease manager sends a lease event, then closes the
+ *               connection
+ * Expected results: The lease event is read, followed by a revocation.
+ */
+START_TEST(receive_lease_events)
+{
+	default_test_config.send_lease_event = true;
+	default_test_config.lease_event = DLM_LEASE_EVENT_TRANSFER_PENDING;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+
+	enum dlm_lease_event event;
+	ck_assert_int_eq(wait_for_event(lease, &event), true);
+	ck_assert_int_eq(event, DLM_LEASE_TRANSFER_PENDING);
+
+	ck_assert_int_eq(wait_for_event(lease, &event), true);
+	ck_assert_int_eq(event, DLM_LEASE_REVOKED);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* no_pending_lease_event
+ *
+ * Test details: Read a lease event when none has been sent
+ * Expected results: dlm_lease_read_event() fails with EAGAIN.
+ */
+START_TEST(no_pending_lease_event)
+{
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease *lease = dlm_get_lease(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(lease, NULL);
+
+	enum dlm_lease_event event;
+	ck_assert_int_eq(dlm_lease_read_event(lease, &event), false);
+	ck_assert_int_eq(errno, EAGAIN);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/**************  Lease session tests ************/
+
+#define TEST_SESSION_CYCLES 3
+
+/* session_gets_lease_repeatedly
+ *
+ * Test details: Get and release the lease of a session several times.
+ * Expected results: Every lease request is made on the same connection,
+ *                   and is granted.  The lease can't be requested again
+ *                   before it is released.
+ */
+START_TEST(session_gets_lease_repeatedly)
+{
+	default_test_config.session_cycles = TEST_SESSION_CYCLES;
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_session *session = dlm_session_open(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(session, NULL);
+
+	for (int i = 0; i < TEST_SESSION_CYCLES; i++) {
+		struct dlm_lease *lease = dlm_session_get_lease(session);
+		ck_assert_ptr_ne(lease, NULL);
+		check_fd_equality(dlm_lease_fd(lease),
+				  default_test_config.fds[0]);
+		ck_assert_str_eq(dlm_lease_name(lease), TEST_LEASE_NAME);
+
+		ck_assert_ptr_eq(dlm_session_get_lease(session), NULL);
+		ck_assert_int_eq(errno, EALREADY);
+
+		int received_fd = dlm_lease_fd(lease);
+		dlm_release_lease(lease);
+		check_fd_is_closed(received_fd);
+	}
+
+	dlm_session_close(session);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* session_closed_before_release
+ *
+ * Test details: Close a session while its lease is still held.
+ * Expected results: The lease stays valid, and is released normally.
+ */
+START_TEST(session_closed_before_release)
+{
+	default_test_config.session_cycles = 1;
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_session *session = dlm_session_open(TEST_LEASE_NAME);
+	ck_assert_ptr_ne(session, NULL);
+
+	struct dlm_lease *lease = dlm_session_get_lease(session);
+	ck_assert_ptr_ne(lease, NULL);
+
+	dlm_session_close(session);
+	check_fd_is_open(dlm_lease_fd(lease));
+	ck_assert_int_ge(dlm_lease_event_fd(lease), 0);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+static void add_lease_session_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease session tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, session_gets_lease_repeatedly);
+	tcase_add_test(tc, session_closed_before_release);
+	suite_add_tcase(s, tc);
+}
+
+static void add_lease_event_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease event tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, receive_lease_events);
+	tcase_add_test(tc, no_pending_lease_event);
+	suite_add_tcase(s, tc);
+}
+
+static void add_lease_topology_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease topology tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, receive_lease_topology);
+	tcase_add_test(tc, unsealed_topology_is_ignored);
+	suite_add_tcase(s, tc);
+}
+
+static void add_lease_resume_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease resume tests");
+
+	tcase_add_checked_fixture(tc, test_setup, test_shutdown);
+
+	tcase_add_test(tc, receive_resume_token);
+	tcase_add_test(tc, no_resume_token_from_manager);
+	tcase_add_test(tc, resume_lease_sends_token);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease selection tests ************/
+
+#define TEST_FORMAT_NV12 0x3231564e
+
+static void select_test_setup(void)
+{
+	test_setup();
+	default_test_config.lease_name = DLM_SELECT_SERVER_NAME;
+	default_test_config.expect_select = true;
+}
+
+/* select_lease_sends_constraints
+ *
+ * Test details: Select a lease with a set of constraints
+ * Expected results: The constraints are sent to the lease manager, and
+ *                   the lease has the name of the selected lease.
+ */
+START_TEST(select_lease_sends_constraints)
+{
+	default_test_config.selected_lease_name = TEST_LEASE_NAME;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease_constraints constraints = {
+	    .flags = DLM_CONSTRAINT_CONNECTED | DLM_CONSTRAINT_PLANE_TYPE,
+	    .min_width = 3840,
+	    .min_height = 2160,
+	    .min_refresh = 60,
+	    .plane_type = 0,
+	    .plane_format = TEST_FORMAT_NV12,
+	};
+	struct dlm_lease *lease = dlm_select_lease(&constraints);
+	ck_assert_ptr_ne(lease, NULL);
+	ck_assert_str_eq(dlm_lease_name(lease), TEST_LEASE_NAME);
+
+	const struct dlm_msg *req = &default_test_config.received_select;
+	uint32_t value;
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_SELECT_FLAGS, &value),
+			 true);
+	ck_assert_int_eq(value, DLM_SELECT_CONNECTED);
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_MIN_WIDTH, &value),
+			 true);
+	ck_assert_int_eq(value, 3840);
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_PLANE_TYPE, &value),
+			 true);
+	ck_assert_int_eq(value, 0);
+	ck_assert_int_eq(dlm_msg_get_u32(req, DLM_ATTR_PLANE_FORMAT, &value),
+			 true);
+	ck_assert_int_eq(value, TEST_FORMAT_NV12);
+	ck_assert_ptr_eq(dlm_msg_get_attr(req, DLM_ATTR_PLANE_MODIFIER, NULL),
+			 NULL);
+
+	dlm_release_lease(lease);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* no_lease_matches_constraints
+ *
+ * Test details: The lease manager has no free lease matching the
+ *               constraints.
+ * Expected results: dlm_select_lease() fails, errno set to ENOENT.
+ */
+START_TEST(no_lease_matches_constraints)
+{
+	default_test_config.reply_status = DLM_STATUS_NO_MATCH;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease_constraints constraints = {.min_refresh = 240};
+	struct dlm_lease *lease = dlm_select_lease(&constraints);
+	ck_assert_ptr_eq(lease, NULL);
+	ck_assert_int_eq(errno, ENOENT);
+
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* selected_lease_without_name
+ *
+ * Test details: The lease manager does not send the name of the selected
+ *               lease.
+ * Expected results: dlm_select_lease() fails, errno set to EPROTO.
+ */
+START_TEST(selected_lease_without_name)
+{
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	struct dlm_lease_constraints constraints = {0};
+	struct dlm_lease *lease = dlm_select_lease(&constraints);
+	ck_assert_ptr_eq(lease, NULL);
+	ck_assert_int_eq(errno, EPROTO);
+
+	test_server_stop(sstate);
+}
+END_TEST
+
+static void add_lease_selection_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease selection tests");
+
+	tcase_add_checked_fixture(tc, select_test_setup, test_shutdown);
+
+	tcase_add_test(tc, select_lease_sends_constraints);
+	tcase_add_test(tc, no_lease_matches_constraints);
+	tcase_add_test(tc, selected_lease_without_name);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease reassignment tests *************/
+
+static void reassign_test_setup(void)
+{
+	test_setup();
+	default_test_config.lease_name = DLM_ADMIN_SERVER_NAME;
+	default_test_config.expect_reassign = true;
+}
+
+/* reassign_leases_sends_plan
+ *
+ * Test details: Request a reassignment of two leases, and wait for it to
+ *               complete.
+ * Expected results: The lease names are sent to the lease manager, and the
+ *                   switch time is reported when it completes.
+ */
+START_TEST(reassign_leases_sends_plan)
+{
+	default_test_config.switch_time = 4321;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	const char *names[] = {"lease-a", "lease-b"};
+	struct dlm_reassign *reassign = dlm_reassign_leases(names, 2);
+	ck_assert_ptr_ne(reassign, NULL);
+
+	const struct dlm_msg *req = &default_test_config.received_reassign;
+	size_t len;
+	const char *list = dlm_msg_get_attr(req, DLM_ATTR_LEASE_LIST, &len);
+	ck_assert_ptr_ne(list, NULL);
+	ck_assert_int_eq(len, sizeof("lease-a") + sizeof("lease-b"));
+	ck_assert_str_eq(list, "lease-a");
+	ck_assert_str_eq(list + sizeof("lease-a"), "lease-b");
+
+	uint32_t switch_time = 0;
+	ck_assert_int_eq(dlm_reassign_wait(reassign, &switch_time), true);
+	ck_assert_int_eq(switch_time, 4321);
+
+	dlm_reassign_close(reassign);
+	test_server_stop(sstate);
+}
+END_TEST
+
+/* reassign_leases_busy
+ *
+ * Test details: The lease manager already has a reassignment in progress.
+ * Expected results: dlm_reassign_leases() fails, errno set to EBUSY.
+ */
+START_TEST(reassign_leases_busy)
+{
+	default_test_config.reply_status = DLM_STATUS_LEASE_BUSY;
+
+	struct server_state *sstate = test_server_start(&default_test_config);
+
+	const char *names[] = {TEST_LEASE_NAME};
+	ck_assert_ptr_eq(dlm_reassign_leases(names, 1), NULL);
+	ck_assert_int_eq(errno, EBUSY);
+
+	test_server_stop(sstate);
+}
+END_TEST
+
+static void add_lease_reassignment_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease reassignment tests");
+
+	tcase_add_checked_fixture(tc, reassign_test_setup, test_shutdown);
+
+	tcase_add_test(tc, reassign_leases_sends_plan);
+	tcase_add_test(tc, reassign_leases_busy);
+	suite_add_tcase(s, tc);
+}
+
+/**************  Lease status tests *************/
+
+/* The status page tests use their own runtime directory, so that they
+ * don't race with the lease manager tests */
+#define STATUS_DIR "/tmp/dlmclient-status-test"
+#define STATUS_FILE STATUS_DIR "/" DLM_STATUS_FILE_NAME
+
+#define STATUS_LEASE_CNT 2
+
+static struct {
+	struct dlm_status_header hdr;
+	struct dlm_status_lease leases[STATUS_LEASE_CNT];
+} status_page;
+
+static void write_status_page(void)
+{
+	int fd = open(STATUS_FILE, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(write(fd, &status_page, sizeof(status_page)),
+			 sizeof(status_page));
+	close(fd);
+}
+
+static void status_test_setup(void)
+{
+	dlm_enable_debug_log(true);
+	mkdir(STATUS_DIR, 0755);
+	setenv("DLM_RUNTIME_PATH", STATUS_DIR, 1);
+
+	status_page = (typeof(status_page)){
+	    .hdr =
+		{
+		    .magic = DLM_STATUS_MAGIC,
+		    .version = DLM_STATUS_VERSION,
+		    .seq = 2,
+		    .nleases = STATUS_LEASE_CNT,
+		},
+	    .leases =
+		{
+		    {.name = "lease-0", .state = DLM_STATUS_LEASE_FREE},
+		    {
+			.name = "lease-1",
+			.state = DLM_STATUS_LEASE_IN_TRANSITION,
+			.holder_pid = 1234,
+			.grants = 2,
+			.transfers = 1,
+			.frame_rate = 59500,
+			.frames = 120,
+			.connections_shed = 3,
+		    },
+		},
+	};
+}
+
+static void status_test_shutdown(void)
+{
+	unlink(STATUS_FILE);
+	rmdir(STATUS_DIR);
+}
+
+/* read_lease_status
+ *
+ * Test details: Read the status page, into arrays of different sizes.
+ * Expected results: The total number of leases is returned, and the
+ *                   status of as many leases as fit is copied.
+ */
+START_TEST(read_lease_status)
+{
+	write_status_page();
+
+	struct dlm_status_page *status = dlm_status_open();
+	ck_assert_ptr_ne(status, NULL);
+
+	struct dlm_lease_status leases[STATUS_LEASE_CNT + 1];
+	memset(leases, 0, sizeof(leases));
+	ck_assert_int_eq(dlm_status_read(status, leases, 1), STATUS_LEASE_CNT);
+	ck_assert_str_eq(leases[0].name, "lease-0");
+	ck_assert_str_eq(leases[1].name, "");
+
+	ck_assert_int_eq(dlm_status_read(status, leases, ARRAY_LEN(leases)),
+			 STATUS_LEASE_CNT);
+	ck_assert_str_eq(leases[1].name, "lease-1");
+	ck_assert_int_eq(leases[1].state, DLM_LEASE_IN_TRANSITION);
+	ck_assert_int_eq(leases[1].holder_pid, 1234);
+	ck_assert_uint_eq(leases[1].grants, 2);
+	ck_assert_uint_eq(leases[1].transfers, 1);
+	ck_assert_int_eq(leases[1].frame_rate == 59.5, true);
+	ck_assert_uint_eq(leases[1].frames, 120);
+	ck_assert_uint_eq(leases[1].connections_shed, 3);
+
+	dlm_status_close(status);
+}
+END_TEST
+
+/* read_changing_lease_status
+ *
+ * Test details: Read the status page while it is being updated, and after
+ *               the lease manager has exited.
+ * Expected results: dlm_status_read() fails with EAGAIN and ESTALE.
+ */
+START_TEST(read_changing_lease_status)
+{
+	status_page.hdr.seq = 3;
+	write_status_page();
+
+	struct dlm_status_page *status = dlm_status_open();
+	ck_assert_ptr_ne(status, NULL);
+
+	struct dlm_lease_status leases[STATUS_LEASE_CNT];
+	ck_assert_int_eq(dlm_status_read(status, leases, STATUS_LEASE_CNT), -1);
+	ck_assert_int_eq(errno, EAGAIN);
+
+	/* The page is shared, so updates are seen through the open handle */
+	status_page.hdr.seq = 4;
+	status_page.hdr.flags = DLM_STATUS_CLOSED;
+	write_status_page();
+
+	ck_assert_int_eq(dlm_status_read(status, leases, STATUS_LEASE_CNT), -1);
+	ck_assert_int_eq(errno, ESTALE);
+
+	dlm_status_close(status);
+}
+END_TEST
+
+/* invalid_status_page
+ *
+ * Test details: Open a missing, and then a truncated, status page.
+ * Expected results: dlm_status_open() fails with ENOENT and EPROTO.
+ */
+START_TEST(invalid_status_page)
+{
+	ck_assert_ptr_eq(dlm_status_open(), NULL);
+	ck_assert_int_eq(errno, ENOENT);
+
+	status_page.hdr.nleases = STATUS_LEASE_CNT + 1;
+	write_status_page();
+
+	ck_assert_ptr_eq(dlm_status_open(), NULL);
+	ck_assert_int_eq(errno, EPROTO);
+}
+END_TEST
+
+static void add_lease_status_tests(Suite *s)
+{
+	TCase *tc = tcase_create("Lease status tests");
+
+	tcase_add_checked_fixture(tc, status_test_setup, status_test_shutdown);
+
+	tcase_add_test(tc, read_lease_status);
+	tcase_add_test(tc, read_changing_lease_status);
+	tcase_add_test(tc, invalid_status_page);
 	suite_add_tcase(s, tc);
 }
 
@@ -281,6 +1227,14 @@ int main(void)
 
 	add_lease_manager_error_tests(s);
 	add_lease_handling_tests(s);
+	add_lease_wait_tests(s);
+	add_lease_resume_tests(s);
+	add_lease_topology_tests(s);
+	add_lease_event_tests(s);
+	add_lease_session_tests(s);
+	add_lease_selection_tests(s);
+	add_lease_reassignment_tests(s);
+	add_lease_status_tests(s);
 
 	sr = srunner_create(s);
 
@@ -13,55 +13,162 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "test-socket-server.h"
 #include <check.h>
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "dlm-protocol.h"
+#include "dlm-topology.h"
 #include "socket-path.h"
 #include "test-helpers.h"
 
-static void send_fd_list_over_socket(int socket, int nfds, int *fds)
+static int create_topology(bool seal)
 {
-	char data;
-	struct iovec iov = {
-	    .iov_base = &data,
-	    .iov_len = 1,
+	struct {
+		struct dlm_topology_header hdr;
+		struct dlm_topology_mode mode;
+		uint32_t pad;
+		struct dlm_topology_plane plane;
+		uint32_t formats[2];
+		struct dlm_topology_prop prop;
+	} topology = {
+	    .hdr =
+		{
+		    .magic = DLM_TOPOLOGY_MAGIC,
+		    .version = DLM_TOPOLOGY_VERSION,
+		    .size = sizeof(topology),
+		    .connector_id = TEST_TOPOLOGY_CONNECTOR_ID,
+		    .crtc_id = TEST_TOPOLOGY_CRTC_ID,
+		    .modes = {offsetof(typeof(topology), mode), 1},
+		    .planes = {offsetof(typeof(topology), plane), 1},
+		    .props = {offsetof(typeof(topology), prop), 1},
+		    .boot_fb_id = TEST_TOPOLOGY_BOOT_FB_ID,
+		    .boot_mode = {offsetof(typeof(topology), mode), 1},
+		},
+	    .mode = {.hdisplay = TEST_TOPOLOGY_HDISPLAY},
+	    .plane =
+		{
+		    .plane_id = TEST_TOPOLOGY_PLANE_ID,
+		    .formats = {offsetof(typeof(topology), formats), 1},
+		},
+	    .formats = {TEST_TOPOLOGY_FORMAT},
+	    .prop =
+		{
+		    .object_id = TEST_TOPOLOGY_PLANE_ID,
+		    .prop_id = TEST_TOPOLOGY_PROP_ID,
+		    .name = TEST_TOPOLOGY_PROP_NAME,
+		},
 	};
 
-	int bufsize = CMSG_SPACE(nfds * sizeof(int));
-	char *buf = malloc(bufsize);
+	int fd = memfd_create("test-topology", MFD_ALLOW_SEALING);
+	ck_assert_int_ge(fd, 0);
+	ck_assert_int_eq(write(fd, &topology, sizeof(topology)),
+			 sizeof(topology));
 
-	struct msghdr msg = {
-	    .msg_iov = &iov,
-	    .msg_iovlen = 1,
-	    .msg_controllen = bufsize,
-	    .msg_control = buf,
-	};
+	if (seal) {
+		ck_assert_int_eq(
+		    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_WRITE), 0);
+	}
+	return fd;
+}
+
+static void send_reply(int socket, uint32_t seq, enum dlm_status status,
+		       int nfds, int *fds, struct dlm_resume_token *token,
+		       const char *lease_name)
+{
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, seq);
+	ck_assert_int_eq(dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, status),
+			 true);
+
+	if (lease_name) {
+		ck_assert_int_eq(dlm_msg_add_attr(&reply, DLM_ATTR_LEASE_NAME,
+						  lease_name,
+						  strlen(lease_name) + 1),
+				 true);
+	}
+
+	if (token) {
+		ck_assert_int_eq(dlm_msg_add_attr(&reply, DLM_ATTR_RESUME_TOKEN,
+						  token, sizeof(*token)),
+				 true);
+	}
+
+	for (int i = 0; i < nfds; i++)
+		ck_assert_int_eq(dlm_msg_add_fd(&reply, fds[i]), true);
 
-	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
-	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	ck_assert_int_eq(dlm_send_msg(socket, &reply), true);
+}
+
+static void send_topology_reply(int socket, uint32_t seq, int lease_fd,
+				int topology_fd)
+{
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, seq);
+	dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, DLM_STATUS_OK);
+	dlm_msg_add_fd(&reply, lease_fd);
+	dlm_msg_add_u32(&reply, DLM_ATTR_TOPOLOGY_FD, 1);
+	dlm_msg_add_fd(&reply, topology_fd);
+	ck_assert_int_eq(dlm_send_msg(socket, &reply), true);
+}
+
+static struct dlm_msg expect_client_command(int socket,
+					    enum dlm_msg_type type)
+{
+	struct dlm_msg msg;
+	ck_assert_int_eq(dlm_receive_msg(socket, &msg), true);
+	ck_assert_int_eq(msg.hdr.version, DLM_PROTOCOL_VERSION);
+	ck_assert_int_eq(msg.hdr.type, type);
+	ck_assert_int_eq(msg.nfds, 0);
+	return msg;
+}
+
+static bool handle_hello(int socket, struct test_config *config)
+{
+	struct dlm_msg hello = expect_client_command(socket, DLM_MSG_HELLO);
+
+	uint32_t version;
+	ck_assert_int_eq(dlm_msg_get_u32(&hello, DLM_ATTR_VERSION, &version),
+			 true);
+	ck_assert_int_eq(version, DLM_PROTOCOL_VERSION);
+
+	if (config->send_unsupported_version) {
+		send_reply(socket, hello.hdr.seq,
+			   DLM_STATUS_UNSUPPORTED_VERSION, 0, NULL, NULL,
+			   NULL);
+		return false;
+	}
 
-	ck_assert_int_gt(sendmsg(socket, &msg, 0), 0);
-	free(buf);
+	uint32_t caps =
+	    DLM_CAP_RESUME_TOKEN | DLM_CAP_TOPOLOGY | DLM_CAP_LEASE_EVENTS;
+	if (config->session_cycles)
+		caps |= DLM_CAP_SESSION;
+
+	struct dlm_msg reply;
+	dlm_msg_init(&reply, DLM_MSG_REPLY, hello.hdr.seq);
+	dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, DLM_STATUS_OK);
+	dlm_msg_add_u32(&reply, DLM_ATTR_VERSION, DLM_PROTOCOL_VERSION);
+	dlm_msg_add_u32(&reply, DLM_ATTR_CAPS, caps);
+	ck_assert_int_eq(dlm_send_msg(socket, &reply), true);
+	return true;
 }
 
-static void expect_client_command(int socket, enum dlm_opcode opcode)
+static void close_socket(void *arg)
 {
-	struct dlm_client_request req;
-	ck_assert_int_eq(receive_dlm_client_request(socket, &req), true);
-	ck_assert_int_eq(req.opcode, opcode);
+	int *fd = arg;
+	if (*fd >= 0)
+		close(*fd);
 }
 
 struct server_state {
@@ -85,8 +192,13 @@ static void *test_server_thread(void *arg)
 	ck_assert_int_eq(
 	    sockaddr_set_lease_server_path(&address, config->lease_name), true);
 
+	/* The thread may be cancelled at any point after the server has
+	 * started, so close the sockets in cleanup handlers. */
+	int client = -1;
 	int server = socket(PF_UNIX, SOCK_SEQPACKET, 0);
 	ck_assert_int_ge(server, 0);
+	pthread_cleanup_push(close_socket, &server);
+	pthread_cleanup_push(close_socket, &client);
 
 	unlink(address.sun_path);
 
@@ -100,17 +212,80 @@ static void *test_server_thread(void *arg)
 	sstate->is_server_started = true;
 	pthread_cond_signal(&sstate->cond);
 
-	int client = accept(server, NULL, NULL);
+	client = accept(server, NULL, NULL);
 	/* accept is the cancellation point for this thread. If
 	 * pthread_cancel() is called on this thread, accept() may return
 	 * -1, so don't assert on it. */
 
-	if (client < 0) {
-		close(server);
-		return NULL;
+	if (client < 0)
+		goto done;
+
+	if (!handle_hello(client, config)) {
+		/* Wait for the client to close the connection, so that the
+		 * reply is not discarded along with any pipelined requests
+		 * left unread. */
+		char buf[64];
+		while (read(client, buf, sizeof(buf)) > 0)
+			;
+		goto done;
+	}
+
+	struct dlm_msg req;
+	if (config->expect_reassign) {
+		req = expect_client_command(client, DLM_MSG_REASSIGN_LEASES);
+		config->received_reassign = req;
+		send_reply(client, req.hdr.seq, config->reply_status, 0, NULL,
+			   NULL, NULL);
+		if (config->reply_status != DLM_STATUS_OK)
+			goto done;
+
+		struct dlm_msg reply;
+		dlm_msg_init(&reply, DLM_MSG_REPLY, req.hdr.seq);
+		dlm_msg_add_u32(&reply, DLM_ATTR_STATUS, DLM_STATUS_OK);
+		dlm_msg_add_u32(&reply, DLM_ATTR_SWITCH_TIME,
+				config->switch_time);
+		ck_assert_int_eq(dlm_send_msg(client, &reply), true);
+
+		/* Wait for the client to close the connection */
+		char buf[64];
+		while (read(client, buf, sizeof(buf)) > 0)
+			;
+		goto done;
+	}
+
+	if (config->session_cycles) {
+		config->fds = calloc(1, sizeof(int));
+		config->fds[0] = get_dummy_fd();
+		for (int i = 0; i < config->session_cycles; i++) {
+			req = expect_client_command(client, DLM_MSG_GET_LEASE);
+			send_reply(client, req.hdr.seq, DLM_STATUS_OK, 1,
+				   config->fds, NULL, NULL);
+			expect_client_command(client, DLM_MSG_RELEASE_LEASE);
+		}
+
+		/* Wait for the client to close the connection */
+		char buf[64];
+		while (read(client, buf, sizeof(buf)) > 0)
+			;
+		goto done;
 	}
 
-	expect_client_command(client, DLM_GET_LEASE);
+	if (config->expect_resume) {
+		req = expect_client_command(client, DLM_MSG_RESUME_LEASE);
+
+		size_t len;
+		const void *token =
+		    dlm_msg_get_attr(&req, DLM_ATTR_RESUME_TOKEN, &len);
+		ck_assert_ptr_ne(token, NULL);
+		ck_assert_int_eq(len, sizeof(config->received_token));
+		memcpy(&config->received_token, token, len);
+	} else if (config->expect_select) {
+		req = expect_client_command(client, DLM_MSG_SELECT_LEASE);
+		config->received_select = req;
+	} else {
+		req = expect_client_command(client, DLM_MSG_GET_LEASE);
+		config->received_get = req;
+	}
 
 	if (config->send_no_data)
 		goto done;
@@ -121,6 +296,12 @@ static void *test_server_thread(void *arg)
 		goto done;
 	}
 
+	if (config->reply_status != DLM_STATUS_OK) {
+		send_reply(client, req.hdr.seq, config->reply_status, 0, NULL,
+			   NULL, NULL);
+		goto done;
+	}
+
 	if (config->nfds == 0)
 		config->nfds = 1;
 
@@ -129,11 +310,31 @@ static void *test_server_thread(void *arg)
 	for (int i = 0; i < config->nfds; i++)
 		config->fds[i] = get_dummy_fd();
 
-	send_fd_list_over_socket(client, config->nfds, config->fds);
-	expect_client_command(client, DLM_RELEASE_LEASE);
+	if (config->send_topology) {
+		int topology_fd = create_topology(!config->unsealed_topology);
+		send_topology_reply(client, req.hdr.seq, config->fds[0],
+				    topology_fd);
+		close(topology_fd);
+	} else {
+		send_reply(
+		    client, req.hdr.seq, DLM_STATUS_OK, config->nfds,
+		    config->fds,
+		    config->send_resume_token ? &config->resume_token : NULL,
+		    config->selected_lease_name);
+	}
+
+	if (config->send_lease_event) {
+		struct dlm_msg event;
+		dlm_msg_init(&event, DLM_MSG_LEASE_EVENT, 0);
+		dlm_msg_add_u32(&event, DLM_ATTR_LEASE_EVENT,
+				config->lease_event);
+		ck_assert_int_eq(dlm_send_msg(client, &event), true);
+		goto done;
+	}
+	expect_client_command(client, DLM_MSG_RELEASE_LEASE);
 done:
-	close(client);
-	close(server);
+	pthread_cleanup_pop(true);
+	pthread_cleanup_pop(true);
 	return NULL;
 }
 
@@ -17,6 +17,8 @@
 #define TEST_SOCKET_SERVER_H
 #include <stdbool.h>
 
+#include "dlm-protocol.h"
+
 struct test_config {
 	char *lease_name;
 	int nfds;
@@ -24,8 +26,51 @@ struct test_config {
 
 	bool send_data_without_fd;
 	bool send_no_data;
+	bool send_unsupported_version;
+	enum dlm_status reply_status;
+
+	bool send_resume_token;
+	struct dlm_resume_token resume_token;
+
+	bool expect_resume;
+	struct dlm_resume_token received_token;
+
+	struct dlm_msg received_get;
+
+	bool send_topology;
+	bool unsealed_topology;
+
+	/* Send a lease event after the lease, then close the connection */
+	bool send_lease_event;
+	uint32_t lease_event;
+
+	/* Lease selection: the server is expected to be started with
+	 * lease_name set to DLM_SELECT_SERVER_NAME */
+	bool expect_select;
+	char *selected_lease_name;
+	struct dlm_msg received_select;
+
+	/* Sessions: the lease is requested and released session_cycles
+	 * times on the same connection */
+	int session_cycles;
+
+	/* Lease reassignment: the server is expected to be started with
+	 * lease_name set to DLM_ADMIN_SERVER_NAME */
+	bool expect_reassign;
+	uint32_t switch_time;
+	struct dlm_msg received_reassign;
 };
 
+/* Contents of the lease topology sent by the test server */
+#define TEST_TOPOLOGY_CONNECTOR_ID 10
+#define TEST_TOPOLOGY_CRTC_ID 20
+#define TEST_TOPOLOGY_PLANE_ID 30
+#define TEST_TOPOLOGY_PROP_ID 40
+#define TEST_TOPOLOGY_PROP_NAME "FB_ID"
+#define TEST_TOPOLOGY_FORMAT 0x34325258
+#define TEST_TOPOLOGY_HDISPLAY 1920
+#define TEST_TOPOLOGY_BOOT_FB_ID 50
+
 void test_config_cleanup(struct test_config *config);
 
 struct server_state *test_server_start(struct test_config *test_config);
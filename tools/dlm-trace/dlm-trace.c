@@ -0,0 +1,182 @@
+/* Copyright 2020-2021 IGEL Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Merge the trace files written by libdlmclient and drm-lease-manager
+ * into a latency breakdown of each traced lease request. */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STAGE_NAME_LEN 32
+
+struct record {
+	uint64_t id;
+	uint64_t time;
+	char stage[STAGE_NAME_LEN];
+};
+
+/* Records of one request, sorted by time */
+struct request {
+	struct record *records;
+	int count;
+};
+
+static struct record *records;
+static int nrecords;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"%s [<trace file>...]\n"
+		"\ttrace file: file written with DLM_TRACE_FILE or "
+		"drm-lease-manager -T.\n"
+		"\tReads the standard input if no file is given.\n",
+		name);
+}
+
+static int add_record(const struct record *record)
+{
+	static int size;
+
+	if (nrecords == size) {
+		int new_size = size ? size * 2 : 256;
+		struct record *new_records =
+		    realloc(records, new_size * sizeof(*records));
+		if (!new_records) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		records = new_records;
+		size = new_size;
+	}
+	records[nrecords++] = *record;
+	return 0;
+}
+
+static int read_records(FILE *file, const char *name)
+{
+	char line[128];
+	int lineno = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		struct record record;
+		lineno++;
+		if (sscanf(line, "%" SCNx64 " %31s %" SCNu64, &record.id,
+			   record.stage, &record.time) != 3) {
+			fprintf(stderr, "%s:%d: invalid trace record\n", name,
+				lineno);
+			continue;
+		}
+		if (add_record(&record))
+			return -1;
+	}
+	return 0;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct record *ra = a, *rb = b;
+
+	if (ra->id != rb->id)
+		return ra->id < rb->id ? -1 : 1;
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	return 0;
+}
+
+static int compare_requests(const void *a, const void *b)
+{
+	const struct request *ra = a, *rb = b;
+	uint64_t ta = ra->records[0].time, tb = rb->records[0].time;
+
+	if (ta != tb)
+		return ta < tb ? -1 : 1;
+	return 0;
+}
+
+static double to_ms(uint64_t ns)
+{
+	return ns / 1000000.0;
+}
+
+static void print_request(const struct request *req)
+{
+	const struct record *first = &req->records[0];
+	const struct record *last = &req->records[req->count - 1];
+
+	printf("%016" PRIx64 ": %.3f ms\n", first->id,
+	       to_ms(last->time - first->time));
+
+	for (int i = 0; i < req->count; i++) {
+		const struct record *record = &req->records[i];
+		uint64_t step = i ? record->time - record[-1].time : 0;
+		printf("  %-20s %10.3f ms  (+%.3f ms)\n", record->stage,
+		       to_ms(record->time - first->time), to_ms(step));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (argc < 2 && read_records(stdin, "stdin"))
+		return EXIT_FAILURE;
+
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "r");
+		if (!file) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+		int ret = read_records(file, argv[i]);
+		fclose(file);
+		if (ret)
+			return EXIT_FAILURE;
+	}
+
+	if (nrecords == 0)
+		return EXIT_SUCCESS;
+
+	qsort(records, nrecords, sizeof(*records), compare_records);
+
+	struct request *requests = calloc(nrecords, sizeof(*requests));
+	if (!requests) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	int nrequests = 0;
+	for (int i = 0; i < nrecords; i++) {
+		if (i == 0 || records[i].id != records[i - 1].id)
+			requests[nrequests++].records = &records[i];
+		requests[nrequests - 1].count++;
+	}
+
+	qsort(requests, nrequests, sizeof(*requests), compare_requests);
+
+	for (int i = 0; i < nrequests; i++)
+		print_request(&requests[i]);
+
+	free(requests);
+	free(records);
+	return EXIT_SUCCESS;
+}